@@ -0,0 +1,43 @@
+#ifndef AUTOGRAD_H
+#define AUTOGRAD_H
+
+#include "tensor.h"
+#include <functional>
+#include <vector>
+
+// Reverse-mode autodiff over the graph the ops record in Tensor::children and
+// Tensor::op_type. Children are shallow copies of the op inputs, so a node is
+// identified by its data pointer, and a gradient reaches a caller's tensor
+// through the grad pointer the copies share: call requires_grad() on a leaf
+// before using it in ops. Gradients are accumulated (+=) into those buffers.
+//
+// Only FLOAT32 graphs are differentiated; children of other dtypes and tensors
+// without an op_type are treated as constants.
+
+// grad_inputs[i] receives d(loss)/d(inputs[i]) and must be added to, not
+// overwritten; it is null when inputs[i] does not need a gradient. Two slots
+// may alias when an op reads the same tensor twice.
+using BackwardFn = std::function<void(const Tensor<FLOAT32>& output, const float* grad_output,
+    const std::vector<const Tensor<FLOAT32>*>& inputs, const std::vector<float*>& grad_inputs)>;
+
+// Replaces the backward formula of an op; the built-in ops are registered already.
+void register_backward(OpType op, BackwardFn fn);
+
+// Allocates a zeroed gradient for a leaf unless it already has one.
+void requires_grad(Tensor<FLOAT32>& tensor);
+
+struct BackwardStats {
+    size_t nodes = 0;            // tensors reached from the root
+    size_t peak_grad_bytes = 0;  // intermediate gradients alive at the same time, at most
+    size_t pool_bytes = 0;       // bytes actually allocated for them, after reuse
+    size_t unfreed_bytes = 0;    // what holding every intermediate gradient to the end would take
+};
+
+// Back-propagates from root, seeded with grad_output (ones when null). Nodes
+// run in topological order from an explicit stack, so graph depth is not
+// limited by the call stack. An intermediate gradient is released to a
+// buffer pool as soon as its node has pushed it to its inputs, and reused by
+// later nodes of the same size.
+BackwardStats backward(const Tensor<FLOAT32>& root, const Tensor<FLOAT32>* grad_output = nullptr);
+
+#endif
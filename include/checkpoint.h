@@ -0,0 +1,413 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "llama_model.h"
+#include "memory_planner.h"
+#include <functional>
+#include <vector>
+
+typedef enum {
+    CHECKPOINT_NONE,      // keep every intermediate of the block until backward
+    CHECKPOINT_BLOCK,     // keep the block input only, rerun the block in backward
+    CHECKPOINT_ATTENTION  // keep the FFN half, rerun norm, QKV, RoPE and attention in backward
+} CheckpointMode;
+
+// Layer l is checkpointed with `mode` when l % every == 0; the others keep
+// everything. {CHECKPOINT_BLOCK, 2} checkpoints every other block.
+struct CheckpointPolicy {
+    CheckpointMode mode = CHECKPOINT_NONE;
+    int every = 1;
+
+    CheckpointMode mode_for(int layer) const {
+        return every > 0 && layer % every == 0 ? mode : CHECKPOINT_NONE;
+    }
+};
+
+// Training forward/backward through a stack of decoder blocks on fresh
+// sequences (positions from 0, causal attention on the contiguous K/V).
+// Every block keeps its input; what else survives until backward depends on
+// the policy, and checkpointed blocks recompute the rest in backward. The FFN
+// never stores its gate/up product (FeedForward::backward_rows recomputes it),
+// so the recomputation here is the attention half plus, for CHECKPOINT_BLOCK,
+// the output projection and the FFN norm.
+//
+// All activations, recompute buffers and gradient workspace are views into
+// one slab laid out by MemoryPlanner from the step's op sequence: what a
+// block's policy doesn't keep, its recomputed copy and its gradients are each
+// live for a few ops only and share bytes. forward() plans its own slab when
+// the shape or policy changes; a caller with buffers of its own (Trainer)
+// instead describes the decoder into its trace and binds it to its slab.
+template<DType dtype>
+class CheckpointedDecoder {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    CheckpointedDecoder(std::vector<LlamaBlock<dtype>>& blocks, const LlamaConfig& config,
+        CheckpointPolicy policy = {});
+    ~CheckpointedDecoder() { deallocate_memory(slab_); }
+
+    CheckpointedDecoder(const CheckpointedDecoder&) = delete;
+    CheckpointedDecoder& operator=(const CheckpointedDecoder&) = delete;
+
+    // input/output: [batch * seq_len, dim]
+    void forward(const T* input, T* output, int batch, int seq_len);
+    // d(input) for the last forward; weight gradients accumulate into the blocks.
+    // aux_grad is d loss / d aux_loss() for MoE blocks.
+    void backward(const T* grad_output, T* grad_input, float aux_grad = 0.0f);
+    // sum of the MoE blocks' load-balancing losses in the last forward
+    float aux_loss() const;
+
+    // Appends one (batch, seq_len) training step to `planner`: the forward ops,
+    // then whatever `between` adds, then the backward ops. input, output,
+    // grad_output and grad_input are the caller's tensor ids, -1 for buffers
+    // outside the plan. After planner.plan(), bind() takes the decoder's
+    // buffers as views into the caller's slab.
+    void describe(MemoryPlanner& planner, int batch, int seq_len, int input, int output,
+        const std::function<void()>& between, int grad_output, int grad_input);
+    void bind(const MemoryPlanner& planner, void* slab);
+
+    void set_policy(CheckpointPolicy policy) { policy_ = policy; }
+    const CheckpointPolicy& policy() const { return policy_; }
+    // held from forward to backward
+    size_t saved_bytes() const { return saved_bytes_; }
+    // the recompute buffers, one block's worth
+    size_t recompute_bytes() const { return recompute_bytes_; }
+    // the plan forward() made for itself, if any
+    const MemoryPlanner& memory_plan() const { return planner_; }
+
+private:
+    struct Activations {
+        Tensor<dtype> input, normed, query, key, value, attention, hidden, ffn_normed, ffn_hidden;
+        Tensor<FLOAT32> inv_rms, lse, ffn_inv_rms;
+    };
+    struct Gradients {
+        Tensor<dtype> ffn_normed, hidden, attention, query, key, value, qkv, normed, input;
+    };
+    struct View {
+        int id;
+        Tensor<dtype>* tensor;
+        Tensor<FLOAT32>* stats;
+        int rows, cols;
+    };
+
+    static void add_rows(T* dst, const T* src, int64_t n);
+    void plan_activations(int batch, int seq_len);
+    // normed, query/key/value and attention (+ their statistics) from the block input
+    void attention_half(int layer, const T* x, Activations& a);
+    // hidden = x + attention W_o^T and its FFN norm
+    void ffn_input(int layer, const T* x, const T* attention, Activations& a);
+    void backward_block(int layer, const T* grad_output, T* grad_input, float aux_grad);
+
+    std::vector<LlamaBlock<dtype>>& blocks_;
+    LlamaConfig config_;
+    CheckpointPolicy policy_;
+    RoPE<dtype> rope_;
+    int batch_;
+    int seq_len_;
+    int64_t rows_;
+    std::vector<int> starts_;
+    std::vector<int> positions_;
+
+    // what describe() last laid out
+    int planned_batch_;
+    int planned_seq_len_;
+    CheckpointPolicy planned_policy_;
+    size_t saved_bytes_;
+    size_t recompute_bytes_;
+    std::vector<View> views_;
+    MemoryPlanner planner_;
+    void* slab_;
+
+    // per block, all views into the bound slab
+    std::vector<Activations> forward_;
+    std::vector<Activations> recompute_;
+    std::vector<Gradients> grads_;
+};
+
+template<DType dtype>
+CheckpointedDecoder<dtype>::CheckpointedDecoder(std::vector<LlamaBlock<dtype>>& blocks, const LlamaConfig& config,
+    CheckpointPolicy policy)
+  : blocks_(blocks), config_(config), policy_(policy), rope_(config.head_dim(), config.max_seq, config.rope_base),
+    batch_(0), seq_len_(0), rows_(0), planned_batch_(0), planned_seq_len_(0), saved_bytes_(0),
+    recompute_bytes_(0), slab_(nullptr), forward_(blocks.size()), recompute_(blocks.size()),
+    grads_(blocks.size()) {}
+
+template<DType dtype>
+void CheckpointedDecoder<dtype>::add_rows(T* dst, const T* src, int64_t n) {
+    if constexpr (dtype == FLOAT32) {
+        simd_add(dst, src, n);
+    } else {
+        for (int64_t i = 0; i < n; ++i) {
+            dst[i] = from_float<dtype>(to_float<dtype>(dst[i]) + to_float<dtype>(src[i]));
+        }
+    }
+}
+
+template<DType dtype>
+void CheckpointedDecoder<dtype>::describe(MemoryPlanner& planner, int batch, int seq_len, int input, int output,
+    const std::function<void()>& between, int grad_output, int grad_input) {
+    const int num_layers = static_cast<int>(blocks_.size());
+    const int64_t rows = static_cast<int64_t>(batch) * seq_len;
+    const int64_t q_cols = static_cast<int64_t>(config_.num_heads) * config_.head_dim();
+    const int64_t kv_cols = static_cast<int64_t>(config_.num_kv_heads) * config_.head_dim();
+    views_.clear();
+    auto buffer = [&](Tensor<dtype>& t, int64_t cols) {
+        views_.push_back({planner.add_tensor(rows * cols * sizeof(T)), &t, nullptr, static_cast<int>(rows),
+            static_cast<int>(cols)});
+        return views_.back().id;
+    };
+    auto stats = [&](Tensor<FLOAT32>& t, int64_t cols) {
+        views_.push_back({planner.add_tensor(rows * cols * sizeof(float)), nullptr, &t, static_cast<int>(rows),
+            static_cast<int>(cols)});
+        return views_.back().id;
+    };
+    // ids of the caller's tensors may be -1
+    auto op = [&](std::vector<int> reads, std::vector<int> writes) {
+        std::erase(reads, -1);
+        std::erase(writes, -1);
+        planner.add_op(reads, writes);
+    };
+
+    struct Ids {
+        int input = -1, normed = -1, query = -1, key = -1, value = -1, attention = -1, hidden = -1;
+        int ffn_normed = -1, ffn_hidden = -1, inv_rms = -1, lse = -1, ffn_inv_rms = -1;
+    };
+    auto attention_ids = [&](Activations& a, Ids& ids) {
+        ids.normed = buffer(a.normed, config_.dim);
+        ids.inv_rms = stats(a.inv_rms, 1);
+        ids.query = buffer(a.query, q_cols);
+        ids.key = buffer(a.key, kv_cols);
+        ids.value = buffer(a.value, kv_cols);
+        ids.attention = buffer(a.attention, q_cols);
+        ids.lse = stats(a.lse, config_.num_heads);
+    };
+    auto ffn_ids = [&](Activations& a, Ids& ids) {
+        ids.hidden = buffer(a.hidden, config_.dim);
+        ids.ffn_normed = buffer(a.ffn_normed, config_.dim);
+        ids.ffn_inv_rms = stats(a.ffn_inv_rms, 1);
+    };
+    const size_t input_bytes = rows * config_.dim * sizeof(T);
+    const size_t attention_bytes = rows * ((config_.dim + 2 * q_cols + 2 * kv_cols) * sizeof(T) +
+        (1 + config_.num_heads) * sizeof(float));
+    const size_t ffn_bytes = rows * (2 * config_.dim * sizeof(T) + sizeof(float));
+
+    saved_bytes_ = 0;
+    recompute_bytes_ = 0;
+    std::vector<Ids> fwd(num_layers), rec(num_layers);
+    for (int l = 0; l < num_layers; ++l) {
+        Activations& a = forward_[l];
+        CheckpointMode mode = policy_.mode_for(l);
+        fwd[l].input = buffer(a.input, config_.dim);
+        attention_ids(a, fwd[l]);
+        ffn_ids(a, fwd[l]);
+        saved_bytes_ += input_bytes + (mode == CHECKPOINT_NONE ? attention_bytes : 0) +
+            (mode == CHECKPOINT_BLOCK ? 0 : ffn_bytes);
+        if (config_.num_experts == 0) {
+            fwd[l].ffn_hidden = buffer(a.ffn_hidden, config_.hidden_dim);
+        } else {
+            a.ffn_hidden = Tensor<dtype>();
+        }
+        if (mode != CHECKPOINT_NONE) {
+            attention_ids(recompute_[l], rec[l]);
+        }
+        if (mode == CHECKPOINT_BLOCK) {
+            ffn_ids(recompute_[l], rec[l]);
+        }
+        recompute_bytes_ = std::max(recompute_bytes_, (mode == CHECKPOINT_NONE ? 0 : attention_bytes) +
+            (mode == CHECKPOINT_BLOCK ? ffn_bytes : 0));
+    }
+
+    // forward: the same ops as forward(), so a block's buffers that its policy
+    // doesn't keep are dead once the block has run
+    op({input}, {fwd[0].input});
+    for (int l = 0; l < num_layers; ++l) {
+        const Ids& f = fwd[l];
+        int out = l + 1 < num_layers ? fwd[l + 1].input : output;
+        op({f.input}, {f.normed, f.inv_rms, f.query, f.key, f.value});
+        op({f.query, f.key, f.value}, {f.attention, f.lse});
+        op({f.input, f.attention}, {f.hidden, f.ffn_normed, f.ffn_inv_rms});
+        op({f.hidden, f.ffn_normed}, {f.ffn_hidden, out});
+    }
+    if (between) {
+        between();
+    }
+
+    // backward
+    int grad_out = grad_output;
+    for (int l = num_layers - 1; l >= 0; --l) {
+        CheckpointMode mode = policy_.mode_for(l);
+        const Ids& f = fwd[l];
+        const Ids& r = rec[l];
+        const Ids& attn = mode == CHECKPOINT_NONE ? f : r;
+        const Ids& ffn = mode == CHECKPOINT_BLOCK ? r : f;
+        Gradients& g = grads_[l];
+        if (mode != CHECKPOINT_NONE) {
+            op({f.input}, {r.normed, r.inv_rms, r.query, r.key, r.value});
+            op({r.query, r.key, r.value}, {r.attention, r.lse});
+        }
+        if (mode == CHECKPOINT_BLOCK) {
+            op({f.input, r.attention}, {r.hidden, r.ffn_normed, r.ffn_inv_rms});
+        }
+        int grad_ffn_normed = buffer(g.ffn_normed, config_.dim), grad_hidden = buffer(g.hidden, config_.dim);
+        int grad_attention = buffer(g.attention, q_cols), grad_query = buffer(g.query, q_cols);
+        int grad_key = buffer(g.key, kv_cols), grad_value = buffer(g.value, kv_cols);
+        int grad_qkv = buffer(g.qkv, q_cols + 2 * kv_cols), grad_normed = buffer(g.normed, config_.dim);
+        int grad_in = l > 0 ? buffer(g.input, config_.dim) : grad_input;
+        op({grad_out, ffn.ffn_normed}, {grad_ffn_normed});
+        op({grad_out, grad_ffn_normed, ffn.hidden, ffn.ffn_inv_rms}, {grad_hidden});
+        op({grad_hidden, attn.attention}, {grad_attention});
+        op({attn.query, attn.key, attn.value, attn.attention, attn.lse, grad_attention},
+            {grad_query, grad_key, grad_value});
+        op({grad_query, grad_key, grad_value}, {grad_qkv});
+        op({grad_qkv, attn.normed}, {grad_normed});
+        op({grad_normed, f.input, attn.inv_rms, grad_hidden}, {grad_in});
+        grad_out = grad_in;
+    }
+    planned_batch_ = batch;
+    planned_seq_len_ = seq_len;
+    planned_policy_ = policy_;
+}
+template<DType dtype>
+void CheckpointedDecoder<dtype>::bind(const MemoryPlanner& planner, void* slab) {
+    for (const View& v : views_) {
+        if (v.tensor) {
+            *v.tensor = planner.view<dtype>(slab, v.id, {v.rows, v.cols});
+        } else {
+            *v.stats = planner.view<FLOAT32>(slab, v.id, {v.rows, v.cols});
+        }
+    }
+}
+
+template<DType dtype>
+void CheckpointedDecoder<dtype>::plan_activations(int batch, int seq_len) {
+    planner_ = MemoryPlanner();
+    describe(planner_, batch, seq_len, -1, -1, nullptr, -1, -1);
+    planner_.plan();
+    deallocate_memory(slab_);
+    slab_ = planner_.allocate_slab();
+    bind(planner_, slab_);
+}
+
+template<DType dtype>
+void CheckpointedDecoder<dtype>::attention_half(int layer, const T* x, Activations& a) {
+    LlamaBlock<dtype>& block = blocks_[layer];
+    block.attention_norm.forward_rows(x, a.normed.data(), rows_, a.inv_rms.data());
+    block.project_qkv(rope_.table(), a.normed.data(), a.query.data(), a.key.data(), a.value.data(), rows_,
+        seq_len_, starts_.data());
+    block.attention.forward_raw(a.query.data(), a.key.data(), a.value.data(), a.attention.data(), a.lse.data(),
+        batch_, seq_len_, seq_len_);
+}
+
+template<DType dtype>
+void CheckpointedDecoder<dtype>::ffn_input(int layer, const T* x, const T* attention, Activations& a) {
+    LlamaBlock<dtype>& block = blocks_[layer];
+    block.output.forward_rows(attention, a.hidden.data(), rows_);
+    add_rows(a.hidden.data(), x, rows_ * config_.dim);
+    block.ffn_norm.forward_rows(a.hidden.data(), a.ffn_normed.data(), rows_, a.ffn_inv_rms.data());
+}
+
+template<DType dtype>
+void CheckpointedDecoder<dtype>::forward(const T* input, T* output, int batch, int seq_len) {
+    if (batch <= 0 || seq_len <= 0 || seq_len > config_.max_seq) {
+        throw std::invalid_argument("CheckpointedDecoder: sequence length outside the RoPE table");
+    }
+    if (batch != planned_batch_ || seq_len != planned_seq_len_ || policy_.mode != planned_policy_.mode ||
+        policy_.every != planned_policy_.every) {
+        plan_activations(batch, seq_len);
+    }
+    batch_ = batch;
+    seq_len_ = seq_len;
+    rows_ = static_cast<int64_t>(batch) * seq_len;
+    starts_.assign(batch, 0);
+    positions_.resize(rows_);
+    for (int64_t i = 0; i < rows_; ++i) {
+        positions_[i] = static_cast<int>(i % seq_len);
+    }
+
+    const int num_layers = static_cast<int>(blocks_.size());
+    const int64_t width = rows_ * config_.dim;
+    std::copy(input, input + width, forward_[0].input.data());
+    for (int l = 0; l < num_layers; ++l) {
+        Activations& a = forward_[l];
+        T* out = l + 1 < num_layers ? forward_[l + 1].input.data() : output;
+        attention_half(l, a.input.data(), a);
+        ffn_input(l, a.input.data(), a.attention.data(), a);
+        blocks_[l].ffn_forward(a.ffn_normed.data(), out, a.ffn_hidden.data(), rows_);
+        add_rows(out, a.hidden.data(), width);
+    }
+}
+
+template<DType dtype>
+float CheckpointedDecoder<dtype>::aux_loss() const {
+    float total = 0.0f;
+    for (const LlamaBlock<dtype>& block : blocks_) {
+        if (block.moe) {
+            total += block.moe->aux_loss();
+        }
+    }
+    return total;
+}
+
+template<DType dtype>
+void CheckpointedDecoder<dtype>::backward_block(int layer, const T* grad_output, T* grad_input, float aux_grad) {
+    LlamaBlock<dtype>& block = blocks_[layer];
+    CheckpointMode mode = policy_.mode_for(layer);
+    Activations& saved = forward_[layer];
+    Activations& recomputed = recompute_[layer];
+    Gradients& g = grads_[layer];
+    const T* x = saved.input.data();
+    Activations& attn = mode == CHECKPOINT_NONE ? saved : recomputed;
+    Activations& ffn = mode == CHECKPOINT_BLOCK ? recomputed : saved;
+    if (mode != CHECKPOINT_NONE) {
+        attention_half(layer, x, recomputed);
+    }
+    if (mode == CHECKPOINT_BLOCK) {
+        ffn_input(layer, x, recomputed.attention.data(), recomputed);
+    }
+
+    const int head_dim = config_.head_dim();
+    const int64_t dim = config_.dim;
+    const int64_t q_cols = static_cast<int64_t>(config_.num_heads) * head_dim;
+    const int64_t kv_cols = static_cast<int64_t>(config_.num_kv_heads) * head_dim;
+    const int64_t qkv_cols = q_cols + 2 * kv_cols;
+
+    // y = hidden + ffn(ffn_norm(hidden)), hidden = x + attention(attention_norm(x)) W_o^T
+    block.ffn_backward(grad_output, ffn.ffn_normed.data(), g.ffn_normed.data(), rows_, aux_grad);
+    block.ffn_norm.backward_rows(g.ffn_normed.data(), ffn.hidden.data(), ffn.ffn_inv_rms.data(),
+        g.hidden.data(), rows_);
+    add_rows(g.hidden.data(), grad_output, rows_ * dim);
+
+    block.output.backward_rows(g.hidden.data(), attn.attention.data(), g.attention.data(), rows_);
+    block.attention.backward_raw(attn.query.data(), attn.key.data(), attn.value.data(), attn.attention.data(),
+        attn.lse.data(), g.attention.data(), g.query.data(), g.key.data(), g.value.data(),
+        batch_, seq_len_, seq_len_);
+    // Q and K were rotated after the projection; the rotation is orthogonal
+    rope_.apply_rows(g.query.data(), positions_.data(), rows_, config_.num_heads, true);
+    rope_.apply_rows(g.key.data(), positions_.data(), rows_, config_.num_kv_heads, true);
+    parallel_for(0, rows_, [&](int64_t lo, int64_t hi) {
+        for (int64_t i = lo; i < hi; ++i) {
+            T* row = g.qkv.data() + i * qkv_cols;
+            std::copy(g.query.data() + i * q_cols, g.query.data() + (i + 1) * q_cols, row);
+            std::copy(g.key.data() + i * kv_cols, g.key.data() + (i + 1) * kv_cols, row + q_cols);
+            std::copy(g.value.data() + i * kv_cols, g.value.data() + (i + 1) * kv_cols, row + q_cols + kv_cols);
+        }
+    });
+    block.qkv.backward_rows(g.qkv.data(), attn.normed.data(), g.normed.data(), rows_);
+    block.attention_norm.backward_rows(g.normed.data(), x, attn.inv_rms.data(), grad_input, rows_);
+    add_rows(grad_input, g.hidden.data(), rows_ * dim);
+}
+
+template<DType dtype>
+void CheckpointedDecoder<dtype>::backward(const T* grad_output, T* grad_input, float aux_grad) {
+    if (rows_ == 0) {
+        throw std::runtime_error("CheckpointedDecoder: backward called without a forward");
+    }
+    const int num_layers = static_cast<int>(blocks_.size());
+    const T* grad = grad_output;
+    for (int l = num_layers - 1; l >= 0; --l) {
+        T* next = l == 0 ? grad_input : grads_[l].input.data();
+        backward_block(l, grad, next, aux_grad);
+        grad = next;
+    }
+}
+
+#endif
@@ -0,0 +1,240 @@
+#ifndef CROSS_ENTROPY_H
+#define CROSS_ENTROPY_H
+
+#include "linear.h"
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+// LM head + softmax cross-entropy without ever holding [rows, vocab] logits.
+// Rows are taken token_chunk at a time and the vocabulary vocab_tile columns at
+// a time, so only one [token_chunk, vocab_tile] fp32 logit tile exists:
+//  1. every tile is folded into a running max / sum per row (online
+//     logsumexp) and the target's logit is picked out on the way;
+//  2. every tile is recomputed and turned into d logits = softmax - onehot,
+//     which goes straight into d hidden (+= dl W) and d W (+= dl^T hidden).
+// The workspace is O(token_chunk * (vocab_tile + dim)) whatever the vocabulary.
+template<DType dtype>
+class ChunkedCrossEntropy {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    // targets equal to ignore_index add neither loss nor gradient
+    static const uint32_t ignore_index = 0xffffffffu;
+
+    explicit ChunkedCrossEntropy(Linear<dtype>& head, int token_chunk = 128, int vocab_tile = 2048);
+
+    // hidden: [rows, in_features], the final-norm output. Returns the mean loss
+    // over the rows that are not ignored.
+    float forward(const T* hidden, const uint32_t* targets, int64_t rows);
+    // Also writes d hidden (scaled by grad_scale, e.g. a loss scale) and
+    // accumulates d W into the head's weight grad when head.trains_weights().
+    float forward_backward(const T* hidden, const uint32_t* targets, int64_t rows, T* grad_hidden,
+        float grad_scale = 1.0f);
+
+    size_t workspace_bytes() const {
+        return (tile_.size() + hidden_.size() + grad_.size() + weight_tile_.size() + row_max_.size() +
+            row_sum_.size() + target_logit_.size()) * sizeof(float);
+    }
+
+private:
+    float run(const T* hidden, const uint32_t* targets, int64_t rows, T* grad_hidden, float grad_scale);
+    // logits of rows [r0, r0 + count) x vocab [v0, v1) into tile_
+    void logits_tile(const T* hidden, int64_t r0, int64_t count, int64_t v0, int64_t v1);
+    // head rows [v0, v0 + count) as fp32, widened once into weight_tile_ unless stored that way
+    const float* weight_rows(int64_t v0, int64_t count);
+
+    Linear<dtype>& head_;
+    int token_chunk_;
+    int vocab_tile_;
+    std::vector<float> tile_;          // [token_chunk, vocab_tile]
+    std::vector<float> hidden_;        // the chunk's input rows, widened
+    std::vector<float> grad_;          // the chunk's d hidden
+    std::vector<float> weight_tile_;   // [vocab_tile, in_features], shared by the workers
+    std::vector<float> row_max_;
+    std::vector<float> row_sum_;
+    std::vector<float> target_logit_;
+};
+
+template<DType dtype>
+ChunkedCrossEntropy<dtype>::ChunkedCrossEntropy(Linear<dtype>& head, int token_chunk, int vocab_tile)
+  : head_(head), token_chunk_(token_chunk), vocab_tile_(vocab_tile) {
+    if (token_chunk <= 0 || vocab_tile <= 0) {
+        throw std::invalid_argument("ChunkedCrossEntropy: chunk sizes must be positive");
+    }
+    if (head.lora() != nullptr) {
+        throw std::invalid_argument("ChunkedCrossEntropy: LoRA on the LM head is not supported");
+    }
+}
+
+template<DType dtype>
+float ChunkedCrossEntropy<dtype>::forward(const T* hidden, const uint32_t* targets, int64_t rows) {
+    return run(hidden, targets, rows, nullptr, 1.0f);
+}
+
+template<DType dtype>
+float ChunkedCrossEntropy<dtype>::forward_backward(const T* hidden, const uint32_t* targets, int64_t rows,
+    T* grad_hidden, float grad_scale) {
+    if (grad_hidden == nullptr) {
+        throw std::invalid_argument("ChunkedCrossEntropy: forward_backward needs a grad_hidden buffer");
+    }
+    return run(hidden, targets, rows, grad_hidden, grad_scale);
+}
+
+template<DType dtype>
+const float* ChunkedCrossEntropy<dtype>::weight_rows(int64_t v0, int64_t count) {
+    const WeightMatrix<dtype>& w = head_.weights();
+    const int64_t k = head_.in_features();
+    if constexpr (dtype == FLOAT32) {
+        if (w.storage() == STORAGE_FULL) {
+            return w.full().data() + v0 * k;
+        }
+    }
+    weight_tile_.resize(static_cast<size_t>(count) * k);
+    float* dst = weight_tile_.data();
+    parallel_for(0, count, [&](int64_t lo, int64_t hi) {
+        for (int64_t j = lo; j < hi; ++j) {
+            w.load_row(v0 + j, dst + j * k);
+        }
+    });
+    return dst;
+}
+
+template<DType dtype>
+void ChunkedCrossEntropy<dtype>::logits_tile(const T* hidden, int64_t r0, int64_t count, int64_t v0, int64_t v1) {
+    const int64_t width = v1 - v0;
+    float* tile = tile_.data();
+    head_.forward_rows_epilogue(hidden + r0 * head_.in_features(), count,
+        [=](int64_t i, int64_t n0, int64_t n1, const float* values) {
+            std::copy(values, values + (n1 - n0), tile + i * width + (n0 - v0));
+        }, v0, v1);
+}
+
+template<DType dtype>
+float ChunkedCrossEntropy<dtype>::run(const T* hidden, const uint32_t* targets, int64_t rows, T* grad_hidden,
+    float grad_scale) {
+    const int64_t k = head_.in_features();
+    const int64_t vocab = head_.out_features();
+    const int64_t chunk = token_chunk_;
+    const int64_t tile = std::min<int64_t>(vocab_tile_, vocab);
+
+    int64_t counted = 0;
+    for (int64_t i = 0; i < rows; ++i) {
+        if (targets[i] == ignore_index) {
+            continue;
+        }
+        if (targets[i] >= static_cast<uint64_t>(vocab)) {
+            throw std::out_of_range("ChunkedCrossEntropy: target outside the vocabulary");
+        }
+        ++counted;
+    }
+    if (counted == 0) {
+        if (grad_hidden != nullptr) {
+            std::fill(grad_hidden, grad_hidden + rows * k, from_float<dtype>(0.0f));
+        }
+        return 0.0f;
+    }
+
+    tile_.resize(chunk * tile);
+    row_max_.resize(chunk);
+    row_sum_.resize(chunk);
+    target_logit_.resize(chunk);
+    T* gw = nullptr;
+    if (grad_hidden != nullptr) {
+        hidden_.resize(chunk * k);
+        grad_.resize(chunk * k);
+        if (head_.trains_weights()) {
+            Tensor<dtype>& weight = head_.weights().full();
+            if (!weight.grad) {
+                weight.grad = std::make_shared<Tensor<dtype>>(weight.shape);
+            }
+            gw = weight.grad->data();
+        }
+    }
+    const float coeff = grad_scale / counted;
+
+    double loss = 0.0;
+    for (int64_t r0 = 0; r0 < rows; r0 += chunk) {
+        const int64_t count = std::min(chunk, rows - r0);
+        const uint32_t* target = targets + r0;
+
+        // pass 1: online logsumexp over the vocab tiles
+        std::fill(row_max_.begin(), row_max_.end(), -std::numeric_limits<float>::infinity());
+        std::fill(row_sum_.begin(), row_sum_.end(), 0.0f);
+        for (int64_t v0 = 0; v0 < vocab; v0 += tile) {
+            const int64_t v1 = std::min(vocab, v0 + tile), width = v1 - v0;
+            logits_tile(hidden, r0, count, v0, v1);
+            parallel_for(0, count, [&](int64_t lo, int64_t hi) {
+                for (int64_t i = lo; i < hi; ++i) {
+                    const float* l = tile_.data() + i * width;
+                    if (target[i] != ignore_index && target[i] >= v0 && target[i] < v1) {
+                        target_logit_[i] = l[target[i] - v0];
+                    }
+                    float m = std::max(row_max_[i], simd_max(l, width));
+                    float sum = row_sum_[i] * std::exp(row_max_[i] - m);
+                    for (int64_t v = 0; v < width; ++v) {
+                        sum += std::exp(l[v] - m);
+                    }
+                    row_max_[i] = m;
+                    row_sum_[i] = sum;
+                }
+            });
+        }
+        for (int64_t i = 0; i < count; ++i) {
+            // row_sum_ now holds logsumexp, which pass 2 needs
+            row_sum_[i] = row_max_[i] + std::log(row_sum_[i]);
+            if (target[i] != ignore_index) {
+                loss += row_sum_[i] - target_logit_[i];
+            }
+        }
+        if (grad_hidden == nullptr) {
+            continue;
+        }
+
+        // pass 2: d logits = (softmax - onehot) / counted, one tile at a time
+        row_to_float<dtype>(hidden + r0 * k, hidden_.data(), count * k);
+        std::fill(grad_.begin(), grad_.begin() + count * k, 0.0f);
+        for (int64_t v0 = 0; v0 < vocab; v0 += tile) {
+            const int64_t v1 = std::min(vocab, v0 + tile), width = v1 - v0;
+            logits_tile(hidden, r0, count, v0, v1);
+            const float* w = weight_rows(v0, width);
+            parallel_for(0, count, [&](int64_t lo, int64_t hi) {
+                for (int64_t i = lo; i < hi; ++i) {
+                    float* dl = tile_.data() + i * width;
+                    if (target[i] == ignore_index) {
+                        std::fill(dl, dl + width, 0.0f);
+                        continue;
+                    }
+                    for (int64_t v = 0; v < width; ++v) {
+                        dl[v] = std::exp(dl[v] - row_sum_[i]) * coeff;
+                    }
+                    if (target[i] >= v0 && target[i] < v1) {
+                        dl[target[i] - v0] -= coeff;
+                    }
+                    float* dh = grad_.data() + i * k;
+                    for (int64_t v = 0; v < width; ++v) {
+                        simd_axpy(dh, w + v * k, dl[v], k);
+                    }
+                }
+            });
+            if (gw == nullptr) {
+                continue;
+            }
+            // each worker owns whole weight rows
+            parallel_for(v0, v1, [&](int64_t lo, int64_t hi) {
+                std::vector<float> acc(k);
+                for (int64_t v = lo; v < hi; ++v) {
+                    row_to_float<dtype>(gw + v * k, acc.data(), k);
+                    for (int64_t i = 0; i < count; ++i) {
+                        simd_axpy(acc.data(), hidden_.data() + i * k, tile_[i * width + v - v0], k);
+                    }
+                    row_from_float<dtype>(acc.data(), gw + v * k, k);
+                }
+            });
+        }
+        row_from_float<dtype>(grad_.data(), grad_hidden + r0 * k, count * k);
+    }
+    return static_cast<float>(loss / counted);
+}
+
+#endif
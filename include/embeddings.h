@@ -2,61 +2,300 @@
 #define EMBEDDINGS_H
 
 #include "tensor.h"
+#include "quantize.h"
+#include "optimizer.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
 #include <memory>
 #include <vector>
 #include <random>
+#include <string>
+
+// Gradient of the embedding table restricted to the rows a batch touched.
+// rows is ascending and unique; values[i] is the summed gradient of rows[i].
+template<DType dtype>
+struct SparseRowGrad {
+    std::vector<uint32_t> rows;
+    Tensor<dtype> values;
+};
 
 template<DType dtype>
 class Embeddings {
 public: 
     Embeddings(size_t vocab_size, size_t embedding_dim);
     Embeddings(size_t vocab_size, size_t embedding_dim, Device device);
+    // The table is kept in `storage` and dequantized row by row on lookup;
+    // outputs are still Tensor<dtype>.
+    Embeddings(size_t vocab_size, size_t embedding_dim, WeightStorage storage, Device device = CPU);
 
     Tensor<dtype> forward(const Tensor<UINT32>& input);
+    // Copies the rows of ids[0..num_tokens) into a preallocated [num_tokens, D] buffer.
+    void gather_rows(const uint32_t* ids, int64_t num_tokens, typename DTypeToType<dtype>::Type* output) const;
+    // Throws std::out_of_range for an id >= vocab size (gather_rows checks too).
+    void validate_ids(const uint32_t* ids, int64_t num_tokens) const;
+
+    // grad_output has the shape forward returned; ids are the ones forward saw.
+    SparseRowGrad<dtype> backward(const Tensor<dtype>& grad_output);
+    SparseRowGrad<dtype> backward_rows(const uint32_t* ids, const typename DTypeToType<dtype>::Type* grad_output,
+        int64_t num_tokens) const;
 
-    Tensor<dtype> backward(const Tensor<dtype>& grad_output);
-    void update(const Tensor<dtype>& grad, float learning_rate);
+    // Both updates only read and write the rows present in grad.
+    void update(const SparseRowGrad<dtype>& grad, float learning_rate);
+    // Lazy Adam: moments of a row only advance when the row receives a gradient,
+    // with bias correction from that row's own step count.
+    void update_adam(const SparseRowGrad<dtype>& grad, float learning_rate, float beta1 = 0.9f,
+        float beta2 = 0.999f, float epsilon = 1e-8f);
+    // The step an Optimizer with `config` would take (SGD with momentum, or
+    // AdamW with its betas, epsilon and decoupled decay), lazily over the given
+    // rows: grad holds count fp32 rows, each multiplied by grad_scale on read
+    // (unscale and clip). States are fp32 and per row, as in update_adam.
+    void update_rows(const uint32_t* rows, const float* grad, int64_t count, const OptimizerConfig& config,
+        float grad_scale = 1.0f);
 
     Tensor<dtype> get_embedding_matrix() const  {
-      return embedding_matrix_;
+      return embedding_matrix_.dense();
+    }
+
+    size_t table_bytes() const {
+      return embedding_matrix_.bytes();
     }
 
 private:
+    using T = typename DTypeToType<dtype>::Type;
+    void init_table();
+
     size_t vocab_size_;
     size_t embedding_dim_;
-    Tensor<dtype> embedding_matrix_;
+    WeightMatrix<dtype> embedding_matrix_;
     Device device;
+
+    std::vector<uint32_t> saved_ids_;
+    std::vector<float> adam_m_;
+    std::vector<float> adam_v_;
+    std::vector<uint32_t> adam_steps_;
 };
 
 template<DType dtype>
 Embeddings<dtype>::Embeddings(size_t vocab_size, size_t embedding_dim)
-    : vocab_size_(vocab_size), embedding_dim_(embedding_dim), device(CPU), 
-      embedding_matrix_(Tensor<dtype>::rand({static_cast<int>(vocab_size), static_cast<int>(embedding_dim)})) {}
+    : vocab_size_(vocab_size), embedding_dim_(embedding_dim),
+      embedding_matrix_(vocab_size, embedding_dim, STORAGE_FULL), device(CPU) {
+    init_table();
+}
 
 
 template<DType dtype>
 Embeddings<dtype>::Embeddings(size_t vocab_size, size_t embedding_dim, Device device)
-    : vocab_size_(vocab_size), embedding_dim_(embedding_dim), device(device), 
-      embedding_matrix_(Tensor<dtype>::rand({static_cast<int>(vocab_size), static_cast<int>(embedding_dim)})) {}
+    : vocab_size_(vocab_size), embedding_dim_(embedding_dim),
+      embedding_matrix_(vocab_size, embedding_dim, STORAGE_FULL), device(device) {
+    init_table();
+}
 
 template<DType dtype>
-Tensor<dtype> Embeddings<dtype>::forward(const Tensor<UINT32>& input) {
-    std::vector<int> output_shape = {static_cast<int>(input.shape[0]), static_cast<int>(embedding_dim_)};
-    Tensor<dtype> output = Tensor<dtype>::zeros(output_shape);
-    output.change_device(device); 
-    for (size_t i = 0; i < input.shape[0]; ++i) {
-        int token_id = static_cast<int>(input.get({static_cast<int>(i), 0}));
-        if(token_id >= vocab_size_){
-          std::cout<<"Token ID: "<<token_id<<std::endl;
-          std::cout<<"Vocab size: "<<vocab_size_<<std::endl;
-          throw std::out_of_range("Token Ids should not exceed vocab size");
+Embeddings<dtype>::Embeddings(size_t vocab_size, size_t embedding_dim, WeightStorage storage, Device device)
+    : vocab_size_(vocab_size), embedding_dim_(embedding_dim), embedding_matrix_(vocab_size, embedding_dim, storage),
+      device(device) {
+    init_table();
+}
+
+template<DType dtype>
+void Embeddings<dtype>::init_table() {
+    // same U(0, 1) init Tensor::rand uses, but generated in fp32 so every dtype
+    // and storage format can be filled through store_row
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> dis(0.0f, 1.0f);
+    std::vector<float> row(embedding_dim_);
+    for (size_t r = 0; r < vocab_size_; ++r) {
+        for (auto& v : row) {
+            v = dis(gen);
+        }
+        embedding_matrix_.store_row(r, row.data());
+    }
+}
+
+template<DType dtype>
+void Embeddings<dtype>::validate_ids(const uint32_t* ids, int64_t num_tokens) const {
+    // branch-free max reduction so the common (valid) case is a single vectorized pass
+    uint32_t max_id = 0;
+    for (int64_t i = 0; i < num_tokens; ++i) {
+        max_id = ids[i] > max_id ? ids[i] : max_id;
+    }
+    if (num_tokens > 0 && max_id >= vocab_size_) {
+        for (int64_t i = 0; i < num_tokens; ++i) {
+            if (ids[i] >= vocab_size_) {
+                throw std::out_of_range("Token Ids should not exceed vocab size (token " + std::to_string(ids[i]) +
+                    " at position " + std::to_string(i) + ", vocab size " + std::to_string(vocab_size_) + ")");
+            }
         }
-        for (size_t j = 0; j < embedding_dim_; ++j) {
-            output.set({static_cast<int>(i), static_cast<int>(j)}, embedding_matrix_.get({token_id, static_cast<int>(j)}));
+    }
+}
+
+template<DType dtype>
+void Embeddings<dtype>::gather_rows(const uint32_t* ids, int64_t num_tokens, T* output) const {
+    validate_ids(ids, num_tokens);
+    const int64_t row_bytes = embedding_dim_ * sizeof(T);
+    parallel_for(0, num_tokens, [&](int64_t lo, int64_t hi) {
+        for (int64_t i = lo; i < hi; ++i) {
+            // memcpy for full storage, otherwise dequantized straight into the output row
+            embedding_matrix_.copy_row(ids[i], output + i * embedding_dim_);
         }
+    }, std::max<int64_t>(1, 65536 / row_bytes));
+}
+
+template<DType dtype>
+Tensor<dtype> Embeddings<dtype>::forward(const Tensor<UINT32>& input) {
+    // [N] -> [N, D], [B, T] -> [B, T, D]
+    if (input.shape.empty() || input.shape.size() > 2) {
+        throw std::runtime_error("Embeddings expects token ids of shape [N] or [B, T]");
     }
+    std::vector<int> output_shape = input.shape;
+    output_shape.push_back(static_cast<int>(embedding_dim_));
+    int64_t num_tokens = input.size();
+
+    // every row is overwritten by the gather, so skip the zero fill
+    T* data = static_cast<T*>(allocate_memory(dtype, num_tokens * embedding_dim_));
+    Tensor<dtype> output(data, output_shape, device);
+    gather_rows(input.data(), num_tokens, output.data());
+    saved_ids_.assign(input.data(), input.data() + num_tokens);
     return output;
 }
 
-#endif
+template<DType dtype>
+SparseRowGrad<dtype> Embeddings<dtype>::backward_rows(const uint32_t* ids, const T* grad_output,
+    int64_t num_tokens) const {
+    // Sort token positions by id so duplicates are adjacent; each unique row is
+    // then reduced by exactly one worker, which needs no atomics and is deterministic.
+    std::vector<uint32_t> order(num_tokens);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+
+    SparseRowGrad<dtype> grad;
+    std::vector<int64_t> segment_start;
+    for (int64_t i = 0; i < num_tokens; ++i) {
+        if (i == 0 || ids[order[i]] != ids[order[i - 1]]) {
+            grad.rows.push_back(ids[order[i]]);
+            segment_start.push_back(i);
+        }
+    }
+    segment_start.push_back(num_tokens);
+
+    const int64_t dim = embedding_dim_;
+    const int64_t num_rows = grad.rows.size();
+    grad.values = Tensor<dtype>(static_cast<T*>(allocate_memory(dtype, std::max<int64_t>(1, num_rows * dim))),
+        {static_cast<int>(num_rows), static_cast<int>(dim)});
+    parallel_for(0, num_rows, [&](int64_t lo, int64_t hi) {
+        std::vector<float> acc(dim);
+        for (int64_t u = lo; u < hi; ++u) {
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            for (int64_t i = segment_start[u]; i < segment_start[u + 1]; ++i) {
+                const T* g = grad_output + static_cast<int64_t>(order[i]) * dim;
+                for (int64_t j = 0; j < dim; ++j) {
+                    acc[j] += to_float<dtype>(g[j]);
+                }
+            }
+            row_from_float<dtype>(acc.data(), grad.values.data() + u * dim, dim);
+        }
+    }, std::max<int64_t>(1, 4096 / std::max<int64_t>(1, dim)));
+    return grad;
+}
+
+template<DType dtype>
+SparseRowGrad<dtype> Embeddings<dtype>::backward(const Tensor<dtype>& grad_output) {
+    if (static_cast<size_t>(grad_output.size()) != saved_ids_.size() * embedding_dim_) {
+        throw std::runtime_error("Embeddings: backward called without a matching forward");
+    }
+    return backward_rows(saved_ids_.data(), grad_output.data(), saved_ids_.size());
+}
+
+template<DType dtype>
+void Embeddings<dtype>::update(const SparseRowGrad<dtype>& grad, float learning_rate) {
+    const int64_t dim = embedding_dim_;
+    parallel_for(0, static_cast<int64_t>(grad.rows.size()), [&](int64_t lo, int64_t hi) {
+        std::vector<float> row(dim);
+        for (int64_t u = lo; u < hi; ++u) {
+            const T* g = grad.values.data() + u * dim;
+            // quantized tables are updated in fp32 and re-quantized row by row
+            embedding_matrix_.load_row(grad.rows[u], row.data());
+            for (int64_t j = 0; j < dim; ++j) {
+                row[j] -= learning_rate * to_float<dtype>(g[j]);
+            }
+            embedding_matrix_.store_row(grad.rows[u], row.data());
+        }
+    });
+}
 
+template<DType dtype>
+void Embeddings<dtype>::update_adam(const SparseRowGrad<dtype>& grad, float learning_rate, float beta1,
+    float beta2, float epsilon) {
+    const int64_t dim = embedding_dim_;
+    if (adam_v_.empty()) {
+        adam_m_.assign(vocab_size_ * embedding_dim_, 0.0f);
+        adam_v_.assign(vocab_size_ * embedding_dim_, 0.0f);
+        adam_steps_.assign(vocab_size_, 0);
+    }
+    parallel_for(0, static_cast<int64_t>(grad.rows.size()), [&](int64_t lo, int64_t hi) {
+        std::vector<float> row(dim);
+        for (int64_t u = lo; u < hi; ++u) {
+            int64_t id = grad.rows[u];
+            uint32_t step = ++adam_steps_[id];
+            float bias1 = 1.0f - std::pow(beta1, static_cast<float>(step));
+            float bias2 = 1.0f - std::pow(beta2, static_cast<float>(step));
+            float step_size = learning_rate / bias1;
+            float inv_sqrt_bias2 = 1.0f / std::sqrt(bias2);
+
+            embedding_matrix_.load_row(id, row.data());
+            float* m = adam_m_.data() + id * dim;
+            float* v = adam_v_.data() + id * dim;
+            const T* g = grad.values.data() + u * dim;
+            for (int64_t j = 0; j < dim; ++j) {
+                float gj = to_float<dtype>(g[j]);
+                m[j] = beta1 * m[j] + (1.0f - beta1) * gj;
+                v[j] = beta2 * v[j] + (1.0f - beta2) * gj * gj;
+                float denom = std::sqrt(v[j]) * inv_sqrt_bias2 + epsilon;
+                row[j] -= step_size * m[j] / denom;
+            }
+            embedding_matrix_.store_row(id, row.data());
+        }
+    });
+}
+
+template<DType dtype>
+void Embeddings<dtype>::update_rows(const uint32_t* rows, const float* grad, int64_t count,
+    const OptimizerConfig& config, float grad_scale) {
+    const int64_t dim = embedding_dim_;
+    const bool adam = config.kind == OPTIMIZER_ADAMW, momentum = !adam && config.momentum != 0.0f;
+    if ((adam || momentum) && adam_m_.empty()) {
+        adam_m_.assign(vocab_size_ * embedding_dim_, 0.0f);
+    }
+    if (adam && adam_v_.empty()) {
+        adam_v_.assign(vocab_size_ * embedding_dim_, 0.0f);
+    }
+    if (adam_steps_.empty()) {
+        adam_steps_.assign(vocab_size_, 0);
+    }
+    const float decay = 1.0f - config.learning_rate * config.weight_decay;
+    parallel_for(0, count, [&](int64_t lo, int64_t hi) {
+        std::vector<float> row(dim);
+        for (int64_t u = lo; u < hi; ++u) {
+            const int64_t id = rows[u];
+            const float* g = grad + u * dim;
+            embedding_matrix_.load_row(id, row.data());
+            if (adam) {
+                const float t = static_cast<float>(++adam_steps_[id]);
+                AdamCoefficients c{grad_scale, decay, config.beta1, config.beta2,
+                    config.learning_rate / (1.0f - std::pow(config.beta1, t)),
+                    1.0f / std::sqrt(1.0f - std::pow(config.beta2, t)), config.epsilon};
+                fused_adamw(row.data(), g, adam_m_.data() + id * dim, adam_v_.data() + id * dim, dim, c);
+            } else {
+                fused_sgd(row.data(), g, momentum ? adam_m_.data() + id * dim : nullptr, dim, grad_scale, decay,
+                    config.learning_rate, config.momentum);
+            }
+            embedding_matrix_.store_row(id, row.data());
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef FEED_FORWARD_H
+#define FEED_FORWARD_H
+
+#include "linear.h"
+#include <cmath>
+#include <vector>
+
+// SwiGLU feed-forward: out = W_down (SiLU(x W_gate^T) * (x W_up^T)).
+// Gate and up are one [2 * hidden, dim] matrix with their rows interleaved
+// (row 2j is gate_j, row 2j + 1 is up_j), so a single GEMM produces both and
+// every epilogue block holds matching pairs: SiLU(gate) * up is applied there
+// and only the [rows, hidden] product is ever written.
+// Backward saves nothing but the input and recomputes gate/up with the same GEMM.
+template<DType dtype>
+class FeedForward {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    FeedForward(int dim, int hidden_dim, WeightStorage storage = STORAGE_FULL, Device device = CPU);
+
+    Tensor<dtype> forward(const Tensor<dtype>& input);
+    Tensor<dtype> backward(const Tensor<dtype>& grad_output);
+
+    // hidden: caller-provided [rows, hidden_dim] scratch.
+    void forward_rows(const T* input, T* output, T* hidden, int64_t rows) const;
+    void backward_rows(const T* grad_output, const T* input, T* grad_input, int64_t rows);
+
+    Linear<dtype>& gate_up() { return gate_up_; }
+    Linear<dtype>& down() { return down_; }
+    int dim() const { return dim_; }
+    int hidden_dim() const { return hidden_dim_; }
+
+private:
+    static float silu(float g) { return g / (1.0f + std::exp(-g)); }
+
+    int dim_;
+    int hidden_dim_;
+    Device device_;
+    Linear<dtype> gate_up_;
+    Linear<dtype> down_;
+    Tensor<dtype> saved_input_;
+};
+
+template<DType dtype>
+FeedForward<dtype>::FeedForward(int dim, int hidden_dim, WeightStorage storage, Device device)
+  : dim_(dim), hidden_dim_(hidden_dim), device_(device), gate_up_(dim, 2 * hidden_dim, storage, device),
+    down_(hidden_dim, dim, storage, device) {}
+
+template<DType dtype>
+void FeedForward<dtype>::forward_rows(const T* input, T* output, T* hidden, int64_t rows) const {
+    const int64_t f = hidden_dim_;
+    gate_up_.forward_rows_epilogue(input, rows, [&](int64_t i, int64_t n0, int64_t n1, const float* gu) {
+        float h[Linear<dtype>::block_n / 2];
+        for (int64_t p = 0; p < (n1 - n0) / 2; ++p) {
+            h[p] = silu(gu[2 * p]) * gu[2 * p + 1];
+        }
+        row_from_float<dtype>(h, hidden + i * f + n0 / 2, (n1 - n0) / 2);
+    });
+    down_.forward_rows(hidden, output, rows);
+}
+
+template<DType dtype>
+void FeedForward<dtype>::backward_rows(const T* grad_output, const T* input, T* grad_input, int64_t rows) {
+    const int64_t f = hidden_dim_;
+    std::vector<float> gate_up(static_cast<size_t>(rows) * 2 * f);
+    std::vector<T> hidden(static_cast<size_t>(rows) * f), grad_hidden(hidden.size()), grad_gate_up(gate_up.size());
+
+    gate_up_.forward_rows_epilogue(input, rows, [&](int64_t i, int64_t n0, int64_t n1, const float* gu) {
+        std::copy(gu, gu + (n1 - n0), gate_up.data() + i * 2 * f + n0);
+        float h[Linear<dtype>::block_n / 2];
+        for (int64_t p = 0; p < (n1 - n0) / 2; ++p) {
+            h[p] = silu(gu[2 * p]) * gu[2 * p + 1];
+        }
+        row_from_float<dtype>(h, hidden.data() + i * f + n0 / 2, (n1 - n0) / 2);
+    });
+    down_.backward_rows(grad_output, hidden.data(), grad_hidden.data(), rows);
+
+    // d gate = dh * up * silu'(gate), d up = dh * silu(gate)
+    parallel_for(0, rows, [&](int64_t lo, int64_t hi) {
+        for (int64_t i = lo; i < hi; ++i) {
+            for (int64_t j = 0; j < f; ++j) {
+                float g = gate_up[i * 2 * f + 2 * j], u = gate_up[i * 2 * f + 2 * j + 1];
+                float dh = to_float<dtype>(grad_hidden[i * f + j]);
+                float s = 1.0f / (1.0f + std::exp(-g));
+                grad_gate_up[i * 2 * f + 2 * j] = from_float<dtype>(dh * u * s * (1.0f + g * (1.0f - s)));
+                grad_gate_up[i * 2 * f + 2 * j + 1] = from_float<dtype>(dh * g * s);
+            }
+        }
+    });
+    gate_up_.backward_rows(grad_gate_up.data(), input, grad_input, rows);
+}
+
+template<DType dtype>
+Tensor<dtype> FeedForward<dtype>::forward(const Tensor<dtype>& input) {
+    if (input.shape.empty() || input.shape.back() != dim_) {
+        throw std::runtime_error("FeedForward: input features do not match the layer");
+    }
+    int64_t rows = input.size() / dim_;
+    Tensor<dtype> output(static_cast<T*>(allocate_memory(dtype, input.size())), input.shape, device_);
+    std::vector<T> hidden(static_cast<size_t>(rows) * hidden_dim_);
+    forward_rows(input.data(), output.data(), hidden.data(), rows);
+    saved_input_ = input;
+    return output;
+}
+
+template<DType dtype>
+Tensor<dtype> FeedForward<dtype>::backward(const Tensor<dtype>& grad_output) {
+    if (saved_input_.data() == nullptr || grad_output.shape != saved_input_.shape) {
+        throw std::runtime_error("FeedForward: backward called without a matching forward");
+    }
+    Tensor<dtype> grad_input(static_cast<T*>(allocate_memory(dtype, saved_input_.size())), saved_input_.shape,
+        device_);
+    backward_rows(grad_output.data(), saved_input_.data(), grad_input.data(), grad_output.size() / dim_);
+    return grad_input;
+}
+
+#endif
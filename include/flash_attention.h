@@ -2,32 +2,641 @@
 #define FLASH_ATTENTION_H
 
 #include "tensor.h"
-#include "rms_norm.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include "kv_cache.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
 
+// Masks are applied inside the kernel, never as a [T, S] tensor. Every mode
+// lets query t see one contiguous key range, so tiles outside it are skipped.
+// Queries are aligned to the end of the keys (query t sits at position
+// t + S - T), which is what decoding against a cache needs.
+typedef enum {
+    MASK_NONE,
+    MASK_CAUSAL,         // key position <= query position
+    MASK_SLIDING_WINDOW, // causal, and only the last `window` keys
+    MASK_BLOCK_DIAGONAL  // causal within each packed sequence (see set_segment_ids)
+} AttentionMask;
+
+template<DType dtype>
+struct AttentionGrads {
+    Tensor<dtype> query;
+    Tensor<dtype> key;
+    Tensor<dtype> value;
+};
+
+// Scaled dot-product attention computed tile by tile with an online softmax:
+// for each query block we stream key/value blocks, keep a running row max and
+// row sum, and rescale the partial output, so the [T, S] score matrix is never
+// materialized. Extra memory is one tile per worker plus O(T) row statistics.
+// Backward keeps only the output and the per-row logsumexp from forward and
+// recomputes the probabilities tile by tile, so training memory stays O(T) too.
+//
+// Layout: query [B, T, H, Dh], key/value [B, S, Hkv, Dh], output [B, T, H, Dh].
+// With Hkv < H (grouped-query / multi-query attention) query head h reads kv
+// head h / (H / Hkv). Work is split per kv head, so each K/V tile is loaded once
+// and used by its whole query-head group; K/V are never expanded to H heads.
 template<DType dtype>
 class FlashAttention {
+    using T = typename DTypeToType<dtype>::Type;
 public:
     FlashAttention(int head_dim, int num_heads, Device device = CPU);
+    FlashAttention(int head_dim, int num_heads, int num_kv_heads, Device device = CPU);
 
     Tensor<dtype> forward(const Tensor<dtype>& query, const Tensor<dtype>& key, const Tensor<dtype>& value);
-    Tensor<dtype> backward(const Tensor<dtype>& grad_output);
+    AttentionGrads<dtype> backward(const Tensor<dtype>& grad_output);
+
+    // Kernels over preallocated buffers. lse, when given, receives the per-row
+    // logsumexp of the scaled scores as [B, H, T]; backward_raw needs it.
+    void forward_raw(const T* query, const T* key, const T* value, T* output, float* lse,
+        int batch, int q_len, int kv_len) const;
+    void backward_raw(const T* query, const T* key, const T* value, const T* output, const float* lse,
+        const T* grad_output, T* grad_query, T* grad_key, T* grad_value, int batch, int q_len, int kv_len) const;
+
+    // Attention for the last q_len positions of each cached sequence, reading
+    // keys/values page by page through the block tables (one page = one tile).
+    // query/output are [seqs, q_len, H, Dh]; the new tokens must already be
+    // appended and stored, so a decode step costs O(length) instead of O(length^2).
+    void forward_paged(const KVCache<dtype>& cache, const std::vector<int>& seqs, int layer,
+        const T* query, T* output, int q_len) const;
+
+    void set_block_sizes(int block_q, int block_kv);
+    void set_mask(AttentionMask mask, int window = 0);
+    // [B, T] ids of the packed sequence each token belongs to; ids must be
+    // non-decreasing along T. Only used by MASK_BLOCK_DIAGONAL.
+    void set_segment_ids(const std::vector<int>& segment_ids, int batch, int seq_len);
+    AttentionMask mask() const { return mask_; }
+    int head_dim() const { return head_dim_; }
+    int num_heads() const { return num_heads_; }
+    int num_kv_heads() const { return num_kv_heads_; }
 
 private:
-    Tensor<dtype> softmax(const Tensor<dtype>& input);
-    Tensor<dtype> matmul(const Tensor<dtype>& tensor1, const Tensor<dtype>& tensor2);
+    // All three take a kv head `kh`; the query rows of a tile are the group's
+    // heads stacked on top of each other (row = g * block + i).
+    void attend_query_block(const T* query, const T* key, const T* value, T* output, float* lse,
+        int b, int kh, int q_begin, int q_end, int q_len, int kv_len) const;
+    void attend_paged(const KVCache<dtype>& cache, int seq, int layer, const T* query, T* output,
+        int kh, int q_len) const;
+    void grad_kv_block(const T* query, const T* key, const T* value, const float* lse, const float* delta,
+        const T* grad_output, T* grad_key, T* grad_value, int b, int kh, int kv_begin, int kv_end,
+        int q_len, int kv_len) const;
+    void grad_q_block(const T* query, const T* key, const T* value, const float* lse, const float* delta,
+        const T* grad_output, T* grad_query, int b, int kh, int q_begin, int q_end, int q_len, int kv_len) const;
+
+    // Keys [lo, hi) visible to query t of batch row b. Both ends are
+    // non-decreasing in t, so a block's range is [lo(first), hi(last)).
+    void visible_range(int b, int t, int q_len, int kv_len, int& lo, int& hi) const;
+
+    int64_t q_index(int b, int t, int h, int q_len) const {
+        return ((static_cast<int64_t>(b) * q_len + t) * num_heads_ + h) * head_dim_;
+    }
+    int64_t kv_index(int b, int s, int kh, int kv_len) const {
+        return ((static_cast<int64_t>(b) * kv_len + s) * num_kv_heads_ + kh) * head_dim_;
+    }
+    int64_t stat_index(int b, int h, int t, int q_len) const {
+        return (static_cast<int64_t>(b) * num_heads_ + h) * q_len + t;
+    }
 
     int head_dim_;
     int num_heads_;
+    int num_kv_heads_;
+    int group_;
     Device device_;
-    
-    Tensor<dtype> attention_scores_;
-    Tensor<dtype> attention_probs_;
-    Tensor<dtype> context_;
+    int block_q_;
+    int block_kv_;
+    float scale_;
+    AttentionMask mask_;
+    int window_;
+    int segment_len_;
+    std::vector<int> segment_begin_;
+
+    // what forward keeps for backward: the inputs (shared, not copied), the
+    // output and one logsumexp per query row
+    Tensor<dtype> saved_query_;
+    Tensor<dtype> saved_key_;
+    Tensor<dtype> saved_value_;
+    Tensor<dtype> saved_output_;
+    std::vector<float> saved_lse_;
 };
 
-template<Dtype dtype>
-FlashAttention::FlashAttention(int head_dim_, int num_heads_, Device device)
-  :head_dim_(head_dim_), num_heads_(num_heads_),device(device){}
+template<DType dtype>
+FlashAttention<dtype>::FlashAttention(int head_dim, int num_heads, Device device)
+  : FlashAttention(head_dim, num_heads, num_heads, device) {}
+
+template<DType dtype>
+FlashAttention<dtype>::FlashAttention(int head_dim, int num_heads, int num_kv_heads, Device device)
+  : head_dim_(head_dim), num_heads_(num_heads), num_kv_heads_(num_kv_heads), device_(device),
+    block_q_(64), block_kv_(64), scale_(1.0f / std::sqrt(static_cast<float>(head_dim))),
+    mask_(MASK_NONE), window_(0), segment_len_(0) {
+    if (num_kv_heads <= 0 || num_heads % num_kv_heads != 0) {
+        throw std::invalid_argument("FlashAttention: num_heads must be a multiple of num_kv_heads");
+    }
+    group_ = num_heads / num_kv_heads;
+}
+
+template<DType dtype>
+void FlashAttention<dtype>::set_block_sizes(int block_q, int block_kv) {
+    if (block_q <= 0 || block_kv <= 0) {
+        throw std::invalid_argument("FlashAttention: block sizes must be positive");
+    }
+    block_q_ = block_q;
+    block_kv_ = block_kv;
+}
+
+template<DType dtype>
+void FlashAttention<dtype>::set_mask(AttentionMask mask, int window) {
+    if (mask == MASK_SLIDING_WINDOW && window <= 0) {
+        throw std::invalid_argument("FlashAttention: sliding window must be positive");
+    }
+    mask_ = mask;
+    window_ = window;
+}
+
+template<DType dtype>
+void FlashAttention<dtype>::set_segment_ids(const std::vector<int>& segment_ids, int batch, int seq_len) {
+    if (static_cast<int64_t>(segment_ids.size()) != static_cast<int64_t>(batch) * seq_len) {
+        throw std::invalid_argument("FlashAttention: segment ids must be [batch, seq_len]");
+    }
+    // store where each token's sequence starts; that is all the mask needs
+    segment_begin_.resize(segment_ids.size());
+    for (int b = 0; b < batch; ++b) {
+        const int* ids = segment_ids.data() + static_cast<int64_t>(b) * seq_len;
+        int* begin = segment_begin_.data() + static_cast<int64_t>(b) * seq_len;
+        for (int t = 0; t < seq_len; ++t) {
+            if (t > 0 && ids[t] < ids[t - 1]) {
+                throw std::invalid_argument("FlashAttention: segment ids must be non-decreasing");
+            }
+            begin[t] = (t > 0 && ids[t] == ids[t - 1]) ? begin[t - 1] : t;
+        }
+    }
+    segment_len_ = seq_len;
+}
+
+template<DType dtype>
+void FlashAttention<dtype>::visible_range(int b, int t, int q_len, int kv_len, int& lo, int& hi) const {
+    const int pos = t + kv_len - q_len;
+    lo = 0;
+    hi = kv_len;
+    switch (mask_) {
+        case MASK_NONE:
+            break;
+        case MASK_CAUSAL:
+            hi = std::min(kv_len, pos + 1);
+            break;
+        case MASK_SLIDING_WINDOW:
+            hi = std::min(kv_len, pos + 1);
+            lo = std::max(0, pos - window_ + 1);
+            break;
+        case MASK_BLOCK_DIAGONAL:
+            hi = std::min(kv_len, pos + 1);
+            lo = segment_begin_[static_cast<int64_t>(b) * segment_len_ + pos];
+            break;
+    }
+}
+
+template<DType dtype>
+void FlashAttention<dtype>::attend_query_block(const T* query, const T* key, const T* value, T* output,
+    float* lse, int b, int kh, int q_begin, int q_end, int q_len, int kv_len) const {
+    const int d = head_dim_;
+    const int block_rows = q_end - q_begin;
+    const int rows = group_ * block_rows;
+
+    // per-worker tiles, sized once and reused across calls
+    static thread_local std::vector<float> q_tile, k_tile, v_tile, scores, acc, row_max, row_sum;
+    static thread_local std::vector<int> row_lo, row_hi;
+    q_tile.resize(static_cast<size_t>(rows) * d);
+    k_tile.resize(static_cast<size_t>(block_kv_) * d);
+    v_tile.resize(static_cast<size_t>(block_kv_) * d);
+    scores.resize(static_cast<size_t>(block_kv_));
+    acc.assign(static_cast<size_t>(rows) * d, 0.0f);
+    row_max.assign(rows, -std::numeric_limits<float>::infinity());
+    row_sum.assign(rows, 0.0f);
+
+    for (int g = 0; g < group_; ++g) {
+        int h = kh * group_ + g;
+        for (int i = 0; i < block_rows; ++i) {
+            float* q = q_tile.data() + (static_cast<int64_t>(g) * block_rows + i) * d;
+            row_to_float<dtype>(query + q_index(b, q_begin + i, h, q_len), q, d);
+            simd_scale(q, scale_, d);
+        }
+    }
+
+    row_lo.resize(block_rows);
+    row_hi.resize(block_rows);
+    for (int i = 0; i < block_rows; ++i) {
+        visible_range(b, q_begin + i, q_len, kv_len, row_lo[i], row_hi[i]);
+    }
+    // tiles entirely outside [lo(first row), hi(last row)) are never loaded
+    const int first_tile = row_lo[0] / block_kv_ * block_kv_;
+    const int last_col = row_hi[block_rows - 1];
+
+    for (int kv_begin = first_tile; kv_begin < last_col; kv_begin += block_kv_) {
+        const int cols = std::min(block_kv_, kv_len - kv_begin);
+        for (int j = 0; j < cols; ++j) {
+            row_to_float<dtype>(key + kv_index(b, kv_begin + j, kh, kv_len), k_tile.data() + j * d, d);
+            row_to_float<dtype>(value + kv_index(b, kv_begin + j, kh, kv_len), v_tile.data() + j * d, d);
+        }
+        for (int r = 0; r < rows; ++r) {
+            const int i = r % block_rows;
+            const int j_lo = std::max(0, row_lo[i] - kv_begin);
+            const int j_hi = std::min(cols, row_hi[i] - kv_begin);
+            if (j_lo >= j_hi) {
+                continue;
+            }
+            float* s = scores.data();
+            const float* q = q_tile.data() + static_cast<int64_t>(r) * d;
+            for (int j = j_lo; j < j_hi; ++j) {
+                s[j] = simd_dot(q, k_tile.data() + j * d, d);
+            }
+            // online softmax: rescale what we have so far to the new running max
+            float new_max = std::max(row_max[r], simd_max(s + j_lo, j_hi - j_lo));
+            float correction = std::exp(row_max[r] - new_max);
+            float sum = 0.0f;
+            for (int j = j_lo; j < j_hi; ++j) {
+                s[j] = std::exp(s[j] - new_max);
+                sum += s[j];
+            }
+            row_sum[r] = row_sum[r] * correction + sum;
+            row_max[r] = new_max;
+            float* o = acc.data() + static_cast<int64_t>(r) * d;
+            simd_scale(o, correction, d);
+            for (int j = j_lo; j < j_hi; ++j) {
+                simd_axpy(o, v_tile.data() + j * d, s[j], d);
+            }
+        }
+    }
+
+    for (int g = 0; g < group_; ++g) {
+        int h = kh * group_ + g;
+        for (int i = 0; i < block_rows; ++i) {
+            int r = g * block_rows + i;
+            float* o = acc.data() + static_cast<int64_t>(r) * d;
+            // a query that sees no key at all (only possible with T > S) outputs zeros
+            simd_scale(o, row_sum[r] > 0.0f ? 1.0f / row_sum[r] : 0.0f, d);
+            row_from_float<dtype>(o, output + q_index(b, q_begin + i, h, q_len), d);
+            if (lse != nullptr) {
+                lse[stat_index(b, h, q_begin + i, q_len)] = row_sum[r] > 0.0f ?
+                    row_max[r] + std::log(row_sum[r]) : std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+}
 
+template<DType dtype>
+void FlashAttention<dtype>::forward_raw(const T* query, const T* key, const T* value, T* output, float* lse,
+    int batch, int q_len, int kv_len) const {
+    if (kv_len <= 0) {
+        throw std::invalid_argument("FlashAttention: empty key/value sequence");
+    }
+    if (mask_ == MASK_BLOCK_DIAGONAL && (segment_len_ != kv_len || q_len > kv_len ||
+        static_cast<int64_t>(segment_begin_.size()) != static_cast<int64_t>(batch) * kv_len)) {
+        throw std::invalid_argument("FlashAttention: segment ids do not match the key/value length");
+    }
+    const int q_blocks = (q_len + block_q_ - 1) / block_q_;
+    const int64_t work = static_cast<int64_t>(batch) * num_kv_heads_ * q_blocks;
+    // one work item per (batch, kv head, query block)
+    parallel_for(0, work, [&](int64_t lo, int64_t hi) {
+        for (int64_t item = lo; item < hi; ++item) {
+            int qb = static_cast<int>(item % q_blocks);
+            int kh = static_cast<int>((item / q_blocks) % num_kv_heads_);
+            int b = static_cast<int>(item / (static_cast<int64_t>(q_blocks) * num_kv_heads_));
+            int q_begin = qb * block_q_;
+            int q_end = std::min(q_len, q_begin + block_q_);
+            attend_query_block(query, key, value, output, lse, b, kh, q_begin, q_end, q_len, kv_len);
+        }
+    });
+}
+
+template<DType dtype>
+void FlashAttention<dtype>::attend_paged(const KVCache<dtype>& cache, int seq, int layer, const T* query,
+    T* output, int kh, int q_len) const {
+    const int d = head_dim_;
+    const int rows = group_ * q_len;
+    const int page_size = cache.page_size();
+    const int kv_len = cache.length(seq);
+    const std::vector<int>& table = cache.block_table(seq);
+
+    static thread_local std::vector<float> q_tile, q_shifted, k_tile, v_tile, scores, acc, row_max, row_sum;
+    static thread_local std::vector<int> row_lo, row_hi;
+    q_tile.resize(static_cast<size_t>(rows) * d);
+    k_tile.resize(static_cast<size_t>(page_size) * d);
+    v_tile.resize(static_cast<size_t>(page_size) * d);
+    scores.resize(page_size);
+    acc.assign(static_cast<size_t>(rows) * d, 0.0f);
+    row_max.assign(rows, -std::numeric_limits<float>::infinity());
+    row_sum.assign(rows, 0.0f);
+    row_lo.resize(q_len);
+    row_hi.resize(q_len);
+
+    for (int g = 0; g < group_; ++g) {
+        int h = kh * group_ + g;
+        for (int i = 0; i < q_len; ++i) {
+            float* q = q_tile.data() + (static_cast<int64_t>(g) * q_len + i) * d;
+            row_to_float<dtype>(query + q_index(0, i, h, q_len), q, d);
+            simd_scale(q, scale_, d);
+        }
+    }
+    for (int i = 0; i < q_len; ++i) {
+        visible_range(0, i, q_len, kv_len, row_lo[i], row_hi[i]);
+    }
+    // streaming caches keep the keys past the sinks at their absolute
+    // position; those pages are scored with the query moved to match
+    const int shifted_begin = cache.shifted_begin(seq);
+    if (shifted_begin < kv_len) {
+        q_shifted.assign(q_tile.begin(), q_tile.end());
+        cache.shift_query(seq, q_shifted.data(), rows);
+    }
+
+    for (int p = row_lo[0] / page_size; p * page_size < row_hi[q_len - 1]; ++p) {
+        const int kv_begin = p * page_size;
+        const int cols = std::min(page_size, kv_len - kv_begin);
+        cache.load_page(layer, table[p], kh, cols, k_tile.data(), v_tile.data());
+        const float* q_page = kv_begin >= shifted_begin ? q_shifted.data() : q_tile.data();
+        for (int r = 0; r < rows; ++r) {
+            const int i = r % q_len;
+            const int j_lo = std::max(0, row_lo[i] - kv_begin);
+            const int j_hi = std::min(cols, row_hi[i] - kv_begin);
+            if (j_lo >= j_hi) {
+                continue;
+            }
+            float* s = scores.data();
+            const float* q = q_page + static_cast<int64_t>(r) * d;
+            for (int j = j_lo; j < j_hi; ++j) {
+                s[j] = simd_dot(q, k_tile.data() + j * d, d);
+            }
+            float new_max = std::max(row_max[r], simd_max(s + j_lo, j_hi - j_lo));
+            float correction = std::exp(row_max[r] - new_max);
+            float sum = 0.0f;
+            for (int j = j_lo; j < j_hi; ++j) {
+                s[j] = std::exp(s[j] - new_max);
+                sum += s[j];
+            }
+            row_sum[r] = row_sum[r] * correction + sum;
+            row_max[r] = new_max;
+            float* o = acc.data() + static_cast<int64_t>(r) * d;
+            simd_scale(o, correction, d);
+            for (int j = j_lo; j < j_hi; ++j) {
+                simd_axpy(o, v_tile.data() + j * d, s[j], d);
+            }
+        }
+    }
+
+    for (int g = 0; g < group_; ++g) {
+        int h = kh * group_ + g;
+        for (int i = 0; i < q_len; ++i) {
+            int r = g * q_len + i;
+            float* o = acc.data() + static_cast<int64_t>(r) * d;
+            simd_scale(o, row_sum[r] > 0.0f ? 1.0f / row_sum[r] : 0.0f, d);
+            row_from_float<dtype>(o, output + q_index(0, i, h, q_len), d);
+        }
+    }
+}
+
+template<DType dtype>
+void FlashAttention<dtype>::forward_paged(const KVCache<dtype>& cache, const std::vector<int>& seqs, int layer,
+    const T* query, T* output, int q_len) const {
+    if (cache.num_kv_heads() != num_kv_heads_ || cache.head_dim() != head_dim_) {
+        throw std::invalid_argument("FlashAttention: KV cache heads/head_dim do not match the layer");
+    }
+    if (mask_ == MASK_BLOCK_DIAGONAL) {
+        throw std::invalid_argument("FlashAttention: block-diagonal masks are not supported on a KV cache");
+    }
+    if (q_len <= 0) {
+        throw std::invalid_argument("FlashAttention: q_len must be positive");
+    }
+    for (int seq : seqs) {
+        if (cache.length(seq) < q_len) {
+            throw std::invalid_argument("FlashAttention: query tokens must be appended to the cache first");
+        }
+    }
+    const int64_t seq_stride = static_cast<int64_t>(q_len) * num_heads_ * head_dim_;
+    // one work item per (sequence, kv head)
+    parallel_for(0, static_cast<int64_t>(seqs.size()) * num_kv_heads_, [&](int64_t lo, int64_t hi) {
+        for (int64_t item = lo; item < hi; ++item) {
+            int n = static_cast<int>(item / num_kv_heads_);
+            int kh = static_cast<int>(item % num_kv_heads_);
+            attend_paged(cache, seqs[n], layer, query + n * seq_stride, output + n * seq_stride, kh, q_len);
+        }
+    });
+}
+
+template<DType dtype>
+Tensor<dtype> FlashAttention<dtype>::forward(const Tensor<dtype>& query, const Tensor<dtype>& key,
+    const Tensor<dtype>& value) {
+    if (query.shape.size() != 4 || key.shape.size() != 4 || value.shape.size() != 4) {
+        throw std::runtime_error("FlashAttention expects [batch, seq, heads, head_dim] tensors");
+    }
+    if (query.shape[2] != num_heads_ || query.shape[3] != head_dim_) {
+        throw std::runtime_error("FlashAttention: query heads/head_dim do not match the layer");
+    }
+    if (key.shape != value.shape || key.shape[0] != query.shape[0] || key.shape[2] != num_kv_heads_ ||
+        key.shape[3] != head_dim_) {
+        throw std::runtime_error("FlashAttention: key/value shapes do not match the query");
+    }
+    int batch = query.shape[0];
+    int q_len = query.shape[1];
+    int kv_len = key.shape[1];
+
+    Tensor<dtype> output(static_cast<T*>(allocate_memory(dtype, query.size())), query.shape, device_);
+    saved_lse_.resize(static_cast<size_t>(batch) * num_heads_ * q_len);
+    forward_raw(query.data(), key.data(), value.data(), output.data(), saved_lse_.data(), batch, q_len, kv_len);
+    saved_query_ = query;
+    saved_key_ = key;
+    saved_value_ = value;
+    saved_output_ = output;
+    return output;
+}
+
+template<DType dtype>
+void FlashAttention<dtype>::grad_kv_block(const T* query, const T* key, const T* value, const float* lse,
+    const float* delta, const T* grad_output, T* grad_key, T* grad_value, int b, int kh, int kv_begin, int kv_end,
+    int q_len, int kv_len) const {
+    const int d = head_dim_;
+    const int cols = kv_end - kv_begin;
+    static thread_local std::vector<float> q_tile, do_tile, k_tile, v_tile, dk, dv;
+    q_tile.resize(static_cast<size_t>(block_q_) * d);
+    do_tile.resize(static_cast<size_t>(block_q_) * d);
+    k_tile.resize(static_cast<size_t>(cols) * d);
+    v_tile.resize(static_cast<size_t>(cols) * d);
+    dk.assign(static_cast<size_t>(cols) * d, 0.0f);
+    dv.assign(static_cast<size_t>(cols) * d, 0.0f);
+
+    for (int j = 0; j < cols; ++j) {
+        row_to_float<dtype>(key + kv_index(b, kv_begin + j, kh, kv_len), k_tile.data() + j * d, d);
+        row_to_float<dtype>(value + kv_index(b, kv_begin + j, kh, kv_len), v_tile.data() + j * d, d);
+    }
+
+    // the kv head's gradient is the sum over every query head in its group
+    for (int q_begin = 0; q_begin < q_len; q_begin += block_q_) {
+        const int rows = std::min(block_q_, q_len - q_begin);
+        int first_lo, first_hi, last_lo, last_hi;
+        visible_range(b, q_begin, q_len, kv_len, first_lo, first_hi);
+        visible_range(b, q_begin + rows - 1, q_len, kv_len, last_lo, last_hi);
+        if (last_hi <= kv_begin || first_lo >= kv_end) {
+            continue;
+        }
+        for (int g = 0; g < group_; ++g) {
+            int h = kh * group_ + g;
+            for (int i = 0; i < rows; ++i) {
+                row_to_float<dtype>(query + q_index(b, q_begin + i, h, q_len), q_tile.data() + i * d, d);
+                row_to_float<dtype>(grad_output + q_index(b, q_begin + i, h, q_len), do_tile.data() + i * d, d);
+            }
+            for (int i = 0; i < rows; ++i) {
+                int lo, hi;
+                visible_range(b, q_begin + i, q_len, kv_len, lo, hi);
+                const int j_lo = std::max(0, lo - kv_begin);
+                const int j_hi = std::min(cols, hi - kv_begin);
+                const float* q = q_tile.data() + i * d;
+                const float* dout = do_tile.data() + i * d;
+                float row_lse = lse[stat_index(b, h, q_begin + i, q_len)];
+                float row_delta = delta[stat_index(b, h, q_begin + i, q_len)];
+                for (int j = j_lo; j < j_hi; ++j) {
+                    // recompute P_ij from the saved logsumexp instead of storing it
+                    float p = std::exp(scale_ * simd_dot(q, k_tile.data() + j * d, d) - row_lse);
+                    float dp = simd_dot(dout, v_tile.data() + j * d, d);
+                    float ds = p * (dp - row_delta);
+                    simd_axpy(dv.data() + j * d, dout, p, d);
+                    simd_axpy(dk.data() + j * d, q, ds * scale_, d);
+                }
+            }
+        }
+    }
+    for (int j = 0; j < cols; ++j) {
+        row_from_float<dtype>(dk.data() + j * d, grad_key + kv_index(b, kv_begin + j, kh, kv_len), d);
+        row_from_float<dtype>(dv.data() + j * d, grad_value + kv_index(b, kv_begin + j, kh, kv_len), d);
+    }
+}
+
+template<DType dtype>
+void FlashAttention<dtype>::grad_q_block(const T* query, const T* key, const T* value, const float* lse,
+    const float* delta, const T* grad_output, T* grad_query, int b, int kh, int q_begin, int q_end,
+    int q_len, int kv_len) const {
+    const int d = head_dim_;
+    const int block_rows = q_end - q_begin;
+    const int rows = group_ * block_rows;
+    static thread_local std::vector<float> q_tile, do_tile, k_tile, v_tile, dq, row_lse, row_delta;
+    static thread_local std::vector<int> row_lo, row_hi;
+    q_tile.resize(static_cast<size_t>(rows) * d);
+    do_tile.resize(static_cast<size_t>(rows) * d);
+    k_tile.resize(static_cast<size_t>(block_kv_) * d);
+    v_tile.resize(static_cast<size_t>(block_kv_) * d);
+    dq.assign(static_cast<size_t>(rows) * d, 0.0f);
+    row_lse.resize(rows);
+    row_delta.resize(rows);
+
+    for (int g = 0; g < group_; ++g) {
+        int h = kh * group_ + g;
+        for (int i = 0; i < block_rows; ++i) {
+            int r = g * block_rows + i;
+            row_to_float<dtype>(query + q_index(b, q_begin + i, h, q_len), q_tile.data() + r * d, d);
+            row_to_float<dtype>(grad_output + q_index(b, q_begin + i, h, q_len), do_tile.data() + r * d, d);
+            row_lse[r] = lse[stat_index(b, h, q_begin + i, q_len)];
+            row_delta[r] = delta[stat_index(b, h, q_begin + i, q_len)];
+        }
+    }
+
+    row_lo.resize(block_rows);
+    row_hi.resize(block_rows);
+    for (int i = 0; i < block_rows; ++i) {
+        visible_range(b, q_begin + i, q_len, kv_len, row_lo[i], row_hi[i]);
+    }
+    const int first_tile = row_lo[0] / block_kv_ * block_kv_;
+    const int last_col = row_hi[block_rows - 1];
+
+    for (int kv_begin = first_tile; kv_begin < last_col; kv_begin += block_kv_) {
+        const int cols = std::min(block_kv_, kv_len - kv_begin);
+        for (int j = 0; j < cols; ++j) {
+            row_to_float<dtype>(key + kv_index(b, kv_begin + j, kh, kv_len), k_tile.data() + j * d, d);
+            row_to_float<dtype>(value + kv_index(b, kv_begin + j, kh, kv_len), v_tile.data() + j * d, d);
+        }
+        for (int r = 0; r < rows; ++r) {
+            const int i = r % block_rows;
+            const int j_lo = std::max(0, row_lo[i] - kv_begin);
+            const int j_hi = std::min(cols, row_hi[i] - kv_begin);
+            const float* q = q_tile.data() + static_cast<int64_t>(r) * d;
+            const float* dout = do_tile.data() + static_cast<int64_t>(r) * d;
+            for (int j = j_lo; j < j_hi; ++j) {
+                float p = std::exp(scale_ * simd_dot(q, k_tile.data() + j * d, d) - row_lse[r]);
+                float ds = p * (simd_dot(dout, v_tile.data() + j * d, d) - row_delta[r]);
+                simd_axpy(dq.data() + static_cast<int64_t>(r) * d, k_tile.data() + j * d, ds * scale_, d);
+            }
+        }
+    }
+    for (int g = 0; g < group_; ++g) {
+        int h = kh * group_ + g;
+        for (int i = 0; i < block_rows; ++i) {
+            int r = g * block_rows + i;
+            row_from_float<dtype>(dq.data() + static_cast<int64_t>(r) * d, grad_query + q_index(b, q_begin + i, h, q_len), d);
+        }
+    }
+}
+
+template<DType dtype>
+void FlashAttention<dtype>::backward_raw(const T* query, const T* key, const T* value, const T* output,
+    const float* lse, const T* grad_output, T* grad_query, T* grad_key, T* grad_value,
+    int batch, int q_len, int kv_len) const {
+    const int d = head_dim_;
+
+    // delta_i = dO_i . O_i, the softmax-jacobian term shared by every kv tile
+    std::vector<float> delta(static_cast<size_t>(batch) * num_heads_ * q_len);
+    parallel_for(0, static_cast<int64_t>(batch) * q_len, [&](int64_t lo, int64_t hi) {
+        std::vector<float> o_row(d), do_row(d);
+        for (int64_t bt = lo; bt < hi; ++bt) {
+            int b = static_cast<int>(bt / q_len), t = static_cast<int>(bt % q_len);
+            for (int h = 0; h < num_heads_; ++h) {
+                row_to_float<dtype>(output + q_index(b, t, h, q_len), o_row.data(), d);
+                row_to_float<dtype>(grad_output + q_index(b, t, h, q_len), do_row.data(), d);
+                delta[stat_index(b, h, t, q_len)] = simd_dot(o_row.data(), do_row.data(), d);
+            }
+        }
+    });
+
+    // dK/dV are owned by kv blocks and dQ by query blocks, so the two passes
+    // write disjoint rows and need no atomics; the scores are recomputed in each
+    const int kv_blocks = (kv_len + block_kv_ - 1) / block_kv_;
+    parallel_for(0, static_cast<int64_t>(batch) * num_kv_heads_ * kv_blocks, [&](int64_t lo, int64_t hi) {
+        for (int64_t item = lo; item < hi; ++item) {
+            int kb = static_cast<int>(item % kv_blocks);
+            int kh = static_cast<int>((item / kv_blocks) % num_kv_heads_);
+            int b = static_cast<int>(item / (static_cast<int64_t>(kv_blocks) * num_kv_heads_));
+            int kv_begin = kb * block_kv_;
+            grad_kv_block(query, key, value, lse, delta.data(), grad_output, grad_key, grad_value, b, kh,
+                kv_begin, std::min(kv_len, kv_begin + block_kv_), q_len, kv_len);
+        }
+    });
+
+    const int q_blocks = (q_len + block_q_ - 1) / block_q_;
+    parallel_for(0, static_cast<int64_t>(batch) * num_kv_heads_ * q_blocks, [&](int64_t lo, int64_t hi) {
+        for (int64_t item = lo; item < hi; ++item) {
+            int qb = static_cast<int>(item % q_blocks);
+            int kh = static_cast<int>((item / q_blocks) % num_kv_heads_);
+            int b = static_cast<int>(item / (static_cast<int64_t>(q_blocks) * num_kv_heads_));
+            int q_begin = qb * block_q_;
+            grad_q_block(query, key, value, lse, delta.data(), grad_output, grad_query, b, kh,
+                q_begin, std::min(q_len, q_begin + block_q_), q_len, kv_len);
+        }
+    });
+}
+
+template<DType dtype>
+AttentionGrads<dtype> FlashAttention<dtype>::backward(const Tensor<dtype>& grad_output) {
+    if (saved_output_.data() == nullptr || grad_output.shape != saved_output_.shape) {
+        throw std::runtime_error("FlashAttention: backward called without a matching forward");
+    }
+    int batch = saved_query_.shape[0];
+    int q_len = saved_query_.shape[1];
+    int kv_len = saved_key_.shape[1];
+    AttentionGrads<dtype> grads;
+    grads.query = Tensor<dtype>(static_cast<T*>(allocate_memory(dtype, saved_query_.size())), saved_query_.shape);
+    grads.key = Tensor<dtype>(static_cast<T*>(allocate_memory(dtype, saved_key_.size())), saved_key_.shape);
+    grads.value = Tensor<dtype>(static_cast<T*>(allocate_memory(dtype, saved_value_.size())), saved_value_.shape);
+    backward_raw(saved_query_.data(), saved_key_.data(), saved_value_.data(), saved_output_.data(),
+        saved_lse_.data(), grad_output.data(), grads.query.data(), grads.key.data(), grads.value.data(),
+        batch, q_len, kv_len);
+    return grads;
+}
 
-#endif 
+#endif
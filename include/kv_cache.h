@@ -0,0 +1,447 @@
+#ifndef KV_CACHE_H
+#define KV_CACHE_H
+
+#include "tensor.h"
+#include "quantize.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// Paged key/value cache for incremental decoding. All memory is one pool of
+// fixed-size pages allocated up front; a sequence owns a block table (the list
+// of its pages, in order) and grows one page at a time, so sequences of any
+// length share the pool without fragmentation or reallocation.
+//
+// Pool layout: [layer][page][kv_head][slot][head_dim]. A page of one kv head is
+// therefore a contiguous [page_size, head_dim] tile, which is exactly what the
+// attention kernels stream.
+//
+// In streaming mode a sequence keeps its first pages ("attention sinks") plus a
+// rolling window of recent tokens; older pages go back to the pool, so a
+// session of any length needs a constant number of pages.
+//
+// The pool can be narrower than the activations. Rows are quantized in store()
+// and widened again in load_page(), inside the attention tile loop.
+typedef enum {
+    KV_STORAGE_FULL,           // the layer's own dtype
+    KV_STORAGE_FLOAT16,        // IEEE half
+    KV_STORAGE_INT8_PER_TOKEN, // int8 with one scale per (token, kv head) row, set on store
+    KV_STORAGE_INT8_PER_HEAD   // int8 with one calibrated scale per (layer, kv head), see set_head_scales
+} KVStorage;
+
+template<DType dtype>
+class KVCache {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    KVCache(int num_layers, int num_kv_heads, int head_dim, int page_size, int num_pages,
+        KVStorage storage = KV_STORAGE_FULL);
+    ~KVCache();
+
+    KVCache(const KVCache&) = delete;
+    KVCache& operator=(const KVCache&) = delete;
+
+    // Returns a sequence id; ids of freed sequences are reused.
+    int add_sequence();
+    // Returns every page of the sequence to the pool.
+    void free_sequence(int seq);
+
+    // Grows the sequence by n token slots (in every layer) and returns the
+    // position of the first one. Pages are taken from the pool as needed.
+    // In streaming mode this may first evict old pages; the returned position
+    // is then the re-based one the new tokens' RoPE should use.
+    int append(int seq, int n = 1);
+    // The position append(seq, n) would return, without changing anything.
+    int append_position(int seq, int n = 1) const;
+    // Writes one token's [kv_heads, head_dim] key and value rows for a layer.
+    void store(int seq, int layer, int pos, const T* key, const T* value);
+
+    // Keep the first `sink_tokens` (rounded up to whole pages) and at least the
+    // last `window_tokens` of every sequence. Evicting a page shifts the later
+    // cache positions back by page_size, but their keys are never rewritten:
+    // keys past the sinks stay rotated to their absolute position (store()
+    // adds evicted_tokens() to the re-based RoPE of new keys), and attention
+    // moves the query by the same offset instead, see shift_query(). A base of
+    // 0 skips this for models whose keys carry no rotary position.
+    void set_streaming(int sink_tokens, int window_tokens, float rope_base = 10000.0f);
+    // Tokens dropped from the sequence so far (its absolute length is length() + this).
+    int evicted_tokens(int seq) const { return evicted_.at(seq); }
+    // First cache position whose keys are held evicted_tokens(seq) positions
+    // past their slot; length(seq) when there are none.
+    int shifted_begin(int seq) const {
+        return rope_base_ > 0.0f && evicted_.at(seq) > 0 ? sink_pages_ * page_size_ : lengths_.at(seq);
+    }
+    // Rotates `rows` fp32 head rows by +evicted_tokens(seq), so queries at a
+    // re-based position score the shifted keys at the right distance.
+    void shift_query(int seq, float* rows, int count) const;
+
+    // KV_STORAGE_INT8_PER_HEAD only: the absolute range each head's keys and
+    // values are expected to stay within (e.g. the max seen on calibration
+    // prompts). Values outside it are clipped. Defaults to 8 for both.
+    void set_head_scales(int layer, const std::vector<float>& key_max_abs, const std::vector<float>& value_max_abs);
+
+    // Copies `count` consecutive slots of one page and kv head into fp32 rows.
+    void load_page(int layer, int page, int kv_head, int count, float* keys, float* values) const;
+
+    int length(int seq) const { return lengths_.at(seq); }
+    const std::vector<int>& block_table(int seq) const { return block_tables_.at(seq); }
+
+    int num_layers() const { return num_layers_; }
+    int num_kv_heads() const { return num_kv_heads_; }
+    int head_dim() const { return head_dim_; }
+    int page_size() const { return page_size_; }
+    int num_pages() const { return num_pages_; }
+    int free_pages() const { return static_cast<int>(free_pages_.size()); }
+    KVStorage storage() const { return storage_; }
+    size_t bytes() const;
+
+private:
+    size_t pool_elements() const {
+        return static_cast<size_t>(num_layers_) * num_pages_ * num_kv_heads_ * page_size_ * head_dim_;
+    }
+    int64_t slot_index(int layer, int page, int kv_head, int slot) const {
+        return (((static_cast<int64_t>(layer) * num_pages_ + page) * num_kv_heads_ + kv_head) * page_size_ + slot) *
+            head_dim_;
+    }
+    void check_sequence(int seq) const;
+    void store_row(T* full, uint16_t* half, int8_t* int8, float* row_scale, float head_scale, int64_t dst,
+        const T* src, int64_t scale_index);
+    void store_float_row(T* full, uint16_t* half, int8_t* int8, float* row_scale, float head_scale, int64_t dst,
+        const float* row, int64_t scale_index);
+    int pages_to_evict(int seq, int n) const;
+    void evict_pages(int seq, int count);
+    void load_rows(const T* full, const uint16_t* half, const int8_t* int8, const float* row_scales,
+        float head_scale, int64_t src, int64_t scale_index, int count, float* dst) const;
+
+    int num_layers_;
+    int num_kv_heads_;
+    int head_dim_;
+    int page_size_;
+    int num_pages_;
+    KVStorage storage_;
+    // only the pair matching storage_ is allocated
+    T* keys_;
+    T* values_;
+    uint16_t* half_keys_;
+    uint16_t* half_values_;
+    int8_t* int8_keys_;
+    int8_t* int8_values_;
+    std::vector<float> key_scales_;   // per row (per token) or per (layer, kv head)
+    std::vector<float> value_scales_;
+    std::vector<int> free_pages_;
+    std::vector<std::vector<int>> block_tables_;
+    std::vector<int> lengths_;
+    std::vector<int> evicted_;
+    // per sequence, the RoPE row rotating by +evicted_ (cos, then signed sin)
+    std::vector<std::vector<float>> shift_rows_;
+    std::vector<bool> active_;
+    int sink_pages_;
+    int window_tokens_;  // 0 = no eviction
+    float rope_base_;
+};
+
+template<DType dtype>
+KVCache<dtype>::KVCache(int num_layers, int num_kv_heads, int head_dim, int page_size, int num_pages,
+    KVStorage storage)
+  : num_layers_(num_layers), num_kv_heads_(num_kv_heads), head_dim_(head_dim), page_size_(page_size),
+    num_pages_(num_pages), storage_(storage), keys_(nullptr), values_(nullptr), half_keys_(nullptr),
+    half_values_(nullptr), int8_keys_(nullptr), int8_values_(nullptr), sink_pages_(0),
+    window_tokens_(0), rope_base_(0.0f) {
+    if (num_layers <= 0 || num_kv_heads <= 0 || head_dim <= 0 || page_size <= 0 || num_pages <= 0) {
+        throw std::invalid_argument("KVCache: all dimensions must be positive");
+    }
+    switch (storage_) {
+        case KV_STORAGE_FULL:
+            keys_ = static_cast<T*>(allocate_memory(dtype, pool_elements()));
+            values_ = static_cast<T*>(allocate_memory(dtype, pool_elements()));
+            break;
+        case KV_STORAGE_FLOAT16:
+            half_keys_ = static_cast<uint16_t*>(allocate_memory(FLOAT16, pool_elements()));
+            half_values_ = static_cast<uint16_t*>(allocate_memory(FLOAT16, pool_elements()));
+            break;
+        case KV_STORAGE_INT8_PER_TOKEN:
+        case KV_STORAGE_INT8_PER_HEAD: {
+            int8_keys_ = static_cast<int8_t*>(allocate_memory(INT8, pool_elements()));
+            int8_values_ = static_cast<int8_t*>(allocate_memory(INT8, pool_elements()));
+            size_t scales = storage_ == KV_STORAGE_INT8_PER_TOKEN ? pool_elements() / head_dim_ :
+                static_cast<size_t>(num_layers_) * num_kv_heads_;
+            float initial = storage_ == KV_STORAGE_INT8_PER_TOKEN ? 0.0f : 8.0f / 127.0f;
+            key_scales_.assign(scales, initial);
+            value_scales_.assign(scales, initial);
+            break;
+        }
+    }
+    // hand out low page ids first
+    free_pages_.resize(num_pages);
+    for (int i = 0; i < num_pages; ++i) {
+        free_pages_[i] = num_pages - 1 - i;
+    }
+}
+
+template<DType dtype>
+KVCache<dtype>::~KVCache() {
+    deallocate_memory(keys_);
+    deallocate_memory(values_);
+    deallocate_memory(half_keys_);
+    deallocate_memory(half_values_);
+    deallocate_memory(int8_keys_);
+    deallocate_memory(int8_values_);
+}
+
+template<DType dtype>
+size_t KVCache<dtype>::bytes() const {
+    switch (storage_) {
+        case KV_STORAGE_FULL: return 2 * pool_elements() * sizeof(T);
+        case KV_STORAGE_FLOAT16: return 2 * pool_elements() * sizeof(uint16_t);
+        default: return 2 * pool_elements() * sizeof(int8_t) + 2 * key_scales_.size() * sizeof(float);
+    }
+}
+
+template<DType dtype>
+void KVCache<dtype>::set_head_scales(int layer, const std::vector<float>& key_max_abs,
+    const std::vector<float>& value_max_abs) {
+    if (storage_ != KV_STORAGE_INT8_PER_HEAD) {
+        throw std::logic_error("KVCache: head scales only apply to KV_STORAGE_INT8_PER_HEAD");
+    }
+    if (static_cast<int>(key_max_abs.size()) != num_kv_heads_ || static_cast<int>(value_max_abs.size()) != num_kv_heads_) {
+        throw std::invalid_argument("KVCache: expected one range per kv head");
+    }
+    for (int kh = 0; kh < num_kv_heads_; ++kh) {
+        key_scales_[static_cast<size_t>(layer) * num_kv_heads_ + kh] = key_max_abs[kh] / 127.0f;
+        value_scales_[static_cast<size_t>(layer) * num_kv_heads_ + kh] = value_max_abs[kh] / 127.0f;
+    }
+}
+
+template<DType dtype>
+void KVCache<dtype>::store_row(T* full, uint16_t* half, int8_t* int8, float* row_scale, float head_scale,
+    int64_t dst, const T* src, int64_t scale_index) {
+    switch (storage_) {
+        case KV_STORAGE_FULL:
+            std::memcpy(full + dst, src, head_dim_ * sizeof(T));
+            return;
+        case KV_STORAGE_FLOAT16:
+            if constexpr (dtype == FLOAT16) {
+                std::memcpy(half + dst, src, head_dim_ * sizeof(uint16_t));
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+    static thread_local std::vector<float> row;
+    row.resize(head_dim_);
+    row_to_float<dtype>(src, row.data(), head_dim_);
+    store_float_row(full, half, int8, row_scale, head_scale, dst, row.data(), scale_index);
+}
+
+template<DType dtype>
+void KVCache<dtype>::store_float_row(T* full, uint16_t* half, int8_t* int8, float* row_scale, float head_scale,
+    int64_t dst, const float* row, int64_t scale_index) {
+    if (storage_ == KV_STORAGE_FULL) {
+        row_from_float<dtype>(row, full + dst, head_dim_);
+    } else if (storage_ == KV_STORAGE_FLOAT16) {
+        row_from_float<FLOAT16>(row, half + dst, head_dim_);
+    } else if (storage_ == KV_STORAGE_INT8_PER_TOKEN) {
+        row_scale[scale_index] = quantize_row_int8(row, int8 + dst, head_dim_);
+    } else {
+        float inv_scale = head_scale > 0.0f ? 1.0f / head_scale : 0.0f;
+        for (int c = 0; c < head_dim_; ++c) {
+            long q = std::lround(row[c] * inv_scale);
+            int8[dst + c] = static_cast<int8_t>(std::max(-127l, std::min(127l, q)));
+        }
+    }
+}
+
+template<DType dtype>
+void KVCache<dtype>::load_rows(const T* full, const uint16_t* half, const int8_t* int8, const float* row_scales,
+    float head_scale, int64_t src, int64_t scale_index, int count, float* dst) const {
+    const int64_t n = static_cast<int64_t>(count) * head_dim_;
+    switch (storage_) {
+        case KV_STORAGE_FULL:
+            row_to_float<dtype>(full + src, dst, n);
+            break;
+        case KV_STORAGE_FLOAT16:
+            row_to_float<FLOAT16>(half + src, dst, n);
+            break;
+        case KV_STORAGE_INT8_PER_TOKEN:
+            for (int j = 0; j < count; ++j) {
+                dequantize_row_int8(int8 + src + static_cast<int64_t>(j) * head_dim_, row_scales[scale_index + j],
+                    dst + static_cast<int64_t>(j) * head_dim_, head_dim_);
+            }
+            break;
+        case KV_STORAGE_INT8_PER_HEAD:
+            dequantize_row_int8(int8 + src, head_scale, dst, n);
+            break;
+    }
+}
+
+template<DType dtype>
+void KVCache<dtype>::check_sequence(int seq) const {
+    if (seq < 0 || seq >= static_cast<int>(active_.size()) || !active_[seq]) {
+        throw std::out_of_range("KVCache: unknown sequence id");
+    }
+}
+
+template<DType dtype>
+int KVCache<dtype>::add_sequence() {
+    for (size_t seq = 0; seq < active_.size(); ++seq) {
+        if (!active_[seq]) {
+            active_[seq] = true;
+            lengths_[seq] = 0;
+            evicted_[seq] = 0;
+            return static_cast<int>(seq);
+        }
+    }
+    active_.push_back(true);
+    lengths_.push_back(0);
+    evicted_.push_back(0);
+    shift_rows_.emplace_back();
+    block_tables_.emplace_back();
+    return static_cast<int>(active_.size()) - 1;
+}
+
+template<DType dtype>
+void KVCache<dtype>::free_sequence(int seq) {
+    check_sequence(seq);
+    std::vector<int>& table = block_tables_[seq];
+    free_pages_.insert(free_pages_.end(), table.rbegin(), table.rend());
+    table.clear();
+    lengths_[seq] = 0;
+    active_[seq] = false;
+}
+
+template<DType dtype>
+int KVCache<dtype>::pages_to_evict(int seq, int n) const {
+    if (window_tokens_ <= 0) {
+        return 0;
+    }
+    // drop whole pages past the sinks while the window would still hold
+    // at least window_tokens once the new tokens are in
+    const int sink_slots = sink_pages_ * page_size_;
+    const int full_pages = lengths_[seq] / page_size_;
+    int evict = 0;
+    while (sink_pages_ + evict < full_pages &&
+           lengths_[seq] + n - sink_slots - (evict + 1) * page_size_ >= window_tokens_) {
+        ++evict;
+    }
+    return evict;
+}
+
+template<DType dtype>
+int KVCache<dtype>::append_position(int seq, int n) const {
+    check_sequence(seq);
+    return lengths_[seq] - pages_to_evict(seq, n) * page_size_;
+}
+
+template<DType dtype>
+int KVCache<dtype>::append(int seq, int n) {
+    check_sequence(seq);
+    std::vector<int>& table = block_tables_[seq];
+    int evict = pages_to_evict(seq, n);
+    if (evict > 0) {
+        evict_pages(seq, evict);
+    }
+    int start = lengths_[seq];
+    int needed = (start + n + page_size_ - 1) / page_size_ - static_cast<int>(table.size());
+    if (needed > static_cast<int>(free_pages_.size())) {
+        throw std::runtime_error("KVCache: page pool exhausted");
+    }
+    for (int i = 0; i < needed; ++i) {
+        table.push_back(free_pages_.back());
+        free_pages_.pop_back();
+    }
+    lengths_[seq] = start + n;
+    return start;
+}
+
+template<DType dtype>
+void KVCache<dtype>::set_streaming(int sink_tokens, int window_tokens, float rope_base) {
+    if (sink_tokens < 0 || window_tokens <= 0) {
+        throw std::invalid_argument("KVCache: streaming needs a positive window");
+    }
+    sink_pages_ = (sink_tokens + page_size_ - 1) / page_size_;
+    window_tokens_ = window_tokens;
+    rope_base_ = rope_base;
+}
+
+template<DType dtype>
+void KVCache<dtype>::evict_pages(int seq, int count) {
+    std::vector<int>& table = block_tables_[seq];
+    auto first = table.begin() + sink_pages_;
+    free_pages_.insert(free_pages_.end(), first, first + count);
+    table.erase(first, first + count);
+    const int shift = count * page_size_;
+    lengths_[seq] -= shift;
+    evicted_[seq] += shift;
+    if (rope_base_ <= 0.0f) {
+        return;
+    }
+    // angles in double: the offset keeps growing over a long session
+    std::vector<float>& row = shift_rows_[seq];
+    row.resize(2 * static_cast<size_t>(head_dim_));
+    for (int i = 0; i < head_dim_ / 2; ++i) {
+        double angle = evicted_[seq] * std::pow(static_cast<double>(rope_base_), -2.0 * i / head_dim_);
+        float c = static_cast<float>(std::cos(angle)), sn = static_cast<float>(std::sin(angle));
+        row[2 * i] = row[2 * i + 1] = c;
+        row[head_dim_ + 2 * i] = -sn;
+        row[head_dim_ + 2 * i + 1] = sn;
+    }
+}
+
+template<DType dtype>
+void KVCache<dtype>::shift_query(int seq, float* rows, int count) const {
+    check_sequence(seq);
+    if (rope_base_ <= 0.0f || evicted_[seq] == 0) {
+        return;
+    }
+    const float* row = shift_rows_[seq].data();
+    for (int r = 0; r < count; ++r) {
+        simd_rotate_pairs(rows + static_cast<int64_t>(r) * head_dim_, row, row + head_dim_, head_dim_);
+    }
+}
+
+template<DType dtype>
+void KVCache<dtype>::store(int seq, int layer, int pos, const T* key, const T* value) {
+    check_sequence(seq);
+    if (pos < 0 || pos >= lengths_[seq] || layer < 0 || layer >= num_layers_) {
+        throw std::out_of_range("KVCache: store outside the reserved slots");
+    }
+    int page = block_tables_[seq][pos / page_size_];
+    int slot = pos % page_size_;
+    const bool shifted = pos >= shifted_begin(seq);
+    static thread_local std::vector<float> row;
+    for (int kh = 0; kh < num_kv_heads_; ++kh) {
+        int64_t dst = slot_index(layer, page, kh, slot);
+        int64_t head = static_cast<int64_t>(layer) * num_kv_heads_ + kh;
+        float key_scale = storage_ == KV_STORAGE_INT8_PER_HEAD ? key_scales_[head] : 0.0f;
+        float value_scale = storage_ == KV_STORAGE_INT8_PER_HEAD ? value_scales_[head] : 0.0f;
+        if (shifted) {
+            // re-based position -> absolute, quantized once like any other key
+            row.resize(head_dim_);
+            row_to_float<dtype>(key + static_cast<int64_t>(kh) * head_dim_, row.data(), head_dim_);
+            shift_query(seq, row.data(), 1);
+            store_float_row(keys_, half_keys_, int8_keys_, key_scales_.data(), key_scale, dst, row.data(),
+                dst / head_dim_);
+        } else {
+            store_row(keys_, half_keys_, int8_keys_, key_scales_.data(), key_scale, dst,
+                key + static_cast<int64_t>(kh) * head_dim_, dst / head_dim_);
+        }
+        store_row(values_, half_values_, int8_values_, value_scales_.data(), value_scale, dst,
+            value + static_cast<int64_t>(kh) * head_dim_, dst / head_dim_);
+    }
+}
+
+template<DType dtype>
+void KVCache<dtype>::load_page(int layer, int page, int kv_head, int count, float* keys, float* values) const {
+    int64_t src = slot_index(layer, page, kv_head, 0);
+    int64_t head = static_cast<int64_t>(layer) * num_kv_heads_ + kv_head;
+    float key_scale = storage_ == KV_STORAGE_INT8_PER_HEAD ? key_scales_[head] : 0.0f;
+    float value_scale = storage_ == KV_STORAGE_INT8_PER_HEAD ? value_scales_[head] : 0.0f;
+    load_rows(keys_, half_keys_, int8_keys_, key_scales_.data(), key_scale, src, src / head_dim_, count, keys);
+    load_rows(values_, half_values_, int8_values_, value_scales_.data(), value_scale, src, src / head_dim_, count,
+        values);
+}
+
+#endif
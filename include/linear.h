@@ -0,0 +1,367 @@
+#ifndef LINEAR_H
+#define LINEAR_H
+
+#include "tensor.h"
+#include "quantize.h"
+#include "lora.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+
+// y = x W^T with W stored as [out_features, in_features] rows in any
+// WeightStorage format. The GEMM walks (row block, weight block) tiles: each
+// weight block is widened to fp32 once per tile and reused by every input row
+// in it, and results are handed to an epilogue while still in fp32, so
+// activation functions or RoPE can be applied before the single store.
+// A LoRA adapter, once attached, is added inside the same tiles: x A^T is
+// computed once per call and every output block gains scale * B (A x) before
+// its epilogue, so the merged weight is never formed and the base weights,
+// then frozen, keep their storage format.
+template<DType dtype>
+class Linear {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    Linear() : in_features_(0), out_features_(0), device_(CPU), frozen_(false) {}
+    Linear(int in_features, int out_features, WeightStorage storage = STORAGE_FULL, Device device = CPU);
+
+    Tensor<dtype> forward(const Tensor<dtype>& input);
+    Tensor<dtype> backward(const Tensor<dtype>& grad_output);
+
+    void forward_rows(const T* input, T* output, int64_t rows) const;
+    // epilogue(row, n_begin, n_end, const float* values) receives output
+    // columns [n_begin, n_end) of one input row. Column blocks are
+    // block_n-aligned, so they never split an even/odd column pair.
+    // [col_begin, col_end) restricts the GEMM to those output columns
+    // (col_end < 0: to the end); blocks are then aligned to col_begin.
+    template<typename Epilogue>
+    void forward_rows_epilogue(const T* input, int64_t rows, Epilogue&& epilogue, int64_t col_begin = 0,
+        int64_t col_end = -1) const;
+    // grad_input may be null. Weight gradients are accumulated into
+    // weight().full().grad when trains_weights(); with a LoRA adapter they go
+    // to its A and B instead.
+    void backward_rows(const T* grad_output, const T* input, T* grad_input, int64_t rows);
+
+    // Quantized weights, weights under a LoRA adapter and frozen layers take no gradient.
+    bool trains_weights() const { return weights_.storage() == STORAGE_FULL && !frozen_ && !lora_; }
+    void set_frozen(bool frozen) { frozen_ = frozen; }
+
+    // alpha / rank scales the adapter's update
+    void attach_lora(int rank, float alpha);
+    LoraAdapter<dtype>* lora() { return lora_.get(); }
+    const LoraAdapter<dtype>* lora() const { return lora_.get(); }
+    // Folds scale * B A into the base weights (requantizing stored rows) and
+    // frees the adapter; an optimizer holding its A/B must not step again.
+    void merge_lora();
+
+    WeightMatrix<dtype>& weights() { return weights_; }
+    const WeightMatrix<dtype>& weights() const { return weights_; }
+    int in_features() const { return in_features_; }
+    int out_features() const { return out_features_; }
+
+    static const int block_m = 32;
+    static const int block_n = 12;  // even (SwiGLU pairs) and a multiple of the 3-wide micro-kernel
+
+private:
+    // fp32 view of weight rows [n0, n0 + count): the stored rows themselves
+    // when they already are fp32, otherwise widened into scratch
+    const float* weight_tile(int64_t n0, int64_t count, std::vector<float>& scratch) const;
+    // u = scale * x A^T as [rows, rank], and B widened to fp32
+    void lora_project(const float* x, int64_t rows, std::vector<float>& u, std::vector<float>& b) const;
+
+    int in_features_;
+    int out_features_;
+    Device device_;
+    bool frozen_;
+    WeightMatrix<dtype> weights_;
+    std::shared_ptr<LoraAdapter<dtype>> lora_;
+    Tensor<dtype> saved_input_;
+};
+
+template<DType dtype>
+Linear<dtype>::Linear(int in_features, int out_features, WeightStorage storage, Device device)
+  : in_features_(in_features), out_features_(out_features), device_(device), frozen_(false),
+    weights_(out_features, in_features, storage) {
+    // U(-1/sqrt(in), 1/sqrt(in)), generated in fp32 so every storage format
+    // can be filled through store_row
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    float bound = 1.0f / std::sqrt(static_cast<float>(in_features));
+    std::uniform_real_distribution<float> dis(-bound, bound);
+    std::vector<float> row(in_features);
+    for (int r = 0; r < out_features; ++r) {
+        for (auto& v : row) {
+            v = dis(gen);
+        }
+        weights_.store_row(r, row.data());
+    }
+}
+
+template<DType dtype>
+const float* Linear<dtype>::weight_tile(int64_t n0, int64_t count, std::vector<float>& scratch) const {
+    if constexpr (dtype == FLOAT32) {
+        if (weights_.storage() == STORAGE_FULL) {
+            return weights_.full().data() + n0 * in_features_;
+        }
+    }
+    scratch.resize(static_cast<size_t>(count) * in_features_);
+    for (int64_t j = 0; j < count; ++j) {
+        weights_.load_row(n0 + j, scratch.data() + j * in_features_);
+    }
+    return scratch.data();
+}
+
+template<DType dtype>
+void Linear<dtype>::lora_project(const float* x, int64_t rows, std::vector<float>& u, std::vector<float>& b) const {
+    const int64_t k = in_features_, r = lora_->rank;
+    std::vector<float> a_scratch;
+    const float* a = float_row<dtype>(lora_->a.data(), a_scratch, r * k);
+    u.resize(static_cast<size_t>(rows) * r);
+    parallel_for(0, rows, [&](int64_t lo, int64_t hi) {
+        for (int64_t i = lo; i < hi; ++i) {
+            for (int64_t j = 0; j < r; ++j) {
+                u[i * r + j] = lora_->scale * simd_dot(x + i * k, a + j * k, k);
+            }
+        }
+    });
+    b.resize(static_cast<size_t>(out_features_) * r);
+    row_to_float<dtype>(lora_->b.data(), b.data(), static_cast<int64_t>(out_features_) * r);
+}
+
+template<DType dtype>
+void Linear<dtype>::attach_lora(int rank, float alpha) {
+    lora_ = std::make_shared<LoraAdapter<dtype>>(in_features_, out_features_, rank, alpha);
+}
+
+template<DType dtype>
+void Linear<dtype>::merge_lora() {
+    if (!lora_) {
+        return;
+    }
+    const int64_t k = in_features_, r = lora_->rank;
+    std::vector<float> a_scratch, b_scratch;
+    const float* a = float_row<dtype>(lora_->a.data(), a_scratch, r * k);
+    const float* b = float_row<dtype>(lora_->b.data(), b_scratch, static_cast<int64_t>(out_features_) * r);
+    parallel_for(0, out_features_, [&](int64_t lo, int64_t hi) {
+        std::vector<float> row(k);
+        for (int64_t j = lo; j < hi; ++j) {
+            weights_.load_row(j, row.data());
+            for (int64_t c = 0; c < r; ++c) {
+                simd_axpy(row.data(), a + c * k, lora_->scale * b[j * r + c], k);
+            }
+            weights_.store_row(j, row.data());
+        }
+    });
+    deallocate_memory(lora_->a.data());
+    deallocate_memory(lora_->b.data());
+    deallocate_memory(lora_->a.grad->data());
+    deallocate_memory(lora_->b.grad->data());
+    lora_.reset();
+}
+
+template<DType dtype>
+template<typename Epilogue>
+void Linear<dtype>::forward_rows_epilogue(const T* input, int64_t rows, Epilogue&& epilogue, int64_t col_begin,
+    int64_t col_end) const {
+    const int64_t k = in_features_;
+    const int64_t n = col_end < 0 ? out_features_ : col_end;
+    const float* x = nullptr;
+    static thread_local std::vector<float> x_scratch;
+    if constexpr (dtype == FLOAT32) {
+        x = input;
+    } else {
+        x_scratch.resize(static_cast<size_t>(rows) * k);
+        row_to_float<dtype>(input, x_scratch.data(), rows * k);
+        x = x_scratch.data();
+    }
+
+    static thread_local std::vector<float> lora_u, lora_b;
+    const int64_t r = lora_ ? lora_->rank : 0;
+    if (lora_) {
+        lora_project(x, rows, lora_u, lora_b);
+    }
+    const float* u = lora_u.data();
+    const float* b = lora_b.data();
+
+    const int64_t m_blocks = (rows + block_m - 1) / block_m;
+    const int64_t n_blocks = (n - col_begin + block_n - 1) / block_n;
+    // items are weight-block major, so consecutive items of one worker share
+    // a weight tile and it is widened only when the block changes
+    parallel_for(0, m_blocks * n_blocks, [&](int64_t lo, int64_t hi) {
+        static thread_local std::vector<float> w_scratch;
+        float out[block_m * block_n];
+        int64_t loaded = -1;
+        const float* w = nullptr;
+        for (int64_t item = lo; item < hi; ++item) {
+            int64_t nb = item / m_blocks, mb = item % m_blocks;
+            int64_t n0 = col_begin + nb * block_n, n1 = std::min(n, n0 + block_n);
+            int64_t m0 = mb * block_m, m1 = std::min(rows, m0 + block_m);
+            if (nb != loaded) {
+                w = weight_tile(n0, n1 - n0, w_scratch);
+                loaded = nb;
+            }
+            // 4x3 register blocks, with plain dot products for the ragged edges
+            const int64_t mr = m1 - m0, nr = n1 - n0;
+            for (int64_t i = 0; i < mr; i += 4) {
+                for (int64_t j = 0; j < nr; j += 3) {
+                    if (i + 4 <= mr && j + 3 <= nr) {
+                        simd_dot_4x3(x + (m0 + i) * k, k, w + j * k, k, k, out + i * block_n + j, block_n);
+                        continue;
+                    }
+                    for (int64_t ii = i; ii < std::min(mr, i + 4); ++ii) {
+                        for (int64_t jj = j; jj < std::min(nr, j + 3); ++jj) {
+                            out[ii * block_n + jj] = simd_dot(x + (m0 + ii) * k, w + jj * k, k);
+                        }
+                    }
+                }
+            }
+            for (int64_t i = 0; r > 0 && i < mr; ++i) {
+                for (int64_t j = 0; j < nr; ++j) {
+                    out[i * block_n + j] += simd_dot(b + (n0 + j) * r, u + (m0 + i) * r, r);
+                }
+            }
+            for (int64_t i = m0; i < m1; ++i) {
+                epilogue(i, n0, n1, out + (i - m0) * block_n);
+            }
+        }
+    });
+}
+
+template<DType dtype>
+void Linear<dtype>::forward_rows(const T* input, T* output, int64_t rows) const {
+    const int64_t n = out_features_;
+    forward_rows_epilogue(input, rows, [&](int64_t i, int64_t n0, int64_t n1, const float* values) {
+        row_from_float<dtype>(values, output + i * n + n0, n1 - n0);
+    });
+}
+
+template<DType dtype>
+void Linear<dtype>::backward_rows(const T* grad_output, const T* input, T* grad_input, int64_t rows) {
+    const int64_t k = in_features_;
+    const int64_t n = out_features_;
+    std::vector<float> x_scratch, dy_scratch;
+    const float* x = float_row<dtype>(input, x_scratch, rows * k);
+    const float* dy = float_row<dtype>(grad_output, dy_scratch, rows * n);
+
+    // adapter terms: u = scale * x A^T and g = scale * dY B, both [rows, rank]
+    const int64_t r = lora_ ? lora_->rank : 0;
+    std::vector<float> u, b, g, a_scratch;
+    const float* a = nullptr;
+    if (lora_) {
+        lora_project(x, rows, u, b);
+        a = float_row<dtype>(lora_->a.data(), a_scratch, r * k);
+        g.assign(static_cast<size_t>(rows) * r, 0.0f);
+        parallel_for(0, rows, [&](int64_t lo, int64_t hi) {
+            for (int64_t i = lo; i < hi; ++i) {
+                for (int64_t j = 0; j < n; ++j) {
+                    simd_axpy(g.data() + i * r, b.data() + j * r, lora_->scale * dy[i * n + j], r);
+                }
+            }
+        });
+    }
+
+    // dX = dY W (+ g A): per row block, stream the weight tiles and axpy them in
+    if (grad_input != nullptr) {
+        const int64_t m_blocks = (rows + block_m - 1) / block_m;
+        parallel_for(0, m_blocks, [&](int64_t lo, int64_t hi) {
+            std::vector<float> w_scratch, dx(static_cast<size_t>(block_m) * k);
+            for (int64_t mb = lo; mb < hi; ++mb) {
+                int64_t m0 = mb * block_m, m1 = std::min(rows, m0 + block_m);
+                std::fill(dx.begin(), dx.end(), 0.0f);
+                for (int64_t n0 = 0; n0 < n; n0 += block_n) {
+                    int64_t n1 = std::min(n, n0 + block_n);
+                    const float* w = weight_tile(n0, n1 - n0, w_scratch);
+                    for (int64_t i = m0; i < m1; ++i) {
+                        for (int64_t j = n0; j < n1; ++j) {
+                            simd_axpy(dx.data() + (i - m0) * k, w + (j - n0) * k, dy[i * n + j], k);
+                        }
+                    }
+                }
+                for (int64_t i = m0; i < m1 && r > 0; ++i) {
+                    for (int64_t j = 0; j < r; ++j) {
+                        simd_axpy(dx.data() + (i - m0) * k, a + j * k, g[i * r + j], k);
+                    }
+                }
+                row_from_float<dtype>(dx.data(), grad_input + m0 * k, (m1 - m0) * k);
+            }
+        });
+    }
+
+    // dB += dY^T u and dA += g^T X; the base weights stay frozen
+    if (lora_) {
+        T* gb = lora_->b.grad->data();
+        T* ga = lora_->a.grad->data();
+        parallel_for(0, n, [&](int64_t lo, int64_t hi) {
+            std::vector<float> acc(r);
+            for (int64_t j = lo; j < hi; ++j) {
+                row_to_float<dtype>(gb + j * r, acc.data(), r);
+                for (int64_t i = 0; i < rows; ++i) {
+                    simd_axpy(acc.data(), u.data() + i * r, dy[i * n + j], r);
+                }
+                row_from_float<dtype>(acc.data(), gb + j * r, r);
+            }
+        });
+        parallel_for(0, r, [&](int64_t lo, int64_t hi) {
+            std::vector<float> acc(k);
+            for (int64_t j = lo; j < hi; ++j) {
+                row_to_float<dtype>(ga + j * k, acc.data(), k);
+                for (int64_t i = 0; i < rows; ++i) {
+                    simd_axpy(acc.data(), x + i * k, g[i * r + j], k);
+                }
+                row_from_float<dtype>(acc.data(), ga + j * k, k);
+            }
+        });
+    }
+
+    // dW += dY^T X, each worker owning whole weight rows
+    if (!trains_weights()) {
+        return;
+    }
+    Tensor<dtype>& weight = weights_.full();
+    if (!weight.grad) {
+        weight.grad = std::make_shared<Tensor<dtype>>(weight.shape);
+    }
+    T* gw = weight.grad->data();
+    parallel_for(0, n, [&](int64_t lo, int64_t hi) {
+        std::vector<float> acc(k);
+        for (int64_t j = lo; j < hi; ++j) {
+            row_to_float<dtype>(gw + j * k, acc.data(), k);
+            for (int64_t i = 0; i < rows; ++i) {
+                simd_axpy(acc.data(), x + i * k, dy[i * n + j], k);
+            }
+            row_from_float<dtype>(acc.data(), gw + j * k, k);
+        }
+    });
+}
+
+template<DType dtype>
+Tensor<dtype> Linear<dtype>::forward(const Tensor<dtype>& input) {
+    if (input.shape.empty() || input.shape.back() != in_features_) {
+        throw std::runtime_error("Linear: input features do not match the layer");
+    }
+    std::vector<int> shape = input.shape;
+    shape.back() = out_features_;
+    Tensor<dtype> output(static_cast<T*>(allocate_memory(dtype, input.size() / in_features_ * out_features_)),
+        shape, device_);
+    forward_rows(input.data(), output.data(), input.size() / in_features_);
+    saved_input_ = input;
+    return output;
+}
+
+template<DType dtype>
+Tensor<dtype> Linear<dtype>::backward(const Tensor<dtype>& grad_output) {
+    if (saved_input_.data() == nullptr || grad_output.shape.back() != out_features_ ||
+        grad_output.size() / out_features_ != saved_input_.size() / in_features_) {
+        throw std::runtime_error("Linear: backward called without a matching forward");
+    }
+    Tensor<dtype> grad_input(static_cast<T*>(allocate_memory(dtype, saved_input_.size())), saved_input_.shape,
+        device_);
+    backward_rows(grad_output.data(), saved_input_.data(), grad_input.data(), grad_output.size() / out_features_);
+    return grad_input;
+}
+
+#endif
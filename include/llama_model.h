@@ -0,0 +1,448 @@
+#ifndef LLAMA_MODEL_H
+#define LLAMA_MODEL_H
+
+#include "tensor.h"
+#include "embeddings.h"
+#include "rms_norm.h"
+#include "linear.h"
+#include "feed_forward.h"
+#include "moe.h"
+#include "flash_attention.h"
+#include "kv_cache.h"
+#include "rope.h"
+#include "memory_planner.h"
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+struct LlamaConfig {
+    int vocab_size = 32000;
+    int dim = 4096;
+    int num_layers = 32;
+    int num_heads = 32;
+    int num_kv_heads = 32;
+    int hidden_dim = 11008;
+    float norm_eps = 1e-5f;
+    float rope_base = 10000.0f;
+    // activation buffers and the KV cache are sized for these once
+    int max_batch = 1;
+    int max_seq = 2048;
+    int page_size = 64;
+    WeightStorage storage = STORAGE_FULL;
+    KVStorage kv_storage = KV_STORAGE_FULL;
+    // num_experts > 0 makes every FFN a mixture of that many hidden_dim experts
+    int num_experts = 0;
+    int experts_per_token = 2;
+    float capacity_factor = 1.25f;
+    float aux_loss_weight = 0.01f;
+
+    int head_dim() const { return dim / num_heads; }
+};
+
+template<DType dtype>
+struct LlamaBlock {
+    explicit LlamaBlock(const LlamaConfig& config, Device device = CPU);
+
+    // normed [rows, D] -> query [rows, H*Dh], key/value [rows, Hkv*Dh], with
+    // Q and K rotated in the GEMM epilogue. Row i is token i % seq_len of
+    // sequence i / seq_len, at position start_positions[i / seq_len] + i % seq_len.
+    void project_qkv(const RopeTable& rope, const typename DTypeToType<dtype>::Type* normed,
+        typename DTypeToType<dtype>::Type* query, typename DTypeToType<dtype>::Type* key,
+        typename DTypeToType<dtype>::Type* value, int64_t rows, int seq_len, const int* start_positions) const;
+
+    // the block's FFN, dense or mixture-of-experts; hidden is the dense FFN's
+    // [rows, hidden_dim] scratch. aux_grad reaches the MoE balancing loss.
+    void ffn_forward(const typename DTypeToType<dtype>::Type* normed, typename DTypeToType<dtype>::Type* output,
+        typename DTypeToType<dtype>::Type* hidden, int64_t rows);
+    void ffn_backward(const typename DTypeToType<dtype>::Type* grad_output,
+        const typename DTypeToType<dtype>::Type* normed, typename DTypeToType<dtype>::Type* grad_normed,
+        int64_t rows, float aux_grad);
+    // the weight matrices LoRA adapts: QKV, output and the FFN (every expert's)
+    std::vector<Linear<dtype>*> projections();
+
+    RMSNorm<dtype> attention_norm;
+    // Q, K and V as one [(H + 2 Hkv) * Dh, D] projection
+    Linear<dtype> qkv;
+    FlashAttention<dtype> attention;
+    Linear<dtype> output;
+    RMSNorm<dtype> ffn_norm;
+    FeedForward<dtype> ffn;  // empty (hidden size 0) when moe is set
+    std::shared_ptr<MixtureOfExperts<dtype>> moe;
+};
+
+template<DType dtype>
+LlamaBlock<dtype>::LlamaBlock(const LlamaConfig& config, Device device)
+  : attention_norm(config.dim, config.norm_eps, device),
+    qkv(config.dim, (config.num_heads + 2 * config.num_kv_heads) * config.head_dim(), config.storage, device),
+    attention(config.head_dim(), config.num_heads, config.num_kv_heads, device),
+    output(config.num_heads * config.head_dim(), config.dim, config.storage, device),
+    ffn_norm(config.dim, config.norm_eps, device),
+    ffn(config.dim, config.num_experts > 0 ? 0 : config.hidden_dim, config.storage, device) {
+    attention.set_mask(MASK_CAUSAL);
+    if (config.num_experts > 0) {
+        moe = std::make_shared<MixtureOfExperts<dtype>>(config.dim, config.hidden_dim, config.num_experts,
+            config.experts_per_token, config.capacity_factor, config.storage, device);
+    }
+}
+
+template<DType dtype>
+void LlamaBlock<dtype>::ffn_forward(const typename DTypeToType<dtype>::Type* normed,
+    typename DTypeToType<dtype>::Type* output, typename DTypeToType<dtype>::Type* hidden, int64_t rows) {
+    if (moe) {
+        moe->forward_rows(normed, output, rows);
+    } else {
+        ffn.forward_rows(normed, output, hidden, rows);
+    }
+}
+
+template<DType dtype>
+void LlamaBlock<dtype>::ffn_backward(const typename DTypeToType<dtype>::Type* grad_output,
+    const typename DTypeToType<dtype>::Type* normed, typename DTypeToType<dtype>::Type* grad_normed, int64_t rows,
+    float aux_grad) {
+    if (moe) {
+        moe->backward_rows(grad_output, normed, grad_normed, rows, aux_grad);
+    } else {
+        ffn.backward_rows(grad_output, normed, grad_normed, rows);
+    }
+}
+
+template<DType dtype>
+std::vector<Linear<dtype>*> LlamaBlock<dtype>::projections() {
+    std::vector<Linear<dtype>*> linears = {&qkv, &output};
+    if (moe) {
+        for (FeedForward<dtype>& expert : moe->experts()) {
+            linears.push_back(&expert.gate_up());
+            linears.push_back(&expert.down());
+        }
+    } else {
+        linears.push_back(&ffn.gate_up());
+        linears.push_back(&ffn.down());
+    }
+    return linears;
+}
+
+template<DType dtype>
+void LlamaBlock<dtype>::project_qkv(const RopeTable& rope, const typename DTypeToType<dtype>::Type* normed,
+    typename DTypeToType<dtype>::Type* query, typename DTypeToType<dtype>::Type* key,
+    typename DTypeToType<dtype>::Type* value, int64_t rows, int seq_len, const int* start_positions) const {
+    const int head_dim = attention.head_dim();
+    const int64_t q_cols = static_cast<int64_t>(attention.num_heads()) * head_dim;
+    const int64_t kv_cols = static_cast<int64_t>(attention.num_kv_heads()) * head_dim;
+    for (int64_t b = 0; b < rows / seq_len; ++b) {
+        rope.check_positions(start_positions[b], seq_len);
+    }
+    // Scatter each column block into Q/K/V, rotating Q and K on the way. Blocks
+    // are even-aligned and split at head boundaries, so RoPE pairs stay intact.
+    qkv.forward_rows_epilogue(normed, rows, [&](int64_t i, int64_t n0, int64_t n1, const float* values) {
+        float span[Linear<dtype>::block_n];
+        const int pos = start_positions[i / seq_len] + static_cast<int>(i % seq_len);
+        for (int64_t c = n0; c < n1;) {
+            int64_t end = std::min(n1, (c / head_dim + 1) * head_dim);
+            int count = static_cast<int>(end - c);
+            std::copy(values + (c - n0), values + (end - n0), span);
+            if (c < q_cols) {
+                rope.rotate_span(span, pos, static_cast<int>(c % head_dim), count);
+                row_from_float<dtype>(span, query + i * q_cols + c, count);
+            } else if (c < q_cols + kv_cols) {
+                rope.rotate_span(span, pos, static_cast<int>(c % head_dim), count);
+                row_from_float<dtype>(span, key + i * kv_cols + (c - q_cols), count);
+            } else {
+                row_from_float<dtype>(span, value + i * kv_cols + (c - q_cols - kv_cols), count);
+            }
+            c = end;
+        }
+    });
+}
+
+// Decoder-only Llama: embeddings, N pre-norm blocks, final norm and LM head.
+// Activation buffers are sized once for (max_batch, max_seq) and laid out by
+// a MemoryPlanner over one block's op sequence, so buffers that are never live
+// together share bytes of a single slab. Keys/values go to a paged KV cache,
+// so a forward call (prefill or decode) does not allocate tensors.
+//
+// Per block, the residual adds are folded into the following RMSNorm
+// (forward_residual_rows) and RoPE is applied in the QKV GEMM epilogue, so Q
+// and K are written once, already rotated.
+template<DType dtype>
+class LlamaModel {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    explicit LlamaModel(const LlamaConfig& config, Device device = CPU);
+
+    ~LlamaModel() { deallocate_memory(slab_); }
+
+    LlamaModel(const LlamaModel&) = delete;
+    LlamaModel& operator=(const LlamaModel&) = delete;
+
+    int start_sequence() { return cache_.add_sequence(); }
+    void end_sequence(int seq) { cache_.free_sequence(seq); }
+
+    // Runs seq_len new tokens for each sequence (ids is [seqs, seq_len]) and
+    // returns the logits of each sequence's last token as a [seqs, vocab] view
+    // into a model-owned buffer, valid until the next call. A prompt is one
+    // call with its full length; decoding is one call per token with seq_len 1.
+    Tensor<dtype> forward(const std::vector<int>& seqs, const uint32_t* ids, int seq_len);
+
+    const LlamaConfig& config() const { return config_; }
+    Embeddings<dtype>& embeddings() { return embeddings_; }
+    std::vector<LlamaBlock<dtype>>& blocks() { return blocks_; }
+    RMSNorm<dtype>& final_norm() { return final_norm_; }
+    Linear<dtype>& lm_head() { return lm_head_; }
+    KVCache<dtype>& cache() { return cache_; }
+    // Dense trainable tensors: norm gains and the weight matrices kept in
+    // STORAGE_FULL (quantized ones are frozen). The embedding table is left
+    // out; it takes sparse row updates through Embeddings. With LoRA attached
+    // only the adapters' A and B train.
+    std::vector<Tensor<dtype>*> parameters();
+
+    // Rank-`rank` adapters on every block's QKV, output, gate/up and down
+    // projections (each expert's, in MoE blocks). Everything else (norm gains,
+    // MoE routers, the LM head) is frozen and takes no gradient, and the base
+    // weights keep their storage, so fine-tuning state is the size of the adapters.
+    void attach_lora(int rank, float alpha);
+    bool has_lora() const { return !blocks_.empty() && blocks_.front().qkv.lora() != nullptr; }
+    // Export: folds the adapters into the base weights and unfreezes the model.
+    void merge_lora();
+    size_t activation_bytes() const { return planner_.slab_bytes(); }
+    const MemoryPlanner& memory_plan() const { return planner_; }
+
+private:
+    void plan_activations();
+    // norm gains, MoE routers and the LM head: what LoRA fine-tuning leaves alone
+    void set_frozen_except_adapters(bool frozen);
+
+    LlamaConfig config_;
+    Device device_;
+    Embeddings<dtype> embeddings_;
+    std::vector<LlamaBlock<dtype>> blocks_;
+    RMSNorm<dtype> final_norm_;
+    Linear<dtype> lm_head_;
+    KVCache<dtype> cache_;
+    std::shared_ptr<const RopeTable> rope_;
+
+    // activations, [max_batch * max_seq, width] unless noted, all views into slab_
+    MemoryPlanner planner_;
+    void* slab_;
+    Tensor<dtype> residual_;
+    Tensor<dtype> normed_;
+    Tensor<dtype> query_;
+    Tensor<dtype> key_;
+    Tensor<dtype> value_;
+    Tensor<dtype> attention_out_;
+    Tensor<dtype> block_out_;
+    Tensor<dtype> ffn_hidden_;
+    Tensor<dtype> last_normed_;  // [max_batch, dim]
+    Tensor<dtype> logits_;       // [max_batch, vocab]
+    std::vector<int> positions_; // first new position of each sequence in the batch
+};
+
+template<DType dtype>
+LlamaModel<dtype>::LlamaModel(const LlamaConfig& config, Device device)
+  : config_(config), device_(device),
+    embeddings_(config.vocab_size, config.dim, config.storage, device),
+    final_norm_(config.dim, config.norm_eps, device),
+    lm_head_(config.dim, config.vocab_size, config.storage, device),
+    cache_(config.num_layers, config.num_kv_heads, config.head_dim(), config.page_size,
+        config.max_batch * ((config.max_seq + config.page_size - 1) / config.page_size), config.kv_storage),
+    rope_(rope_table(config.head_dim(), config.max_seq, config.rope_base)),
+    slab_(nullptr), positions_(config.max_batch) {
+    if (config.dim % config.num_heads != 0 || config.head_dim() % 2 != 0) {
+        throw std::invalid_argument("LlamaModel: dim must split into even-sized heads");
+    }
+    blocks_.reserve(config.num_layers);
+    for (int l = 0; l < config.num_layers; ++l) {
+        blocks_.emplace_back(config, device);
+    }
+    plan_activations();
+}
+
+template<DType dtype>
+std::vector<Tensor<dtype>*> LlamaModel<dtype>::parameters() {
+    std::vector<Tensor<dtype>*> params;
+    if (has_lora()) {
+        for (LlamaBlock<dtype>& block : blocks_) {
+            for (Linear<dtype>* linear : block.projections()) {
+                params.push_back(&linear->lora()->a);
+                params.push_back(&linear->lora()->b);
+            }
+        }
+        return params;
+    }
+    auto add_linear = [&](Linear<dtype>& linear) {
+        if (linear.trains_weights()) {
+            params.push_back(&linear.weights().full());
+        }
+    };
+    for (LlamaBlock<dtype>& block : blocks_) {
+        params.push_back(&block.attention_norm.weight());
+        params.push_back(&block.ffn_norm.weight());
+        if (block.moe) {
+            add_linear(block.moe->router());
+        }
+        for (Linear<dtype>* linear : block.projections()) {
+            add_linear(*linear);
+        }
+    }
+    params.push_back(&final_norm_.weight());
+    add_linear(lm_head_);
+    return params;
+}
+
+template<DType dtype>
+void LlamaModel<dtype>::attach_lora(int rank, float alpha) {
+    for (LlamaBlock<dtype>& block : blocks_) {
+        for (Linear<dtype>* linear : block.projections()) {
+            linear->attach_lora(rank, alpha);
+        }
+    }
+    set_frozen_except_adapters(true);
+}
+
+template<DType dtype>
+void LlamaModel<dtype>::merge_lora() {
+    for (LlamaBlock<dtype>& block : blocks_) {
+        for (Linear<dtype>* linear : block.projections()) {
+            linear->merge_lora();
+        }
+    }
+    set_frozen_except_adapters(false);
+}
+
+template<DType dtype>
+void LlamaModel<dtype>::set_frozen_except_adapters(bool frozen) {
+    for (LlamaBlock<dtype>& block : blocks_) {
+        block.attention_norm.set_frozen(frozen);
+        block.ffn_norm.set_frozen(frozen);
+        if (block.moe) {
+            block.moe->router().set_frozen(frozen);
+        }
+    }
+    final_norm_.set_frozen(frozen);
+    lm_head_.set_frozen(frozen);
+}
+
+template<DType dtype>
+void LlamaModel<dtype>::plan_activations() {
+    const int64_t tokens = static_cast<int64_t>(config_.max_batch) * config_.max_seq;
+    const int64_t q_cols = static_cast<int64_t>(config_.num_heads) * config_.head_dim();
+    const int64_t kv_cols = static_cast<int64_t>(config_.num_kv_heads) * config_.head_dim();
+    auto add = [&](int64_t rows, int64_t cols) { return planner_.add_tensor(rows * cols * sizeof(T)); };
+    int residual = add(tokens, config_.dim), normed = add(tokens, config_.dim);
+    int query = add(tokens, q_cols), key = add(tokens, kv_cols), value = add(tokens, kv_cols);
+    int attention_out = add(tokens, q_cols), block_out = add(tokens, config_.dim);
+    int ffn_hidden = add(tokens, config_.hidden_dim);
+    int last_normed = add(config_.max_batch, config_.dim), logits = add(config_.max_batch, config_.vocab_size);
+
+    // The op sequence of forward() with a single block: every block runs the
+    // same ops, and the only values carried from one block to the next are
+    // residual and block_out, which this trace already keeps live throughout.
+    planner_.add_op({}, {residual});
+    planner_.add_op({residual, block_out}, {residual, normed});
+    planner_.add_op({normed}, {query, key, value});
+    planner_.add_op({query, key, value}, {attention_out});
+    planner_.add_op({attention_out}, {block_out});
+    planner_.add_op({residual, block_out}, {residual, normed});
+    planner_.add_op({normed}, {block_out, ffn_hidden});
+    planner_.add_op({residual, block_out}, {last_normed});
+    planner_.add_op({last_normed}, {logits});
+    // returned to the caller, valid until the next forward
+    planner_.keep_alive(logits);
+    planner_.plan();
+
+    slab_ = planner_.allocate_slab();
+    auto view = [&](int id, int64_t rows, int64_t cols) {
+        return planner_.view<dtype>(slab_, id, {static_cast<int>(rows), static_cast<int>(cols)}, device_);
+    };
+    residual_ = view(residual, tokens, config_.dim);
+    normed_ = view(normed, tokens, config_.dim);
+    query_ = view(query, tokens, q_cols);
+    key_ = view(key, tokens, kv_cols);
+    value_ = view(value, tokens, kv_cols);
+    attention_out_ = view(attention_out, tokens, q_cols);
+    block_out_ = view(block_out, tokens, config_.dim);
+    ffn_hidden_ = view(ffn_hidden, tokens, config_.hidden_dim);
+    last_normed_ = view(last_normed, config_.max_batch, config_.dim);
+    logits_ = view(logits, config_.max_batch, config_.vocab_size);
+}
+
+template<DType dtype>
+Tensor<dtype> LlamaModel<dtype>::forward(const std::vector<int>& seqs, const uint32_t* ids, int seq_len) {
+    const int batch = static_cast<int>(seqs.size());
+    if (batch <= 0 || batch > config_.max_batch || seq_len <= 0 || seq_len > config_.max_seq) {
+        throw std::invalid_argument("LlamaModel: batch/sequence length outside the preallocated sizes");
+    }
+    const int64_t rows = static_cast<int64_t>(batch) * seq_len;
+    const int64_t dim = config_.dim;
+    const int64_t kv_cols = static_cast<int64_t>(config_.num_kv_heads) * config_.head_dim();
+
+    // a batch of fresh prompts can use the tiled kernel on the contiguous
+    // K/V buffers; anything else attends through the cache
+    bool fresh = true;
+    // check the ids and every sequence before growing any, so a rejected batch leaves the cache untouched
+    embeddings_.validate_ids(ids, rows);
+    for (int b = 0; b < batch; ++b) {
+        if (cache_.append_position(seqs[b], seq_len) + seq_len > config_.max_seq) {
+            throw std::out_of_range("LlamaModel: sequence grew past max_seq");
+        }
+    }
+    for (int b = 0; b < batch; ++b) {
+        fresh = fresh && cache_.length(seqs[b]) == 0 && cache_.evicted_tokens(seqs[b]) == 0;
+        positions_[b] = cache_.append(seqs[b], seq_len);
+    }
+
+    embeddings_.gather_rows(ids, rows, residual_.data());
+    for (int l = 0; l < config_.num_layers; ++l) {
+        LlamaBlock<dtype>& block = blocks_[l];
+        if (l == 0) {
+            block.attention_norm.forward_rows(residual_.data(), normed_.data(), rows);
+        } else {
+            block.attention_norm.forward_residual_rows(residual_.data(), block_out_.data(), normed_.data(), rows);
+        }
+        block.project_qkv(*rope_, normed_.data(), query_.data(), key_.data(), value_.data(), rows, seq_len,
+            positions_.data());
+        for (int64_t i = 0; i < rows; ++i) {
+            int b = static_cast<int>(i / seq_len);
+            cache_.store(seqs[b], l, positions_[b] + static_cast<int>(i % seq_len), key_.data() + i * kv_cols,
+                value_.data() + i * kv_cols);
+        }
+        if (fresh) {
+            block.attention.forward_raw(query_.data(), key_.data(), value_.data(), attention_out_.data(), nullptr,
+                batch, seq_len, seq_len);
+        } else {
+            block.attention.forward_paged(cache_, seqs, l, query_.data(), attention_out_.data(), seq_len);
+        }
+        block.output.forward_rows(attention_out_.data(), block_out_.data(), rows);
+        block.ffn_norm.forward_residual_rows(residual_.data(), block_out_.data(), normed_.data(), rows);
+        block.ffn_forward(normed_.data(), block_out_.data(), ffn_hidden_.data(), rows);
+    }
+
+    // only each sequence's last token needs the final norm and the LM head
+    for (int b = 0; b < batch; ++b) {
+        int64_t last = static_cast<int64_t>(b) * seq_len + seq_len - 1;
+        final_norm_.forward_residual_rows(residual_.data() + last * dim, block_out_.data() + last * dim,
+            last_normed_.data() + b * dim, 1);
+    }
+    lm_head_.forward_rows(last_normed_.data(), logits_.data(), batch);
+    return Tensor<dtype>(logits_.data(), {batch, config_.vocab_size}, device_);
+}
+
+// Copies the dense parameters of one model into another of the same config
+// and a different dtype (e.g. an fp32 init into an fp16 training copy).
+template<DType dst, DType src>
+void copy_parameters(LlamaModel<src>& from, LlamaModel<dst>& to) {
+    std::vector<Tensor<src>*> source = from.parameters();
+    std::vector<Tensor<dst>*> target = to.parameters();
+    if (source.size() != target.size()) {
+        throw std::invalid_argument("copy_parameters: models have different parameter lists");
+    }
+    for (size_t i = 0; i < source.size(); ++i) {
+        if (source[i]->shape != target[i]->shape) {
+            throw std::invalid_argument("copy_parameters: parameter shapes differ");
+        }
+        auto converted = source[i]->template change_dtype<dst>();
+        std::memcpy(target[i]->data(), converted->data(), target[i]->size() * sizeof(typename DTypeToType<dst>::Type));
+        deallocate_memory(converted->data());
+    }
+}
+
+#endif
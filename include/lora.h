@@ -0,0 +1,48 @@
+#ifndef LORA_H
+#define LORA_H
+
+#include "tensor.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+
+// Low-rank update of a frozen [out, in] weight: W + scale * B A, with A
+// [rank, in] and B [out, rank]. B starts at zero, so attaching an adapter
+// leaves the layer's output unchanged until it has been trained.
+template<DType dtype>
+struct LoraAdapter {
+    LoraAdapter(int in_features, int out_features, int rank, float alpha);
+
+    int64_t num_elements() const { return static_cast<int64_t>(a.size()) + b.size(); }
+
+    int rank;
+    float scale;  // alpha / rank
+    Tensor<dtype> a;
+    Tensor<dtype> b;
+};
+
+// checked before a and b are allocated from it
+inline int lora_rank(int in_features, int out_features, int rank) {
+    if (rank <= 0 || rank > std::min(in_features, out_features)) {
+        throw std::invalid_argument("LoraAdapter: rank must be in [1, min(in, out)]");
+    }
+    return rank;
+}
+
+template<DType dtype>
+LoraAdapter<dtype>::LoraAdapter(int in_features, int out_features, int rank, float alpha)
+  : rank(lora_rank(in_features, out_features, rank)), scale(alpha / rank), a(std::vector<int>{rank, in_features}),
+    b(std::vector<int>{out_features, rank}) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    float bound = 1.0f / std::sqrt(static_cast<float>(in_features));
+    std::uniform_real_distribution<float> dis(-bound, bound);
+    for (int i = 0; i < a.size(); ++i) {
+        a.data()[i] = from_float<dtype>(dis(gen));
+    }
+    a.grad = std::make_shared<Tensor<dtype>>(a.shape);
+    b.grad = std::make_shared<Tensor<dtype>>(b.shape);
+}
+
+#endif
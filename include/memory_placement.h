@@ -0,0 +1,41 @@
+#ifndef MEMORY_PLACEMENT_H
+#define MEMORY_PLACEMENT_H
+
+#include <vector>
+#include <cstddef>
+
+typedef enum {
+    PLACEMENT_DEFAULT,     // plain malloc, pages land wherever the first writer runs
+    PLACEMENT_FIRST_TOUCH, // pages are zeroed by the pool workers that will later read them
+    PLACEMENT_INTERLEAVE   // pages are spread round-robin over all NUMA nodes
+} MemoryPlacement;
+
+struct NumaTopology {
+    // cpus of each node, in node order
+    std::vector<std::vector<int>> node_cpus;
+
+    size_t num_nodes() const { return node_cpus.size(); }
+    int node_of_cpu(int cpu) const;
+};
+
+const NumaTopology& numa_topology();
+
+void set_memory_placement(MemoryPlacement placement);
+MemoryPlacement get_memory_placement();
+
+// Buffers at least this large are 2MB aligned and advised for transparent huge pages.
+void set_huge_page_threshold(size_t bytes);
+size_t get_huge_page_threshold();
+
+// Applies the current placement to a freshly allocated, untouched buffer.
+void place_buffer(void* ptr, size_t bytes);
+
+// Node-local copies of a read-only buffer (weights), one per NUMA node.
+// Free each replica with deallocate_memory.
+std::vector<void*> replicate_per_node(const void* src, size_t bytes);
+
+// Replica to read from the calling thread: the pinned node of the current pool
+// worker, or replica 0 from outside the pool.
+const void* local_replica(const std::vector<void*>& replicas);
+
+#endif
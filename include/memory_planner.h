@@ -0,0 +1,60 @@
+#ifndef MEMORY_PLANNER_H
+#define MEMORY_PLANNER_H
+
+#include "tensor.h"
+#include <cstddef>
+#include <vector>
+
+// Static activation planner. Describe a fixed op sequence once: every
+// intermediate tensor with its size, and every op with the tensors it reads and
+// writes. A tensor is live from the first op that touches it to the last, and
+// tensors whose lifetimes don't overlap may share bytes. plan() assigns offsets
+// into one slab (largest tensors first, each at the lowest offset that clears
+// every already-placed tensor it is live with), then the caller allocates the
+// slab once and creates tensors as views into it.
+class MemoryPlanner {
+public:
+    explicit MemoryPlanner(size_t alignment = 64);
+
+    int add_tensor(size_t bytes);
+    // Returns the op's step index. Ops are steps in program order.
+    int add_op(const std::vector<int>& reads, const std::vector<int>& writes);
+    // Keeps a tensor live until the end (e.g. outputs handed back to the caller).
+    void keep_alive(int tensor);
+
+    void plan();
+
+    size_t offset(int tensor) const;
+    size_t slab_bytes() const { return slab_bytes_; }
+    // Largest sum of simultaneously live tensors: no packing can beat it.
+    size_t peak_live_bytes() const;
+    // What one buffer per tensor would cost.
+    size_t unshared_bytes() const;
+    int num_tensors() const { return static_cast<int>(tensors_.size()); }
+
+    // Allocates a slab of slab_bytes() with allocate_memory.
+    void* allocate_slab() const;
+
+    template<DType dtype>
+    Tensor<dtype> view(void* slab, int tensor, const std::vector<int>& shape, Device device = CPU) const {
+        auto* base = static_cast<char*>(slab) + offset(tensor);
+        return Tensor<dtype>(reinterpret_cast<typename DTypeToType<dtype>::Type*>(base), shape, device);
+    }
+
+private:
+    struct TensorInfo {
+        size_t bytes;
+        int first;
+        int last;
+        size_t offset;
+    };
+    void touch(int tensor, int step);
+
+    size_t alignment_;
+    int steps_;
+    bool planned_;
+    size_t slab_bytes_;
+    std::vector<TensorInfo> tensors_;
+};
+
+#endif
@@ -0,0 +1,320 @@
+#ifndef MOE_H
+#define MOE_H
+
+#include "feed_forward.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+// Mixture-of-experts SwiGLU FFN. A [num_experts, dim] router picks each
+// token's top_k experts, whose softmax probabilities are renormalized over
+// the k into mixing weights. Assignments are then grouped by expert into one
+// contiguous buffer (first choices of every token before second choices, so
+// capacity drops hit the lower-ranked ones first) and every expert runs its
+// GEMMs on its own slice; the thread pool splits all experts' slices into
+// equal work items at once. Outputs are combined back per token with the
+// mixing weights.
+//
+// An expert takes at most capacity(rows) assignments per call, beyond which
+// assignments are dropped (contribute nothing). aux_loss() is the Switch
+// load-balancing loss num_experts * sum_e f_e P_e, with f_e the fraction of
+// assignments routed to e and P_e its mean router probability.
+//
+// Like FeedForward, backward saves nothing but the input: routing and expert
+// outputs are recomputed from it. Expert backwards run in turn, each over the
+// whole pool.
+template<DType dtype>
+class MixtureOfExperts {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    MixtureOfExperts(int dim, int hidden_dim, int num_experts, int top_k = 2, float capacity_factor = 1.25f,
+        WeightStorage storage = STORAGE_FULL, Device device = CPU);
+
+    void forward_rows(const T* input, T* output, int64_t rows);
+    // aux_grad is d loss / d aux_loss(), i.e. the loss weight times any loss scale.
+    void backward_rows(const T* grad_output, const T* input, T* grad_input, int64_t rows, float aux_grad = 0.0f);
+
+    // capacity_factor <= 0 disables the cap
+    int64_t capacity(int64_t rows) const;
+    // of the last forward or backward
+    float aux_loss() const { return aux_loss_; }
+    int64_t dropped() const { return dropped_; }
+    const std::vector<int64_t>& expert_counts() const { return counts_; }
+
+    Linear<dtype>& router() { return router_; }
+    std::vector<FeedForward<dtype>>& experts() { return experts_; }
+    int num_experts() const { return num_experts_; }
+    int top_k() const { return top_k_; }
+    void set_capacity_factor(float capacity_factor) { capacity_factor_ = capacity_factor; }
+
+    static const int64_t rows_per_item = 2 * Linear<dtype>::block_m;
+
+private:
+    // router probabilities, top-k choices, capacity and the expert-sorted slots
+    void route(const T* input, int64_t rows);
+    // input rows gathered into slot order, and every expert's output for its slots
+    void run_experts(const T* input);
+
+    int dim_;
+    int hidden_dim_;
+    int num_experts_;
+    int top_k_;
+    float capacity_factor_;
+    Linear<dtype> router_;
+    std::vector<FeedForward<dtype>> experts_;
+
+    std::vector<float> probs_;       // [rows, num_experts]
+    std::vector<int> choice_;        // [rows, top_k] expert ids
+    std::vector<float> weight_;      // [rows, top_k] mixing weights
+    std::vector<int64_t> slot_;      // [rows, top_k] position in the grouped buffer, -1 when dropped
+    std::vector<int64_t> token_;     // [slots] source token of each slot
+    std::vector<int64_t> offset_;    // [num_experts + 1] start of each expert's slots
+    std::vector<int64_t> counts_;    // [num_experts] assignments before the cap
+    std::vector<T> grouped_input_;   // [slots, dim]
+    std::vector<T> grouped_output_;  // [slots, dim]
+    float aux_loss_;
+    int64_t dropped_;
+};
+
+template<DType dtype>
+MixtureOfExperts<dtype>::MixtureOfExperts(int dim, int hidden_dim, int num_experts, int top_k, float capacity_factor,
+    WeightStorage storage, Device device)
+  : dim_(dim), hidden_dim_(hidden_dim), num_experts_(num_experts), top_k_(top_k), capacity_factor_(capacity_factor),
+    router_(dim, num_experts, STORAGE_FULL, device), aux_loss_(0.0f), dropped_(0) {
+    if (num_experts <= 0 || top_k <= 0 || top_k > num_experts) {
+        throw std::invalid_argument("MixtureOfExperts: top_k must be in [1, num_experts]");
+    }
+    experts_.reserve(num_experts);
+    for (int e = 0; e < num_experts; ++e) {
+        experts_.emplace_back(dim, hidden_dim, storage, device);
+    }
+}
+
+template<DType dtype>
+int64_t MixtureOfExperts<dtype>::capacity(int64_t rows) const {
+    if (capacity_factor_ <= 0.0f) {
+        return rows;
+    }
+    double slots = static_cast<double>(capacity_factor_) * rows * top_k_ / num_experts_;
+    return std::min<int64_t>(rows, std::max<int64_t>(1, static_cast<int64_t>(std::ceil(slots))));
+}
+
+template<DType dtype>
+void MixtureOfExperts<dtype>::route(const T* input, int64_t rows) {
+    const int64_t e_count = num_experts_, k = top_k_;
+    probs_.resize(rows * e_count);
+    choice_.resize(rows * k);
+    weight_.resize(rows * k);
+    slot_.resize(rows * k);
+    router_.forward_rows_epilogue(input, rows, [&](int64_t i, int64_t n0, int64_t n1, const float* values) {
+        std::copy(values, values + (n1 - n0), probs_.data() + i * e_count + n0);
+    });
+    parallel_for(0, rows, [&](int64_t lo, int64_t hi) {
+        std::vector<int> order(e_count);
+        for (int64_t i = lo; i < hi; ++i) {
+            float* p = probs_.data() + i * e_count;
+            float max = *std::max_element(p, p + e_count), sum = 0.0f;
+            for (int64_t e = 0; e < e_count; ++e) {
+                sum += (p[e] = std::exp(p[e] - max));
+            }
+            for (int64_t e = 0; e < e_count; ++e) {
+                p[e] /= sum;
+            }
+            // ties go to the lower expert id
+            for (int e = 0; e < e_count; ++e) {
+                order[e] = e;
+            }
+            std::partial_sort(order.begin(), order.begin() + k, order.end(),
+                [p](int a, int b) { return p[a] > p[b] || (p[a] == p[b] && a < b); });
+            float top = 0.0f;
+            for (int64_t c = 0; c < k; ++c) {
+                top += p[order[c]];
+            }
+            for (int64_t c = 0; c < k; ++c) {
+                choice_[i * k + c] = order[c];
+                weight_[i * k + c] = p[order[c]] / top;
+            }
+        }
+    });
+
+    // rank-major dispatch: every token's first choice claims capacity before
+    // any second choice does
+    const int64_t cap = capacity(rows);
+    counts_.assign(e_count, 0);
+    std::vector<int64_t> kept(e_count, 0);
+    for (int64_t c = 0; c < k; ++c) {
+        for (int64_t i = 0; i < rows; ++i) {
+            int e = choice_[i * k + c];
+            ++counts_[e];
+            slot_[i * k + c] = kept[e] < cap ? kept[e]++ : -1;
+        }
+    }
+    offset_.assign(e_count + 1, 0);
+    for (int64_t e = 0; e < e_count; ++e) {
+        offset_[e + 1] = offset_[e] + kept[e];
+    }
+    token_.resize(offset_[e_count]);
+    dropped_ = rows * k - offset_[e_count];
+    for (int64_t i = 0; i < rows; ++i) {
+        for (int64_t c = 0; c < k; ++c) {
+            int64_t& s = slot_[i * k + c];
+            if (s >= 0) {
+                s += offset_[choice_[i * k + c]];
+                token_[s] = i;
+            }
+        }
+    }
+
+    double aux = 0.0;
+    for (int64_t e = 0; e < e_count; ++e) {
+        double mean_prob = 0.0;
+        for (int64_t i = 0; i < rows; ++i) {
+            mean_prob += probs_[i * e_count + e];
+        }
+        aux += static_cast<double>(counts_[e]) / (rows * k) * mean_prob / rows;
+    }
+    aux_loss_ = static_cast<float>(e_count * aux);
+}
+
+template<DType dtype>
+void MixtureOfExperts<dtype>::run_experts(const T* input) {
+    const int64_t slots = static_cast<int64_t>(token_.size()), dim = dim_;
+    grouped_input_.resize(slots * dim);
+    grouped_output_.resize(slots * dim);
+    parallel_for(0, slots, [&](int64_t lo, int64_t hi) {
+        for (int64_t s = lo; s < hi; ++s) {
+            std::copy(input + token_[s] * dim, input + (token_[s] + 1) * dim, grouped_input_.data() + s * dim);
+        }
+    });
+
+    // (expert, row range) items over all experts; a worker's items are
+    // consecutive, so it mostly stays on one expert's weights
+    struct Item {
+        int expert;
+        int64_t begin, end;
+    };
+    std::vector<Item> items;
+    for (int e = 0; e < num_experts_; ++e) {
+        for (int64_t r = offset_[e]; r < offset_[e + 1]; r += rows_per_item) {
+            items.push_back({e, r, std::min(offset_[e + 1], r + rows_per_item)});
+        }
+    }
+    parallel_for(0, static_cast<int64_t>(items.size()), [&](int64_t lo, int64_t hi) {
+        static thread_local std::vector<T> hidden;
+        hidden.resize(static_cast<size_t>(rows_per_item) * hidden_dim_);
+        for (int64_t it = lo; it < hi; ++it) {
+            const Item& item = items[it];
+            experts_[item.expert].forward_rows(grouped_input_.data() + item.begin * dim,
+                grouped_output_.data() + item.begin * dim, hidden.data(), item.end - item.begin);
+        }
+    });
+}
+
+template<DType dtype>
+void MixtureOfExperts<dtype>::forward_rows(const T* input, T* output, int64_t rows) {
+    const int64_t dim = dim_, k = top_k_;
+    route(input, rows);
+    run_experts(input);
+    parallel_for(0, rows, [&](int64_t lo, int64_t hi) {
+        std::vector<float> acc(dim), y(dim);
+        for (int64_t i = lo; i < hi; ++i) {
+            std::fill(acc.begin(), acc.end(), 0.0f);
+            for (int64_t c = 0; c < k; ++c) {
+                int64_t s = slot_[i * k + c];
+                if (s >= 0) {
+                    row_to_float<dtype>(grouped_output_.data() + s * dim, y.data(), dim);
+                    simd_axpy(acc.data(), y.data(), weight_[i * k + c], dim);
+                }
+            }
+            row_from_float<dtype>(acc.data(), output + i * dim, dim);
+        }
+    });
+}
+
+template<DType dtype>
+void MixtureOfExperts<dtype>::backward_rows(const T* grad_output, const T* input, T* grad_input, int64_t rows,
+    float aux_grad) {
+    const int64_t dim = dim_, k = top_k_, e_count = num_experts_;
+    route(input, rows);
+    run_experts(input);
+    const int64_t slots = static_cast<int64_t>(token_.size());
+
+    // d weight = dy . expert output; each slot's expert sees weight * dy
+    std::vector<float> grad_weight(rows * k, 0.0f);
+    std::vector<T> grad_grouped(slots * dim), grad_grouped_input(slots * dim);
+    parallel_for(0, rows, [&](int64_t lo, int64_t hi) {
+        std::vector<float> dy(dim), y(dim);
+        for (int64_t i = lo; i < hi; ++i) {
+            row_to_float<dtype>(grad_output + i * dim, dy.data(), dim);
+            for (int64_t c = 0; c < k; ++c) {
+                int64_t s = slot_[i * k + c];
+                if (s < 0) {
+                    continue;
+                }
+                row_to_float<dtype>(grouped_output_.data() + s * dim, y.data(), dim);
+                grad_weight[i * k + c] = simd_dot(dy.data(), y.data(), dim);
+                for (int64_t d = 0; d < dim; ++d) {
+                    y[d] = weight_[i * k + c] * dy[d];
+                }
+                row_from_float<dtype>(y.data(), grad_grouped.data() + s * dim, dim);
+            }
+        }
+    });
+    // experts one after another: each one's GEMMs split over the whole pool,
+    // so backward time doesn't hinge on the busiest expert
+    for (int64_t e = 0; e < e_count; ++e) {
+        int64_t b = offset_[e], n = offset_[e + 1] - b;
+        if (n > 0) {
+            experts_[e].backward_rows(grad_grouped.data() + b * dim, grouped_input_.data() + b * dim,
+                grad_grouped_input.data() + b * dim, n);
+        }
+    }
+
+    // router: through the top-k renormalization, the balancing loss (f_e held
+    // constant) and the softmax
+    std::vector<T> grad_logits(rows * e_count);
+    parallel_for(0, rows, [&](int64_t lo, int64_t hi) {
+        std::vector<float> dp(e_count);
+        for (int64_t i = lo; i < hi; ++i) {
+            const float* p = probs_.data() + i * e_count;
+            for (int64_t e = 0; e < e_count; ++e) {
+                dp[e] = aux_grad * e_count * static_cast<float>(counts_[e]) / (rows * k) / rows;
+            }
+            float top = 0.0f, mixed = 0.0f;
+            for (int64_t c = 0; c < k; ++c) {
+                top += p[choice_[i * k + c]];
+                mixed += grad_weight[i * k + c] * weight_[i * k + c];
+            }
+            for (int64_t c = 0; c < k; ++c) {
+                dp[choice_[i * k + c]] += (grad_weight[i * k + c] - mixed) / top;
+            }
+            float dot = 0.0f;
+            for (int64_t e = 0; e < e_count; ++e) {
+                dot += p[e] * dp[e];
+            }
+            for (int64_t e = 0; e < e_count; ++e) {
+                grad_logits[i * e_count + e] = from_float<dtype>(p[e] * (dp[e] - dot));
+            }
+        }
+    });
+    router_.backward_rows(grad_logits.data(), input, grad_input, rows);
+
+    // grad_input += the experts' input gradients, gathered back per token
+    parallel_for(0, rows, [&](int64_t lo, int64_t hi) {
+        std::vector<float> acc(dim), g(dim);
+        for (int64_t i = lo; i < hi; ++i) {
+            row_to_float<dtype>(grad_input + i * dim, acc.data(), dim);
+            for (int64_t c = 0; c < k; ++c) {
+                int64_t s = slot_[i * k + c];
+                if (s >= 0) {
+                    row_to_float<dtype>(grad_grouped_input.data() + s * dim, g.data(), dim);
+                    simd_add(acc.data(), g.data(), dim);
+                }
+            }
+            row_from_float<dtype>(acc.data(), grad_input + i * dim, dim);
+        }
+    });
+}
+
+#endif
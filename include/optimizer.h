@@ -0,0 +1,479 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "tensor.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+typedef enum {
+    OPTIMIZER_SGD,   // SGD with heavy-ball momentum (none when momentum == 0)
+    OPTIMIZER_ADAMW  // Adam with decoupled weight decay
+} OptimizerKind;
+
+typedef enum {
+    STATE_FLOAT32,
+    STATE_FLOAT16,   // second moment kept as sqrt(v) so small gradients don't underflow
+    STATE_BFLOAT16
+} StatePrecision;
+
+struct OptimizerConfig {
+    OptimizerKind kind = OPTIMIZER_ADAMW;
+    float learning_rate = 1e-3f;
+    float beta1 = 0.9f;
+    float beta2 = 0.999f;
+    float epsilon = 1e-8f;
+    float momentum = 0.9f;       // SGD only
+    float weight_decay = 0.0f;   // decoupled: p -= lr * weight_decay * p
+    float max_grad_norm = 0.0f;  // clip the global gradient norm to this; 0 disables
+    StatePrecision state_precision = STATE_FLOAT32;
+    // For FLOAT16 parameters: update an fp32 copy and round it into the
+    // parameter, so steps smaller than half an fp16 ulp still add up.
+    bool master_weights = true;
+};
+
+// Dynamic loss scaling for half-precision backward passes: the loss is
+// multiplied by scale() so small gradients don't flush to zero in fp16. A step
+// whose gradients overflowed is skipped and the scale backs off; after
+// growth_interval clean steps in a row it grows again.
+class LossScaler {
+public:
+    explicit LossScaler(float initial_scale = 65536.0f, int growth_interval = 2000, float growth_factor = 2.0f,
+        float backoff_factor = 0.5f)
+      : scale_(initial_scale), growth_interval_(growth_interval), growth_factor_(growth_factor),
+        backoff_factor_(backoff_factor), good_steps_(0), skipped_steps_(0) {}
+
+    float scale() const { return scale_; }
+    int64_t skipped_steps() const { return skipped_steps_; }
+
+    void update(bool overflow) {
+        if (overflow) {
+            scale_ = std::max(1.0f, scale_ * backoff_factor_);
+            good_steps_ = 0;
+            ++skipped_steps_;
+        } else if (++good_steps_ == growth_interval_) {
+            scale_ *= growth_factor_;
+            good_steps_ = 0;
+        }
+    }
+
+private:
+    float scale_;
+    int growth_interval_;
+    float growth_factor_;
+    float backoff_factor_;
+    int good_steps_;
+    int64_t skipped_steps_;
+};
+
+inline uint16_t float_to_bfloat16(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return static_cast<uint16_t>((bits >> 16) | 0x40);  // keep NaN a NaN
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);  // round to nearest even
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+inline float bfloat16_to_float(uint16_t h) {
+    uint32_t bits = static_cast<uint32_t>(h) << 16;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// 16-bit state <-> fp32 for a span; `squared` marks a state stored as its square root.
+inline void widen_state(const uint16_t* src, float* dst, int64_t n, StatePrecision precision, bool squared) {
+    int64_t i = 0;
+#ifdef __AVX2__
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m256 x;
+        if (precision == STATE_BFLOAT16) {
+            x = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+        } else {
+#ifdef __F16C__
+            x = _mm256_cvtph_ps(h);
+#else
+            break;
+#endif
+        }
+        _mm256_storeu_ps(dst + i, squared ? _mm256_mul_ps(x, x) : x);
+    }
+#endif
+    for (; i < n; ++i) {
+        float x = precision == STATE_BFLOAT16 ? bfloat16_to_float(src[i]) : half_to_float(src[i]);
+        dst[i] = squared ? x * x : x;
+    }
+}
+
+inline void narrow_state(const float* src, uint16_t* dst, int64_t n, StatePrecision precision, bool squared) {
+    int64_t i = 0;
+#ifdef __AVX2__
+    const __m256i round = _mm256_set1_epi32(0x7fff), one = _mm256_set1_epi32(1);
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(src + i);
+        if (squared) {
+            x = _mm256_sqrt_ps(x);
+        }
+        __m128i h;
+        if (precision == STATE_BFLOAT16) {
+            // round to nearest even, as float_to_bfloat16 (states are never NaN)
+            __m256i bits = _mm256_castps_si256(x);
+            __m256i odd = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+            bits = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(round, odd)), 16);
+            h = _mm_packus_epi32(_mm256_castsi256_si128(bits), _mm256_extracti128_si256(bits, 1));
+        } else {
+#ifdef __F16C__
+            h = _mm256_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT);
+#else
+            break;
+#endif
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+    }
+#endif
+    for (; i < n; ++i) {
+        float x = squared ? std::sqrt(src[i]) : src[i];
+        dst[i] = precision == STATE_BFLOAT16 ? float_to_bfloat16(x) : float_to_half(x);
+    }
+}
+
+struct AdamCoefficients {
+    float grad_scale;      // global-norm clipping folded into the gradient read
+    float decay;           // 1 - lr * weight_decay, or 1
+    float beta1, beta2;
+    float step_size;       // lr / (1 - beta1^t)
+    float inv_sqrt_bias2;  // 1 / sqrt(1 - beta2^t)
+    float epsilon;
+};
+
+// One pass over a span: moments, bias correction, decay and the update.
+inline void fused_adamw(float* p, const float* g, float* m, float* v, int64_t n, const AdamCoefficients& c) {
+    int64_t i = 0;
+#ifdef __AVX2__
+    const __m256 scale = _mm256_set1_ps(c.grad_scale), decay = _mm256_set1_ps(c.decay);
+    const __m256 b1 = _mm256_set1_ps(c.beta1), b1c = _mm256_set1_ps(1.0f - c.beta1);
+    const __m256 b2 = _mm256_set1_ps(c.beta2), b2c = _mm256_set1_ps(1.0f - c.beta2);
+    const __m256 step = _mm256_set1_ps(c.step_size), isb2 = _mm256_set1_ps(c.inv_sqrt_bias2);
+    const __m256 eps = _mm256_set1_ps(c.epsilon);
+    for (; i + 8 <= n; i += 8) {
+        __m256 gv = _mm256_mul_ps(_mm256_loadu_ps(g + i), scale);
+        __m256 mv = _mm256_fmadd_ps(b1, _mm256_loadu_ps(m + i), _mm256_mul_ps(b1c, gv));
+        __m256 vv = _mm256_fmadd_ps(b2, _mm256_loadu_ps(v + i), _mm256_mul_ps(b2c, _mm256_mul_ps(gv, gv)));
+        __m256 denom = _mm256_fmadd_ps(_mm256_sqrt_ps(vv), isb2, eps);
+        __m256 pv = _mm256_mul_ps(_mm256_loadu_ps(p + i), decay);
+        _mm256_storeu_ps(p + i, _mm256_fnmadd_ps(step, _mm256_div_ps(mv, denom), pv));
+        _mm256_storeu_ps(m + i, mv);
+        _mm256_storeu_ps(v + i, vv);
+    }
+#endif
+    for (; i < n; ++i) {
+        float gi = g[i] * c.grad_scale;
+        m[i] = c.beta1 * m[i] + (1.0f - c.beta1) * gi;
+        v[i] = c.beta2 * v[i] + (1.0f - c.beta2) * gi * gi;
+        p[i] = p[i] * c.decay - c.step_size * m[i] / (std::sqrt(v[i]) * c.inv_sqrt_bias2 + c.epsilon);
+    }
+}
+
+// buf = momentum * buf + g;  p = decay * p - lr * buf   (buf null: plain SGD)
+inline void fused_sgd(float* p, const float* g, float* buf, int64_t n, float grad_scale, float decay, float lr,
+    float momentum) {
+    int64_t i = 0;
+#ifdef __AVX2__
+    const __m256 scale = _mm256_set1_ps(grad_scale), dv = _mm256_set1_ps(decay);
+    const __m256 rate = _mm256_set1_ps(lr), mom = _mm256_set1_ps(momentum);
+    for (; i + 8 <= n; i += 8) {
+        __m256 gv = _mm256_mul_ps(_mm256_loadu_ps(g + i), scale);
+        if (buf != nullptr) {
+            gv = _mm256_fmadd_ps(mom, _mm256_loadu_ps(buf + i), gv);
+            _mm256_storeu_ps(buf + i, gv);
+        }
+        _mm256_storeu_ps(p + i, _mm256_fnmadd_ps(rate, gv, _mm256_mul_ps(_mm256_loadu_ps(p + i), dv)));
+    }
+#endif
+    for (; i < n; ++i) {
+        float gi = g[i] * grad_scale;
+        if (buf != nullptr) {
+            buf[i] = momentum * buf[i] + gi;
+            gi = buf[i];
+        }
+        p[i] = p[i] * decay - lr * gi;
+    }
+}
+
+// Multi-tensor optimizer: every registered parameter is cut into fixed-size
+// chunks and one parallel_for walks all of them, reading the gradient,
+// updating the optimizer state and the weight, and zeroing the gradient in a
+// single pass per element. Clipping needs the global norm first, so it adds one
+// read-only pass (a parallel reduction over the same chunks) and is applied as
+// a scale on the gradient inside the update.
+//
+// Gradients are read from param.grad, which is allocated on registration if
+// missing so the layers' backward passes accumulate into it.
+template<DType dtype>
+class Optimizer {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    explicit Optimizer(const OptimizerConfig& config)
+      : config_(config), steps_(0), total_(0), last_grad_norm_(0.0f), last_grad_scale_(1.0f) {}
+
+    Optimizer(const Optimizer&) = delete;
+    Optimizer& operator=(const Optimizer&) = delete;
+
+    // Weight decay applies to parameters with two or more dims (not norm gains).
+    void add_parameter(Tensor<dtype>& param) { add_parameter(param, param.shape.size() >= 2); }
+    void add_parameter(Tensor<dtype>& param, bool decay);
+
+    // Clips, updates every parameter and zeroes the gradients. Returns the
+    // global gradient norm before clipping, or 0 when clipping is disabled
+    // (the norm is not computed then).
+    // extra_sum_squares is the squared norm of gradients the caller updates
+    // itself (e.g. sparse embedding rows), in the same scale as the .grads: it
+    // counts towards the clipping norm and the overflow check, and the caller
+    // applies last_grad_scale() to those gradients.
+    float step(double extra_sum_squares = 0.0);
+    // For gradients of a loss multiplied by scaler.scale(). The norm pass
+    // doubles as the overflow check: any inf/nan gradient makes the sum
+    // non-finite, and then the step is skipped (gradients are zeroed) and false
+    // returned. Otherwise the unscale is folded into the update's gradient read.
+    bool step(LossScaler& scaler, double extra_sum_squares = 0.0);
+    // unscaled norm seen by the last step, when it computed one
+    float last_grad_norm() const { return last_grad_norm_; }
+    // what the last applied step multiplied every gradient by: unscale and clip
+    float last_grad_scale() const { return last_grad_scale_; }
+    void zero_grad();
+    // sqrt of the sum of squared gradients over every parameter, plus extra_sum_squares
+    float global_grad_norm(double extra_sum_squares = 0.0) const;
+
+    OptimizerConfig& config() { return config_; }
+    int64_t steps() const { return steps_; }
+    int64_t num_elements() const { return total_; }
+    // moments plus master weights
+    size_t state_bytes() const {
+        return (state32_.size() + master_.size()) * sizeof(float) + state16_.size() * sizeof(uint16_t);
+    }
+
+    static const int64_t chunk_size = 1 << 15;
+
+private:
+    struct Param {
+        Tensor<dtype>* tensor;
+        int64_t offset;  // into the state arenas
+        bool decay;
+    };
+    struct Chunk {
+        int param;
+        int64_t begin;
+        int64_t end;
+    };
+
+    int states_per_element() const {
+        if (config_.kind == OPTIMIZER_ADAMW) return 2;
+        return config_.momentum != 0.0f ? 1 : 0;
+    }
+    void allocate_states();
+    // grad_scale multiplies every gradient read (unscaling, clipping)
+    void apply(float grad_scale);
+    void update_chunk(const Chunk& chunk, float grad_scale, const AdamCoefficients& adam);
+
+    OptimizerConfig config_;
+    int64_t steps_;
+    int64_t total_;
+    float last_grad_norm_;
+    float last_grad_scale_;
+    std::vector<Param> params_;
+    std::vector<Chunk> chunks_;
+    // [state][element], one of the two depending on state_precision
+    std::vector<float> state32_;
+    std::vector<uint16_t> state16_;
+    std::vector<float> master_;
+};
+
+template<DType dtype>
+void Optimizer<dtype>::add_parameter(Tensor<dtype>& param, bool decay) {
+    if (steps_ > 0) {
+        throw std::logic_error("Optimizer: parameters must be registered before the first step");
+    }
+    if (!param.grad) {
+        param.grad = std::make_shared<Tensor<dtype>>(param.shape);
+    }
+    const int id = static_cast<int>(params_.size());
+    params_.push_back({&param, total_, decay});
+    for (int64_t begin = 0; begin < param.size(); begin += chunk_size) {
+        chunks_.push_back({id, begin, std::min<int64_t>(param.size(), begin + chunk_size)});
+    }
+    total_ += param.size();
+}
+
+template<DType dtype>
+void Optimizer<dtype>::allocate_states() {
+    const size_t n = static_cast<size_t>(states_per_element()) * total_;
+    if (config_.state_precision == STATE_FLOAT32) {
+        state32_.assign(n, 0.0f);
+    } else {
+        state16_.assign(n, 0);
+    }
+    if (dtype != FLOAT32 && config_.master_weights) {
+        master_.resize(total_);
+        for (const Param& param : params_) {
+            row_to_float<dtype>(param.tensor->data(), master_.data() + param.offset, param.tensor->size());
+        }
+    }
+}
+
+template<DType dtype>
+float Optimizer<dtype>::global_grad_norm(double extra_sum_squares) const {
+    std::vector<double> partial(chunks_.size(), 0.0);
+    parallel_for(0, static_cast<int64_t>(chunks_.size()), [&](int64_t lo, int64_t hi) {
+        std::vector<float> scratch;
+        for (int64_t c = lo; c < hi; ++c) {
+            const Chunk& chunk = chunks_[c];
+            const T* g = params_[chunk.param].tensor->grad->data() + chunk.begin;
+            const int64_t n = chunk.end - chunk.begin;
+            partial[c] = simd_sum_squares(float_row<dtype>(g, scratch, n), n);
+        }
+    });
+    // summed in chunk order, so the norm doesn't depend on the thread count
+    double total = extra_sum_squares;
+    for (double p : partial) {
+        total += p;
+    }
+    return static_cast<float>(std::sqrt(total));
+}
+
+template<DType dtype>
+void Optimizer<dtype>::update_chunk(const Chunk& chunk, float grad_scale, const AdamCoefficients& adam) {
+    static const int64_t tile = 512;
+    const Param& param = params_[chunk.param];
+    const bool wide_state = config_.state_precision == STATE_FLOAT32;
+    const bool sqrt_v = config_.state_precision == STATE_FLOAT16;
+    const int states = states_per_element();
+    const float decay = param.decay ? 1.0f - config_.learning_rate * config_.weight_decay : 1.0f;
+    AdamCoefficients c = adam;
+    c.grad_scale = grad_scale;
+    c.decay = decay;
+
+    float p_buf[tile], g_buf[tile], s_buf[2][tile];
+    for (int64_t b = chunk.begin; b < chunk.end; b += tile) {
+        const int64_t n = std::min(tile, chunk.end - b);
+        T* p = param.tensor->data() + b;
+        T* g = param.tensor->grad->data() + b;
+        float* pf = p_buf;
+        const float* gf = g_buf;
+        if constexpr (dtype == FLOAT32) {
+            pf = p;
+            gf = g;
+        } else {
+            if (master_.empty()) {
+                row_to_float<dtype>(p, p_buf, n);
+            } else {
+                pf = master_.data() + param.offset + b;
+            }
+            row_to_float<dtype>(g, g_buf, n);
+        }
+        float* s[2] = {nullptr, nullptr};
+        for (int k = 0; k < states; ++k) {
+            const int64_t at = k * total_ + param.offset + b;
+            if (wide_state) {
+                s[k] = state32_.data() + at;
+                continue;
+            }
+            s[k] = s_buf[k];
+            widen_state(state16_.data() + at, s[k], n, config_.state_precision, k == 1 && sqrt_v);
+        }
+
+        if (config_.kind == OPTIMIZER_ADAMW) {
+            fused_adamw(pf, gf, s[0], s[1], n, c);
+        } else {
+            fused_sgd(pf, gf, s[0], n, grad_scale, decay, config_.learning_rate, config_.momentum);
+        }
+
+        if constexpr (dtype != FLOAT32) {
+            row_from_float<dtype>(pf, p, n);
+        }
+        if (!wide_state) {
+            for (int k = 0; k < states; ++k) {
+                narrow_state(s[k], state16_.data() + k * total_ + param.offset + b, n, config_.state_precision,
+                    k == 1 && sqrt_v);
+            }
+        }
+        std::memset(g, 0, n * sizeof(T));
+    }
+}
+
+template<DType dtype>
+float Optimizer<dtype>::step(double extra_sum_squares) {
+    float norm = 0.0f;
+    float grad_scale = 1.0f;
+    if (config_.max_grad_norm > 0.0f) {
+        norm = global_grad_norm(extra_sum_squares);
+        if (norm > config_.max_grad_norm) {
+            grad_scale = config_.max_grad_norm / (norm + 1e-6f);
+        }
+    }
+    last_grad_norm_ = norm;
+    last_grad_scale_ = grad_scale;
+    apply(grad_scale);
+    return norm;
+}
+
+template<DType dtype>
+bool Optimizer<dtype>::step(LossScaler& scaler, double extra_sum_squares) {
+    float norm = global_grad_norm(extra_sum_squares);
+    if (!std::isfinite(norm)) {
+        zero_grad();
+        scaler.update(true);
+        return false;
+    }
+    const float unscale = 1.0f / scaler.scale();
+    norm *= unscale;
+    float grad_scale = unscale;
+    if (config_.max_grad_norm > 0.0f && norm > config_.max_grad_norm) {
+        grad_scale *= config_.max_grad_norm / (norm + 1e-6f);
+    }
+    last_grad_norm_ = norm;
+    last_grad_scale_ = grad_scale;
+    apply(grad_scale);
+    scaler.update(false);
+    return true;
+}
+
+template<DType dtype>
+void Optimizer<dtype>::apply(float grad_scale) {
+    if (steps_ == 0) {
+        allocate_states();
+    }
+    ++steps_;
+    AdamCoefficients adam{};
+    if (config_.kind == OPTIMIZER_ADAMW) {
+        const float t = static_cast<float>(steps_);
+        adam.beta1 = config_.beta1;
+        adam.beta2 = config_.beta2;
+        adam.step_size = config_.learning_rate / (1.0f - std::pow(config_.beta1, t));
+        adam.inv_sqrt_bias2 = 1.0f / std::sqrt(1.0f - std::pow(config_.beta2, t));
+        adam.epsilon = config_.epsilon;
+    }
+    parallel_for(0, static_cast<int64_t>(chunks_.size()), [&](int64_t lo, int64_t hi) {
+        for (int64_t c = lo; c < hi; ++c) {
+            update_chunk(chunks_[c], grad_scale, adam);
+        }
+    });
+}
+
+template<DType dtype>
+void Optimizer<dtype>::zero_grad() {
+    parallel_for(0, static_cast<int64_t>(chunks_.size()), [&](int64_t lo, int64_t hi) {
+        for (int64_t c = lo; c < hi; ++c) {
+            const Chunk& chunk = chunks_[c];
+            T* g = params_[chunk.param].tensor->grad->data();
+            std::memset(g + chunk.begin, 0, (chunk.end - chunk.begin) * sizeof(T));
+        }
+    });
+}
+
+#endif
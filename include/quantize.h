@@ -0,0 +1,163 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include "tensor.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+typedef enum {
+    STORAGE_FULL,        // the layer's own dtype
+    STORAGE_FLOAT16,     // IEEE half
+    STORAGE_INT8_ROWWISE // symmetric int8 with one fp32 scale per row
+} WeightStorage;
+
+// Returns the scale such that src ~= dst * scale.
+inline float quantize_row_int8(const float* src, int8_t* dst, int64_t n) {
+    float max_abs = 0.0f;
+    for (int64_t i = 0; i < n; ++i) {
+        max_abs = std::max(max_abs, std::abs(src[i]));
+    }
+    float scale = max_abs / 127.0f;
+    float inv_scale = scale > 0.0f ? 1.0f / scale : 0.0f;
+    for (int64_t i = 0; i < n; ++i) {
+        dst[i] = static_cast<int8_t>(std::lround(src[i] * inv_scale));
+    }
+    return scale;
+}
+
+inline void dequantize_row_int8(const int8_t* src, float scale, float* dst, int64_t n) {
+    for (int64_t i = 0; i < n; ++i) {
+        dst[i] = src[i] * scale;
+    }
+}
+
+// Row-major [rows, cols] parameter matrix that can live in a narrower format
+// than the activations it produces. Rows are (de)quantized one at a time, so
+// callers never need a dense fp32 copy.
+template<DType dtype>
+class WeightMatrix {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    WeightMatrix() : rows_(0), cols_(0), storage_(STORAGE_FULL) {}
+
+    WeightMatrix(int64_t rows, int64_t cols, WeightStorage storage = STORAGE_FULL)
+        : rows_(rows), cols_(cols), storage_(storage) {
+        std::vector<int> shape = {static_cast<int>(rows), static_cast<int>(cols)};
+        switch (storage_) {
+            case STORAGE_FULL: full_ = Tensor<dtype>(shape); break;
+            case STORAGE_FLOAT16: half_ = Tensor<FLOAT16>(shape); break;
+            case STORAGE_INT8_ROWWISE:
+                int8_ = Tensor<INT8>(shape);
+                scales_.assign(rows, 0.0f);
+                break;
+        }
+    }
+
+    static WeightMatrix from_tensor(const Tensor<dtype>& src, WeightStorage storage) {
+        if (src.shape.size() != 2) {
+            throw std::runtime_error("WeightMatrix expects a 2-D tensor");
+        }
+        WeightMatrix m(src.shape[0], src.shape[1], storage);
+        std::vector<float> row(m.cols_);
+        for (int64_t r = 0; r < m.rows_; ++r) {
+            row_to_float<dtype>(src.data() + r * m.cols_, row.data(), m.cols_);
+            m.store_row(r, row.data());
+        }
+        return m;
+    }
+
+    int64_t rows() const { return rows_; }
+    int64_t cols() const { return cols_; }
+    WeightStorage storage() const { return storage_; }
+
+    size_t bytes() const {
+        switch (storage_) {
+            case STORAGE_FULL: return rows_ * cols_ * sizeof(T);
+            case STORAGE_FLOAT16: return rows_ * cols_ * sizeof(uint16_t);
+            default: return rows_ * cols_ * sizeof(int8_t) + scales_.size() * sizeof(float);
+        }
+    }
+
+    void load_row(int64_t r, float* dst) const {
+        switch (storage_) {
+            case STORAGE_FULL:
+                row_to_float<dtype>(full_.data() + r * cols_, dst, cols_);
+                break;
+            case STORAGE_FLOAT16:
+                row_to_float<FLOAT16>(half_.data() + r * cols_, dst, cols_);
+                break;
+            case STORAGE_INT8_ROWWISE:
+                dequantize_row_int8(int8_.data() + r * cols_, scales_[r], dst, cols_);
+                break;
+        }
+    }
+
+    // Writes row r in the layer dtype; a plain memcpy when nothing needs converting.
+    void copy_row(int64_t r, T* dst) const {
+        if (storage_ == STORAGE_FULL) {
+            std::memcpy(dst, full_.data() + r * cols_, cols_ * sizeof(T));
+            return;
+        }
+        if constexpr (dtype == FLOAT32) {
+            load_row(r, dst);
+        } else {
+            if constexpr (dtype == FLOAT16) {
+                if (storage_ == STORAGE_FLOAT16) {
+                    std::memcpy(dst, half_.data() + r * cols_, cols_ * sizeof(T));
+                    return;
+                }
+            }
+            static thread_local std::vector<float> row;
+            row.resize(cols_);
+            load_row(r, row.data());
+            row_from_float<dtype>(row.data(), dst, cols_);
+        }
+    }
+
+    void store_row(int64_t r, const float* src) {
+        switch (storage_) {
+            case STORAGE_FULL:
+                row_from_float<dtype>(src, full_.data() + r * cols_, cols_);
+                break;
+            case STORAGE_FLOAT16:
+                row_from_float<FLOAT16>(src, half_.data() + r * cols_, cols_);
+                break;
+            case STORAGE_INT8_ROWWISE:
+                scales_[r] = quantize_row_int8(src, int8_.data() + r * cols_, cols_);
+                break;
+        }
+    }
+
+    // Dense copy in the layer dtype (shares storage when already STORAGE_FULL).
+    Tensor<dtype> dense() const {
+        if (storage_ == STORAGE_FULL) {
+            return full_;
+        }
+        Tensor<dtype> out({static_cast<int>(rows_), static_cast<int>(cols_)});
+        for (int64_t r = 0; r < rows_; ++r) {
+            copy_row(r, out.data() + r * cols_);
+        }
+        return out;
+    }
+
+    // Only valid for STORAGE_FULL.
+    Tensor<dtype>& full() { return full_; }
+    const Tensor<dtype>& full() const { return full_; }
+
+    const uint16_t* half_data() const { return half_.data(); }
+    const int8_t* int8_data() const { return int8_.data(); }
+    const float* scales() const { return scales_.data(); }
+
+private:
+    int64_t rows_;
+    int64_t cols_;
+    WeightStorage storage_;
+    Tensor<dtype> full_;
+    Tensor<FLOAT16> half_;
+    Tensor<INT8> int8_;
+    std::vector<float> scales_;
+};
+
+#endif
@@ -1,47 +1,240 @@
 #ifndef RMS_NORM_H
 #define RMS_NORM_H
 
+#include "tensor.h"
+#include "simd.h"
+#include "thread_pool.h"
 #include <memory>
 #include <numeric>
 #include <cmath>
 #include <vector>
 
+// Llama RMSNorm: every row of the last axis is scaled by 1/rms(row) and a
+// learnable per-channel gain. Statistics are accumulated in fp32 for all dtypes.
 template<DType dtype>
 class RMSNorm {
+    using T = typename DTypeToType<dtype>::Type;
 public:
+    // The gain is sized (to ones) from the first input seen.
     RMSNorm(float epsilon, Device device = CPU);
+    RMSNorm(int dim, float epsilon, Device device = CPU);
 
     Tensor<dtype> forward(const Tensor<dtype>& input);
+    // residual += input, then normalizes the updated residual. Saves the extra
+    // pass that a separate add followed by a norm would make over the stream.
+    Tensor<dtype> forward_residual(Tensor<dtype>& residual, const Tensor<dtype>& input);
+    // Returns d(input) and accumulates d(weight) into weight().grad unless frozen.
     Tensor<dtype> backward(const Tensor<dtype>& grad_output);
 
+    // Row kernels over preallocated [rows, dim] buffers. inv_rms, when given,
+    // receives one value per row for backward_rows.
+    void forward_rows(const T* input, T* output, int64_t rows, float* inv_rms = nullptr) const;
+    void forward_residual_rows(T* residual, const T* input, T* output, int64_t rows,
+        float* inv_rms = nullptr) const;
+    void backward_rows(const T* grad_output, const T* input, const float* inv_rms, T* grad_input,
+        int64_t rows);
+
+    Tensor<dtype>& weight() { return weight_; }
+    int dim() const { return dim_; }
+    bool frozen() const { return frozen_; }
+    void set_frozen(bool frozen) { frozen_ = frozen; }
+
 private:
+    void ensure_dim(int dim);
+    void normalize_row(const float* x, T* out, float* inv_rms_out) const;
+
+    int dim_;
     float epsilon_;
     Device device_;
+    Tensor<dtype> weight_;
+    bool frozen_;
+
+    Tensor<dtype> saved_input_;
+    std::vector<float> saved_inv_rms_;
 };
 
 template<DType dtype>
 RMSNorm<dtype>::RMSNorm(float epsilon, Device device)
-: epsilon_(epsilon), device_(device) {}
+: dim_(0), epsilon_(epsilon), device_(device), frozen_(false) {}
 
 template<DType dtype>
-Tensor<dtype> RMSNorm<dtype>::forward(const Tensor<dtype>& input) { 
-    using T = typename DTypeToType<dtype>::Type;
+RMSNorm<dtype>::RMSNorm(int dim, float epsilon, Device device)
+: dim_(0), epsilon_(epsilon), device_(device), frozen_(false) {
+    ensure_dim(dim);
+}
+
+template<DType dtype>
+void RMSNorm<dtype>::ensure_dim(int dim) {
+    if (dim_ == dim) {
+        return;
+    }
+    if (dim_ != 0) {
+        throw std::runtime_error("RMSNorm: last dimension does not match the gain size");
+    }
+    dim_ = dim;
+    weight_ = Tensor<dtype>({dim});
+    for (int i = 0; i < dim; ++i) {
+        weight_.data()[i] = from_float<dtype>(1.0f);
+    }
+}
+
+template<DType dtype>
+void RMSNorm<dtype>::normalize_row(const float* x, T* out, float* inv_rms_out) const {
+    static thread_local std::vector<float> gain_scratch;
+    static thread_local std::vector<float> out_scratch;
+    const float* gain = float_row<dtype>(weight_.data(), gain_scratch, dim_);
+    float inv_rms = 1.0f / std::sqrt(simd_sum_squares(x, dim_) / dim_ + epsilon_);
+    if (inv_rms_out != nullptr) {
+        *inv_rms_out = inv_rms;
+    }
+    if constexpr (dtype == FLOAT32) {
+        simd_mul_scale(out, x, gain, inv_rms, dim_);
+    } else {
+        out_scratch.resize(dim_);
+        simd_mul_scale(out_scratch.data(), x, gain, inv_rms, dim_);
+        row_from_float<dtype>(out_scratch.data(), out, dim_);
+    }
+}
+
+template<DType dtype>
+void RMSNorm<dtype>::forward_rows(const T* input, T* output, int64_t rows, float* inv_rms) const {
+    const int64_t dim = dim_;
+    parallel_for(0, rows, [&](int64_t lo, int64_t hi) {
+        std::vector<float> scratch;
+        for (int64_t r = lo; r < hi; ++r) {
+            const float* x = float_row<dtype>(input + r * dim, scratch, dim);
+            normalize_row(x, output + r * dim, inv_rms ? inv_rms + r : nullptr);
+        }
+    }, std::max<int64_t>(1, 16384 / std::max<int64_t>(1, dim)));
+}
 
+template<DType dtype>
+void RMSNorm<dtype>::forward_residual_rows(T* residual, const T* input, T* output, int64_t rows,
+    float* inv_rms) const {
+    const int64_t dim = dim_;
+    parallel_for(0, rows, [&](int64_t lo, int64_t hi) {
+        for (int64_t r = lo; r < hi; ++r) {
+            T* res = residual + r * dim;
+            const T* in = input + r * dim;
+            if constexpr (dtype == FLOAT32) {
+                simd_add(res, in, dim);
+                normalize_row(res, output + r * dim, inv_rms ? inv_rms + r : nullptr);
+            } else {
+                static thread_local std::vector<float> sum;
+                sum.resize(dim);
+                for (int64_t j = 0; j < dim; ++j) {
+                    // round through the storage type so the saved residual and
+                    // the normalized value see the same numbers
+                    res[j] = from_float<dtype>(to_float<dtype>(res[j]) + to_float<dtype>(in[j]));
+                    sum[j] = to_float<dtype>(res[j]);
+                }
+                normalize_row(sum.data(), output + r * dim, inv_rms ? inv_rms + r : nullptr);
+            }
+        }
+    }, std::max<int64_t>(1, 16384 / std::max<int64_t>(1, dim)));
+}
+
+template<DType dtype>
+void RMSNorm<dtype>::backward_rows(const T* grad_output, const T* input, const float* inv_rms, T* grad_input,
+    int64_t rows) {
+    // y = g * x * r,  r = (mean(x^2) + eps)^-1/2
+    // dx = r * (g*dy) - x * r^3 / D * sum(g*dy*x),  dg = sum_rows(dy * x * r)
+    const int64_t dim = dim_;
+    if (!frozen_ && !weight_.grad) {
+        weight_.grad = std::make_shared<Tensor<dtype>>(weight_.shape);
+    }
+    std::vector<float> gain(dim);
+    row_to_float<dtype>(weight_.data(), gain.data(), dim);
+    // d gain partials per fixed block of rows, summed in block order below,
+    // so the result doesn't depend on the thread count or finishing order
+    const int64_t block = std::max<int64_t>(1, 16384 / std::max<int64_t>(1, dim));
+    const int64_t blocks = (rows + block - 1) / block;
+    std::vector<float> partials(frozen_ ? 0 : static_cast<size_t>(blocks) * dim, 0.0f);
+
+    parallel_for(0, blocks, [&](int64_t b_lo, int64_t b_hi) {
+        std::vector<float> x_scratch, dy_scratch;
+        std::vector<float> gdy(dim), dx(dim);
+        for (int64_t b = b_lo; b < b_hi; ++b) {
+            float* partial = frozen_ ? nullptr : partials.data() + b * dim;
+            for (int64_t r = b * block; r < std::min(rows, (b + 1) * block); ++r) {
+                const float* x = float_row<dtype>(input + r * dim, x_scratch, dim);
+                const float* dy = float_row<dtype>(grad_output + r * dim, dy_scratch, dim);
+                float rr = inv_rms[r];
+                for (int64_t j = 0; j < dim; ++j) {
+                    gdy[j] = gain[j] * dy[j];
+                }
+                if (partial != nullptr) {
+                    for (int64_t j = 0; j < dim; ++j) {
+                        partial[j] += dy[j] * x[j] * rr;
+                    }
+                }
+                float coeff = simd_dot(gdy.data(), x, dim) * rr * rr * rr / dim;
+                for (int64_t j = 0; j < dim; ++j) {
+                    dx[j] = rr * gdy[j] - coeff * x[j];
+                }
+                row_from_float<dtype>(dx.data(), grad_input + r * dim, dim);
+            }
+        }
+    });
+    if (frozen_) {
+        return;
+    }
+    std::vector<float> grad_weight(dim, 0.0f);
+    for (int64_t b = 0; b < blocks; ++b) {
+        simd_add(grad_weight.data(), partials.data() + b * dim, dim);
+    }
+
+    T* gw = weight_.grad->data();
+    for (int64_t j = 0; j < dim; ++j) {
+        gw[j] = from_float<dtype>(to_float<dtype>(gw[j]) + grad_weight[j]);
+    }
+}
+
+template<DType dtype>
+Tensor<dtype> RMSNorm<dtype>::forward(const Tensor<dtype>& input) { 
     std::vector<int> shape = input.get_shape();
-    int num_elements = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int>());
+    if (shape.empty()) {
+        throw std::runtime_error("RMSNorm: input must have at least one dimension");
+    }
+    ensure_dim(shape.back());
+    int64_t rows = input.size() / dim_;
 
     Tensor<dtype> normed_tensor(shape);
-    T mean_square = 0;
-    for (int i = 0; i < num_elements; ++i) {
-        mean_square += input.data()[i] * input.data()[i];
-    }
-    mean_square /= num_elements;
-    T rms = std::sqrt(mean_square + epsilon_);
-    for (int i = 0; i < num_elements; ++i) {
-        normed_tensor.data()[i] = input.data()[i] / rms;
+    normed_tensor.change_device(device_);
+    saved_inv_rms_.resize(rows);
+    forward_rows(input.data(), normed_tensor.data(), rows, saved_inv_rms_.data());
+    saved_input_ = input;
+    return normed_tensor;
+}
+
+template<DType dtype>
+Tensor<dtype> RMSNorm<dtype>::forward_residual(Tensor<dtype>& residual, const Tensor<dtype>& input) {
+    if (residual.shape != input.shape) {
+        throw std::runtime_error("RMSNorm: residual and input shapes do not match");
     }
+    ensure_dim(input.shape.back());
+    int64_t rows = input.size() / dim_;
 
+    Tensor<dtype> normed_tensor(input.shape);
+    normed_tensor.change_device(device_);
+    saved_inv_rms_.resize(rows);
+    forward_residual_rows(residual.data(), input.data(), normed_tensor.data(), rows, saved_inv_rms_.data());
+
+    // the residual keeps being updated in place downstream, so backward needs its own copy
+    saved_input_ = Tensor<dtype>(residual.shape);
+    std::memcpy(saved_input_.data(), residual.data(), residual.size() * sizeof(T));
     return normed_tensor;
 }
 
+template<DType dtype>
+Tensor<dtype> RMSNorm<dtype>::backward(const Tensor<dtype>& grad_output) {
+    if (saved_input_.data() == nullptr || grad_output.shape != saved_input_.shape) {
+        throw std::runtime_error("RMSNorm: backward called without a matching forward");
+    }
+    int64_t rows = grad_output.size() / dim_;
+    Tensor<dtype> grad_input(grad_output.shape);
+    backward_rows(grad_output.data(), saved_input_.data(), saved_inv_rms_.data(), grad_input.data(), rows);
+    return grad_input;
+}
+
 #endif
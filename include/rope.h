@@ -0,0 +1,187 @@
+#ifndef ROPE_H
+#define ROPE_H
+
+#include "tensor.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Rotary position embedding tables. Pair (2i, 2i+1) of a head is rotated by
+// pos * base^(-2i / head_dim). Rows are stored expanded to head_dim floats in
+// the layout simd_rotate_pairs expects, so applying RoPE is one fused
+// multiply-add pass per head.
+struct RopeTable {
+    int head_dim;
+    int max_pos;
+    float base;
+    std::vector<float> cos;     // [max_pos, head_dim]
+    std::vector<float> sin;     // [max_pos, head_dim], negated on even lanes
+    std::vector<float> inv_sin; // the same for the inverse rotation (-pos)
+
+    RopeTable(int head_dim, int max_pos, float base);
+
+    // Throws unless positions [first, first + count) are all in the table.
+    // rotate/rotate_span run inside parallel regions and don't check, so
+    // callers check once before entering one.
+    void check_positions(int first, int count = 1) const {
+        if (first < 0 || count < 0 || first > max_pos - count) {
+            throw std::out_of_range("RoPE: position outside the precomputed table");
+        }
+    }
+    void check_positions(const int* positions, int64_t count) const {
+        for (int64_t i = 0; i < count; ++i) {
+            check_positions(positions[i]);
+        }
+    }
+
+    // Rotates elements [offset, offset + count) of one head, for epilogues
+    // that see a head in column blocks. offset and count must be even.
+    void rotate_span(float* x, int pos, int offset, int count, bool inverse = false) const {
+        const int64_t at = static_cast<int64_t>(pos) * head_dim + offset;
+        simd_rotate_pairs(x, cos.data() + at, (inverse ? inv_sin.data() : sin.data()) + at, count);
+    }
+
+    // Rotates `heads` consecutive head rows in place to position pos, or back
+    // from it when inverse is set (the transpose, used by backward and re-basing).
+    void rotate(float* x, int heads, int pos, bool inverse = false) const {
+        const float* c = cos.data() + static_cast<int64_t>(pos) * head_dim;
+        const float* s = (inverse ? inv_sin.data() : sin.data()) + static_cast<int64_t>(pos) * head_dim;
+        for (int h = 0; h < heads; ++h) {
+            simd_rotate_pairs(x + static_cast<int64_t>(h) * head_dim, c, s, head_dim);
+        }
+    }
+};
+
+inline RopeTable::RopeTable(int head_dim, int max_pos, float base)
+  : head_dim(head_dim), max_pos(max_pos), base(base) {
+    if (head_dim <= 0 || head_dim % 2 != 0 || max_pos <= 0) {
+        throw std::invalid_argument("RoPE: head_dim must be even and max_pos positive");
+    }
+    const size_t n = static_cast<size_t>(max_pos) * head_dim;
+    cos.resize(n);
+    sin.resize(n);
+    inv_sin.resize(n);
+    for (int pos = 0; pos < max_pos; ++pos) {
+        for (int i = 0; i < head_dim / 2; ++i) {
+            // angles in double: pos * theta gets large for long contexts
+            double angle = pos * std::pow(static_cast<double>(base), -2.0 * i / head_dim);
+            float c = static_cast<float>(std::cos(angle)), s = static_cast<float>(std::sin(angle));
+            size_t at = static_cast<size_t>(pos) * head_dim + 2 * i;
+            cos[at] = cos[at + 1] = c;
+            sin[at] = -s;
+            sin[at + 1] = s;
+            inv_sin[at] = s;
+            inv_sin[at + 1] = -s;
+        }
+    }
+}
+
+// Process-wide table cache keyed by (head_dim, base). A request for more
+// positions than the cached table holds rebuilds it larger; tables are shared,
+// so callers holding the old one keep a valid copy.
+inline std::shared_ptr<const RopeTable> rope_table(int head_dim, int max_pos, float base = 10000.0f) {
+    static std::mutex mutex;
+    static std::map<std::pair<int, float>, std::shared_ptr<const RopeTable>> tables;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& entry = tables[{head_dim, base}];
+    if (!entry || entry->max_pos < max_pos) {
+        entry = std::make_shared<const RopeTable>(head_dim, max_pos, base);
+    }
+    return entry;
+}
+
+// Applies RoPE in place to query or key activations laid out as
+// [B, T, H, Dh] (or [N, H, Dh]). Positions are given per token, so packed
+// batches and cached decode steps (where the token sits at position
+// cache.length() - 1) use the same entry point.
+template<DType dtype>
+class RoPE {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    RoPE(int head_dim, int max_pos, float base = 10000.0f, Device device = CPU);
+
+    // x: [B, T, H, Dh]; positions: B * T ids, or empty for 0..T-1 in every row.
+    void forward(Tensor<dtype>& x, const std::vector<int>& positions = {}) const;
+    // The rotation is orthogonal, so backward rotates the gradient back in place.
+    void backward(Tensor<dtype>& grad, const std::vector<int>& positions = {}) const;
+
+    // x: `tokens` rows of [heads, head_dim]; positions has one id per token.
+    void apply_rows(T* x, const int* positions, int64_t tokens, int heads, bool inverse = false) const;
+    // Single fp32 row of [heads, head_dim], for projection epilogues that
+    // still hold their output in fp32 registers/scratch.
+    void apply_float_row(float* x, int heads, int pos, bool inverse = false) const {
+        table_->check_positions(pos);
+        table_->rotate(x, heads, pos, inverse);
+    }
+
+    const RopeTable& table() const { return *table_; }
+
+private:
+    void apply(Tensor<dtype>& x, const std::vector<int>& positions, bool inverse) const;
+
+    int head_dim_;
+    Device device_;
+    std::shared_ptr<const RopeTable> table_;
+};
+
+template<DType dtype>
+RoPE<dtype>::RoPE(int head_dim, int max_pos, float base, Device device)
+  : head_dim_(head_dim), device_(device), table_(rope_table(head_dim, max_pos, base)) {}
+
+template<DType dtype>
+void RoPE<dtype>::apply_rows(T* x, const int* positions, int64_t tokens, int heads, bool inverse) const {
+    const int64_t row = static_cast<int64_t>(heads) * head_dim_;
+    table_->check_positions(positions, tokens);
+    parallel_for(0, tokens, [&](int64_t lo, int64_t hi) {
+        std::vector<float> scratch(dtype == FLOAT32 ? 0 : row);
+        for (int64_t t = lo; t < hi; ++t) {
+            if constexpr (dtype == FLOAT32) {
+                table_->rotate(x + t * row, heads, positions[t], inverse);
+            } else {
+                row_to_float<dtype>(x + t * row, scratch.data(), row);
+                table_->rotate(scratch.data(), heads, positions[t], inverse);
+                row_from_float<dtype>(scratch.data(), x + t * row, row);
+            }
+        }
+    }, std::max<int64_t>(1, 16384 / std::max<int64_t>(1, row)));
+}
+
+template<DType dtype>
+void RoPE<dtype>::apply(Tensor<dtype>& x, const std::vector<int>& positions, bool inverse) const {
+    if (x.shape.size() < 3 || x.shape.back() != head_dim_) {
+        throw std::runtime_error("RoPE expects [..., seq, heads, head_dim] activations");
+    }
+    const int heads = x.shape[x.shape.size() - 2];
+    const int64_t tokens = x.size() / (static_cast<int64_t>(heads) * head_dim_);
+    if (!positions.empty()) {
+        if (static_cast<int64_t>(positions.size()) != tokens) {
+            throw std::invalid_argument("RoPE: expected one position id per token");
+        }
+        apply_rows(x.data(), positions.data(), tokens, heads, inverse);
+        return;
+    }
+    const int seq_len = x.shape[x.shape.size() - 3];
+    std::vector<int> ids(tokens);
+    for (int64_t t = 0; t < tokens; ++t) {
+        ids[t] = static_cast<int>(t % seq_len);
+    }
+    apply_rows(x.data(), ids.data(), tokens, heads, inverse);
+}
+
+template<DType dtype>
+void RoPE<dtype>::forward(Tensor<dtype>& x, const std::vector<int>& positions) const {
+    apply(x, positions, false);
+}
+
+template<DType dtype>
+void RoPE<dtype>::backward(Tensor<dtype>& grad, const std::vector<int>& positions) const {
+    apply(grad, positions, true);
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "tensor.h"
+#include "thread_pool.h"
+#include <cstdint>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct SamplingConfig {
+    float temperature = 1.0f;         // <= 0: greedy
+    int top_k = 0;                    // 0: no limit
+    float top_p = 1.0f;               // nucleus mass, applied after top_k
+    float repetition_penalty = 1.0f;  // seen tokens: positive logits / p, negative * p
+    float frequency_penalty = 0.0f;   // minus count * penalty
+    float presence_penalty = 0.0f;    // minus penalty once a token has been seen
+};
+
+// Next-token sampler for a [batch, vocab] logits tensor, one row per
+// sequence, rows in parallel. A step touches the full vocabulary only in
+// linear passes: penalties go to the tokens a sequence has seen (kept as a
+// sparse count table), top-k is a size-k heap selection, and the softmax is
+// one fused exp-and-sum pass. Top-p never sorts the vocabulary: tokens whose
+// probability is below (1 - p) / vocab are left out up front (together they
+// hold less than 1 - p of the mass, so the nucleus never reaches them), and
+// the nucleus cutoff among the rest is found by a mass-weighted quickselect,
+// linear in the candidates however flat the distribution is.
+//
+// Every sequence owns a seeded RNG stream, so its tokens depend on its seed
+// and logits only, not on the batch it was sampled in.
+class Sampler {
+public:
+    explicit Sampler(int vocab_size, SamplingConfig config = {});
+
+    void start_sequence(int seq, uint64_t seed);
+    void end_sequence(int seq);
+    // Counts tokens for the penalties, e.g. the prompt; sampled tokens are counted automatically.
+    void observe(int seq, const uint32_t* tokens, int64_t n);
+
+    // logits: [seqs.size(), vocab]; writes one token per sequence
+    template<DType dtype>
+    void sample(const Tensor<dtype>& logits, const std::vector<int>& seqs, uint32_t* tokens);
+    // fp32 rows, overwritten with scratch values
+    void sample_rows(float* logits, const std::vector<int>& seqs, uint32_t* tokens);
+
+    const SamplingConfig& config() const { return config_; }
+    void set_config(const SamplingConfig& config) { config_ = config; }
+    int vocab_size() const { return vocab_size_; }
+
+private:
+    struct SequenceState {
+        std::mt19937_64 rng;
+        std::unordered_map<uint32_t, int> counts;
+    };
+
+    uint32_t sample_row(float* logits, SequenceState& state) const;
+    SequenceState& state(int seq);
+
+    int vocab_size_;
+    SamplingConfig config_;
+    std::unordered_map<int, SequenceState> sequences_;
+};
+
+template<DType dtype>
+void Sampler::sample(const Tensor<dtype>& logits, const std::vector<int>& seqs, uint32_t* tokens) {
+    if (logits.size() != static_cast<int>(seqs.size()) * vocab_size_) {
+        throw std::invalid_argument("Sampler: logits must be [seqs, vocab]");
+    }
+    static thread_local std::vector<float> rows;
+    rows.resize(static_cast<size_t>(logits.size()));
+    row_to_float<dtype>(logits.data(), rows.data(), logits.size());
+    sample_rows(rows.data(), seqs, tokens);
+}
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cmath>
+#include <cstdint>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Small fp32 vector primitives shared by the CPU kernels. The AVX2/FMA path is
+// picked at compile time; the scalar loops are written so the compiler can
+// still vectorize them on other targets.
+
+#ifdef __AVX2__
+inline float simd_hsum(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    __m128 shuf = _mm_movehdup_ps(lo);
+    __m128 sums = _mm_add_ps(lo, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+#endif
+
+inline float simd_dot(const float* a, const float* b, int64_t n) {
+    int64_t i = 0;
+    float acc = 0.0f;
+#ifdef __AVX2__
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    acc = simd_hsum(_mm256_add_ps(acc0, acc1));
+#endif
+    for (; i < n; ++i) {
+        acc += a[i] * b[i];
+    }
+    return acc;
+}
+
+// out[i * ldo + j] = dot(a_i, b_j) for a 4x3 block of rows. Each loaded
+// vector feeds three or four FMAs, and the 12 accumulators plus the loaded
+// operands exactly fill the 16 AVX2 registers.
+inline void simd_dot_4x3(const float* a, int64_t lda, const float* b, int64_t ldb, int64_t n,
+    float* out, int64_t ldo) {
+    int64_t k = 0;
+    float acc[4][3] = {};
+#ifdef __AVX2__
+    __m256 c[4][3];
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            c[i][j] = _mm256_setzero_ps();
+        }
+    }
+    for (; k + 8 <= n; k += 8) {
+        __m256 vb[3];
+        for (int j = 0; j < 3; ++j) {
+            vb[j] = _mm256_loadu_ps(b + j * ldb + k);
+        }
+        for (int i = 0; i < 4; ++i) {
+            __m256 va = _mm256_loadu_ps(a + i * lda + k);
+            for (int j = 0; j < 3; ++j) {
+                c[i][j] = _mm256_fmadd_ps(va, vb[j], c[i][j]);
+            }
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            acc[i][j] = simd_hsum(c[i][j]);
+        }
+    }
+#endif
+    for (; k < n; ++k) {
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                acc[i][j] += a[i * lda + k] * b[j * ldb + k];
+            }
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            out[i * ldo + j] = acc[i][j];
+        }
+    }
+}
+
+inline float simd_sum_squares(const float* a, int64_t n) {
+    return simd_dot(a, a, n);
+}
+
+// y += alpha * x
+inline void simd_axpy(float* y, const float* x, float alpha, int64_t n) {
+    int64_t i = 0;
+#ifdef __AVX2__
+    __m256 va = _mm256_set1_ps(alpha);
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] += alpha * x[i];
+    }
+}
+
+// y = x * w * scale
+inline void simd_mul_scale(float* y, const float* x, const float* w, float scale, int64_t n) {
+    int64_t i = 0;
+#ifdef __AVX2__
+    __m256 vs = _mm256_set1_ps(scale);
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(w + i));
+        _mm256_storeu_ps(y + i, _mm256_mul_ps(v, vs));
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] = x[i] * w[i] * scale;
+    }
+}
+
+// y += x
+inline void simd_add(float* y, const float* x, int64_t n) {
+    int64_t i = 0;
+#ifdef __AVX2__
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_loadu_ps(y + i), _mm256_loadu_ps(x + i)));
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] += x[i];
+    }
+}
+
+// y *= alpha
+inline void simd_scale(float* y, float alpha, int64_t n) {
+    int64_t i = 0;
+#ifdef __AVX2__
+    __m256 va = _mm256_set1_ps(alpha);
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_mul_ps(_mm256_loadu_ps(y + i), va));
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] *= alpha;
+    }
+}
+
+// Rotates interleaved pairs: (x0, x1) -> (x0*c - x1*s, x0*s + x1*c). cos and
+// sin are expanded per element, with sin already negated on even lanes, so
+// y = x * cos + swap_pairs(x) * sin.
+inline void simd_rotate_pairs(float* x, const float* cos, const float* sin, int64_t n) {
+    int64_t i = 0;
+#ifdef __AVX2__
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(x + i);
+        __m256 swapped = _mm256_permute_ps(v, 0xB1);
+        __m256 out = _mm256_mul_ps(v, _mm256_loadu_ps(cos + i));
+        _mm256_storeu_ps(x + i, _mm256_fmadd_ps(swapped, _mm256_loadu_ps(sin + i), out));
+    }
+#endif
+    for (; i + 2 <= n; i += 2) {
+        float x0 = x[i], x1 = x[i + 1];
+        x[i] = x0 * cos[i] + x1 * sin[i];
+        x[i + 1] = x1 * cos[i + 1] + x0 * sin[i + 1];
+    }
+}
+
+inline float simd_max(const float* a, int64_t n) {
+    float m = a[0];
+    int64_t i = 0;
+#ifdef __AVX2__
+    if (n >= 8) {
+        __m256 vm = _mm256_loadu_ps(a);
+        for (i = 8; i + 8 <= n; i += 8) {
+            vm = _mm256_max_ps(vm, _mm256_loadu_ps(a + i));
+        }
+        float lanes[8];
+        _mm256_storeu_ps(lanes, vm);
+        for (float lane : lanes) {
+            m = lane > m ? lane : m;
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        m = a[i] > m ? a[i] : m;
+    }
+    return m;
+}
+
+#ifdef __AVX2__
+// e^x, Cephes expf: x = n ln2 + r, a degree-6 polynomial for e^r and 2^n
+// built in the exponent bits. Inputs are clamped to about [-88.4, 88.4].
+inline __m256 simd_exp_ps(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-88.3762626647949f)), _mm256_set1_ps(88.3762626647949f));
+    __m256 fx = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504088896341f), _mm256_set1_ps(0.5f)));
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), x);
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_add_ps(_mm256_fmadd_ps(y, _mm256_mul_ps(x, x), x), _mm256_set1_ps(1.0f));
+    __m256i n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(n));
+}
+#endif
+
+// x[i] = e^((x[i] - shift) * scale); returns the sum. With shift = max(x)
+// this is the numerator pass of a softmax at temperature 1 / scale.
+inline float simd_exp_sum(float* x, float shift, float scale, int64_t n) {
+    float sum = 0.0f;
+    int64_t i = 0;
+#ifdef __AVX2__
+    __m256 vs = _mm256_set1_ps(shift), vk = _mm256_set1_ps(scale), acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        __m256 e = simd_exp_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), vs), vk));
+        _mm256_storeu_ps(x + i, e);
+        acc = _mm256_add_ps(acc, e);
+    }
+    sum = simd_hsum(acc);
+#endif
+    for (; i < n; ++i) {
+        x[i] = std::exp((x[i] - shift) * scale);
+        sum += x[i];
+    }
+    return sum;
+}
+
+#endif
@@ -10,6 +10,7 @@
 #include <variant>
 #include <numeric> 
 #include <stdexcept>
+#include <cstring>
 #include <cuda_runtime.h>
 
 typedef enum {
@@ -26,6 +27,18 @@ typedef enum{
   CPU
 } Device;
 
+// Which op produced a tensor, so autograd can find its backward formula.
+typedef enum {
+    OP_NONE,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_MATMUL,
+    OP_GET_SLICE,
+    OP_HSTACK,
+    OP_VSTACK
+} OpType;
+
 template<DType dtype>
 struct DTypeToType;
 
@@ -46,6 +59,111 @@ struct DTypeToType<UINT8> { using Type = uint8_t; };
 
 template<>
 struct DTypeToType<UINT32> { using Type = uint32_t; };
+
+// FLOAT16 is stored as raw IEEE half bits; kernels widen to float to do math.
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0) {
+        if (mant == 0) {
+            bits = sign;
+        } else {
+            // subnormal half -> normal float
+            exp = 127 - 15 + 1;
+            while ((mant & 0x400) == 0) {
+                mant <<= 1;
+                --exp;
+            }
+            mant &= 0x3ff;
+            bits = sign | (exp << 23) | (mant << 13);
+        }
+    } else if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else {
+        bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+inline uint16_t float_to_half(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    int32_t exp = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = bits & 0x7fffff;
+    if (((bits >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    }
+    if (exp >= 0x1f) {
+        return sign | 0x7c00;
+    }
+    if (exp <= 0) {
+        if (exp < -10) {
+            return sign;
+        }
+        mant |= 0x800000;
+        uint32_t shift = static_cast<uint32_t>(14 - exp);
+        uint32_t half_mant = mant >> shift;
+        uint32_t round = (mant >> (shift - 1)) & 1;
+        uint32_t sticky = (mant & ((1u << (shift - 1)) - 1)) != 0;
+        half_mant += round & (sticky | (half_mant & 1));
+        return sign | static_cast<uint16_t>(half_mant);
+    }
+    uint16_t half = sign | static_cast<uint16_t>(exp << 10) | static_cast<uint16_t>(mant >> 13);
+    // round to nearest even; a carry into the exponent is the correct result
+    if ((mant & 0x1000) && (mant & 0x2fff)) {
+        ++half;
+    }
+    return half;
+}
+
+template<DType dtype>
+inline float to_float(typename DTypeToType<dtype>::Type v) {
+    if constexpr (dtype == FLOAT16) {
+        return half_to_float(v);
+    } else {
+        return static_cast<float>(v);
+    }
+}
+
+template<DType dtype>
+inline typename DTypeToType<dtype>::Type from_float(float v) {
+    if constexpr (dtype == FLOAT16) {
+        return float_to_half(v);
+    } else {
+        return static_cast<typename DTypeToType<dtype>::Type>(v);
+    }
+}
+
+template<DType dtype>
+inline void row_to_float(const typename DTypeToType<dtype>::Type* src, float* dst, int64_t n) {
+    for (int64_t i = 0; i < n; ++i) {
+        dst[i] = to_float<dtype>(src[i]);
+    }
+}
+
+template<DType dtype>
+inline void row_from_float(const float* src, typename DTypeToType<dtype>::Type* dst, int64_t n) {
+    for (int64_t i = 0; i < n; ++i) {
+        dst[i] = from_float<dtype>(src[i]);
+    }
+}
+
+// Returns the row itself for FLOAT32 data, otherwise widens it into scratch.
+template<DType dtype>
+inline const float* float_row(const typename DTypeToType<dtype>::Type* src, std::vector<float>& scratch, int64_t n) {
+    if constexpr (dtype == FLOAT32) {
+        return src;
+    } else {
+        scratch.resize(n);
+        row_to_float<dtype>(src, scratch.data(), n);
+        return scratch.data();
+    }
+}
   
 
 
@@ -65,6 +183,8 @@ using TensorVariant = std::variant<
 extern size_t get_dtype_size(DType dtype);
 extern void* allocate_memory(DType dtype, size_t num_elements);
 extern void deallocate_memory(void* ptr);
+// Number of allocate_memory calls so far; lets tests assert a hot path allocates nothing.
+extern size_t allocation_count();
 
 template <DType dtype>
 class Tensor : public std::enable_shared_from_this<Tensor<dtype>> {
@@ -84,7 +204,7 @@ public:
 
     Tensor(const std::vector<int>& shape) : type(dtype), shape(shape), tens_device(CPU) {
         int num_elems = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int>());
-        data_ = static_cast<T*>(allocate_memory(dtype, num_elems * sizeof(T)));
+        data_ = static_cast<T*>(allocate_memory(dtype, num_elems));
         for (int i = 0; i < num_elems; ++i) {
             data_[i] = 0;
         }
@@ -137,14 +257,17 @@ public:
     std::shared_ptr<const Tensor<new_dtype>> change_dtype() const {
         auto new_tensor = std::make_shared<Tensor<new_dtype>>(shape);
         int num_elems = std::accumulate(shape.begin(), shape.end(), 1, std::multiplies<int>());
-         
-        typename DTypeToType<new_dtype>::Type* new_data = new typename DTypeToType<new_dtype>::Type[num_elems];
- 
+        typename DTypeToType<new_dtype>::Type* new_data = new_tensor->data();
+
         for (int i = 0; i < num_elems; ++i) {
-            new_data[i] = static_cast<typename DTypeToType<new_dtype>::Type>(data_[i]);
+            // FLOAT16 holds raw half bits, so it has to go through a real conversion
+            if constexpr (dtype == FLOAT16 || new_dtype == FLOAT16) {
+                new_data[i] = from_float<new_dtype>(to_float<dtype>(data_[i]));
+            } else {
+                new_data[i] = static_cast<typename DTypeToType<new_dtype>::Type>(data_[i]);
+            }
         }
 
-        new_tensor->data_set(new_data);
         new_tensor->set_children(this->children);
         return new_tensor;
     }
@@ -192,11 +315,14 @@ public:
     std::vector<int> shape;
     DType type;
     std::shared_ptr<Tensor> grad;
+    // set by the op that produced this tensor; children are its inputs
+    OpType op_type = OP_NONE;
+    std::vector<int> op_args;
 
 private:
     Device tens_device;
     template <typename Op>
-    Tensor<dtype> tensorOperation(const TensorVariant& rhs, Op op) const;
+    Tensor<dtype> tensorOperation(const TensorVariant& rhs, Op op, OpType op_type) const;
     T* data_;  
     std::vector<TensorVariant> children;
 
@@ -0,0 +1,70 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+
+// Persistent worker pool shared by the CPU kernels. Work is split statically:
+// for a given range, worker i always gets the same chunk, so pages first touched
+// by worker i in an init pass are the ones it reads back in later passes.
+class ThreadPool {
+public:
+    static ThreadPool& instance();
+
+    explicit ThreadPool(size_t num_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // An exception thrown by fn on a worker is rethrown here, on the calling
+    // thread, once every chunk has finished (the first one if several throw).
+    void parallel_for(int64_t begin, int64_t end, const std::function<void(int64_t, int64_t)>& fn,
+        int64_t grain = 1);
+
+    // Runs fn(worker_index) once on every worker; exceptions as for parallel_for.
+    void run_on_workers(const std::function<void(size_t)>& fn);
+
+    // Pins worker i to the i-th cpu of the node-ordered cpu list, so consecutive
+    // workers (and therefore consecutive chunks of a range) share a NUMA node.
+    void pin_to_numa_nodes();
+    void unpin();
+    bool is_pinned() const { return pinned_; }
+
+    size_t num_threads() const { return workers_.size(); }
+    // NUMA node the given worker is pinned to, or -1 when unpinned.
+    int worker_node(size_t worker) const;
+
+    // Index of the calling worker, or -1 when called from outside the pool.
+    static int current_worker();
+
+private:
+    void worker_loop(size_t index);
+    void dispatch(const std::function<void(size_t)>& task);
+
+    std::vector<std::thread> workers_;
+    std::vector<int> worker_nodes_;
+    std::mutex mutex_;
+    std::mutex dispatch_mutex_;
+    std::condition_variable cv_;
+    std::condition_variable done_cv_;
+    std::function<void(size_t)> task_;
+    std::exception_ptr error_;
+    uint64_t generation_;
+    size_t pending_;
+    bool stop_;
+    bool pinned_;
+};
+
+template<typename F>
+inline void parallel_for(int64_t begin, int64_t end, F&& fn, int64_t grain = 1) {
+    ThreadPool::instance().parallel_for(begin, end, std::forward<F>(fn), grain);
+}
+
+#endif
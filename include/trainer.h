@@ -0,0 +1,287 @@
+#ifndef TRAINER_H
+#define TRAINER_H
+
+#include "checkpoint.h"
+#include "cross_entropy.h"
+#include "optimizer.h"
+#include <future>
+#include <unordered_map>
+#include <vector>
+
+struct TrainerConfig {
+    int micro_batch = 4;         // sequences per forward/backward
+    int seq_len = 64;
+    int accumulation_steps = 1;  // micro-batches per optimizer step
+    bool prefetch = true;        // assemble the next micro-batch while this one runs
+    CheckpointPolicy checkpoint;
+};
+
+// Language-model training loop over a token stream. One step is a logical
+// batch of micro_batch * accumulation_steps sequences, run as
+// accumulation_steps forward/backward passes of micro_batch sequences each:
+// weight gradients accumulate in place in the parameters' .grad, embedding
+// gradients in one sparse row table, and the optimizer runs once at the end.
+// Activation memory is that of one micro-batch, whatever the logical batch:
+// the micro-batch's forward/backward, decoder included, is described to a
+// MemoryPlanner once and every activation is a view into its slab.
+//
+// Source is a Dataloader or anything else with get_next_batch_uint32(); its
+// batches are treated as one contiguous stream and cut into windows of
+// seq_len + 1 tokens that overlap by one (inputs and shifted targets). Fetched
+// batches are owned, and freed, by the trainer. With prefetch the next window
+// is cut on another thread while the current one computes.
+//
+// The embedding rows take the same step as the dense parameters (the
+// optimizer's kind, hyper-parameters and current learning rate), from the
+// fp32 accumulator, and count towards its clipping norm. fp16 models step
+// through a LossScaler; a step with an overflow anywhere, embeddings included,
+// is skipped whole. A model with LoRA attached trains its adapters only; the
+// embeddings stay frozen.
+template<DType dtype, typename Source>
+class Trainer {
+    using T = typename DTypeToType<dtype>::Type;
+public:
+    Trainer(LlamaModel<dtype>& model, Source& source, const OptimizerConfig& optimizer, TrainerConfig config = {});
+    ~Trainer();
+
+    // One logical batch. Returns false, without stepping, once the source
+    // cannot fill it; loss is the mean cross-entropy over the batch's tokens
+    // (MoE balancing losses are trained on but not included).
+    bool step(float& loss);
+
+    int64_t steps() const { return steps_; }
+    int64_t tokens_per_step() const {
+        return static_cast<int64_t>(config_.micro_batch) * config_.seq_len * config_.accumulation_steps;
+    }
+    // largest activation footprint of a micro-batch so far: the planned slab
+    // and the loss workspace
+    size_t peak_activation_bytes() const { return peak_activation_bytes_; }
+    const MemoryPlanner& memory_plan() const { return planner_; }
+    Optimizer<dtype>& optimizer() { return optimizer_; }
+    LossScaler& scaler() { return scaler_; }
+
+private:
+    struct MicroBatch {
+        std::vector<uint32_t> ids, targets;
+    };
+
+    void plan_activations();
+    bool fetch(MicroBatch& batch);
+    float forward_backward(const MicroBatch& batch, float grad_scale);
+    void accumulate_embedding_grad(const SparseRowGrad<dtype>& grad);
+    double embedding_sum_squares() const;
+    // grad_scale: what the optimizer's step multiplied its gradients by
+    void update_embeddings(float grad_scale);
+    void clear_embedding_grad() {
+        embedding_slot_.clear();
+        embedding_rows_.clear();
+        embedding_grad_.clear();
+    }
+
+    LlamaModel<dtype>& model_;
+    Source& source_;
+    TrainerConfig config_;
+    CheckpointedDecoder<dtype> decoder_;
+    ChunkedCrossEntropy<dtype> head_loss_;
+    Optimizer<dtype> optimizer_;
+    LossScaler scaler_;
+    int64_t steps_;
+    size_t peak_activation_bytes_;
+
+    std::vector<uint32_t> stream_;  // fetched tokens not cut into a window yet
+    size_t stream_pos_;
+    bool exhausted_;
+    MicroBatch current_, next_;
+    std::future<bool> pending_;
+
+    // [micro_batch * seq_len, width], all views into slab_
+    MemoryPlanner planner_;
+    void* slab_;
+    Tensor<dtype> x_, h_, normed_, grad_normed_, grad_h_, grad_x_;
+    Tensor<FLOAT32> inv_rms_;
+    std::unordered_map<uint32_t, int64_t> embedding_slot_;
+    std::vector<uint32_t> embedding_rows_;
+    std::vector<float> embedding_grad_;
+};
+
+template<DType dtype, typename Source>
+Trainer<dtype, Source>::Trainer(LlamaModel<dtype>& model, Source& source, const OptimizerConfig& optimizer,
+    TrainerConfig config)
+  : model_(model), source_(source), config_(config), decoder_(model.blocks(), model.config(), config.checkpoint),
+    head_loss_(model.lm_head()), optimizer_(optimizer), steps_(0),
+    peak_activation_bytes_(0), stream_pos_(0), exhausted_(false), slab_(nullptr) {
+    if (config.micro_batch <= 0 || config.seq_len <= 0 || config.accumulation_steps <= 0) {
+        throw std::invalid_argument("Trainer: batch sizes must be positive");
+    }
+    if (config.seq_len > model.config().max_seq) {
+        throw std::invalid_argument("Trainer: seq_len exceeds the model's max_seq");
+    }
+    for (Tensor<dtype>* p : model.parameters()) {
+        optimizer_.add_parameter(*p);
+    }
+    plan_activations();
+}
+
+template<DType dtype, typename Source>
+Trainer<dtype, Source>::~Trainer() {
+    if (pending_.valid()) {
+        pending_.wait();
+    }
+    deallocate_memory(slab_);
+}
+
+template<DType dtype, typename Source>
+void Trainer<dtype, Source>::plan_activations() {
+    const int64_t rows = static_cast<int64_t>(config_.micro_batch) * config_.seq_len, dim = model_.config().dim;
+    auto add = [&]() { return planner_.add_tensor(rows * dim * sizeof(T)); };
+    int x = add(), h = add(), normed = add(), grad_normed = add(), grad_h = add(), grad_x = add();
+    int inv_rms = planner_.add_tensor(rows * sizeof(float));
+
+    // the op sequence of forward_backward()
+    planner_.add_op({}, {x});
+    decoder_.describe(planner_, config_.micro_batch, config_.seq_len, x, h, [&] {
+        planner_.add_op({h}, {normed, inv_rms});
+        planner_.add_op({normed}, {grad_normed});
+        planner_.add_op({grad_normed, h, inv_rms}, {grad_h});
+    }, grad_h, grad_x);
+    planner_.add_op({grad_x}, {});
+    planner_.plan();
+
+    slab_ = planner_.allocate_slab();
+    auto view = [&](int id) {
+        return planner_.view<dtype>(slab_, id, {static_cast<int>(rows), static_cast<int>(dim)});
+    };
+    x_ = view(x);
+    h_ = view(h);
+    normed_ = view(normed);
+    grad_normed_ = view(grad_normed);
+    grad_h_ = view(grad_h);
+    grad_x_ = view(grad_x);
+    inv_rms_ = planner_.view<FLOAT32>(slab_, inv_rms, {static_cast<int>(rows), 1});
+    decoder_.bind(planner_, slab_);
+}
+
+template<DType dtype, typename Source>
+bool Trainer<dtype, Source>::fetch(MicroBatch& batch) {
+    const int64_t seq = config_.seq_len, rows = static_cast<int64_t>(config_.micro_batch) * seq;
+    // micro_batch windows of seq + 1 tokens, each sharing its last token with the next
+    while (!exhausted_ && stream_.size() - stream_pos_ < static_cast<size_t>(rows + 1)) {
+        Tensor<UINT32> fetched = source_.get_next_batch_uint32();
+        if (fetched.shape.empty()) {
+            exhausted_ = true;
+            break;
+        }
+        stream_.erase(stream_.begin(), stream_.begin() + stream_pos_);
+        stream_pos_ = 0;
+        stream_.insert(stream_.end(), fetched.data(), fetched.data() + fetched.size());
+        deallocate_memory(fetched.data());
+    }
+    if (stream_.size() - stream_pos_ < static_cast<size_t>(rows + 1)) {
+        return false;
+    }
+    batch.ids.assign(stream_.begin() + stream_pos_, stream_.begin() + stream_pos_ + rows);
+    batch.targets.assign(stream_.begin() + stream_pos_ + 1, stream_.begin() + stream_pos_ + rows + 1);
+    stream_pos_ += rows;
+    return true;
+}
+
+template<DType dtype, typename Source>
+float Trainer<dtype, Source>::forward_backward(const MicroBatch& batch, float grad_scale) {
+    const int64_t rows = static_cast<int64_t>(batch.ids.size());
+    model_.embeddings().gather_rows(batch.ids.data(), rows, x_.data());
+    decoder_.forward(x_.data(), h_.data(), config_.micro_batch, config_.seq_len);
+    model_.final_norm().forward_rows(h_.data(), normed_.data(), rows, inv_rms_.data());
+    float loss = head_loss_.forward_backward(normed_.data(), batch.targets.data(), rows, grad_normed_.data(),
+        grad_scale);
+    peak_activation_bytes_ = std::max(peak_activation_bytes_, planner_.slab_bytes() + head_loss_.workspace_bytes());
+
+    model_.final_norm().backward_rows(grad_normed_.data(), h_.data(), inv_rms_.data(), grad_h_.data(), rows);
+    decoder_.backward(grad_h_.data(), grad_x_.data(), model_.config().aux_loss_weight * grad_scale);
+    if (!model_.has_lora()) {
+        SparseRowGrad<dtype> grad = model_.embeddings().backward_rows(batch.ids.data(), grad_x_.data(), rows);
+        accumulate_embedding_grad(grad);
+        deallocate_memory(grad.values.data());
+    }
+    return loss;
+}
+
+template<DType dtype, typename Source>
+void Trainer<dtype, Source>::accumulate_embedding_grad(const SparseRowGrad<dtype>& grad) {
+    const int64_t dim = model_.config().dim;
+    const T* values = grad.values.data();
+    for (size_t r = 0; r < grad.rows.size(); ++r) {
+        auto [it, inserted] = embedding_slot_.emplace(grad.rows[r], static_cast<int64_t>(embedding_rows_.size()));
+        if (inserted) {
+            embedding_rows_.push_back(grad.rows[r]);
+            embedding_grad_.resize(embedding_rows_.size() * dim, 0.0f);
+        }
+        float* acc = embedding_grad_.data() + it->second * dim;
+        for (int64_t d = 0; d < dim; ++d) {
+            acc[d] += to_float<dtype>(values[r * dim + d]);
+        }
+    }
+}
+
+template<DType dtype, typename Source>
+double Trainer<dtype, Source>::embedding_sum_squares() const {
+    const int64_t dim = model_.config().dim;
+    double total = 0.0;
+    for (size_t r = 0; r < embedding_rows_.size(); ++r) {
+        total += simd_sum_squares(embedding_grad_.data() + r * dim, dim);
+    }
+    return total;
+}
+
+template<DType dtype, typename Source>
+void Trainer<dtype, Source>::update_embeddings(float grad_scale) {
+    if (!embedding_rows_.empty()) {
+        model_.embeddings().update_rows(embedding_rows_.data(), embedding_grad_.data(),
+            static_cast<int64_t>(embedding_rows_.size()), optimizer_.config(), grad_scale);
+    }
+    clear_embedding_grad();
+}
+
+template<DType dtype, typename Source>
+bool Trainer<dtype, Source>::step(float& loss) {
+    const bool scaled = dtype == FLOAT16;
+    const float loss_scale = scaled ? scaler_.scale() : 1.0f;
+    // every micro-batch's mean loss counts 1 / accumulation_steps of the step's
+    const float grad_scale = loss_scale / config_.accumulation_steps;
+
+    double total = 0.0;
+    for (int m = 0; m < config_.accumulation_steps; ++m) {
+        bool have = false;
+        if (pending_.valid()) {
+            have = pending_.get();
+            std::swap(current_, next_);
+        } else {
+            have = fetch(current_);
+        }
+        if (!have) {
+            // drop whatever this partial step accumulated
+            for (Tensor<dtype>* p : model_.parameters()) {
+                std::fill(p->grad->data(), p->grad->data() + p->size(), from_float<dtype>(0.0f));
+            }
+            clear_embedding_grad();
+            return false;
+        }
+        if (config_.prefetch) {
+            pending_ = std::async(std::launch::async, &Trainer::fetch, this, std::ref(next_));
+        }
+        total += forward_backward(current_, grad_scale);
+    }
+
+    // the embedding rows join the dense step's clipping norm and overflow check
+    const double embedding_sq = embedding_sum_squares();
+    bool applied = scaled ? optimizer_.step(scaler_, embedding_sq) : (optimizer_.step(embedding_sq), true);
+    if (applied) {
+        update_embeddings(optimizer_.last_grad_scale());
+    } else {
+        clear_embedding_grad();
+    }
+    ++steps_;
+    loss = static_cast<float>(total / config_.accumulation_steps);
+    return true;
+}
+
+#endif
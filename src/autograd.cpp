@@ -0,0 +1,348 @@
+#include "autograd.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace {
+
+using FloatTensor = Tensor<FLOAT32>;
+using Inputs = std::vector<const FloatTensor*>;
+using GradInputs = std::vector<float*>;
+
+void add_into(float* dst, const float* src, int64_t n, float sign = 1.0f) {
+    parallel_for(0, n, [&](int64_t lo, int64_t hi) {
+        simd_axpy(dst + lo, src + lo, sign, hi - lo);
+    }, 4096);
+}
+
+void add_backward(const FloatTensor& out, const float* g, const Inputs&, const GradInputs& dx) {
+    for (float* d : dx) {
+        if (d != nullptr) {
+            add_into(d, g, out.size());
+        }
+    }
+}
+
+void sub_backward(const FloatTensor& out, const float* g, const Inputs&, const GradInputs& dx) {
+    if (dx[0] != nullptr) {
+        add_into(dx[0], g, out.size());
+    }
+    if (dx[1] != nullptr) {
+        add_into(dx[1], g, out.size(), -1.0f);
+    }
+}
+
+void mul_backward(const FloatTensor& out, const float* g, const Inputs& x, const GradInputs& dx) {
+    const int64_t n = out.size();
+    // one slot at a time, so x * x accumulates both terms into the same buffer
+    for (int s = 0; s < 2; ++s) {
+        if (dx[s] == nullptr) {
+            continue;
+        }
+        const float* other = x[1 - s]->data();
+        float* d = dx[s];
+        parallel_for(0, n, [&](int64_t lo, int64_t hi) {
+            for (int64_t i = lo; i < hi; ++i) {
+                d[i] += g[i] * other[i];
+            }
+        }, 4096);
+    }
+}
+
+// [m, k] x [k, p], with the leading dims of the first operand folded into m
+void matmul_backward(const FloatTensor& out, const float* g, const Inputs& x, const GradInputs& dx) {
+    const int64_t k = x[0]->shape.back();
+    const int64_t p = x[1]->shape.back();
+    const int64_t m = x[0]->size() / k;
+    const float* a = x[0]->data();
+    const float* b = x[1]->data();
+    // dA = dY B^T
+    if (dx[0] != nullptr) {
+        float* da = dx[0];
+        parallel_for(0, m, [&](int64_t lo, int64_t hi) {
+            for (int64_t i = lo; i < hi; ++i) {
+                for (int64_t j = 0; j < k; ++j) {
+                    da[i * k + j] += simd_dot(g + i * p, b + j * p, p);
+                }
+            }
+        });
+    }
+    // dB = A^T dY, each worker owning whole rows of dB
+    if (dx[1] != nullptr) {
+        float* db = dx[1];
+        parallel_for(0, k, [&](int64_t lo, int64_t hi) {
+            for (int64_t j = lo; j < hi; ++j) {
+                for (int64_t i = 0; i < m; ++i) {
+                    simd_axpy(db + j * p, g + i * p, a[i * k + j], p);
+                }
+            }
+        });
+    }
+    (void)out;
+}
+
+void get_slice_backward(const FloatTensor& out, const float* g, const Inputs& x, const GradInputs& dx) {
+    if (dx[0] == nullptr) {
+        return;
+    }
+    // op_args: start indices, then strides
+    const std::vector<int>& shape = x[0]->shape;
+    const size_t dims = shape.size();
+    std::vector<int> index(dims, 0);
+    for (int64_t r = 0; r < out.size(); ++r) {
+        int64_t flat = 0;
+        for (size_t d = 0; d < dims; ++d) {
+            flat = flat * shape[d] + out.op_args[d] + index[d] * out.op_args[dims + d];
+        }
+        dx[0][flat] += g[r];
+        for (int d = static_cast<int>(dims) - 1; d >= 0; --d) {
+            if (++index[d] < out.shape[d]) {
+                break;
+            }
+            index[d] = 0;
+        }
+    }
+}
+
+void hstack_backward(const FloatTensor& out, const float* g, const Inputs& x, const GradInputs& dx) {
+    const int64_t rows = out.shape[0], cols = out.shape[1];
+    int64_t offset = 0;
+    for (size_t s = 0; s < x.size(); ++s) {
+        const int64_t w = x[s]->shape[1];
+        if (dx[s] != nullptr) {
+            for (int64_t r = 0; r < rows; ++r) {
+                simd_axpy(dx[s] + r * w, g + r * cols + offset, 1.0f, w);
+            }
+        }
+        offset += w;
+    }
+}
+
+void vstack_backward(const FloatTensor&, const float* g, const Inputs& x, const GradInputs& dx) {
+    int64_t offset = 0;
+    for (size_t s = 0; s < x.size(); ++s) {
+        if (dx[s] != nullptr) {
+            add_into(dx[s], g + offset, x[s]->size());
+        }
+        offset += x[s]->size();
+    }
+}
+
+std::mutex g_registry_mutex;
+
+std::vector<BackwardFn>& registry() {
+    static std::vector<BackwardFn> fns = [] {
+        std::vector<BackwardFn> table(OP_VSTACK + 1);
+        table[OP_ADD] = add_backward;
+        table[OP_SUB] = sub_backward;
+        table[OP_MUL] = mul_backward;
+        table[OP_MATMUL] = matmul_backward;
+        table[OP_GET_SLICE] = get_slice_backward;
+        table[OP_HSTACK] = hstack_backward;
+        table[OP_VSTACK] = vstack_backward;
+        return table;
+    }();
+    return fns;
+}
+
+// Gradient buffers recycled by element count. Reuse only needs an exact size
+// match: ops in one model repeat the same few shapes.
+class GradPool {
+public:
+    ~GradPool() {
+        for (auto& entry : free_) {
+            deallocate_memory(entry.second);
+        }
+    }
+
+    float* acquire(int64_t n) {
+        float* buffer;
+        auto it = free_.find(n);
+        if (it != free_.end()) {
+            buffer = it->second;
+            free_.erase(it);
+        } else {
+            buffer = static_cast<float*>(allocate_memory(FLOAT32, n));
+            stats_.pool_bytes += n * sizeof(float);
+        }
+        std::fill(buffer, buffer + n, 0.0f);
+        live_bytes_ += n * sizeof(float);
+        stats_.unfreed_bytes += n * sizeof(float);
+        stats_.peak_grad_bytes = std::max(stats_.peak_grad_bytes, live_bytes_);
+        return buffer;
+    }
+
+    void release(float* buffer, int64_t n) {
+        live_bytes_ -= n * sizeof(float);
+        free_.emplace(n, buffer);
+    }
+
+    BackwardStats& stats() { return stats_; }
+
+private:
+    std::multimap<int64_t, float*> free_;
+    size_t live_bytes_ = 0;
+    BackwardStats stats_;
+};
+
+struct Node {
+    const FloatTensor* tensor;
+    std::vector<int> inputs;  // node per child slot, -1 for constants
+    int pending = 0;          // consumers that have not pushed their gradient yet
+    bool needs_grad = false;
+    float* grad = nullptr;    // pooled, for nodes that have inputs
+};
+
+bool is_leaf(const FloatTensor& t) {
+    return t.op_type == OP_NONE || t.get_children_size() == 0;
+}
+
+}  // namespace
+
+void register_backward(OpType op, BackwardFn fn) {
+    std::lock_guard<std::mutex> lock(g_registry_mutex);
+    registry()[op] = std::move(fn);
+}
+
+void requires_grad(Tensor<FLOAT32>& tensor) {
+    if (!tensor.grad) {
+        tensor.grad = std::make_shared<Tensor<FLOAT32>>(tensor.shape);
+    }
+}
+
+BackwardStats backward(const Tensor<FLOAT32>& root, const Tensor<FLOAT32>* grad_output) {
+    if (grad_output != nullptr && grad_output->size() != root.size()) {
+        throw std::runtime_error("backward: grad_output does not match the root's shape");
+    }
+
+    // discover the graph, depth-first with an explicit stack; on the way out
+    // a node knows whether anything below it wants a gradient
+    std::vector<Node> nodes;
+    std::unordered_map<const void*, int> index;
+    auto visit = [&](const FloatTensor* t) {
+        auto found = index.find(t->data());
+        if (found != index.end()) {
+            return std::make_pair(found->second, false);
+        }
+        int id = static_cast<int>(nodes.size());
+        index.emplace(t->data(), id);
+        nodes.push_back({t, {}, 0, false, nullptr});
+        return std::make_pair(id, true);
+    };
+    std::vector<std::pair<int, size_t>> stack;  // node, next child slot
+    stack.emplace_back(visit(&root).first, 0);
+    while (!stack.empty()) {
+        auto& [id, slot] = stack.back();
+        const FloatTensor* t = nodes[id].tensor;
+        const auto& children = t->get_children();
+        if (is_leaf(*t) || slot == children.size()) {
+            Node& node = nodes[id];
+            node.needs_grad = node.tensor->grad != nullptr;
+            for (int in : node.inputs) {
+                node.needs_grad = node.needs_grad || (in >= 0 && nodes[in].needs_grad);
+            }
+            stack.pop_back();
+            continue;
+        }
+        const auto* child = std::get_if<std::shared_ptr<FloatTensor>>(&children[slot++]);
+        if (child == nullptr || !*child) {
+            nodes[id].inputs.push_back(-1);
+            continue;
+        }
+        auto [child_id, fresh] = visit(child->get());
+        nodes[id].inputs.push_back(child_id);
+        if (fresh) {
+            stack.emplace_back(child_id, 0);
+        }
+    }
+
+    GradPool pool;
+    pool.stats().nodes = nodes.size();
+    if (!nodes[0].needs_grad) {
+        return pool.stats();
+    }
+    for (const Node& node : nodes) {
+        if (!node.needs_grad || is_leaf(*node.tensor)) {
+            continue;
+        }
+        for (int in : node.inputs) {
+            if (in >= 0 && nodes[in].needs_grad) {
+                ++nodes[in].pending;
+            }
+        }
+    }
+
+    // where a node's gradient is accumulated: straight into the caller's
+    // buffer for leaves, a pooled buffer for everything with inputs
+    auto grad_buffer = [&](Node& node) -> float* {
+        if (is_leaf(*node.tensor)) {
+            return node.tensor->grad->data();
+        }
+        if (node.grad == nullptr) {
+            node.grad = pool.acquire(node.tensor->size());
+        }
+        return node.grad;
+    };
+
+    float* seed = grad_buffer(nodes[0]);
+    if (grad_output != nullptr) {
+        add_into(seed, grad_output->data(), root.size());
+    } else {
+        std::fill(seed, seed + root.size(), 1.0f);
+    }
+
+    // Kahn's order from a LIFO: a node runs the moment its last consumer has
+    // finished, which keeps few gradients alive at once on chain-like graphs
+    std::vector<int> ready = {0};
+    Inputs inputs;
+    GradInputs grad_inputs;
+    while (!ready.empty()) {
+        int id = ready.back();
+        ready.pop_back();
+        Node& node = nodes[id];
+        if (is_leaf(*node.tensor)) {
+            continue;
+        }
+        const FloatTensor& t = *node.tensor;
+        const auto& children = t.get_children();
+        inputs.assign(children.size(), nullptr);
+        grad_inputs.assign(children.size(), nullptr);
+        for (size_t s = 0; s < children.size(); ++s) {
+            int in = node.inputs[s];
+            if (in < 0) {
+                continue;
+            }
+            inputs[s] = nodes[in].tensor;
+            if (nodes[in].needs_grad) {
+                grad_inputs[s] = grad_buffer(nodes[in]);
+            }
+        }
+        BackwardFn fn;
+        {
+            std::lock_guard<std::mutex> lock(g_registry_mutex);
+            fn = registry()[t.op_type];
+        }
+        if (!fn) {
+            throw std::runtime_error("backward: no backward registered for op " + std::to_string(t.op_type));
+        }
+        fn(t, node.grad, inputs, grad_inputs);
+
+        // an intermediate the caller asked about keeps a copy, then the buffer goes back
+        if (t.grad) {
+            add_into(t.grad->data(), node.grad, t.size());
+        }
+        pool.release(node.grad, t.size());
+        node.grad = nullptr;
+        // a tensor read twice by this op counts once per slot
+        for (int in : node.inputs) {
+            if (in >= 0 && nodes[in].needs_grad && --nodes[in].pending == 0) {
+                ready.push_back(in);
+            }
+        }
+    }
+    return pool.stats();
+}
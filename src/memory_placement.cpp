@@ -0,0 +1,161 @@
+#include "memory_placement.h"
+#include "thread_pool.h"
+#include "tensor.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// mbind(2) modes, spelled out so we don't need libnuma at link time
+static const int MPOL_MODE_BIND = 2;
+static const int MPOL_MODE_INTERLEAVE = 3;
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+static std::atomic<MemoryPlacement> g_placement(PLACEMENT_DEFAULT);
+static std::atomic<size_t> g_huge_page_threshold(HUGE_PAGE_SIZE);
+
+static std::vector<int> parse_cpulist(const std::string& list) {
+    // format: "0-3,8-11,16"
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty()) {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int lo = std::stoi(range.substr(0, dash));
+        int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+        for (int cpu = lo; cpu <= hi; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+static NumaTopology detect_topology() {
+    NumaTopology topo;
+    for (int node = 0;; ++node) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!file.is_open()) {
+            break;
+        }
+        std::string line;
+        std::getline(file, line);
+        topo.node_cpus.push_back(parse_cpulist(line));
+    }
+    if (topo.node_cpus.empty()) {
+        std::vector<int> cpus(std::max(1u, std::thread::hardware_concurrency()));
+        std::iota(cpus.begin(), cpus.end(), 0);
+        topo.node_cpus.push_back(cpus);
+    }
+    return topo;
+}
+
+int NumaTopology::node_of_cpu(int cpu) const {
+    for (size_t node = 0; node < node_cpus.size(); ++node) {
+        for (int c : node_cpus[node]) {
+            if (c == cpu) {
+                return static_cast<int>(node);
+            }
+        }
+    }
+    return -1;
+}
+
+const NumaTopology& numa_topology() {
+    static NumaTopology topo = detect_topology();
+    return topo;
+}
+
+void set_memory_placement(MemoryPlacement placement) {
+    g_placement = placement;
+}
+
+MemoryPlacement get_memory_placement() {
+    return g_placement;
+}
+
+void set_huge_page_threshold(size_t bytes) {
+    g_huge_page_threshold = bytes;
+}
+
+size_t get_huge_page_threshold() {
+    return g_huge_page_threshold;
+}
+
+static bool bind_pages(void* ptr, size_t bytes, int mode, unsigned long nodemask) {
+    long rc = syscall(SYS_mbind, ptr, bytes, mode, &nodemask, sizeof(nodemask) * 8, 0);
+    return rc == 0;
+}
+
+void place_buffer(void* ptr, size_t bytes) {
+    if (ptr == nullptr || bytes == 0) {
+        return;
+    }
+    bool page_aligned = reinterpret_cast<uintptr_t>(ptr) % HUGE_PAGE_SIZE == 0;
+    if (page_aligned) {
+        madvise(ptr, bytes, MADV_HUGEPAGE);
+    }
+
+    const NumaTopology& topo = numa_topology();
+    switch (get_memory_placement()) {
+        case PLACEMENT_INTERLEAVE:
+            if (page_aligned && topo.num_nodes() > 1 && topo.num_nodes() <= 64) {
+                unsigned long mask = topo.num_nodes() == 64 ? ~0ul : (1ul << topo.num_nodes()) - 1;
+                bind_pages(ptr, bytes, MPOL_MODE_INTERLEAVE, mask);
+            }
+            break;
+        case PLACEMENT_FIRST_TOUCH: {
+            // Zero with the same static split the kernels use, so every page is
+            // faulted in on the node of the worker that will stream it later.
+            char* bytes_ptr = static_cast<char*>(ptr);
+            parallel_for(0, static_cast<int64_t>(bytes), [&](int64_t lo, int64_t hi) {
+                std::memset(bytes_ptr + lo, 0, hi - lo);
+            }, 4096);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+std::vector<void*> replicate_per_node(const void* src, size_t bytes) {
+    const NumaTopology& topo = numa_topology();
+    std::vector<void*> replicas;
+    for (size_t node = 0; node < topo.num_nodes(); ++node) {
+        void* dst = nullptr;
+        size_t padded = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        if (posix_memalign(&dst, HUGE_PAGE_SIZE, padded) != 0) {
+            for (void* replica : replicas) {
+                deallocate_memory(replica);
+            }
+            throw std::bad_alloc();
+        }
+        madvise(dst, padded, MADV_HUGEPAGE);
+        if (topo.num_nodes() > 1 && node < 64) {
+            bind_pages(dst, padded, MPOL_MODE_BIND, 1ul << node);
+        }
+        std::memcpy(dst, src, bytes);
+        replicas.push_back(dst);
+    }
+    return replicas;
+}
+
+const void* local_replica(const std::vector<void*>& replicas) {
+    if (replicas.empty()) {
+        return nullptr;
+    }
+    int worker = ThreadPool::current_worker();
+    int node = worker < 0 ? -1 : ThreadPool::instance().worker_node(worker);
+    if (node < 0 || node >= static_cast<int>(replicas.size())) {
+        return replicas[0];
+    }
+    return replicas[node];
+}
@@ -0,0 +1,125 @@
+#include "memory_planner.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+MemoryPlanner::MemoryPlanner(size_t alignment)
+  : alignment_(alignment), steps_(0), planned_(false), slab_bytes_(0) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        throw std::invalid_argument("MemoryPlanner: alignment must be a power of two");
+    }
+}
+
+int MemoryPlanner::add_tensor(size_t bytes) {
+    size_t aligned = (bytes + alignment_ - 1) / alignment_ * alignment_;
+    tensors_.push_back({aligned, -1, -1, 0});
+    planned_ = false;
+    return static_cast<int>(tensors_.size()) - 1;
+}
+
+void MemoryPlanner::touch(int tensor, int step) {
+    if (tensor < 0 || tensor >= static_cast<int>(tensors_.size())) {
+        throw std::out_of_range("MemoryPlanner: unknown tensor id");
+    }
+    TensorInfo& info = tensors_[tensor];
+    info.first = info.first < 0 ? step : std::min(info.first, step);
+    info.last = std::max(info.last, step);
+}
+
+int MemoryPlanner::add_op(const std::vector<int>& reads, const std::vector<int>& writes) {
+    int step = steps_++;
+    for (int t : reads) {
+        touch(t, step);
+    }
+    for (int t : writes) {
+        touch(t, step);
+    }
+    planned_ = false;
+    return step;
+}
+
+void MemoryPlanner::keep_alive(int tensor) {
+    touch(tensor, std::numeric_limits<int>::max());
+}
+
+void MemoryPlanner::plan() {
+    std::vector<int> order(tensors_.size());
+    std::iota(order.begin(), order.end(), 0);
+    // ties broken by id so the plan is deterministic
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return tensors_[a].bytes != tensors_[b].bytes ? tensors_[a].bytes > tensors_[b].bytes : a < b;
+    });
+
+    std::vector<int> placed;
+    std::vector<std::pair<size_t, size_t>> busy;
+    slab_bytes_ = 0;
+    for (int id : order) {
+        TensorInfo& info = tensors_[id];
+        if (info.first < 0) {
+            throw std::logic_error("MemoryPlanner: tensor is never used by an op");
+        }
+        // byte ranges of already-placed tensors that are live at the same time
+        busy.clear();
+        for (int other : placed) {
+            const TensorInfo& o = tensors_[other];
+            if (o.first <= info.last && info.first <= o.last) {
+                busy.emplace_back(o.offset, o.offset + o.bytes);
+            }
+        }
+        std::sort(busy.begin(), busy.end());
+        // lowest gap that fits
+        size_t candidate = 0;
+        for (const auto& range : busy) {
+            if (candidate + info.bytes <= range.first) {
+                break;
+            }
+            candidate = std::max(candidate, range.second);
+        }
+        info.offset = candidate;
+        slab_bytes_ = std::max(slab_bytes_, candidate + info.bytes);
+        placed.push_back(id);
+    }
+    planned_ = true;
+}
+
+size_t MemoryPlanner::offset(int tensor) const {
+    if (!planned_) {
+        throw std::logic_error("MemoryPlanner: plan() has not run since the last change");
+    }
+    return tensors_.at(tensor).offset;
+}
+
+size_t MemoryPlanner::peak_live_bytes() const {
+    // lifetimes are closed intervals over steps; sweep their endpoints
+    std::vector<std::pair<long long, long long>> events;
+    for (const TensorInfo& info : tensors_) {
+        if (info.first < 0) {
+            continue;
+        }
+        events.emplace_back(info.first, static_cast<long long>(info.bytes));
+        events.emplace_back(static_cast<long long>(info.last) + 1, -static_cast<long long>(info.bytes));
+    }
+    std::sort(events.begin(), events.end());
+    long long live = 0, peak = 0;
+    for (const auto& event : events) {
+        live += event.second;
+        peak = std::max(peak, live);
+    }
+    return static_cast<size_t>(peak);
+}
+
+size_t MemoryPlanner::unshared_bytes() const {
+    size_t total = 0;
+    for (const TensorInfo& info : tensors_) {
+        total += info.bytes;
+    }
+    return total;
+}
+
+void* MemoryPlanner::allocate_slab() const {
+    if (!planned_) {
+        throw std::logic_error("MemoryPlanner: plan() has not run since the last change");
+    }
+    return allocate_memory(UINT8, slab_bytes_);
+}
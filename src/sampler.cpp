@@ -0,0 +1,161 @@
+#include "sampler.h"
+#include "simd.h"
+#include <algorithm>
+#include <stdexcept>
+
+Sampler::Sampler(int vocab_size, SamplingConfig config) : vocab_size_(vocab_size), config_(config) {
+    if (vocab_size <= 0) {
+        throw std::invalid_argument("Sampler: vocab_size must be positive");
+    }
+}
+
+void Sampler::start_sequence(int seq, uint64_t seed) {
+    SequenceState& s = sequences_[seq];
+    s.rng.seed(seed);
+    s.counts.clear();
+}
+
+void Sampler::end_sequence(int seq) {
+    sequences_.erase(seq);
+}
+
+Sampler::SequenceState& Sampler::state(int seq) {
+    auto it = sequences_.find(seq);
+    if (it == sequences_.end()) {
+        throw std::out_of_range("Sampler: sequence was not started");
+    }
+    return it->second;
+}
+
+void Sampler::observe(int seq, const uint32_t* tokens, int64_t n) {
+    SequenceState& s = state(seq);
+    // the penalties index the logits row with every counted token
+    for (int64_t i = 0; i < n; ++i) {
+        if (tokens[i] >= static_cast<uint32_t>(vocab_size_)) {
+            throw std::out_of_range("Sampler: token id outside the vocabulary");
+        }
+    }
+    for (int64_t i = 0; i < n; ++i) {
+        ++s.counts[tokens[i]];
+    }
+}
+
+void Sampler::sample_rows(float* logits, const std::vector<int>& seqs, uint32_t* tokens) {
+    // look the states up before going parallel; rows must not share one
+    std::vector<SequenceState*> states;
+    for (int seq : seqs) {
+        SequenceState* s = &state(seq);
+        if (std::find(states.begin(), states.end(), s) != states.end()) {
+            throw std::invalid_argument("Sampler: a sequence appears twice in one batch");
+        }
+        states.push_back(s);
+    }
+    parallel_for(0, static_cast<int64_t>(seqs.size()), [&](int64_t lo, int64_t hi) {
+        for (int64_t b = lo; b < hi; ++b) {
+            tokens[b] = sample_row(logits + b * vocab_size_, *states[b]);
+            ++states[b]->counts[tokens[b]];
+        }
+    });
+}
+
+uint32_t Sampler::sample_row(float* x, SequenceState& s) const {
+    const int64_t vocab = vocab_size_;
+    const SamplingConfig& c = config_;
+    for (const auto& [token, count] : s.counts) {
+        float& l = x[token];
+        if (c.repetition_penalty != 1.0f) {
+            l = l > 0.0f ? l / c.repetition_penalty : l * c.repetition_penalty;
+        }
+        l -= c.frequency_penalty * count + c.presence_penalty;
+    }
+
+    const float max = simd_max(x, vocab);
+    if (c.temperature <= 0.0f) {
+        return static_cast<uint32_t>(std::find(x, x + vocab, max) - x);
+    }
+    const float inv_t = 1.0f / c.temperature;
+    const float u = std::generate_canonical<float, 24>(s.rng);
+
+    // candidates as (weight, token)
+    static thread_local std::vector<std::pair<float, uint32_t>> cand;
+    auto heavier = [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+    cand.clear();
+    float total = 0.0f;
+    if (c.top_k > 0 && c.top_k < vocab) {
+        // min-heap of the k best logits; most tokens fail the first compare
+        const int64_t k = c.top_k;
+        for (int64_t i = 0; i < vocab; ++i) {
+            if (static_cast<int64_t>(cand.size()) < k) {
+                cand.emplace_back(x[i], static_cast<uint32_t>(i));
+                std::push_heap(cand.begin(), cand.end(), heavier);
+            } else if (heavier({x[i], static_cast<uint32_t>(i)}, cand.front())) {
+                std::pop_heap(cand.begin(), cand.end(), heavier);
+                cand.back() = {x[i], static_cast<uint32_t>(i)};
+                std::push_heap(cand.begin(), cand.end(), heavier);
+            }
+        }
+        for (auto& [w, token] : cand) {
+            w = std::exp((w - max) * inv_t);
+            total += w;
+        }
+    } else {
+        total = simd_exp_sum(x, max, inv_t, vocab);
+        if (c.top_p >= 1.0f) {
+            float target = u * total, acc = 0.0f;
+            for (int64_t i = 0; i < vocab; ++i) {
+                acc += x[i];
+                if (acc > target) {
+                    return static_cast<uint32_t>(i);
+                }
+            }
+            return static_cast<uint32_t>(std::max_element(x, x + vocab) - x);
+        }
+        const float floor = (1.0f - c.top_p) * total / vocab;
+        for (int64_t i = 0; i < vocab; ++i) {
+            if (x[i] >= floor) {
+                cand.emplace_back(x[i], static_cast<uint32_t>(i));
+            }
+        }
+    }
+
+    // nucleus: a selection weighted by mass. Halve the range holding the
+    // cutoff with nth_element, taking the whole heavier half when it does not
+    // reach top_p yet; only the last few candidates are sorted.
+    const int64_t n = static_cast<int64_t>(cand.size());
+    int64_t keep = n;
+    if (c.top_p < 1.0f) {
+        const float needed = c.top_p * total;
+        float acc = 0.0f;
+        int64_t lo = 0, hi = n;
+        while (hi - lo > 32) {
+            const int64_t mid = lo + (hi - lo) / 2;
+            std::nth_element(cand.begin() + lo, cand.begin() + mid, cand.begin() + hi, heavier);
+            float mass = 0.0f;
+            for (int64_t i = lo; i < mid; ++i) {
+                mass += cand[i].first;
+            }
+            if (acc + mass >= needed) {
+                hi = mid;
+            } else {
+                acc += mass;
+                lo = mid;
+            }
+        }
+        std::sort(cand.begin() + lo, cand.begin() + hi, heavier);
+        while (lo < hi && acc < needed) {
+            acc += cand[lo++].first;
+        }
+        keep = std::max<int64_t>(1, lo);
+        total = acc;
+    }
+    float target = u * total, acc = 0.0f;
+    for (int64_t i = 0; i < keep; ++i) {
+        acc += cand[i].first;
+        if (acc > target) {
+            return cand[i].second;
+        }
+    }
+    return cand[keep - 1].second;
+}
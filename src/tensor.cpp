@@ -1,5 +1,7 @@
 #include "tensor.h"
+#include "memory_placement.h"
 #include <random>
+#include <atomic>
 #include <algorithm>
 #include <iostream>
 #include <cstring>
@@ -41,12 +43,31 @@ std::string type_name() {
     return (status == 0) ? res.get() : typeid(T).name();
 }
 
+static std::atomic<size_t> g_allocation_count(0);
+
+size_t allocation_count() {
+    return g_allocation_count;
+}
+
 void* allocate_memory(DType dtype, size_t num_elements) {
+    ++g_allocation_count;
     size_t size = get_dtype_size(dtype);
     if (size == 0) {
         return NULL; 
     }
-    return malloc(size * num_elements);
+    size_t bytes = size * num_elements;
+    if (bytes < get_huge_page_threshold()) {
+        return malloc(bytes);
+    }
+    // large buffers (weights, activations) get 2MB alignment so they can be
+    // backed by huge pages and bound to NUMA nodes; free() still releases them
+    const size_t huge_page = 2 * 1024 * 1024;
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, huge_page, (bytes + huge_page - 1) / huge_page * huge_page) != 0) {
+        return NULL;
+    }
+    place_buffer(ptr, bytes);
+    return ptr;
 }
 
 void deallocate_memory(void* ptr) {
@@ -204,6 +225,11 @@ Tensor<dtype> Tensor<dtype>::get_slice(const std::vector<int>& start_indices, co
     Tensor<dtype> result = Tensor<dtype>(result_data, result_shape);
     result.type = dtype;
     result.set_children({TensorVariant(std::const_pointer_cast<Tensor<dtype>>(this->shared_from_this()))});
+    result.op_type = OP_GET_SLICE;
+    result.op_args = start_indices;
+    for (size_t j = 0; j < shape.size(); ++j) {
+        result.op_args.push_back(stride.size() > j ? stride[j] : 1);
+    }
     return result;
 }
 
@@ -255,7 +281,7 @@ void Tensor<dtype>::set_slice(const std::vector<int>& start_indices, const std::
 
 template<DType dtype>
 template <typename Op>
-Tensor<dtype> Tensor<dtype>::tensorOperation(const TensorVariant& rhs, Op op) const {
+Tensor<dtype> Tensor<dtype>::tensorOperation(const TensorVariant& rhs, Op op, OpType op_type) const {
     if (auto other_tensor = std::get_if<std::shared_ptr<Tensor<dtype>>>(&rhs)) {
         if (this->shape != (*other_tensor)->shape) {
             throw std::runtime_error("Shapes do not match for tensor operation.");
@@ -283,6 +309,7 @@ Tensor<dtype> Tensor<dtype>::tensorOperation(const TensorVariant& rhs, Op op) co
         children.push_back(std::const_pointer_cast<Tensor<dtype>>(this_shared));
         children.push_back(*other_tensor);
         result.set_children(children);
+        result.op_type = op_type;
 
         result.type = dtype;
         return result;
@@ -292,32 +319,32 @@ Tensor<dtype> Tensor<dtype>::tensorOperation(const TensorVariant& rhs, Op op) co
 
 template <DType dtype>
 Tensor<dtype> Tensor<dtype>::operator+(const Tensor<dtype>& other) const {
-    return tensorOperation(std::make_shared<Tensor<dtype>>(other), std::plus<typename DTypeToType<dtype>::Type>());
+    return tensorOperation(std::make_shared<Tensor<dtype>>(other), std::plus<typename DTypeToType<dtype>::Type>(), OP_ADD);
 }
 
 template <DType dtype>
 Tensor<dtype> Tensor<dtype>::operator-(const Tensor<dtype>& other) const {
-    return tensorOperation(std::make_shared<Tensor<dtype>>(other), std::minus<typename DTypeToType<dtype>::Type>());
+    return tensorOperation(std::make_shared<Tensor<dtype>>(other), std::minus<typename DTypeToType<dtype>::Type>(), OP_SUB);
 }
 
 template <DType dtype>
 Tensor<dtype> Tensor<dtype>::operator*(const Tensor<dtype>& other) const {
-    return tensorOperation(std::make_shared<Tensor<dtype>>(other), std::multiplies<typename DTypeToType<dtype>::Type>());
+    return tensorOperation(std::make_shared<Tensor<dtype>>(other), std::multiplies<typename DTypeToType<dtype>::Type>(), OP_MUL);
 }
 
 template <DType dtype>
 Tensor<dtype> Tensor<dtype>::operator+(const TensorVariant& other) const {
-    return tensorOperation(other, std::plus<typename DTypeToType<dtype>::Type>());
+    return tensorOperation(other, std::plus<typename DTypeToType<dtype>::Type>(), OP_ADD);
 }
 
 template <DType dtype>
 Tensor<dtype> Tensor<dtype>::operator-(const TensorVariant& other) const {
-    return tensorOperation(other, std::minus<typename DTypeToType<dtype>::Type>());
+    return tensorOperation(other, std::minus<typename DTypeToType<dtype>::Type>(), OP_SUB);
 }
 
 template <DType dtype>
 Tensor<dtype> Tensor<dtype>::operator*(const TensorVariant& other) const {
-    return tensorOperation(other, std::multiplies<typename DTypeToType<dtype>::Type>());
+    return tensorOperation(other, std::multiplies<typename DTypeToType<dtype>::Type>(), OP_MUL);
 }
 
 
@@ -400,6 +427,7 @@ Tensor<dtype> matmul(const Tensor<dtype>& tens1, const Tensor<dtype>& tens2) {
     result.type = dtype;
     result.set_children(std::vector<TensorVariant>{std::make_shared<Tensor<dtype>>(tens1), 
         std::make_shared<Tensor<dtype>>(tens2)});
+    result.op_type = OP_MATMUL;
     return result;
 }
 
@@ -435,6 +463,7 @@ Tensor<dtype> hstack_impl(const std::vector<Tensor<dtype>>& tensors) {
         children.push_back(std::make_shared<Tensor<dtype>>(tensor));
     }
     result.set_children(children);
+    result.op_type = OP_HSTACK;
     return result;
 }
 
@@ -478,7 +507,8 @@ Tensor<dtype> vstack_impl(const std::vector<Tensor<dtype>>& tensors) {
     for (const auto& tensor : tensors) {
         children.push_back(std::make_shared<Tensor<dtype>>(tensor));
     }
-    result.set_children(children);  
+    result.set_children(children);
+    result.op_type = OP_VSTACK;
     return result;
 }
 
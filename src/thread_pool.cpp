@@ -0,0 +1,180 @@
+#include "thread_pool.h"
+#include "memory_placement.h"
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+
+static thread_local int tls_worker_index = -1;
+
+ThreadPool& ThreadPool::instance() {
+    static ThreadPool pool([] {
+        const char* env = std::getenv("LLAMA_NUM_THREADS");
+        if (env != nullptr && std::atoi(env) > 0) {
+            return static_cast<size_t>(std::atoi(env));
+        }
+        return static_cast<size_t>(std::max(1u, std::thread::hardware_concurrency()));
+    }());
+    return pool;
+}
+
+ThreadPool::ThreadPool(size_t num_threads)
+    : generation_(0), pending_(0), stop_(false), pinned_(false) {
+    num_threads = std::max<size_t>(1, num_threads);
+    worker_nodes_.assign(num_threads, -1);
+    for (size_t i = 0; i < num_threads; ++i) {
+        workers_.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+}
+
+int ThreadPool::current_worker() {
+    return tls_worker_index;
+}
+
+int ThreadPool::worker_node(size_t worker) const {
+    return worker < worker_nodes_.size() ? worker_nodes_[worker] : -1;
+}
+
+void ThreadPool::worker_loop(size_t index) {
+    tls_worker_index = static_cast<int>(index);
+    uint64_t seen = 0;
+    while (true) {
+        std::function<void(size_t)> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_) {
+                return;
+            }
+            seen = generation_;
+            task = task_;
+        }
+        std::exception_ptr error;
+        try {
+            task(index);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            // the first failure is rethrown by dispatch() on the calling thread
+            if (error && !error_) {
+                error_ = error;
+            }
+            if (--pending_ == 0) {
+                done_cv_.notify_one();
+            }
+        }
+    }
+}
+
+void ThreadPool::dispatch(const std::function<void(size_t)>& task) {
+    // one job in flight at a time, e.g. main thread and a loader thread both calling in
+    std::lock_guard<std::mutex> caller_lock(dispatch_mutex_);
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        task_ = task;
+        pending_ = workers_.size();
+        ++generation_;
+        cv_.notify_all();
+        done_cv_.wait(lock, [this] { return pending_ == 0; });
+        task_ = nullptr;
+        std::swap(error, error_);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::run_on_workers(const std::function<void(size_t)>& fn) {
+    if (tls_worker_index >= 0) {
+        throw std::runtime_error("run_on_workers cannot be called from inside the pool");
+    }
+    dispatch(fn);
+}
+
+void ThreadPool::parallel_for(int64_t begin, int64_t end, const std::function<void(int64_t, int64_t)>& fn,
+    int64_t grain) {
+    int64_t total = end - begin;
+    if (total <= 0) {
+        return;
+    }
+    grain = std::max<int64_t>(1, grain);
+    int64_t num_chunks = std::min<int64_t>(workers_.size(), (total + grain - 1) / grain);
+    // nested calls and tiny ranges run inline on the caller
+    if (num_chunks <= 1 || tls_worker_index >= 0) {
+        fn(begin, end);
+        return;
+    }
+    int64_t chunk = (total + num_chunks - 1) / num_chunks;
+    dispatch([&](size_t worker) {
+        int64_t lo = begin + static_cast<int64_t>(worker) * chunk;
+        int64_t hi = std::min(end, lo + chunk);
+        if (lo < hi) {
+            fn(lo, hi);
+        }
+    });
+}
+
+void ThreadPool::pin_to_numa_nodes() {
+    const NumaTopology& topo = numa_topology();
+    std::vector<int> cpus;
+    std::vector<int> nodes;
+    for (size_t node = 0; node < topo.num_nodes(); ++node) {
+        for (int cpu : topo.node_cpus[node]) {
+            cpus.push_back(cpu);
+            nodes.push_back(static_cast<int>(node));
+        }
+    }
+    if (cpus.empty()) {
+        return;
+    }
+    // Spread workers evenly over the node-ordered cpu list so each node gets a
+    // contiguous block of workers even when there are fewer workers than cpus.
+    size_t n = workers_.size();
+    std::vector<int> worker_cpu(n);
+    for (size_t i = 0; i < n; ++i) {
+        size_t slot = (i * cpus.size()) / n;
+        worker_cpu[i] = cpus[slot];
+        worker_nodes_[i] = nodes[slot];
+    }
+    run_on_workers([&](size_t worker) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker_cpu[worker], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    });
+    pinned_ = true;
+}
+
+void ThreadPool::unpin() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto& node : numa_topology().node_cpus) {
+        for (int cpu : node) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    run_on_workers([&](size_t) {
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    });
+    std::fill(worker_nodes_.begin(), worker_nodes_.end(), -1);
+    pinned_ = false;
+}
@@ -0,0 +1,325 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <vector>
+#include "flash_attention.h"
+
+// Reference attention that materializes the full [T, S] score matrix per head.
+// kv_heads < heads means grouped-query attention (query head h reads kv head h / group).
+// `visible(b, i, j)`, when given, masks out scores the way an explicit mask tensor would.
+static std::vector<float> naive_attention(const std::vector<float>& q, const std::vector<float>& k,
+    const std::vector<float>& v, int batch, int q_len, int kv_len, int heads, int kv_heads, int dim,
+    const std::function<bool(int, int, int)>& visible = nullptr) {
+    std::vector<float> out(static_cast<size_t>(batch) * q_len * heads * dim, 0.0f);
+    std::vector<float> scores(static_cast<size_t>(q_len) * kv_len);
+    float scale = 1.0f / std::sqrt(static_cast<float>(dim));
+    int group = heads / kv_heads;
+    for (int b = 0; b < batch; ++b) {
+        for (int h = 0; h < heads; ++h) {
+            int kh = h / group;
+            for (int i = 0; i < q_len; ++i) {
+                float mx = -INFINITY;
+                for (int j = 0; j < kv_len; ++j) {
+                    float s = 0.0f;
+                    for (int c = 0; c < dim; ++c) {
+                        s += q[((b * q_len + i) * heads + h) * dim + c] * k[((b * kv_len + j) * kv_heads + kh) * dim + c];
+                    }
+                    scores[i * kv_len + j] = (visible && !visible(b, i, j)) ? -INFINITY : s * scale;
+                    mx = std::max(mx, scores[i * kv_len + j]);
+                }
+                if (mx == -INFINITY) {
+                    continue;
+                }
+                float sum = 0.0f;
+                for (int j = 0; j < kv_len; ++j) {
+                    scores[i * kv_len + j] = std::exp(scores[i * kv_len + j] - mx);
+                    sum += scores[i * kv_len + j];
+                }
+                for (int j = 0; j < kv_len; ++j) {
+                    float p = scores[i * kv_len + j] / sum;
+                    for (int c = 0; c < dim; ++c) {
+                        out[((b * q_len + i) * heads + h) * dim + c] += p * v[((b * kv_len + j) * kv_heads + kh) * dim + c];
+                    }
+                }
+            }
+        }
+    }
+    return out;
+}
+
+static Tensor<FLOAT32> random_tensor(const std::vector<int>& shape, std::mt19937& rng) {
+    Tensor<FLOAT32> t(shape);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    for (int i = 0; i < t.size(); ++i) {
+        t.data()[i] = dist(rng);
+    }
+    return t;
+}
+
+void test_flash_attention_forward() {
+    std::mt19937 rng(3);
+    const int batch = 2, q_len = 37, kv_len = 53, heads = 3, dim = 16;
+    Tensor<FLOAT32> q = random_tensor({batch, q_len, heads, dim}, rng);
+    Tensor<FLOAT32> k = random_tensor({batch, kv_len, heads, dim}, rng);
+    Tensor<FLOAT32> v = random_tensor({batch, kv_len, heads, dim}, rng);
+
+    std::vector<float> expected = naive_attention(std::vector<float>(q.data(), q.data() + q.size()),
+        std::vector<float>(k.data(), k.data() + k.size()), std::vector<float>(v.data(), v.data() + v.size()),
+        batch, q_len, kv_len, heads, heads, dim);
+
+    FlashAttention<FLOAT32> attention(dim, heads);
+    // small tiles so partial tiles and several kv blocks are exercised
+    attention.set_block_sizes(8, 16);
+    Tensor<FLOAT32> out = attention.forward(q, k, v);
+    assert(out.shape == q.shape);
+    for (int i = 0; i < out.size(); ++i) {
+        assert(std::abs(out.data()[i] - expected[i]) < 1e-4f);
+    }
+
+    // fp16 storage, fp32 math
+    Tensor<FLOAT16> qh(q.shape), kh(k.shape), vh(v.shape);
+    row_from_float<FLOAT16>(q.data(), qh.data(), q.size());
+    row_from_float<FLOAT16>(k.data(), kh.data(), k.size());
+    row_from_float<FLOAT16>(v.data(), vh.data(), v.size());
+    FlashAttention<FLOAT16> half_attention(dim, heads);
+    Tensor<FLOAT16> out_h = half_attention.forward(qh, kh, vh);
+    for (int i = 0; i < out_h.size(); ++i) {
+        assert(std::abs(half_to_float(out_h.data()[i]) - expected[i]) < 2e-2f);
+    }
+    std::cout << "FlashAttention forward tests passed!" << std::endl;
+}
+
+void benchmark_flash_attention() {
+    std::mt19937 rng(11);
+    const int batch = 1, heads = 8, dim = 64;
+    FlashAttention<FLOAT32> attention(dim, heads);
+    for (int seq : {256, 512, 1024, 2048}) {
+        Tensor<FLOAT32> q = random_tensor({batch, seq, heads, dim}, rng);
+        Tensor<FLOAT32> k = random_tensor({batch, seq, heads, dim}, rng);
+        Tensor<FLOAT32> v = random_tensor({batch, seq, heads, dim}, rng);
+        std::vector<float> qv(q.data(), q.data() + q.size());
+        std::vector<float> kv(k.data(), k.data() + k.size());
+        std::vector<float> vv(v.data(), v.data() + v.size());
+
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<float> expected = naive_attention(qv, kv, vv, batch, seq, seq, heads, heads, dim);
+        auto mid = std::chrono::high_resolution_clock::now();
+        Tensor<FLOAT32> out = attention.forward(q, k, v);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        float max_err = 0.0f;
+        for (int i = 0; i < out.size(); ++i) {
+            max_err = std::max(max_err, std::abs(out.data()[i] - expected[i]));
+        }
+        std::chrono::duration<double, std::milli> naive_ms = mid - start;
+        std::chrono::duration<double, std::milli> flash_ms = end - mid;
+        // naive keeps a [T, S] score matrix per head; flash keeps one 64x64 tile per worker
+        double naive_mb = static_cast<double>(seq) * seq * sizeof(float) / 1e6;
+        double flash_mb = (64.0 * 64 + 3 * 64.0 * dim) * sizeof(float) * ThreadPool::instance().num_threads() / 1e6;
+        std::cout << "T=" << seq << " naive: " << naive_ms.count() << " ms (" << naive_mb << " MB scores), flash: "
+                  << flash_ms.count() << " ms (" << flash_mb << " MB tiles), max err " << max_err << std::endl;
+        deallocate_memory(out.data());
+    }
+}
+
+void test_flash_attention_backward() {
+    std::mt19937 rng(5);
+    const int batch = 1, q_len = 11, kv_len = 13, heads = 2, dim = 8;
+    Tensor<FLOAT32> q = random_tensor({batch, q_len, heads, dim}, rng);
+    Tensor<FLOAT32> k = random_tensor({batch, kv_len, heads, dim}, rng);
+    Tensor<FLOAT32> v = random_tensor({batch, kv_len, heads, dim}, rng);
+    Tensor<FLOAT32> upstream = random_tensor({batch, q_len, heads, dim}, rng);
+
+    FlashAttention<FLOAT32> attention(dim, heads);
+    attention.set_block_sizes(4, 5);
+    attention.forward(q, k, v);
+    AttentionGrads<FLOAT32> grads = attention.backward(upstream);
+
+    // loss = sum(out * upstream), checked by central differences in double
+    auto loss = [&]() {
+        FlashAttention<FLOAT32> probe(dim, heads);
+        Tensor<FLOAT32> out = probe.forward(q, k, v);
+        double total = 0.0;
+        for (int i = 0; i < out.size(); ++i) {
+            total += static_cast<double>(out.data()[i]) * upstream.data()[i];
+        }
+        return total;
+    };
+    const float h = 1e-2f;
+    double max_err = 0.0;
+    for (auto pair : {std::make_pair(&q, &grads.query), std::make_pair(&k, &grads.key),
+                      std::make_pair(&v, &grads.value)}) {
+        Tensor<FLOAT32>& input = *pair.first;
+        Tensor<FLOAT32>& grad = *pair.second;
+        for (int i = 0; i < input.size(); ++i) {
+            float saved = input.data()[i];
+            input.data()[i] = saved + h;
+            double up = loss();
+            input.data()[i] = saved - h;
+            double down = loss();
+            input.data()[i] = saved;
+            double numeric = (up - down) / (2 * h);
+            max_err = std::max(max_err, std::abs(numeric - grad.data()[i]));
+            assert(std::abs(numeric - grad.data()[i]) < 5e-3 * std::max(1.0, std::abs(numeric)));
+        }
+    }
+    std::cout << "FlashAttention backward matches finite differences (max err " << max_err << ")" << std::endl;
+}
+
+void test_grouped_query_attention() {
+    std::mt19937 rng(7);
+    const int batch = 2, q_len = 19, kv_len = 23, heads = 6, dim = 8;
+    for (int kv_heads : {1, 2, 3}) {
+        Tensor<FLOAT32> q = random_tensor({batch, q_len, heads, dim}, rng);
+        Tensor<FLOAT32> k = random_tensor({batch, kv_len, kv_heads, dim}, rng);
+        Tensor<FLOAT32> v = random_tensor({batch, kv_len, kv_heads, dim}, rng);
+        std::vector<float> expected = naive_attention(std::vector<float>(q.data(), q.data() + q.size()),
+            std::vector<float>(k.data(), k.data() + k.size()), std::vector<float>(v.data(), v.data() + v.size()),
+            batch, q_len, kv_len, heads, kv_heads, dim);
+
+        FlashAttention<FLOAT32> attention(dim, heads, kv_heads);
+        attention.set_block_sizes(4, 8);
+        Tensor<FLOAT32> out = attention.forward(q, k, v);
+        for (int i = 0; i < out.size(); ++i) {
+            assert(std::abs(out.data()[i] - expected[i]) < 1e-4f);
+        }
+
+        // dK/dV must sum over every query head in the group
+        Tensor<FLOAT32> upstream = random_tensor(q.shape, rng);
+        AttentionGrads<FLOAT32> grads = attention.backward(upstream);
+        assert(grads.key.shape == k.shape && grads.value.shape == v.shape);
+        auto loss = [&]() {
+            FlashAttention<FLOAT32> probe(dim, heads, kv_heads);
+            Tensor<FLOAT32> probe_out = probe.forward(q, k, v);
+            double total = 0.0;
+            for (int i = 0; i < probe_out.size(); ++i) {
+                total += static_cast<double>(probe_out.data()[i]) * upstream.data()[i];
+            }
+            deallocate_memory(probe_out.data());
+            return total;
+        };
+        const float h = 1e-2f;
+        for (auto pair : {std::make_pair(&k, &grads.key), std::make_pair(&v, &grads.value)}) {
+            Tensor<FLOAT32>& input = *pair.first;
+            Tensor<FLOAT32>& grad = *pair.second;
+            for (int i = 0; i < input.size(); i += 7) {
+                float saved = input.data()[i];
+                input.data()[i] = saved + h;
+                double up = loss();
+                input.data()[i] = saved - h;
+                double down = loss();
+                input.data()[i] = saved;
+                double numeric = (up - down) / (2 * h);
+                assert(std::abs(numeric - grad.data()[i]) < 5e-3 * std::max(1.0, std::abs(numeric)));
+            }
+        }
+    }
+
+    bool threw = false;
+    try {
+        FlashAttention<FLOAT32> bad(8, 6, 4);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+    std::cout << "Grouped-query attention tests passed!" << std::endl;
+}
+
+void test_attention_masks() {
+    std::mt19937 rng(13);
+    const int batch = 2, heads = 4, kv_heads = 2, dim = 8;
+    // segments: row 0 packs lengths 9/14/6, row 1 packs 20/9
+    std::vector<int> segments;
+    for (int len : {9, 14, 6}) segments.insert(segments.end(), len, static_cast<int>(segments.size()));
+    for (int len : {20, 9}) segments.insert(segments.end(), len, static_cast<int>(segments.size()));
+    const int seq = 29, window = 5;
+
+    struct Case { AttentionMask mask; int q_len; };
+    for (Case c : {Case{MASK_CAUSAL, seq}, Case{MASK_CAUSAL, 7}, Case{MASK_SLIDING_WINDOW, seq},
+                   Case{MASK_SLIDING_WINDOW, 3}, Case{MASK_BLOCK_DIAGONAL, seq}}) {
+        const int q_len = c.q_len, kv_len = seq;
+        auto visible = [&](int b, int i, int j) {
+            int pos = i + kv_len - q_len;
+            switch (c.mask) {
+                case MASK_CAUSAL: return j <= pos;
+                case MASK_SLIDING_WINDOW: return j <= pos && pos - j < window;
+                case MASK_BLOCK_DIAGONAL: return j <= pos && segments[b * seq + j] == segments[b * seq + pos];
+                default: return true;
+            }
+        };
+        Tensor<FLOAT32> q = random_tensor({batch, q_len, heads, dim}, rng);
+        Tensor<FLOAT32> k = random_tensor({batch, kv_len, kv_heads, dim}, rng);
+        Tensor<FLOAT32> v = random_tensor({batch, kv_len, kv_heads, dim}, rng);
+        std::vector<float> expected = naive_attention(std::vector<float>(q.data(), q.data() + q.size()),
+            std::vector<float>(k.data(), k.data() + k.size()), std::vector<float>(v.data(), v.data() + v.size()),
+            batch, q_len, kv_len, heads, kv_heads, dim, visible);
+
+        auto make_layer = [&]() {
+            FlashAttention<FLOAT32> layer(dim, heads, kv_heads);
+            layer.set_block_sizes(4, 4);
+            layer.set_mask(c.mask, window);
+            if (c.mask == MASK_BLOCK_DIAGONAL) {
+                layer.set_segment_ids(segments, batch, seq);
+            }
+            return layer;
+        };
+        FlashAttention<FLOAT32> attention = make_layer();
+        Tensor<FLOAT32> out = attention.forward(q, k, v);
+        for (int i = 0; i < out.size(); ++i) {
+            assert(std::abs(out.data()[i] - expected[i]) < 1e-4f);
+        }
+
+        // masked-out keys must get exactly zero gradient; the rest match finite differences
+        Tensor<FLOAT32> upstream = random_tensor(q.shape, rng);
+        AttentionGrads<FLOAT32> grads = attention.backward(upstream);
+        auto loss = [&]() {
+            FlashAttention<FLOAT32> probe = make_layer();
+            Tensor<FLOAT32> probe_out = probe.forward(q, k, v);
+            double total = 0.0;
+            for (int i = 0; i < probe_out.size(); ++i) {
+                total += static_cast<double>(probe_out.data()[i]) * upstream.data()[i];
+            }
+            deallocate_memory(probe_out.data());
+            return total;
+        };
+        const float h = 1e-2f;
+        for (auto pair : {std::make_pair(&q, &grads.query), std::make_pair(&k, &grads.key),
+                          std::make_pair(&v, &grads.value)}) {
+            Tensor<FLOAT32>& input = *pair.first;
+            Tensor<FLOAT32>& grad = *pair.second;
+            for (int i = 0; i < input.size(); i += 5) {
+                float saved = input.data()[i];
+                input.data()[i] = saved + h;
+                double up = loss();
+                input.data()[i] = saved - h;
+                double down = loss();
+                input.data()[i] = saved;
+                double numeric = (up - down) / (2 * h);
+                assert(std::abs(numeric - grad.data()[i]) < 5e-3 * std::max(1.0, std::abs(numeric)));
+            }
+        }
+    }
+    std::cout << "Attention mask tests passed!" << std::endl;
+}
+
+void benchmark_attention_masks() {
+    std::mt19937 rng(17);
+    const int batch = 1, heads = 8, dim = 64, seq = 4096;
+    Tensor<FLOAT32> q = random_tensor({batch, seq, heads, dim}, rng);
+    Tensor<FLOAT32> k = random_tensor({batch, seq, heads, dim}, rng);
+    Tensor<FLOAT32> v = random_tensor({batch, seq, heads, dim}, rng);
+    const char* names[] = {"none", "causal", "sliding window (256)"};
+    AttentionMask masks[] = {MASK_NONE, MASK_CAUSAL, MASK_SLIDING_WINDOW};
+    for (int m = 0; m < 3; ++m) {
+        FlashAttention<FLOAT32> attention(dim, heads);
+        attention.set_mask(masks[m], 256);
+        auto start = std::chrono::high_resolution_clock::now();
+        Tensor<FLOAT32> out = attention.forward(q, k, v);
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> ms = end - start;
+        std::cout << "T=" << seq << " mask " << names[m] << ": " << ms.count() << " ms" << std::endl;
+        deallocate_memory(out.data());
+    }
+}
@@ -0,0 +1,120 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+#include "autograd.h"
+
+static Tensor<FLOAT32> uniform_tensor(const std::vector<int>& shape, std::mt19937& rng) {
+    std::uniform_real_distribution<float> dis(-1.0f, 1.0f);
+    Tensor<FLOAT32> t(shape);
+    for (int i = 0; i < t.size(); ++i) t.data()[i] = dis(rng);
+    return t;
+}
+
+// Every registered op in one graph, with a shared input and a squared term.
+static Tensor<FLOAT32> autograd_graph(const Tensor<FLOAT32>& x, const Tensor<FLOAT32>& w, const Tensor<FLOAT32>& b) {
+    auto h = std::make_shared<Tensor<FLOAT32>>(matmul(x, w) + b);
+    auto sq = std::make_shared<Tensor<FLOAT32>>(*h * *h);
+    Tensor<FLOAT32> left = h->get_slice({0, 1}, {4, 4});
+    Tensor<FLOAT32> right = sq->get_slice({0, 0}, {4, 3}) - b.get_slice({0, 2}, {4, 5});
+    Tensor<FLOAT32> wide = hstack(left, right);
+    return vstack(wide, hstack(right, left) * wide);
+}
+
+static float weighted_sum(const Tensor<FLOAT32>& out, const Tensor<FLOAT32>& weights) {
+    double total = 0.0;
+    for (int i = 0; i < out.size(); ++i) total += static_cast<double>(out.data()[i]) * weights.data()[i];
+    return static_cast<float>(total);
+}
+
+void test_autograd() {
+    std::mt19937 rng(42);
+    // get_slice needs shared ownership, so inputs live in shared_ptrs
+    auto x = std::make_shared<Tensor<FLOAT32>>(uniform_tensor({4, 6}, rng));
+    auto w = std::make_shared<Tensor<FLOAT32>>(uniform_tensor({6, 5}, rng));
+    auto b = std::make_shared<Tensor<FLOAT32>>(uniform_tensor({4, 5}, rng));
+    requires_grad(*x);
+    requires_grad(*w);
+    requires_grad(*b);
+
+    Tensor<FLOAT32> out = autograd_graph(*x, *w, *b);
+    Tensor<FLOAT32> seed = uniform_tensor(out.shape, rng);
+    BackwardStats stats = backward(out, &seed);
+    assert(stats.nodes > 10);
+
+    // central differences of sum(seed * out) against every input element
+    const float eps = 1e-2f;
+    float max_err = 0.0f;
+    for (auto& leaf : {x, w, b}) {
+        for (int i = 0; i < leaf->size(); ++i) {
+            float orig = leaf->data()[i];
+            leaf->data()[i] = orig + eps;
+            float up = weighted_sum(autograd_graph(*x, *w, *b), seed);
+            leaf->data()[i] = orig - eps;
+            float down = weighted_sum(autograd_graph(*x, *w, *b), seed);
+            leaf->data()[i] = orig;
+            float numeric = (up - down) / (2 * eps);
+            float analytic = leaf->grad->data()[i];
+            max_err = std::max(max_err, std::fabs(numeric - analytic) / std::max(1.0f, std::fabs(numeric)));
+        }
+    }
+    assert(max_err < 1e-2f);
+
+    // a second backward accumulates
+    float before = w->grad->data()[3];
+    backward(out, &seed);
+    assert(std::fabs(w->grad->data()[3] - 2 * before) < 1e-4f * std::max(1.0f, std::fabs(before)));
+
+    // constants get nothing and need no gradient storage
+    Tensor<FLOAT32> c = uniform_tensor({4, 5}, rng);
+    Tensor<FLOAT32> only_constants = c * c;
+    BackwardStats none = backward(only_constants);
+    assert(none.pool_bytes == 0 && !c.grad);
+
+    // a chain far deeper than a recursive walk would survive
+    Tensor<FLOAT32> start = uniform_tensor({8}, rng), step = uniform_tensor({8}, rng);
+    requires_grad(start);
+    Tensor<FLOAT32> chain = start;
+    const int depth = 20000;
+    for (int i = 0; i < depth; ++i) {
+        chain = chain + step;
+    }
+    BackwardStats deep = backward(chain);
+    for (int i = 0; i < 8; ++i) {
+        assert(start.grad->data()[i] == 1.0f);
+    }
+    // a node's gradient and its input's, never more, recycled through the pool
+    assert(deep.peak_grad_bytes == 2 * 8 * sizeof(float));
+    assert(deep.pool_bytes == 2 * 8 * sizeof(float));
+    std::cout << "gradient check max error: " << max_err << ", chain of " << depth << ": peak "
+              << deep.peak_grad_bytes << " B vs " << deep.unfreed_bytes << " B without freeing" << std::endl;
+}
+
+void benchmark_autograd() {
+    std::mt19937 rng(7);
+    const int batch = 64, width = 256, layers = 16;
+    Tensor<FLOAT32> x = uniform_tensor({batch, width}, rng);
+    std::vector<Tensor<FLOAT32>> weights;
+    for (int l = 0; l < layers; ++l) {
+        weights.push_back(uniform_tensor({width, width}, rng));
+        for (int i = 0; i < weights[l].size(); ++i) weights[l].data()[i] *= 0.1f;
+        requires_grad(weights[l]);
+    }
+    // x <- x + (x W) * (x W), a residual stack with a square nonlinearity
+    Tensor<FLOAT32> h = x;
+    for (int l = 0; l < layers; ++l) {
+        Tensor<FLOAT32> y = matmul(h, weights[l]);
+        h = h + y * y;
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    BackwardStats stats = backward(h);
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    std::cout << "backward through " << layers << " layers: " << elapsed.count() * 1e3 << " ms, " << stats.nodes
+              << " nodes, gradient memory peak " << stats.peak_grad_bytes / 1e6 << " MB, pool "
+              << stats.pool_bytes / 1e6 << " MB, without freeing " << stats.unfreed_bytes / 1e6 << " MB"
+              << std::endl;
+}
@@ -0,0 +1,151 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "checkpoint.h"
+
+// Every weight gradient of the decoder blocks, flattened.
+static std::vector<float> block_weight_grads(LlamaModel<FLOAT32>& model) {
+    std::vector<float> grads;
+    auto append = [&](Tensor<FLOAT32>& weight) {
+        assert(weight.grad);
+        grads.insert(grads.end(), weight.grad->data(), weight.grad->data() + weight.size());
+        weight.grad = nullptr;
+    };
+    for (LlamaBlock<FLOAT32>& block : model.blocks()) {
+        append(block.attention_norm.weight());
+        append(block.qkv.weights().full());
+        append(block.output.weights().full());
+        append(block.ffn_norm.weight());
+        append(block.ffn.gate_up().weights().full());
+        append(block.ffn.down().weights().full());
+    }
+    return grads;
+}
+
+static float max_abs_diff(const std::vector<float>& a, const std::vector<float>& b) {
+    assert(a.size() == b.size());
+    float diff = 0.0f;
+    for (size_t i = 0; i < a.size(); ++i) diff = std::max(diff, std::fabs(a[i] - b[i]));
+    return diff;
+}
+
+void test_checkpointing() {
+    LlamaConfig config;
+    config.vocab_size = 64;
+    config.dim = 32;
+    config.num_layers = 3;
+    config.num_heads = 4;
+    config.num_kv_heads = 2;
+    config.hidden_dim = 48;
+    config.max_seq = 16;
+    LlamaModel<FLOAT32> model(config);
+    const int batch = 2, seq = 8, rows = batch * seq;
+
+    std::mt19937 rng(43);
+    std::normal_distribution<float> dis(0.0f, 1.0f);
+    std::vector<float> x(rows * config.dim), seed(rows * config.dim);
+    for (auto& v : x) v = dis(rng);
+    for (auto& v : seed) v = dis(rng);
+
+    CheckpointedDecoder<FLOAT32> decoder(model.blocks(), config);
+    std::vector<float> y(x.size()), dx(x.size());
+    decoder.forward(x.data(), y.data(), batch, seq);
+    size_t full_bytes = decoder.saved_bytes();
+    size_t full_slab = decoder.memory_plan().slab_bytes();
+    assert(full_slab < decoder.memory_plan().unshared_bytes());
+    decoder.backward(seed.data(), dx.data());
+    std::vector<float> grads = block_weight_grads(model);
+
+    // d sum(seed * y) / dx by central differences
+    auto loss = [&](const std::vector<float>& input) {
+        std::vector<float> out(input.size());
+        decoder.forward(input.data(), out.data(), batch, seq);
+        double total = 0.0;
+        for (size_t i = 0; i < out.size(); ++i) total += static_cast<double>(out[i]) * seed[i];
+        return total;
+    };
+    const float eps = 1e-2f;
+    for (int i : {0, 37, 250, rows * config.dim - 1}) {
+        std::vector<float> up = x, down = x;
+        up[i] += eps;
+        down[i] -= eps;
+        float numeric = static_cast<float>((loss(up) - loss(down)) / (2 * eps));
+        assert(std::fabs(numeric - dx[i]) < 2e-2f * std::max(1.0f, std::fabs(numeric)));
+    }
+    // and through one weight of the middle block
+    float& w = model.blocks()[1].qkv.weights().full().data()[5];
+    const float w0 = w;
+    w = w0 + eps;
+    double up = loss(x);
+    w = w0 - eps;
+    double down = loss(x);
+    w = w0;
+    float numeric = static_cast<float>((up - down) / (2 * eps));
+    // block 1's gradients start after block 0's; attention_norm comes before qkv
+    const int64_t block_size = grads.size() / config.num_layers;
+    float analytic = grads[block_size + config.dim + 5];
+    assert(std::fabs(numeric - analytic) < 2e-2f * std::max(1.0f, std::fabs(numeric)));
+
+    // every policy gives the same output and gradients for less memory
+    std::vector<CheckpointPolicy> policies = {{CHECKPOINT_ATTENTION, 1}, {CHECKPOINT_BLOCK, 1}, {CHECKPOINT_BLOCK, 2}};
+    for (const CheckpointPolicy& policy : policies) {
+        decoder.set_policy(policy);
+        std::vector<float> y2(x.size()), dx2(x.size());
+        decoder.forward(x.data(), y2.data(), batch, seq);
+        size_t saved = decoder.saved_bytes();
+        decoder.backward(seed.data(), dx2.data());
+        assert(max_abs_diff(y, y2) < 1e-5f);
+        assert(max_abs_diff(dx, dx2) < 1e-5f);
+        assert(max_abs_diff(grads, block_weight_grads(model)) < 1e-4f);
+        assert(saved < full_bytes);
+        assert(decoder.memory_plan().slab_bytes() < full_slab);
+        std::cout << "policy " << policy.mode << "/" << policy.every << ": saved " << saved << " B of " << full_bytes
+                  << " B, recompute buffers " << decoder.recompute_bytes() << " B, slab "
+                  << decoder.memory_plan().slab_bytes() << " B of " << full_slab << " B" << std::endl;
+    }
+}
+
+void benchmark_checkpointing() {
+    LlamaConfig config;
+    config.vocab_size = 256;
+    config.dim = 256;
+    config.num_layers = 8;
+    config.num_heads = 8;
+    config.num_kv_heads = 4;
+    config.hidden_dim = 688;
+    config.max_seq = 256;
+    LlamaModel<FLOAT32> model(config);
+    const int batch = 2, seq = 256, rows = batch * seq;
+
+    std::mt19937 rng(44);
+    std::normal_distribution<float> dis(0.0f, 1.0f);
+    std::vector<float> x(rows * config.dim), seed(rows * config.dim), y(x.size()), dx(x.size());
+    for (auto& v : x) v = dis(rng);
+    for (auto& v : seed) v = dis(rng);
+
+    struct Named { const char* name; CheckpointPolicy policy; };
+    std::vector<Named> policies = {{"none", {CHECKPOINT_NONE, 1}}, {"attention only", {CHECKPOINT_ATTENTION, 1}},
+        {"every 2nd block", {CHECKPOINT_BLOCK, 2}}, {"every block", {CHECKPOINT_BLOCK, 1}}};
+    double baseline = 0.0;
+    for (const Named& entry : policies) {
+        CheckpointedDecoder<FLOAT32> decoder(model.blocks(), config, entry.policy);
+        decoder.forward(x.data(), y.data(), batch, seq);
+        decoder.backward(seed.data(), dx.data());
+        const int iters = 3;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int it = 0; it < iters; ++it) {
+            decoder.forward(x.data(), y.data(), batch, seq);
+            decoder.backward(seed.data(), dx.data());
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsed = end - start;
+        double step = elapsed.count() / iters;
+        if (baseline == 0.0) baseline = step;
+        std::cout << entry.name << ": " << step * 1e3 << " ms/step (" << step / baseline << "x), activations "
+                  << (decoder.saved_bytes() + decoder.recompute_bytes()) / 1e6 << " MB, planned slab "
+                  << decoder.memory_plan().slab_bytes() / 1e6 << " MB" << std::endl;
+    }
+}
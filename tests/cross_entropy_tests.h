@@ -0,0 +1,130 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "cross_entropy.h"
+
+// Full-logits cross-entropy through Linear: logits, softmax, d logits and
+// lm_head.backward_rows, the way the training glue did it before.
+template<DType dtype>
+static float naive_cross_entropy(Linear<dtype>& head, const typename DTypeToType<dtype>::Type* hidden,
+    const uint32_t* targets, int64_t rows, typename DTypeToType<dtype>::Type* grad_hidden, size_t* logit_bytes) {
+    using T = typename DTypeToType<dtype>::Type;
+    const int64_t vocab = head.out_features();
+    std::vector<T> logits(static_cast<size_t>(rows) * vocab);
+    head.forward_rows(hidden, logits.data(), rows);
+    int64_t counted = 0;
+    for (int64_t i = 0; i < rows; ++i) counted += targets[i] != ChunkedCrossEntropy<dtype>::ignore_index;
+    double loss = 0.0;
+    for (int64_t i = 0; i < rows; ++i) {
+        T* l = logits.data() + i * vocab;
+        if (targets[i] == ChunkedCrossEntropy<dtype>::ignore_index) {
+            for (int64_t v = 0; v < vocab; ++v) l[v] = from_float<dtype>(0.0f);
+            continue;
+        }
+        float m = -INFINITY, sum = 0.0f;
+        for (int64_t v = 0; v < vocab; ++v) m = std::max(m, to_float<dtype>(l[v]));
+        for (int64_t v = 0; v < vocab; ++v) sum += std::exp(to_float<dtype>(l[v]) - m);
+        float lse = m + std::log(sum);
+        loss += lse - to_float<dtype>(l[targets[i]]);
+        for (int64_t v = 0; v < vocab; ++v) {
+            float p = std::exp(to_float<dtype>(l[v]) - lse);
+            l[v] = from_float<dtype>((p - (v == targets[i] ? 1.0f : 0.0f)) / counted);
+        }
+    }
+    head.backward_rows(logits.data(), hidden, grad_hidden, rows);
+    if (logit_bytes != nullptr) *logit_bytes = logits.size() * sizeof(T);
+    return static_cast<float>(loss / counted);
+}
+
+void test_cross_entropy() {
+    std::mt19937 rng(46);
+    std::normal_distribution<float> dis(0.0f, 1.0f);
+    const int dim = 40, vocab = 1000;
+    const int64_t rows = 37;
+    std::vector<float> hidden(rows * dim);
+    for (auto& h : hidden) h = dis(rng);
+    std::vector<uint32_t> targets(rows);
+    for (auto& t : targets) t = rng() % vocab;
+    targets[3] = targets[20] = ChunkedCrossEntropy<FLOAT32>::ignore_index;
+    targets[5] = vocab - 1;
+
+    // same weights for both paths; the grads are compared after each run
+    Linear<FLOAT32> naive_head(dim, vocab), chunked_head(dim, vocab);
+    Tensor<FLOAT32>& w = naive_head.weights().full();
+    std::copy(w.data(), w.data() + w.size(), chunked_head.weights().full().data());
+
+    std::vector<float> dh_naive(rows * dim), dh_chunked(rows * dim);
+    float loss_naive = naive_cross_entropy(naive_head, hidden.data(), targets.data(), rows, dh_naive.data(), nullptr);
+    // 16-row chunks and 256-wide tiles leave a ragged last chunk and tile
+    ChunkedCrossEntropy<FLOAT32> ce(chunked_head, 16, 256);
+    float loss_chunked = ce.forward_backward(hidden.data(), targets.data(), rows, dh_chunked.data());
+    assert(std::fabs(loss_naive - loss_chunked) < 1e-4f);
+    assert(std::fabs(ce.forward(hidden.data(), targets.data(), rows) - loss_chunked) < 1e-6f);
+
+    float dh_diff = 0.0f, dw_diff = 0.0f;
+    for (size_t i = 0; i < dh_naive.size(); ++i) dh_diff = std::max(dh_diff, std::fabs(dh_naive[i] - dh_chunked[i]));
+    const float* gw_naive = naive_head.weights().full().grad->data();
+    const float* gw_chunked = chunked_head.weights().full().grad->data();
+    for (int i = 0; i < w.size(); ++i) dw_diff = std::max(dw_diff, std::fabs(gw_naive[i] - gw_chunked[i]));
+    assert(dh_diff < 1e-5f && dw_diff < 1e-5f);
+    for (int d = 0; d < dim; ++d) assert(dh_chunked[3 * dim + d] == 0.0f && dh_chunked[20 * dim + d] == 0.0f);
+
+    // grad_scale multiplies d hidden and d W, not the loss
+    std::vector<float> dh_scaled(rows * dim);
+    float loss_scaled = ce.forward_backward(hidden.data(), targets.data(), rows, dh_scaled.data(), 8.0f);
+    assert(loss_scaled == loss_chunked);
+    for (size_t i = 0; i < dh_scaled.size(); ++i) assert(std::fabs(dh_scaled[i] - 8.0f * dh_chunked[i]) < 1e-5f);
+
+    // the workspace depends on the chunk sizes, not on the vocabulary
+    size_t small_bytes = ce.workspace_bytes();
+    Linear<FLOAT32> big_head(dim, 50 * vocab);
+    ChunkedCrossEntropy<FLOAT32> big_ce(big_head, 16, 256);
+    std::vector<uint32_t> big_targets(rows);
+    for (auto& t : big_targets) t = rng() % (50 * vocab);
+    big_ce.forward_backward(hidden.data(), big_targets.data(), rows, dh_chunked.data());
+    assert(big_ce.workspace_bytes() == small_bytes);
+
+    // fp16 activations and weights go through the same fp32 tiles
+    Linear<FLOAT16> head16(dim, vocab);
+    std::vector<uint16_t> hidden16(rows * dim), dh16(rows * dim), dh16_naive(rows * dim);
+    for (size_t i = 0; i < hidden.size(); ++i) hidden16[i] = from_float<FLOAT16>(hidden[i]);
+    ChunkedCrossEntropy<FLOAT16> ce16(head16, 16, 256);
+    float loss16 = ce16.forward_backward(hidden16.data(), targets.data(), rows, dh16.data());
+    float loss16_naive = naive_cross_entropy(head16, hidden16.data(), targets.data(), rows, dh16_naive.data(), nullptr);
+    assert(std::fabs(loss16 - loss16_naive) < 1e-2f);
+
+    std::cout << "chunked vs full-logits cross-entropy: loss " << loss_chunked << " vs " << loss_naive
+              << ", max |d hidden| diff " << dh_diff << ", max |d W| diff " << dw_diff << ", workspace "
+              << small_bytes << " bytes for vocab " << vocab << " and " << 50 * vocab << std::endl;
+}
+
+void benchmark_cross_entropy() {
+    std::mt19937 rng(47);
+    std::normal_distribution<float> dis(0.0f, 1.0f);
+    const int dim = 256, vocab = 32000;
+    const int64_t rows = 512;
+    std::vector<float> hidden(rows * dim), dh(rows * dim);
+    for (auto& h : hidden) h = dis(rng);
+    std::vector<uint32_t> targets(rows);
+    for (auto& t : targets) t = rng() % vocab;
+    Linear<FLOAT32> head(dim, vocab);
+
+    size_t logit_bytes = 0;
+    naive_cross_entropy(head, hidden.data(), targets.data(), rows, dh.data(), &logit_bytes);
+    auto start = std::chrono::high_resolution_clock::now();
+    float loss_naive = naive_cross_entropy(head, hidden.data(), targets.data(), rows, dh.data(), nullptr);
+    auto mid = std::chrono::high_resolution_clock::now();
+    ChunkedCrossEntropy<FLOAT32> ce(head);
+    float loss_chunked = ce.forward_backward(hidden.data(), targets.data(), rows, dh.data());
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double> naive_s = mid - start, chunked_s = end - mid;
+    std::cout << "rows " << rows << ", dim " << dim << ", vocab " << vocab << std::endl;
+    std::cout << "full logits: " << naive_s.count() * 1000 << " ms, " << logit_bytes / (1024.0 * 1024.0)
+              << " MB of logits, loss " << loss_naive << std::endl;
+    std::cout << "chunked:     " << chunked_s.count() * 1000 << " ms, " << ce.workspace_bytes() / (1024.0 * 1024.0)
+              << " MB workspace, loss " << loss_chunked << std::endl;
+}
@@ -1,4 +1,5 @@
 #include <cassert>
+#include <chrono>
 #include <iostream>
 #include "embeddings.h"
 #include "tensor.h"
@@ -18,8 +19,10 @@ void test_embeddings() {
     input.set({0, 0}, 3); // Token ID 3
     
     Tensor<FLOAT32> output = embeddings.forward(input);
+    assert(output.shape.size() == 3);
     assert(output.shape[0] == 1);          // Batch size
-    assert(output.shape[1] == embedding_dim); // Embedding dimension
+    assert(output.shape[1] == 1);          // Sequence length
+    assert(output.shape[2] == embedding_dim); // Embedding dimension
    
     // Test Forward Method: Multiple Token IDs
     input_shape = {2, 1}; // (batch_size = 2, sequence_length = 1)
@@ -29,7 +32,20 @@ void test_embeddings() {
     
     output = embeddings.forward(input_multiple);
     assert(output.shape[0] == 2);         // Batch size
-    assert(output.shape[1] == embedding_dim); // Embedding dimension
+    assert(output.shape[2] == embedding_dim); // Embedding dimension
+
+    // Test Forward Method: [B, T] batch gathers whole rows
+    Tensor<UINT32> input_bt({2, 3});
+    std::vector<uint32_t> ids = {0, 9, 4, 4, 1, 7};
+    std::copy(ids.begin(), ids.end(), input_bt.data());
+    output = embeddings.forward(input_bt);
+    assert(output.shape == std::vector<int>({2, 3, static_cast<int>(embedding_dim)}));
+    Tensor<FLOAT32> table = embeddings.get_embedding_matrix();
+    for (size_t t = 0; t < ids.size(); ++t) {
+        for (size_t j = 0; j < embedding_dim; ++j) {
+            assert(output.data()[t * embedding_dim + j] == table.data()[ids[t] * embedding_dim + j]);
+        }
+    }
     
     // Test Forward Method: Out of Range Token ID
     Tensor<UINT32> input_out_of_range({1, 1});
@@ -47,3 +63,132 @@ void test_embeddings() {
     std::cout << "All tests passed!" << std::endl;
 }
 
+
+void benchmark_embedding_gather() {
+    // Llama-7B sized table, 2048-token prefill
+    const size_t vocab_size = 32000;
+    const size_t embedding_dim = 4096;
+    const int batch = 1, seq = 2048;
+    Embeddings<FLOAT32> embeddings(vocab_size, embedding_dim);
+
+    Tensor<UINT32> tokens({batch, seq});
+    std::mt19937 rng(7);
+    for (int i = 0; i < batch * seq; ++i) {
+        tokens.data()[i] = rng() % vocab_size;
+    }
+
+    embeddings.forward(tokens);
+    const int iters = 10;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iters; ++i) {
+        Tensor<FLOAT32> out = embeddings.forward(tokens);
+        deallocate_memory(out.data());
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+
+    // one read of the row plus one write of the output per token
+    double bytes = 2.0 * batch * seq * embedding_dim * sizeof(float) * iters;
+    std::cout << "Gather of " << batch * seq << " tokens: " << elapsed.count() / iters * 1e3 << " ms, "
+              << bytes / elapsed.count() / 1e9 << " GB/s" << std::endl;
+}
+
+void test_embedding_sparse_grad() {
+    const size_t vocab_size = 50;
+    const size_t embedding_dim = 6;
+    Embeddings<FLOAT32> embeddings(vocab_size, embedding_dim);
+    Tensor<FLOAT32> before = embeddings.get_embedding_matrix();
+    std::vector<float> initial(before.data(), before.data() + vocab_size * embedding_dim);
+
+    // duplicates (3 and 17) must be summed into a single row
+    Tensor<UINT32> tokens({2, 4});
+    std::vector<uint32_t> ids = {17, 3, 42, 3, 0, 17, 17, 8};
+    std::copy(ids.begin(), ids.end(), tokens.data());
+    Tensor<FLOAT32> out = embeddings.forward(tokens);
+
+    Tensor<FLOAT32> grad_output = Tensor<FLOAT32>::rand(out.shape);
+    SparseRowGrad<FLOAT32> grad = embeddings.backward(grad_output);
+    assert(grad.rows == std::vector<uint32_t>({0, 3, 8, 17, 42}));
+
+    std::vector<float> dense(vocab_size * embedding_dim, 0.0f);
+    for (size_t t = 0; t < ids.size(); ++t) {
+        for (size_t j = 0; j < embedding_dim; ++j) {
+            dense[ids[t] * embedding_dim + j] += grad_output.data()[t * embedding_dim + j];
+        }
+    }
+    for (size_t u = 0; u < grad.rows.size(); ++u) {
+        for (size_t j = 0; j < embedding_dim; ++j) {
+            assert(std::abs(grad.values.data()[u * embedding_dim + j] - dense[grad.rows[u] * embedding_dim + j]) < 1e-5f);
+        }
+    }
+
+    // SGD leaves untouched rows bit-identical
+    const float lr = 0.1f;
+    embeddings.update(grad, lr);
+    const float* table = embeddings.get_embedding_matrix().data();
+    for (size_t i = 0; i < vocab_size * embedding_dim; ++i) {
+        assert(std::abs(table[i] - (initial[i] - lr * dense[i])) < 1e-6f);
+    }
+
+    // first lazy Adam step moves every touched weight by ~lr and nothing else
+    std::vector<float> after_sgd(table, table + vocab_size * embedding_dim);
+    embeddings.update_adam(grad, 0.01f);
+    for (size_t r = 0; r < vocab_size; ++r) {
+        bool touched = std::find(grad.rows.begin(), grad.rows.end(), r) != grad.rows.end();
+        for (size_t j = 0; j < embedding_dim; ++j) {
+            float delta = after_sgd[r * embedding_dim + j] - table[r * embedding_dim + j];
+            if (touched) {
+                assert(std::abs(delta - 0.01f) < 1e-4f);
+            } else {
+                assert(delta == 0.0f);
+            }
+        }
+    }
+    std::cout << "Sparse embedding gradient tests passed!" << std::endl;
+}
+
+void test_quantized_embeddings() {
+    const size_t vocab_size = 1000;
+    const size_t embedding_dim = 64;
+    Embeddings<FLOAT32> full(vocab_size, embedding_dim);
+    Embeddings<FLOAT32> half(vocab_size, embedding_dim, STORAGE_FLOAT16);
+    Embeddings<FLOAT32> int8(vocab_size, embedding_dim, STORAGE_INT8_ROWWISE);
+
+    std::cout << "Table bytes: fp32 " << full.table_bytes() << ", fp16 " << half.table_bytes()
+              << ", int8 " << int8.table_bytes() << std::endl;
+    assert(half.table_bytes() * 2 == full.table_bytes());
+    assert(int8.table_bytes() * 3 < full.table_bytes());
+
+    Tensor<UINT32> tokens({4, 16});
+    for (int i = 0; i < tokens.size(); ++i) {
+        tokens.data()[i] = (i * 37) % vocab_size;
+    }
+    for (Embeddings<FLOAT32>* emb : {&half, &int8}) {
+        Tensor<FLOAT32> out = emb->forward(tokens);
+        Tensor<FLOAT32> table = emb->get_embedding_matrix();
+        // lookups return exactly the dequantized rows, which stay close to U(0, 1) values
+        float tolerance = emb == &half ? 1e-3f : 1.0f / 127.0f;
+        for (int t = 0; t < tokens.size(); ++t) {
+            for (size_t j = 0; j < embedding_dim; ++j) {
+                float v = out.data()[t * embedding_dim + j];
+                assert(v == table.data()[tokens.data()[t] * embedding_dim + j]);
+                assert(v > -tolerance && v < 1.0f + tolerance);
+            }
+        }
+
+        // sparse updates re-quantize only the touched rows
+        Tensor<FLOAT32> grad_output = Tensor<FLOAT32>::ones(out.shape);
+        SparseRowGrad<FLOAT32> grad = emb->backward(grad_output);
+        emb->update(grad, 0.0f);
+        Tensor<FLOAT32> after = emb->get_embedding_matrix();
+        for (size_t i = 0; i < vocab_size * embedding_dim; ++i) {
+            assert(std::abs(after.data()[i] - table.data()[i]) <= tolerance);
+        }
+    }
+
+    // a half-precision layer over an int8 table
+    Embeddings<FLOAT16> half_layer(vocab_size, embedding_dim, STORAGE_INT8_ROWWISE);
+    Tensor<FLOAT16> half_out = half_layer.forward(tokens);
+    assert(half_out.shape[2] == static_cast<int>(embedding_dim));
+    std::cout << "Quantized embedding tests passed!" << std::endl;
+}
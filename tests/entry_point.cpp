@@ -13,6 +13,22 @@
 #include "dataloading.h"
 #include "embed_tests.h"
 #include "rms_norm_test.h"
+#include "numa_benchmark.h"
+#include "attention_tests.h"
+#include "kv_cache_tests.h"
+#include "rope_tests.h"
+#include "feed_forward_tests.h"
+#include "llama_model_tests.h"
+#include "memory_planner_tests.h"
+#include "autograd_tests.h"
+#include "checkpoint_tests.h"
+#include "optimizer_tests.h"
+#include "mixed_precision_tests.h"
+#include "cross_entropy_tests.h"
+#include "trainer_tests.h"
+#include "lora_tests.h"
+#include "moe_tests.h"
+#include "sampler_tests.h"
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
@@ -78,6 +94,166 @@ int main(int argc, char* argv[]) {
             std::cout << "Testing the rms norm function..." << std::endl;
             test_rmsnorm_forward();
             break;
+        case 15:
+            std::cout << "Running decode benchmark with NUMA placement on/off..." << std::endl;
+            benchmark_numa_decode();
+            break;
+        case 16:
+            std::cout << "Testing row-wise rms norm forward/backward..." << std::endl;
+            test_rmsnorm_rows_and_backward();
+            break;
+        case 17:
+            std::cout << "Running Benchmark for embedding row gather..." << std::endl;
+            benchmark_embedding_gather();
+            break;
+        case 18:
+            std::cout << "Testing sparse embedding gradients and updates..." << std::endl;
+            test_embedding_sparse_grad();
+            break;
+        case 19:
+            std::cout << "Testing fp16/int8 embedding tables..." << std::endl;
+            test_quantized_embeddings();
+            break;
+        case 20:
+            std::cout << "Testing the flash attention forward..." << std::endl;
+            test_flash_attention_forward();
+            break;
+        case 21:
+            std::cout << "Running Benchmark for flash attention vs naive attention..." << std::endl;
+            benchmark_flash_attention();
+            break;
+        case 22:
+            std::cout << "Testing the flash attention backward..." << std::endl;
+            test_flash_attention_backward();
+            break;
+        case 23:
+            std::cout << "Testing grouped-query attention..." << std::endl;
+            test_grouped_query_attention();
+            break;
+        case 24:
+            std::cout << "Testing causal/sliding-window/block-diagonal attention masks..." << std::endl;
+            test_attention_masks();
+            break;
+        case 25:
+            std::cout << "Running Benchmark for masked attention..." << std::endl;
+            benchmark_attention_masks();
+            break;
+        case 26:
+            std::cout << "Testing the paged KV cache..." << std::endl;
+            test_paged_kv_cache();
+            break;
+        case 27:
+            std::cout << "Running Benchmark for cached decode vs recomputing the prefix..." << std::endl;
+            benchmark_kv_cache_decode();
+            break;
+        case 28:
+            std::cout << "Testing fp16/int8 KV cache storage..." << std::endl;
+            test_quantized_kv_cache();
+            break;
+        case 29:
+            std::cout << "Testing KV cache eviction with attention sinks..." << std::endl;
+            test_streaming_kv_cache();
+            break;
+        case 30:
+            std::cout << "Testing RoPE..." << std::endl;
+            test_rope();
+            break;
+        case 31:
+            std::cout << "Testing the SwiGLU feed-forward layer..." << std::endl;
+            test_feed_forward();
+            break;
+        case 32:
+            std::cout << "Running Benchmark for fused vs unfused SwiGLU..." << std::endl;
+            benchmark_feed_forward();
+            break;
+        case 33:
+            std::cout << "Testing the Llama model forward..." << std::endl;
+            test_llama_model();
+            break;
+        case 34:
+            std::cout << "Running Benchmark for Llama prefill vs decode..." << std::endl;
+            benchmark_llama_model();
+            break;
+        case 35:
+            std::cout << "Testing the activation memory planner..." << std::endl;
+            test_memory_planner();
+            break;
+        case 36:
+            std::cout << "Testing autograd..." << std::endl;
+            test_autograd();
+            break;
+        case 37:
+            std::cout << "Running Benchmark for autograd peak gradient memory..." << std::endl;
+            benchmark_autograd();
+            break;
+        case 38:
+            std::cout << "Testing activation checkpointing..." << std::endl;
+            test_checkpointing();
+            break;
+        case 39:
+            std::cout << "Running Benchmark for checkpointing memory vs compute..." << std::endl;
+            benchmark_checkpointing();
+            break;
+        case 40:
+            std::cout << "Testing the fused optimizers..." << std::endl;
+            test_optimizer();
+            break;
+        case 41:
+            std::cout << "Running Benchmark for fused vs per-tensor AdamW..." << std::endl;
+            benchmark_optimizer();
+            break;
+        case 42:
+            std::cout << "Testing mixed-precision training..." << std::endl;
+            test_mixed_precision();
+            break;
+        case 43:
+            std::cout << "Running Benchmark for fp32 vs mixed-precision training on wikitext-2..." << std::endl;
+            benchmark_mixed_precision();
+            break;
+        case 44:
+            std::cout << "Testing chunked cross-entropy..." << std::endl;
+            test_cross_entropy();
+            break;
+        case 45:
+            std::cout << "Running Benchmark for chunked vs full-logits cross-entropy..." << std::endl;
+            benchmark_cross_entropy();
+            break;
+        case 46:
+            std::cout << "Testing the gradient-accumulation trainer..." << std::endl;
+            test_trainer();
+            break;
+        case 47:
+            std::cout << "Running Benchmark for micro-batched training on wikitext-2..." << std::endl;
+            benchmark_trainer();
+            break;
+        case 48:
+            std::cout << "Testing LoRA adapters..." << std::endl;
+            test_lora();
+            break;
+        case 49:
+            std::cout << "Running Benchmark for LoRA vs full fine-tuning..." << std::endl;
+            benchmark_lora();
+            break;
+        case 50:
+            std::cout << "Testing the mixture-of-experts FFN..." << std::endl;
+            test_moe();
+            break;
+        case 51:
+            std::cout << "Running Benchmark for dense vs mixture-of-experts FFN..." << std::endl;
+            benchmark_moe();
+            break;
+        case 52:
+            std::cout << "Testing the token sampler..." << std::endl;
+            test_sampler();
+            break;
+        case 53:
+            std::cout << "Running Benchmark for the sampler vs full-sort sampling..." << std::endl;
+            benchmark_sampler();
+            break;
+        case 54:
+            std::cout << "Testing the thread pool..." << std::endl;
+            test_thread_pool();
+            break;
 
         default:
             std::cout << "Invalid test number." << std::endl;
@@ -0,0 +1,291 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "flash_attention.h"
+#include "kv_cache.h"
+
+// Slice tokens [0, len) of a [1, S, Hkv, Dh] tensor into a fresh contiguous tensor.
+static Tensor<FLOAT32> prefix_of(const Tensor<FLOAT32>& t, int len) {
+    Tensor<FLOAT32> out({1, len, t.shape[2], t.shape[3]});
+    std::memcpy(out.data(), t.data(), sizeof(float) * out.size());
+    return out;
+}
+
+void test_paged_kv_cache() {
+    std::mt19937 rng(19);
+    const int heads = 4, kv_heads = 2, dim = 8, page_size = 4, layers = 2;
+    const int lengths[2] = {21, 13};
+    KVCache<FLOAT32> cache(layers, kv_heads, dim, page_size, 16);
+    FlashAttention<FLOAT32> attention(dim, heads, kv_heads);
+    attention.set_block_sizes(4, 4);
+    attention.set_mask(MASK_CAUSAL);
+
+    Tensor<FLOAT32> keys[2], values[2], queries[2];
+    int seqs[2];
+    for (int n = 0; n < 2; ++n) {
+        keys[n] = random_tensor({1, lengths[n], kv_heads, dim}, rng);
+        values[n] = random_tensor({1, lengths[n], kv_heads, dim}, rng);
+        queries[n] = random_tensor({1, lengths[n], heads, dim}, rng);
+        seqs[n] = cache.add_sequence();
+    }
+
+    // interleave single-token decode steps of both sequences, so their pages interleave in the pool
+    const int64_t kv_row = kv_heads * dim, q_row = heads * dim;
+    std::vector<float> out(q_row);
+    for (int step = 0; step < lengths[0]; ++step) {
+        for (int n = 0; n < 2; ++n) {
+            if (step >= lengths[n]) {
+                continue;
+            }
+            int pos = cache.append(seqs[n]);
+            assert(pos == step);
+            for (int layer = 0; layer < layers; ++layer) {
+                cache.store(seqs[n], layer, pos, keys[n].data() + pos * kv_row, values[n].data() + pos * kv_row);
+            }
+            attention.forward_paged(cache, {seqs[n]}, layers - 1, queries[n].data() + pos * q_row, out.data(), 1);
+
+            FlashAttention<FLOAT32> reference(dim, heads, kv_heads);
+            Tensor<FLOAT32> q({1, 1, heads, dim});
+            std::memcpy(q.data(), queries[n].data() + pos * q_row, sizeof(float) * q_row);
+            Tensor<FLOAT32> expected = reference.forward(q, prefix_of(keys[n], pos + 1), prefix_of(values[n], pos + 1));
+            for (int i = 0; i < q_row; ++i) {
+                assert(std::abs(out[i] - expected.data()[i]) < 1e-5f);
+            }
+        }
+    }
+    assert(cache.free_pages() == 16 - (21 + 3) / 4 - (13 + 3) / 4);
+
+    // chunked prefill: the last 5 queries at once, causal inside the chunk
+    const int chunk = 5;
+    std::vector<float> chunk_out(chunk * q_row);
+    const float* chunk_q = queries[0].data() + (lengths[0] - chunk) * q_row;
+    attention.forward_paged(cache, {seqs[0]}, 0, chunk_q, chunk_out.data(), chunk);
+    Tensor<FLOAT32> q({1, chunk, heads, dim});
+    std::memcpy(q.data(), chunk_q, sizeof(float) * q.size());
+    Tensor<FLOAT32> expected = attention.forward(q, keys[0], values[0]);
+    for (int i = 0; i < q.size(); ++i) {
+        assert(std::abs(chunk_out[i] - expected.data()[i]) < 1e-5f);
+    }
+    bool empty_threw = false;
+    try {
+        attention.forward_paged(cache, {seqs[0]}, 0, chunk_q, chunk_out.data(), 0);
+    } catch (const std::invalid_argument&) {
+        empty_threw = true;
+    }
+    assert(empty_threw);
+
+    // freed pages go back to the pool and the id is reused
+    cache.free_sequence(seqs[0]);
+    assert(cache.free_pages() == 16 - (13 + 3) / 4);
+    assert(cache.add_sequence() == seqs[0]);
+    bool threw = false;
+    try {
+        cache.append(seqs[0], 16 * page_size);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    std::cout << "Paged KV cache tests passed!" << std::endl;
+}
+
+void benchmark_kv_cache_decode() {
+    std::mt19937 rng(23);
+    const int heads = 8, dim = 64, page_size = 64, max_len = 4096;
+    KVCache<FLOAT32> cache(1, heads, dim, page_size, max_len / page_size);
+    FlashAttention<FLOAT32> attention(dim, heads);
+    attention.set_mask(MASK_CAUSAL);
+    Tensor<FLOAT32> q = random_tensor({1, max_len, heads, dim}, rng);
+    Tensor<FLOAT32> k = random_tensor({1, max_len, heads, dim}, rng);
+    Tensor<FLOAT32> v = random_tensor({1, max_len, heads, dim}, rng);
+    const int64_t row = heads * dim;
+    std::vector<float> out(row);
+    int seq = cache.add_sequence();
+
+    for (int len = 1; len <= max_len; ++len) {
+        int pos = cache.append(seq);
+        cache.store(seq, 0, pos, k.data() + pos * row, v.data() + pos * row);
+        if (len % 1024 != 0) {
+            continue;
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        attention.forward_paged(cache, {seq}, 0, q.data() + pos * row, out.data(), 1);
+        auto mid = std::chrono::high_resolution_clock::now();
+        // without a cache the step re-runs causal attention over the whole prefix
+        Tensor<FLOAT32> full = attention.forward(prefix_of(q, len), prefix_of(k, len), prefix_of(v, len));
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> cached_ms = mid - start;
+        std::chrono::duration<double, std::milli> full_ms = end - mid;
+        std::cout << "T=" << len << " cached decode: " << cached_ms.count() << " ms, recompute prefix: "
+                  << full_ms.count() << " ms" << std::endl;
+        deallocate_memory(full.data());
+    }
+}
+
+void test_quantized_kv_cache() {
+    std::mt19937 rng(29);
+    const int heads = 8, kv_heads = 4, dim = 64, page_size = 16, len = 300, queries = 8;
+    Tensor<FLOAT32> k = random_tensor({1, len, kv_heads, dim}, rng);
+    Tensor<FLOAT32> v = random_tensor({1, len, kv_heads, dim}, rng);
+    Tensor<FLOAT32> q = random_tensor({1, queries, heads, dim}, rng);
+    const int64_t row = kv_heads * dim;
+    const int pages = (len + page_size - 1) / page_size;
+
+    // calibrated per-head ranges for the static int8 variant
+    std::vector<float> key_range(kv_heads, 0.0f), value_range(kv_heads, 0.0f);
+    for (int t = 0; t < len; ++t) {
+        for (int kh = 0; kh < kv_heads; ++kh) {
+            for (int c = 0; c < dim; ++c) {
+                key_range[kh] = std::max(key_range[kh], std::abs(k.data()[t * row + kh * dim + c]));
+                value_range[kh] = std::max(value_range[kh], std::abs(v.data()[t * row + kh * dim + c]));
+            }
+        }
+    }
+
+    FlashAttention<FLOAT32> attention(dim, heads, kv_heads);
+    attention.set_mask(MASK_CAUSAL);
+    const char* names[] = {"fp32", "fp16", "int8 per-token", "int8 per-head"};
+    KVStorage storages[] = {KV_STORAGE_FULL, KV_STORAGE_FLOAT16, KV_STORAGE_INT8_PER_TOKEN, KV_STORAGE_INT8_PER_HEAD};
+    const float tolerance[] = {0.0f, 2e-3f, 2e-2f, 3e-2f};
+    std::vector<float> reference(q.size()), out(q.size());
+    size_t full_bytes = 0;
+    for (int s = 0; s < 4; ++s) {
+        KVCache<FLOAT32> cache(1, kv_heads, dim, page_size, pages, storages[s]);
+        if (storages[s] == KV_STORAGE_INT8_PER_HEAD) {
+            cache.set_head_scales(0, key_range, value_range);
+        }
+        int seq = cache.add_sequence();
+        for (int t = 0; t < len; ++t) {
+            int pos = cache.append(seq);
+            cache.store(seq, 0, pos, k.data() + pos * row, v.data() + pos * row);
+        }
+        attention.forward_paged(cache, {seq}, 0, q.data(), s == 0 ? reference.data() : out.data(), queries);
+        if (s == 0) {
+            full_bytes = cache.bytes();
+            continue;
+        }
+        // relative L2 error of the attention output against the fp32 cache
+        double err = 0.0, norm = 0.0;
+        for (size_t i = 0; i < out.size(); ++i) {
+            err += (out[i] - reference[i]) * (out[i] - reference[i]);
+            norm += reference[i] * reference[i];
+        }
+        double rel = std::sqrt(err / norm);
+        std::cout << names[s] << ": " << cache.bytes() << " bytes (" << 100.0 * cache.bytes() / full_bytes
+                  << "% of fp32), relative output error " << rel << std::endl;
+        assert(rel < tolerance[s]);
+    }
+    std::cout << "Quantized KV cache tests passed!" << std::endl;
+}
+
+// Interleaved-pair RoPE at position pos, the convention the cache re-rotates with.
+static void rotate_row(float* x, int dim, int pos, float base) {
+    for (int i = 0; i < dim / 2; ++i) {
+        double angle = pos * std::pow(static_cast<double>(base), -2.0 * i / dim);
+        float c = static_cast<float>(std::cos(angle)), s = static_cast<float>(std::sin(angle));
+        float x0 = x[2 * i], x1 = x[2 * i + 1];
+        x[2 * i] = x0 * c - x1 * s;
+        x[2 * i + 1] = x0 * s + x1 * c;
+    }
+}
+
+void test_streaming_kv_cache() {
+    std::mt19937 rng(31);
+    const int heads = 4, kv_heads = 2, dim = 16, page_size = 4, sinks = 4, window = 10, steps = 200;
+    const float base = 10000.0f;
+    const int max_pages = (sinks + window) / page_size + 2;
+    KVCache<FLOAT32> cache(2, kv_heads, dim, page_size, max_pages);
+    cache.set_streaming(sinks, window, base);
+    FlashAttention<FLOAT32> attention(dim, heads, kv_heads);
+
+    // raw (unrotated) keys per absolute token
+    Tensor<FLOAT32> raw_k = random_tensor({1, steps, kv_heads, dim}, rng);
+    Tensor<FLOAT32> v = random_tensor({1, steps, kv_heads, dim}, rng);
+    Tensor<FLOAT32> q = random_tensor({1, steps, heads, dim}, rng);
+    const int64_t kv_row = kv_heads * dim, q_row = heads * dim;
+    std::vector<float> k_row(kv_row), q_rot(q_row), out(q_row);
+    int seq = cache.add_sequence();
+
+    for (int t = 0; t < steps; ++t) {
+        int pos = cache.append(seq);
+        assert(pos + cache.evicted_tokens(seq) == t);
+        std::memcpy(k_row.data(), raw_k.data() + t * kv_row, sizeof(float) * kv_row);
+        for (int kh = 0; kh < kv_heads; ++kh) {
+            rotate_row(k_row.data() + kh * dim, dim, pos, base);
+        }
+        for (int layer = 0; layer < 2; ++layer) {
+            cache.store(seq, layer, pos, k_row.data(), v.data() + t * kv_row);
+        }
+        assert(cache.length(seq) <= sinks + window + page_size);
+        assert(cache.num_pages() - cache.free_pages() <= max_pages);
+
+        std::memcpy(q_rot.data(), q.data() + t * q_row, sizeof(float) * q_row);
+        for (int h = 0; h < heads; ++h) {
+            rotate_row(q_rot.data() + h * dim, dim, pos, base);
+        }
+        attention.forward_paged(cache, {seq}, 1, q_rot.data(), out.data(), 1);
+
+        // reference: the kept tokens (sinks, then the window) with RoPE at their cache slots
+        const int held = cache.length(seq);
+        Tensor<FLOAT32> ref_k({1, held, kv_heads, dim}), ref_v({1, held, kv_heads, dim}), ref_q({1, 1, heads, dim});
+        for (int slot = 0; slot < held; ++slot) {
+            int token = slot < sinks ? slot : slot + cache.evicted_tokens(seq);
+            std::memcpy(ref_k.data() + slot * kv_row, raw_k.data() + token * kv_row, sizeof(float) * kv_row);
+            std::memcpy(ref_v.data() + slot * kv_row, v.data() + token * kv_row, sizeof(float) * kv_row);
+            for (int kh = 0; kh < kv_heads; ++kh) {
+                rotate_row(ref_k.data() + slot * kv_row + kh * dim, dim, slot, base);
+            }
+        }
+        std::memcpy(ref_q.data(), q_rot.data(), sizeof(float) * q_row);
+        FlashAttention<FLOAT32> reference(dim, heads, kv_heads);
+        Tensor<FLOAT32> expected = reference.forward(ref_q, ref_k, ref_v);
+        for (int i = 0; i < q_row; ++i) {
+            assert(std::abs(out[i] - expected.data()[i]) < 1e-4f);
+        }
+        deallocate_memory(expected.data());
+    }
+    assert(cache.evicted_tokens(seq) > 0);
+
+    // int8 keys are quantized once, at store, however many evictions they live
+    // through: rotated back by the evicted offset, each one matches its raw key
+    // freshly rotated at its final slot to within one quantization step
+    KVCache<FLOAT32> int8_cache(1, kv_heads, dim, page_size, max_pages, KV_STORAGE_INT8_PER_TOKEN);
+    int8_cache.set_streaming(sinks, window, base);
+    int s8 = int8_cache.add_sequence();
+    for (int t = 0; t < steps; ++t) {
+        int pos = int8_cache.append(s8);
+        std::memcpy(k_row.data(), raw_k.data() + t * kv_row, sizeof(float) * kv_row);
+        for (int kh = 0; kh < kv_heads; ++kh) {
+            rotate_row(k_row.data() + kh * dim, dim, pos, base);
+        }
+        int8_cache.store(s8, 0, pos, k_row.data(), v.data() + t * kv_row);
+    }
+    const int held = int8_cache.length(s8), evicted = int8_cache.evicted_tokens(s8);
+    assert(evicted > 0 && int8_cache.shifted_begin(s8) == sinks);
+    std::vector<float> page_k(page_size * dim), page_v(page_size * dim), expected_k(dim);
+    for (int p = 0; p * page_size < held; ++p) {
+        const int cols = std::min(page_size, held - p * page_size);
+        for (int kh = 0; kh < kv_heads; ++kh) {
+            int8_cache.load_page(0, int8_cache.block_table(s8)[p], kh, cols, page_k.data(), page_v.data());
+            for (int j = 0; j < cols; ++j) {
+                const int slot = p * page_size + j;
+                const int token = slot < sinks ? slot : slot + evicted;
+                float* k = page_k.data() + j * dim;
+                if (slot >= int8_cache.shifted_begin(s8)) {
+                    rotate_row(k, dim, -evicted, base);
+                }
+                const float* raw = raw_k.data() + token * kv_row + kh * dim;
+                std::memcpy(expected_k.data(), raw, sizeof(float) * dim);
+                rotate_row(expected_k.data(), dim, slot, base);
+                float max_abs = 0.0f;
+                for (int c = 0; c < dim; ++c) max_abs = std::max(max_abs, std::abs(raw[c]));
+                for (int c = 0; c < dim; ++c) {
+                    assert(std::abs(k[c] - expected_k[c]) <= 1.01f * max_abs / 127.0f);
+                }
+            }
+        }
+    }
+    std::cout << "Streaming KV cache tests passed (" << cache.evicted_tokens(seq) << " tokens evicted)" << std::endl;
+}
@@ -0,0 +1,161 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "llama_model.h"
+
+// Same network written with the layer-level Tensor APIs, for a single sequence.
+static std::vector<float> reference_llama_logits(LlamaModel<FLOAT32>& model, const std::vector<uint32_t>& ids) {
+    const LlamaConfig& c = model.config();
+    const int seq = static_cast<int>(ids.size()), dh = c.head_dim();
+    Tensor<FLOAT32> x({1, seq, c.dim});
+    model.embeddings().gather_rows(ids.data(), seq, x.data());
+    RoPE<FLOAT32> rope(dh, c.max_seq, c.rope_base);
+    for (LlamaBlock<FLOAT32>& block : model.blocks()) {
+        Tensor<FLOAT32> qkv = block.qkv.forward(block.attention_norm.forward(x));
+        Tensor<FLOAT32> q({1, seq, c.num_heads, dh}), k({1, seq, c.num_kv_heads, dh}), v({1, seq, c.num_kv_heads, dh});
+        const int qc = c.num_heads * dh, kc = c.num_kv_heads * dh;
+        for (int t = 0; t < seq; ++t) {
+            const float* row = qkv.data() + t * (qc + 2 * kc);
+            std::copy(row, row + qc, q.data() + t * qc);
+            std::copy(row + qc, row + qc + kc, k.data() + t * kc);
+            std::copy(row + qc + kc, row + qc + 2 * kc, v.data() + t * kc);
+        }
+        rope.forward(q);
+        rope.forward(k);
+        FlashAttention<FLOAT32> attention(dh, c.num_heads, c.num_kv_heads);
+        attention.set_mask(MASK_CAUSAL);
+        Tensor<FLOAT32> attended = attention.forward(q, k, v);
+        attended.shape = {1, seq, qc};
+        Tensor<FLOAT32> o = block.output.forward(attended);
+        simd_add(x.data(), o.data(), x.size());
+        Tensor<FLOAT32> f = block.ffn.forward(block.ffn_norm.forward(x));
+        simd_add(x.data(), f.data(), x.size());
+    }
+    Tensor<FLOAT32> last({1, c.dim});
+    std::copy(x.data() + (seq - 1) * c.dim, x.data() + seq * c.dim, last.data());
+    Tensor<FLOAT32> logits = model.lm_head().forward(model.final_norm().forward(last));
+    return std::vector<float>(logits.data(), logits.data() + logits.size());
+}
+
+void test_llama_model() {
+    LlamaConfig config;
+    config.vocab_size = 97;
+    config.dim = 32;
+    config.num_layers = 2;
+    config.num_heads = 4;
+    config.num_kv_heads = 2;
+    config.hidden_dim = 48;
+    config.max_batch = 2;
+    config.max_seq = 24;
+    config.page_size = 4;
+    LlamaModel<FLOAT32> model(config);
+
+    std::mt19937 rng(47);
+    std::vector<uint32_t> prompt(11), continuation(6);
+    for (auto& id : prompt) id = rng() % config.vocab_size;
+    for (auto& id : continuation) id = rng() % config.vocab_size;
+    std::vector<uint32_t> full = prompt;
+    full.insert(full.end(), continuation.begin(), continuation.end());
+    std::vector<float> expected = reference_llama_logits(model, full);
+
+    // batch of two: seq a is prompt + token-by-token decode, seq b is the whole text as one prefill
+    int a = model.start_sequence();
+    int b = model.start_sequence();
+    model.forward({a}, prompt.data(), static_cast<int>(prompt.size()));
+    for (size_t i = 0; i + 1 < continuation.size(); ++i) {
+        model.forward({a}, &continuation[i], 1);
+    }
+    size_t before = allocation_count();
+    Tensor<FLOAT32> decode_logits = model.forward({a}, &continuation.back(), 1);
+    assert(allocation_count() == before);
+    for (int i = 0; i < config.vocab_size; ++i) {
+        assert(std::abs(decode_logits.data()[i] - expected[i]) < 1e-4f);
+    }
+    Tensor<FLOAT32> prefill_logits = model.forward({b}, full.data(), static_cast<int>(full.size()));
+    for (int i = 0; i < config.vocab_size; ++i) {
+        assert(std::abs(prefill_logits.data()[i] - expected[i]) < 1e-4f);
+    }
+
+    // batched decode over both sequences with one call
+    model.end_sequence(a);
+    a = model.start_sequence();
+    model.forward({a}, full.data(), static_cast<int>(full.size()) - 1);
+    model.end_sequence(b);
+    b = model.start_sequence();
+    model.forward({b}, full.data(), static_cast<int>(full.size()) - 1);
+    uint32_t next[2] = {full.back(), full.back()};
+    before = allocation_count();
+    Tensor<FLOAT32> batched = model.forward({a, b}, next, 1);
+    assert(allocation_count() == before);
+    assert(batched.shape[0] == 2);
+    for (int i = 0; i < config.vocab_size; ++i) {
+        assert(std::abs(batched.data()[i] - expected[i]) < 1e-4f);
+        assert(std::abs(batched.data()[config.vocab_size + i] - expected[i]) < 1e-4f);
+    }
+
+    // a batch that would push one sequence past max_seq changes no sequence
+    model.forward({a}, next, 1);
+    std::vector<uint32_t> chunk(14, full[0]);
+    bool threw = false;
+    try {
+        model.forward({b, a}, chunk.data(), 7);
+    } catch (const std::out_of_range&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(model.cache().length(b) == static_cast<int>(full.size()));
+    assert(model.cache().length(a) == static_cast<int>(full.size()) + 1);
+
+    // and so does one with an out-of-vocab id
+    std::vector<uint32_t> bad = {full[0], static_cast<uint32_t>(config.vocab_size)};
+    threw = false;
+    try {
+        model.forward({b, a}, bad.data(), 1);
+    } catch (const std::out_of_range&) {
+        threw = true;
+    }
+    assert(threw);
+    assert(model.cache().length(b) == static_cast<int>(full.size()));
+    assert(model.cache().length(a) == static_cast<int>(full.size()) + 1);
+    std::cout << "LlamaModel tests passed!" << std::endl;
+}
+
+void benchmark_llama_model() {
+    LlamaConfig config;
+    config.vocab_size = 4096;
+    config.dim = 512;
+    config.num_layers = 4;
+    config.num_heads = 8;
+    config.num_kv_heads = 4;
+    config.hidden_dim = 1376;
+    config.max_seq = 512;
+    LlamaModel<FLOAT32> model(config);
+    std::cout << "activations: " << model.activation_bytes() / 1e6 << " MB, KV cache: "
+              << model.cache().bytes() / 1e6 << " MB" << std::endl;
+
+    std::mt19937 rng(53);
+    const int prompt_len = 256, decode_len = 64;
+    std::vector<uint32_t> prompt(prompt_len);
+    for (auto& id : prompt) id = rng() % config.vocab_size;
+    int seq = model.start_sequence();
+
+    auto start = std::chrono::high_resolution_clock::now();
+    Tensor<FLOAT32> logits = model.forward({seq}, prompt.data(), prompt_len);
+    auto mid = std::chrono::high_resolution_clock::now();
+    size_t before = allocation_count();
+    for (int step = 0; step < decode_len; ++step) {
+        // greedy next token
+        uint32_t next = static_cast<uint32_t>(std::max_element(logits.data(), logits.data() + config.vocab_size) -
+            logits.data());
+        logits = model.forward({seq}, &next, 1);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> prefill_s = mid - start;
+    std::chrono::duration<double> decode_s = end - mid;
+    std::cout << "prefill: " << prompt_len / prefill_s.count() << " tokens/s, decode: "
+              << decode_len / decode_s.count() << " tokens/s, allocations during decode: "
+              << allocation_count() - before << std::endl;
+}
@@ -0,0 +1,218 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "trainer.h"
+
+static void fill_normal(float* data, int64_t n, std::mt19937& rng, float stddev) {
+    std::normal_distribution<float> dis(0.0f, stddev);
+    for (int64_t i = 0; i < n; ++i) data[i] = dis(rng);
+}
+
+// sum(c * y) for y = layer(x)
+static double weighted_output(const Linear<FLOAT32>& layer, const std::vector<float>& x, const std::vector<float>& c,
+    int64_t rows) {
+    std::vector<float> y(c.size());
+    layer.forward_rows(x.data(), y.data(), rows);
+    double sum = 0.0;
+    for (size_t i = 0; i < y.size(); ++i) sum += static_cast<double>(c[i]) * y[i];
+    return sum;
+}
+
+void test_lora() {
+    std::mt19937 rng(48);
+    const int in = 40, out = 26, rank = 4;
+    const int64_t rows = 37;
+    Linear<FLOAT32> layer(in, out);
+    std::vector<float> x(rows * in), c(rows * out), base(rows * out), fused(rows * out), merged(rows * out);
+    fill_normal(x.data(), x.size(), rng, 1.0f);
+    fill_normal(c.data(), c.size(), rng, 1.0f);
+    layer.forward_rows(x.data(), base.data(), rows);
+
+    // B starts at zero: attaching changes nothing until B is trained
+    layer.attach_lora(rank, 8.0f);
+    LoraAdapter<FLOAT32>& lora = *layer.lora();
+    assert(lora.scale == 2.0f && !layer.trains_weights());
+    layer.forward_rows(x.data(), fused.data(), rows);
+    for (size_t i = 0; i < fused.size(); ++i) assert(fused[i] == base[i]);
+
+    // the fused product matches W + scale * B A formed explicitly
+    fill_normal(lora.b.data(), lora.b.size(), rng, 0.3f);
+    layer.forward_rows(x.data(), fused.data(), rows);
+    const float* w = layer.weights().full().data();
+    float fused_diff = 0.0f;
+    for (int64_t i = 0; i < rows; ++i) {
+        for (int j = 0; j < out; ++j) {
+            double y = 0.0;
+            for (int d = 0; d < in; ++d) {
+                double wd = w[j * in + d];
+                for (int r = 0; r < rank; ++r) wd += lora.scale * lora.b.data()[j * rank + r] * lora.a.data()[r * in + d];
+                y += wd * x[i * in + d];
+            }
+            fused_diff = std::max(fused_diff, static_cast<float>(std::fabs(y - fused[i * out + j])));
+        }
+    }
+    assert(fused_diff < 1e-4f);
+
+    // A, B and x gradients against finite differences of sum(c * y)
+    std::vector<float> dx(rows * in);
+    layer.backward_rows(c.data(), x.data(), dx.data(), rows);
+    assert(!layer.weights().full().grad);
+    const double eps = 1e-2;
+    auto check = [&](const Linear<FLOAT32>& l, float* value, float grad) {
+        float saved = *value;
+        *value = saved + eps;
+        double plus = weighted_output(l, x, c, rows);
+        *value = saved - eps;
+        double minus = weighted_output(l, x, c, rows);
+        *value = saved;
+        double numeric = (plus - minus) / (2 * eps);
+        assert(std::fabs(numeric - grad) < 2e-2 * std::max(1.0, std::fabs(numeric)));
+    };
+    for (int i : {0, 7, rank * in - 1}) check(layer, lora.a.data() + i, lora.a.grad->data()[i]);
+    for (int i : {0, 11, out * rank - 1}) check(layer, lora.b.data() + i, lora.b.grad->data()[i]);
+    for (int i : {0, 13, static_cast<int>(rows * in) - 1}) check(layer, x.data() + i, dx[i]);
+
+    // merging reproduces the fused output with the adapter gone
+    layer.merge_lora();
+    assert(layer.lora() == nullptr && layer.trains_weights());
+    layer.forward_rows(x.data(), merged.data(), rows);
+    for (size_t i = 0; i < merged.size(); ++i) assert(std::fabs(merged[i] - fused[i]) < 1e-4f);
+
+    bool bad_rank = false;
+    try {
+        Linear<FLOAT32> rankless(in, out);
+        rankless.attach_lora(0, 1.0f);
+    } catch (const std::invalid_argument&) {
+        bad_rank = true;
+    }
+    assert(bad_rank);
+
+    // an int8 base stays int8 under its adapter
+    Linear<FLOAT32> q8(in, out, STORAGE_INT8_ROWWISE);
+    size_t q8_bytes = q8.weights().bytes();
+    q8.attach_lora(rank, 4.0f);
+    fill_normal(q8.lora()->b.data(), q8.lora()->b.size(), rng, 0.3f);
+    q8.backward_rows(c.data(), x.data(), dx.data(), rows);
+    assert(q8.weights().storage() == STORAGE_INT8_ROWWISE && q8.weights().bytes() == q8_bytes);
+    check(q8, q8.lora()->b.data() + 5, q8.lora()->b.grad->data()[5]);
+
+    // fine-tuning a model: only adapters train, base weights do not move, and
+    // the merged model gives the adapted logits
+    LlamaConfig tiny;
+    tiny.vocab_size = 64;
+    tiny.dim = 32;
+    tiny.num_layers = 2;
+    tiny.num_heads = 4;
+    tiny.num_kv_heads = 2;
+    tiny.hidden_dim = 48;
+    tiny.max_seq = 16;
+    LlamaModel<FLOAT32> model(tiny);
+    std::vector<float> lm_head_before(model.lm_head().weights().full().data(),
+        model.lm_head().weights().full().data() + model.lm_head().weights().full().size());
+    std::vector<float> qkv_before(model.blocks()[0].qkv.weights().full().data(),
+        model.blocks()[0].qkv.weights().full().data() + model.blocks()[0].qkv.weights().full().size());
+    model.attach_lora(4, 8.0f);
+    std::vector<Tensor<FLOAT32>*> params = model.parameters();
+    assert(params.size() == 8 * static_cast<size_t>(tiny.num_layers));
+
+    std::vector<uint32_t> tokens(4000);
+    for (size_t i = 0; i < tokens.size(); ++i) tokens[i] = (i * 5 + i / 3) % tiny.vocab_size;
+    VectorTokenSource source{tokens, 64};
+    OptimizerConfig adam;
+    adam.learning_rate = 1e-2f;
+    Trainer<FLOAT32, VectorTokenSource> trainer(model, source, adam, TrainerConfig{4, 16, 1, true, {}});
+    int64_t adapter_elements = 0;
+    for (Tensor<FLOAT32>* p : params) adapter_elements += p->size();
+    assert(trainer.optimizer().num_elements() == adapter_elements);
+    float first = 0.0f, loss = 0.0f;
+    for (int step = 0; step < 40 && trainer.step(loss); ++step) {
+        if (step == 0) first = loss;
+    }
+    assert(loss < first);
+    const float* head = model.lm_head().weights().full().data();
+    const float* qkv = model.blocks()[0].qkv.weights().full().data();
+    for (size_t i = 0; i < lm_head_before.size(); ++i) assert(head[i] == lm_head_before[i]);
+    for (size_t i = 0; i < qkv_before.size(); ++i) assert(qkv[i] == qkv_before[i]);
+    // frozen norm gains never get a gradient to go stale in
+    for (LlamaBlock<FLOAT32>& block : model.blocks()) {
+        assert(!block.attention_norm.weight().grad && !block.ffn_norm.weight().grad);
+    }
+    assert(!model.final_norm().weight().grad);
+
+    std::vector<uint32_t> prompt(tokens.begin(), tokens.begin() + 12);
+    int seq = model.start_sequence();
+    Tensor<FLOAT32> adapted = model.forward({seq}, prompt.data(), 12);
+    std::vector<float> adapted_logits(adapted.data(), adapted.data() + adapted.size());
+    model.end_sequence(seq);
+    model.merge_lora();
+    assert(!model.has_lora());
+    seq = model.start_sequence();
+    Tensor<FLOAT32> exported = model.forward({seq}, prompt.data(), 12);
+    model.end_sequence(seq);
+    float export_diff = 0.0f;
+    for (size_t i = 0; i < adapted_logits.size(); ++i) {
+        export_diff = std::max(export_diff, std::fabs(adapted_logits[i] - exported.data()[i]));
+    }
+    assert(export_diff < 1e-3f);
+
+    // MoE routers are frozen with the rest of the base model
+    LlamaConfig moe_config = tiny;
+    moe_config.num_experts = 4;
+    LlamaModel<FLOAT32> moe_model(moe_config);
+    moe_model.attach_lora(4, 8.0f);
+    assert(!moe_model.blocks()[0].moe->router().trains_weights());
+    moe_model.merge_lora();
+    assert(moe_model.blocks()[0].moe->router().trains_weights());
+
+    std::cout << "LoRA: fused vs explicit merged weight " << fused_diff << ", fine-tuning loss " << first << " -> "
+              << loss << " with " << adapter_elements << " trainable elements, export logit diff " << export_diff
+              << std::endl;
+}
+
+// Full fine-tuning against rank-8 LoRA on an int8 base: trainable state and step time.
+void benchmark_lora() {
+    LlamaConfig config;
+    config.vocab_size = 256;
+    config.dim = 256;
+    config.num_layers = 4;
+    config.num_heads = 8;
+    config.num_kv_heads = 4;
+    config.hidden_dim = 688;
+    config.max_seq = 64;
+    std::vector<uint32_t> tokens(1 << 16);
+    std::mt19937 rng(49);
+    for (auto& t : tokens) t = rng() % 256;
+    OptimizerConfig adam;
+    adam.learning_rate = 1e-3f;
+
+    const int steps = 5;
+    for (bool lora : {false, true}) {
+        LlamaConfig c = config;
+        if (lora) c.storage = STORAGE_INT8_ROWWISE;
+        LlamaModel<FLOAT32> model(c);
+        if (lora) model.attach_lora(8, 16.0f);
+        VectorTokenSource source{tokens, 512};
+        Trainer<FLOAT32, VectorTokenSource> trainer(model, source, adam, TrainerConfig{4, 64, 1, true, {}});
+        float loss = 0.0f;
+        trainer.step(loss);
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int step = 0; step < steps; ++step) trainer.step(loss);
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsed = end - start;
+
+        size_t weight_bytes = 0, trainable = 0;
+        for (LlamaBlock<FLOAT32>& block : model.blocks()) {
+            for (Linear<FLOAT32>* l : {&block.qkv, &block.output, &block.ffn.gate_up(), &block.ffn.down()}) {
+                weight_bytes += l->weights().bytes();
+            }
+        }
+        for (Tensor<FLOAT32>* p : model.parameters()) trainable += p->size();
+        std::cout << (lora ? "LoRA r=8, int8 base: " : "full fine-tuning:    ") << "block weights "
+                  << weight_bytes / 1e6 << " MB, trainable " << trainable << " elements, grads + AdamW state "
+                  << (trainable * sizeof(float) + trainer.optimizer().state_bytes()) / 1e6 << " MB, "
+                  << elapsed.count() / steps * 1000 << " ms/step" << std::endl;
+    }
+}
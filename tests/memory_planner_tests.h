@@ -0,0 +1,77 @@
+#include <cassert>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "memory_planner.h"
+#include "llama_model.h"
+
+void test_memory_planner() {
+    // a chain where each op reads the previous output: only neighbours overlap
+    MemoryPlanner chain(64);
+    std::vector<int> ids;
+    for (int i = 0; i < 6; ++i) {
+        ids.push_back(chain.add_tensor(1000));
+    }
+    for (int i = 0; i < 6; ++i) {
+        chain.add_op(i == 0 ? std::vector<int>{} : std::vector<int>{ids[i - 1]}, {ids[i]});
+    }
+    chain.plan();
+    assert(chain.unshared_bytes() == 6 * 1024);
+    assert(chain.peak_live_bytes() == 2 * 1024);
+    assert(chain.slab_bytes() == 2 * 1024);
+    for (int id : ids) {
+        assert(chain.offset(id) % 64 == 0);
+    }
+
+    // random lifetimes: tensors live at the same time must not share bytes
+    std::mt19937 rng(41);
+    MemoryPlanner planner(32);
+    const int tensors = 40, steps = 30;
+    std::vector<int> first(tensors), last(tensors);
+    std::vector<size_t> bytes(tensors);
+    for (int i = 0; i < tensors; ++i) {
+        bytes[i] = 1 + rng() % 5000;
+        planner.add_tensor(bytes[i]);
+        first[i] = rng() % steps;
+        last[i] = first[i] + rng() % 8;
+    }
+    for (int s = 0; s < steps + 8; ++s) {
+        std::vector<int> live;
+        for (int i = 0; i < tensors; ++i) {
+            if (first[i] == s || last[i] == s) live.push_back(i);
+        }
+        planner.add_op(live, {});
+    }
+    planner.plan();
+    for (int a = 0; a < tensors; ++a) {
+        assert(planner.offset(a) + bytes[a] <= planner.slab_bytes());
+        for (int b = a + 1; b < tensors; ++b) {
+            bool live_together = first[a] <= last[b] && first[b] <= last[a];
+            bool disjoint = planner.offset(a) + bytes[a] <= planner.offset(b) ||
+                planner.offset(b) + bytes[b] <= planner.offset(a);
+            assert(!live_together || disjoint);
+        }
+    }
+    assert(planner.peak_live_bytes() <= planner.slab_bytes());
+    assert(planner.slab_bytes() <= planner.unshared_bytes());
+    std::cout << "random plan: " << planner.slab_bytes() << " bytes, peak live " << planner.peak_live_bytes()
+              << ", unshared " << planner.unshared_bytes() << std::endl;
+
+    // the model's activations come from one slab
+    LlamaConfig config;
+    config.vocab_size = 4096;
+    config.dim = 512;
+    config.num_layers = 4;
+    config.num_heads = 8;
+    config.num_kv_heads = 4;
+    config.hidden_dim = 1376;
+    config.max_seq = 512;
+    size_t before = allocation_count();
+    LlamaModel<FLOAT32> model(config);
+    const MemoryPlanner& plan = model.memory_plan();
+    assert(plan.slab_bytes() < plan.unshared_bytes());
+    assert(plan.slab_bytes() >= plan.peak_live_bytes());
+    std::cout << "llama activations: " << plan.slab_bytes() / 1e6 << " MB planned vs "
+              << plan.unshared_bytes() / 1e6 << " MB unshared (peak live " << plan.peak_live_bytes() / 1e6
+              << " MB), " << allocation_count() - before << " allocations for the whole model" << std::endl;
+}
@@ -0,0 +1,246 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+#include "checkpoint.h"
+#include "cross_entropy.h"
+#include "optimizer.h"
+
+// One language-model step over a [batch, seq] window: decoder blocks, final
+// norm, then LM head and softmax cross-entropy fused in ChunkedCrossEntropy.
+// The loss gradient is multiplied by loss_scale before it enters the
+// half-precision backward.
+template<DType dtype>
+struct TinyLmStep {
+    using T = typename DTypeToType<dtype>::Type;
+
+    TinyLmStep(LlamaModel<dtype>& model, CheckpointPolicy policy)
+      : model(model), decoder(model.blocks(), model.config(), policy), head_loss(model.lm_head()) {}
+
+    float forward_backward(const uint32_t* ids, const uint32_t* targets, int batch, int seq, float loss_scale) {
+        const LlamaConfig& c = model.config();
+        const int64_t rows = static_cast<int64_t>(batch) * seq, dim = c.dim;
+        x.resize(rows * dim);
+        h.resize(rows * dim);
+        normed.resize(rows * dim);
+        inv_rms.resize(rows);
+        model.embeddings().gather_rows(ids, rows, x.data());
+        decoder.forward(x.data(), h.data(), batch, seq);
+        model.final_norm().forward_rows(h.data(), normed.data(), rows, inv_rms.data());
+        // x is reused for d h and h for d x
+        grad_normed.resize(rows * dim);
+        float loss = head_loss.forward_backward(normed.data(), targets, rows, grad_normed.data(), loss_scale);
+        model.final_norm().backward_rows(grad_normed.data(), h.data(), inv_rms.data(), x.data(), rows);
+        decoder.backward(x.data(), h.data());
+        embedding_grad = model.embeddings().backward_rows(ids, h.data(), rows);
+        return loss;
+    }
+
+    // Applies the sparse embedding gradient unless it overflowed; returns false then.
+    bool update_embeddings(float loss_scale, float learning_rate) {
+        T* g = embedding_grad.values.data();
+        const int64_t n = static_cast<int64_t>(embedding_grad.rows.size()) * model.config().dim;
+        bool finite = true;
+        for (int64_t i = 0; i < n; ++i) {
+            float v = to_float<dtype>(g[i]) / loss_scale;
+            finite = finite && std::isfinite(v);
+            g[i] = from_float<dtype>(v);
+        }
+        if (finite) {
+            model.embeddings().update_adam(embedding_grad, learning_rate);
+        }
+        deallocate_memory(g);
+        return finite;
+    }
+
+    LlamaModel<dtype>& model;
+    CheckpointedDecoder<dtype> decoder;
+    ChunkedCrossEntropy<dtype> head_loss;
+    std::vector<T> x, h, normed, grad_normed;
+    std::vector<float> inv_rms;
+    SparseRowGrad<dtype> embedding_grad;
+};
+
+void test_mixed_precision() {
+    // change_dtype converts to and from half bits instead of casting integers
+    std::vector<float> values = {0.5f, -1.25f, 3.0f, 1e-3f};
+    std::vector<int> shape = {4};
+    Tensor<FLOAT32> source(values, shape);
+    auto half = source.change_dtype<FLOAT16>();
+    auto back = half->change_dtype<FLOAT32>();
+    for (int i = 0; i < 4; ++i) {
+        assert(std::fabs(back->data()[i] - values[i]) < 1e-3f * std::fabs(values[i]) + 1e-6f);
+    }
+
+    // the scaler backs off on overflow and grows after a clean run
+    LossScaler scaler(1024.0f, 3);
+    scaler.update(true);
+    assert(scaler.scale() == 512.0f && scaler.skipped_steps() == 1);
+    for (int i = 0; i < 3; ++i) scaler.update(false);
+    assert(scaler.scale() == 1024.0f);
+
+    // an inf gradient skips the step and leaves the weights alone
+    OptimizerConfig config;
+    config.kind = OPTIMIZER_SGD;
+    config.learning_rate = 1e-5f;
+    config.momentum = 0.0f;
+    Tensor<FLOAT16> w({16}), w_rounded({16});
+    for (int i = 0; i < 16; ++i) w.data()[i] = w_rounded.data()[i] = float_to_half(1.0f);
+    Optimizer<FLOAT16> opt(config);
+    opt.add_parameter(w);
+    LossScaler loss_scaler(256.0f);
+    w.grad->data()[3] = float_to_half(INFINITY);
+    assert(!opt.step(loss_scaler));
+    assert(loss_scaler.scale() == 128.0f && half_to_float(w.data()[3]) == 1.0f && w.grad->data()[3] == 0);
+
+    // steps far below an fp16 ulp at 1.0 (~1e-3) only add up with master weights
+    OptimizerConfig no_master = config;
+    no_master.master_weights = false;
+    Optimizer<FLOAT16> opt_rounded(no_master);
+    opt_rounded.add_parameter(w_rounded);
+    for (int step = 0; step < 200; ++step) {
+        for (int i = 0; i < 16; ++i) {
+            w.grad->data()[i] = float_to_half(loss_scaler.scale());
+            w_rounded.grad->data()[i] = float_to_half(1.0f);
+        }
+        assert(opt.step(loss_scaler));
+        opt_rounded.step();
+    }
+    assert(std::fabs(half_to_float(w.data()[0]) - (1.0f - 200 * 1e-5f)) < 1e-3f);
+    assert(half_to_float(w_rounded.data()[0]) == 1.0f);
+    assert(opt.state_bytes() == 16 * sizeof(float));
+
+    // a scaled fp32 step matches an unscaled one
+    Tensor<FLOAT32> a({33}), b({33});
+    for (int i = 0; i < 33; ++i) a.data()[i] = b.data()[i] = 0.1f * i;
+    OptimizerConfig adam;
+    adam.max_grad_norm = 1.0f;
+    Optimizer<FLOAT32> opt_a(adam), opt_b(adam);
+    opt_a.add_parameter(a);
+    opt_b.add_parameter(b);
+    LossScaler fixed(1024.0f);
+    for (int step = 0; step < 5; ++step) {
+        for (int i = 0; i < 33; ++i) {
+            a.grad->data()[i] = 0.3f * std::sin(float(i + step));
+            b.grad->data()[i] = 1024.0f * a.grad->data()[i];
+        }
+        opt_a.step();
+        assert(opt_b.step(fixed));
+    }
+    for (int i = 0; i < 33; ++i) assert(std::fabs(a.data()[i] - b.data()[i]) < 1e-6f);
+
+    // an fp16 copy of an fp32 model computes the same loss, give or take rounding
+    LlamaConfig tiny;
+    tiny.vocab_size = 64;
+    tiny.dim = 32;
+    tiny.num_layers = 2;
+    tiny.num_heads = 4;
+    tiny.num_kv_heads = 2;
+    tiny.hidden_dim = 48;
+    tiny.max_seq = 16;
+    LlamaModel<FLOAT32> model32(tiny);
+    LlamaModel<FLOAT16> model16(tiny);
+    copy_parameters(model32, model16);
+    std::vector<uint32_t> ids(16), targets(16);
+    for (int i = 0; i < 16; ++i) {
+        ids[i] = (i * 7) % 64;
+        targets[i] = (i * 7 + 1) % 64;
+    }
+    // the embedding tables are initialized independently, so only the ballpark matches
+    TinyLmStep<FLOAT32> step32(model32, {});
+    TinyLmStep<FLOAT16> step16(model16, {});
+    float loss32 = step32.forward_backward(ids.data(), targets.data(), 1, 16, 1.0f);
+    float loss16 = step16.forward_backward(ids.data(), targets.data(), 1, 16, 1024.0f);
+    assert(std::isfinite(loss16) && loss32 > 3.0f && loss16 > 3.0f);
+    std::cout << "tiny model loss: fp32 " << loss32 << ", fp16 " << loss16 << std::endl;
+}
+
+static std::vector<uint32_t> read_bytes_corpus() {
+    for (const char* path : {"data/wikitext-2-validation.txt", "../data/wikitext-2-validation.txt",
+             "../../data/wikitext-2-validation.txt"}) {
+        std::ifstream file(path, std::ios::binary);
+        if (file) {
+            std::stringstream ss;
+            ss << file.rdbuf();
+            std::string text = ss.str();
+            return std::vector<uint32_t>(text.begin(), text.end());
+        }
+    }
+    return {};
+}
+
+// Byte-level LM on wikitext-2, trained in fp32 and in fp16 with master
+// weights and dynamic loss scaling from the same initial weights.
+template<DType dtype>
+static void train_bytes_lm(LlamaModel<dtype>& model, const std::vector<uint32_t>& corpus, int steps, bool scaled) {
+    const int batch = 4, seq = 64;
+    OptimizerConfig config;
+    config.learning_rate = 3e-3f;
+    config.weight_decay = 0.01f;
+    config.max_grad_norm = 1.0f;
+    Optimizer<dtype> opt(config);
+    for (Tensor<dtype>* p : model.parameters()) opt.add_parameter(*p);
+    LossScaler scaler(65536.0f, 50);
+    TinyLmStep<dtype> lm(model, {});
+
+    std::mt19937 rng(47);
+    std::vector<uint32_t> ids(batch * seq), targets(batch * seq);
+    double first = 0.0, last = 0.0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int step = 0; step < steps; ++step) {
+        for (int b = 0; b < batch; ++b) {
+            size_t at = rng() % (corpus.size() - seq - 1);
+            for (int t = 0; t < seq; ++t) {
+                ids[b * seq + t] = corpus[at + t] & 0xff;
+                targets[b * seq + t] = corpus[at + t + 1] & 0xff;
+            }
+        }
+        float loss_scale = scaled ? scaler.scale() : 1.0f;
+        float loss = lm.forward_backward(ids.data(), targets.data(), batch, seq, loss_scale);
+        bool applied = scaled ? opt.step(scaler) : (opt.step(), true);
+        if (applied) {
+            lm.update_embeddings(loss_scale, config.learning_rate);
+        } else {
+            deallocate_memory(lm.embedding_grad.values.data());
+        }
+        if (step < 10) first += loss / 10;
+        if (step >= steps - 10) last += loss / 10;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    std::cout << (dtype == FLOAT32 ? "fp32" : "fp16 mixed") << ": " << steps * batch * seq / elapsed.count()
+              << " tokens/s, loss " << first << " -> " << last;
+    if (scaled) {
+        std::cout << ", skipped " << scaler.skipped_steps() << " steps, final scale " << scaler.scale();
+    }
+    size_t param_bytes = 0;
+    for (Tensor<dtype>* p : model.parameters()) param_bytes += p->size() * sizeof(typename DTypeToType<dtype>::Type);
+    std::cout << ", weights+grads " << 2 * param_bytes / 1e6 << " MB, optimizer state " << opt.state_bytes() / 1e6
+              << " MB" << std::endl;
+}
+
+void benchmark_mixed_precision() {
+    std::vector<uint32_t> corpus = read_bytes_corpus();
+    if (corpus.empty()) {
+        std::cout << "data/wikitext-2-validation.txt not found, skipping" << std::endl;
+        return;
+    }
+    LlamaConfig config;
+    config.vocab_size = 256;
+    config.dim = 128;
+    config.num_layers = 2;
+    config.num_heads = 4;
+    config.num_kv_heads = 2;
+    config.hidden_dim = 344;
+    config.max_seq = 64;
+    LlamaModel<FLOAT32> model32(config);
+    LlamaModel<FLOAT16> model16(config);
+    copy_parameters(model32, model16);
+    const int steps = 150;
+    train_bytes_lm(model32, corpus, steps, false);
+    train_bytes_lm(model16, corpus, steps, true);
+}
@@ -0,0 +1,157 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "moe.h"
+
+// sum(c * y) + aux_weight * aux_loss for y = moe(x)
+static double moe_objective(MixtureOfExperts<FLOAT32>& moe, const std::vector<float>& x, const std::vector<float>& c,
+    int64_t rows, float aux_weight) {
+    std::vector<float> y(x.size());
+    moe.forward_rows(x.data(), y.data(), rows);
+    double sum = aux_weight * moe.aux_loss();
+    for (size_t i = 0; i < y.size(); ++i) sum += static_cast<double>(c[i]) * y[i];
+    return sum;
+}
+
+void test_moe() {
+    std::mt19937 rng(50);
+    std::normal_distribution<float> dis(0.0f, 1.0f);
+    const int dim = 24, hidden = 20, experts = 4, k = 2;
+    const int64_t rows = 45;
+    std::vector<float> x(rows * dim), c(rows * dim), y(rows * dim);
+    for (auto& v : x) v = dis(rng);
+    for (auto& v : c) v = dis(rng);
+
+    // without a cap: every token gets its top-2 experts' outputs, mixed with
+    // the renormalized router probabilities
+    MixtureOfExperts<FLOAT32> moe(dim, hidden, experts, k, 0.0f);
+    moe.forward_rows(x.data(), y.data(), rows);
+    assert(moe.dropped() == 0);
+    std::vector<float> logits(experts), expert_out(dim), h(hidden);
+    float max_diff = 0.0f;
+    for (int64_t i = 0; i < rows; ++i) {
+        moe.router().forward_rows(x.data() + i * dim, logits.data(), 1);
+        float max = *std::max_element(logits.begin(), logits.end()), sum = 0.0f;
+        for (auto& l : logits) sum += (l = std::exp(l - max));
+        int first = 0, second = -1;
+        for (int e = 1; e < experts; ++e) if (logits[e] > logits[first]) first = e;
+        for (int e = 0; e < experts; ++e) if (e != first && (second < 0 || logits[e] > logits[second])) second = e;
+        float top = logits[first] + logits[second];
+        std::vector<float> ref(dim, 0.0f);
+        for (int e : {first, second}) {
+            moe.experts()[e].forward_rows(x.data() + i * dim, expert_out.data(), h.data(), 1);
+            for (int d = 0; d < dim; ++d) ref[d] += logits[e] / top * expert_out[d];
+        }
+        for (int d = 0; d < dim; ++d) max_diff = std::max(max_diff, std::fabs(ref[d] - y[i * dim + d]));
+    }
+    assert(max_diff < 1e-5f);
+
+    // a capacity factor of 0.5 holds each expert to ceil(0.5 * 45 * 2 / 4) = 12
+    // assignments and drops the rest
+    moe.set_capacity_factor(0.5f);
+    assert(moe.capacity(rows) == 12);
+    moe.forward_rows(x.data(), y.data(), rows);
+    int64_t expected_drops = 0;
+    for (int64_t n : moe.expert_counts()) expected_drops += std::max<int64_t>(0, n - 12);
+    assert(moe.dropped() == expected_drops && expected_drops > 0);
+    moe.set_capacity_factor(0.0f);
+
+    // a near-uniform random router sits close to the balanced value of 1
+    assert(moe.aux_loss() >= 0.9f);
+
+    // x, router and expert gradients against finite differences, balancing loss included
+    const float aux_weight = 0.5f;
+    std::vector<float> dx(rows * dim);
+    moe.backward_rows(c.data(), x.data(), dx.data(), rows, aux_weight);
+    const double eps = 1e-3;
+    auto check = [&](float* value, float grad) {
+        float saved = *value;
+        *value = saved + eps;
+        double plus = moe_objective(moe, x, c, rows, aux_weight);
+        *value = saved - eps;
+        double minus = moe_objective(moe, x, c, rows, aux_weight);
+        *value = saved;
+        double numeric = (plus - minus) / (2 * eps);
+        assert(std::fabs(numeric - grad) < 2e-2 * std::max(1.0, std::fabs(numeric)));
+    };
+    for (int i : {0, 100, static_cast<int>(rows * dim) - 1}) check(x.data() + i, dx[i]);
+    Tensor<FLOAT32>& router = moe.router().weights().full();
+    for (int i : {0, 31, router.size() - 1}) check(router.data() + i, router.grad->data()[i]);
+    for (int e = 0; e < experts; ++e) {
+        Tensor<FLOAT32>& down = moe.experts()[e].down().weights().full();
+        if (down.grad) check(down.data() + 7, down.grad->data()[7]);
+    }
+
+    // a MoE Llama runs inference and trains through the decoder
+    LlamaConfig tiny;
+    tiny.vocab_size = 64;
+    tiny.dim = 32;
+    tiny.num_layers = 2;
+    tiny.num_heads = 4;
+    tiny.num_kv_heads = 2;
+    tiny.hidden_dim = 24;
+    tiny.max_seq = 16;
+    tiny.num_experts = 4;
+    LlamaModel<FLOAT32> model(tiny);
+    std::vector<uint32_t> ids(16);
+    for (int i = 0; i < 16; ++i) ids[i] = (i * 3) % 64;
+    int seq = model.start_sequence();
+    Tensor<FLOAT32> out = model.forward({seq}, ids.data(), 16);
+    for (int i = 0; i < out.size(); ++i) assert(std::isfinite(out.data()[i]));
+    model.end_sequence(seq);
+    // norms, then router + 4 experts x 2 matrices + QKV + output per block, and the LM head
+    assert(model.parameters().size() == static_cast<size_t>(tiny.num_layers) * (2 + 1 + 8 + 2) + 2);
+
+    std::vector<uint32_t> tokens(3000);
+    for (size_t i = 0; i < tokens.size(); ++i) tokens[i] = (i * 5 + i / 3) % tiny.vocab_size;
+    VectorTokenSource source{tokens, 64};
+    OptimizerConfig adam;
+    adam.learning_rate = 1e-2f;
+    Trainer<FLOAT32, VectorTokenSource> trainer(model, source, adam, TrainerConfig{4, 16, 1, true, {}});
+    float first = 0.0f, loss = 0.0f;
+    for (int step = 0; step < 30 && trainer.step(loss); ++step) {
+        if (step == 0) first = loss;
+    }
+    assert(loss < first);
+
+    std::cout << "MoE: max diff from per-token reference " << max_diff << ", " << expected_drops
+              << " assignments dropped at capacity factor 0.5, tiny MoE model loss " << first << " -> " << loss
+              << std::endl;
+}
+
+// Same active FFN compute per token (top-2 experts of hidden H/2 vs one dense
+// FFN of hidden H) while the parameter count grows with the experts.
+void benchmark_moe() {
+    const int dim = 512, hidden = 1376;
+    const int64_t rows = 1024;
+    std::mt19937 rng(51);
+    std::normal_distribution<float> dis(0.0f, 1.0f);
+    std::vector<float> x(rows * dim), y(rows * dim), h(rows * hidden);
+    for (auto& v : x) v = dis(rng);
+    const int iters = 3;
+
+    FeedForward<FLOAT32> dense(dim, hidden);
+    dense.forward_rows(x.data(), y.data(), h.data(), rows);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int it = 0; it < iters; ++it) dense.forward_rows(x.data(), y.data(), h.data(), rows);
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> dense_s = end - start;
+    std::cout << "dense FFN, hidden " << hidden << ": " << 3.0 * dim * hidden / 1e6 << "M params, "
+              << dense_s.count() / iters * 1000 << " ms per " << rows << " tokens" << std::endl;
+
+    for (int experts : {4, 8, 16}) {
+        MixtureOfExperts<FLOAT32> moe(dim, hidden / 2, experts, 2, 1.25f);
+        moe.forward_rows(x.data(), y.data(), rows);
+        start = std::chrono::high_resolution_clock::now();
+        for (int it = 0; it < iters; ++it) moe.forward_rows(x.data(), y.data(), rows);
+        end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> moe_s = end - start;
+        std::cout << "MoE " << experts << " x hidden " << hidden / 2 << ", top-2: "
+                  << (3.0 * dim * hidden / 2 * experts + dim * experts) / 1e6 << "M params, "
+                  << moe_s.count() / iters * 1000 << " ms per " << rows << " tokens, " << moe.dropped()
+                  << " dropped, aux loss " << moe.aux_loss() << std::endl;
+    }
+}
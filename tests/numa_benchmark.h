@@ -0,0 +1,117 @@
+#include <cassert>
+#include <chrono>
+#include <stdexcept>
+#include <iostream>
+#include <vector>
+#include "tensor.h"
+#include "thread_pool.h"
+#include "memory_placement.h"
+
+// Decode is a chain of GEMVs that stream every weight once per token, so it is
+// bound by memory bandwidth and sensitive to where the weight pages live.
+static double run_gemv_decode(int num_layers, int dim, int num_tokens, bool replicate = false) {
+    std::vector<Tensor<FLOAT32>> weights;
+    std::vector<std::vector<void*>> replicas;
+    for (int l = 0; l < num_layers; ++l) {
+        weights.push_back(Tensor<FLOAT32>::rand({dim, dim}));
+        if (replicate) {
+            replicas.push_back(replicate_per_node(weights[l].data(), weights[l].size() * sizeof(float)));
+        }
+    }
+    std::vector<float> x(dim, 1.0f / dim);
+    std::vector<float> y(dim);
+
+    auto decode_token = [&]() {
+        for (int l = 0; l < num_layers; ++l) {
+            parallel_for(0, dim, [&](int64_t lo, int64_t hi) {
+                const float* w = replicate ? static_cast<const float*>(local_replica(replicas[l]))
+                                           : weights[l].data();
+                for (int64_t r = lo; r < hi; ++r) {
+                    const float* row = w + r * dim;
+                    float acc = 0.0f;
+                    for (int c = 0; c < dim; ++c) {
+                        acc += row[c] * x[c];
+                    }
+                    y[r] = acc;
+                }
+            });
+            std::swap(x, y);
+        }
+    };
+
+    decode_token();
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < num_tokens; ++t) {
+        decode_token();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    for (auto& layer : replicas) {
+        for (void* replica : layer) {
+            deallocate_memory(replica);
+        }
+    }
+    return num_tokens / elapsed.count();
+}
+
+void benchmark_numa_decode() {
+    const int num_layers = 16;
+    const int dim = 2048;
+    const int num_tokens = 20;
+    ThreadPool& pool = ThreadPool::instance();
+
+    std::cout << "NUMA nodes: " << numa_topology().num_nodes()
+              << ", pool threads: " << pool.num_threads() << std::endl;
+
+    set_memory_placement(PLACEMENT_DEFAULT);
+    pool.unpin();
+    double off = run_gemv_decode(num_layers, dim, num_tokens);
+    std::cout << "placement off (malloc, unpinned):     " << off << " tokens/s" << std::endl;
+
+    pool.pin_to_numa_nodes();
+    set_memory_placement(PLACEMENT_FIRST_TOUCH);
+    double first_touch = run_gemv_decode(num_layers, dim, num_tokens);
+    std::cout << "first-touch + pinned workers:         " << first_touch << " tokens/s" << std::endl;
+
+    set_memory_placement(PLACEMENT_INTERLEAVE);
+    double interleave = run_gemv_decode(num_layers, dim, num_tokens);
+    std::cout << "interleaved + pinned workers:         " << interleave << " tokens/s" << std::endl;
+
+    set_memory_placement(PLACEMENT_DEFAULT);
+    double replicated = run_gemv_decode(num_layers, dim, num_tokens, true);
+    std::cout << "replicated per node + pinned workers: " << replicated << " tokens/s" << std::endl;
+
+    pool.unpin();
+    std::cout << "Speedup (first-touch vs off): " << first_touch / off << "x" << std::endl;
+}
+
+void test_thread_pool() {
+    ThreadPool pool(4);
+    // a throwing chunk reaches the caller instead of terminating the worker
+    bool caught = false;
+    try {
+        pool.parallel_for(0, 100, [](int64_t lo, int64_t hi) {
+            if (lo <= 60 && 60 < hi) {
+                throw std::out_of_range("chunk");
+            }
+        });
+    } catch (const std::out_of_range&) {
+        caught = true;
+    }
+    assert(caught);
+    caught = false;
+    try {
+        pool.run_on_workers([](size_t) { throw std::runtime_error("every worker"); });
+    } catch (const std::runtime_error&) {
+        caught = true;
+    }
+    assert(caught);
+
+    // and the pool keeps working afterwards
+    std::vector<int> hits(100, 0);
+    pool.parallel_for(0, 100, [&](int64_t lo, int64_t hi) {
+        for (int64_t i = lo; i < hi; ++i) ++hits[i];
+    });
+    for (int h : hits) assert(h == 1);
+    std::cout << "worker exceptions rethrown on the caller" << std::endl;
+}
@@ -0,0 +1,211 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "optimizer.h"
+
+// Textbook per-tensor AdamW, one pass per formula, for comparison.
+struct ReferenceAdamW {
+    OptimizerConfig config;
+    std::vector<std::vector<float>> m, v;
+    int t = 0;
+
+    explicit ReferenceAdamW(const OptimizerConfig& c) : config(c) {}
+
+    float step(std::vector<Tensor<FLOAT32>*>& params) {
+        if (m.empty()) {
+            for (auto* p : params) {
+                m.emplace_back(p->size(), 0.0f);
+                v.emplace_back(p->size(), 0.0f);
+            }
+        }
+        ++t;
+        double sq = 0.0;
+        for (auto* p : params) {
+            for (int i = 0; i < p->size(); ++i) sq += static_cast<double>(p->grad->data()[i]) * p->grad->data()[i];
+        }
+        float norm = static_cast<float>(std::sqrt(sq));
+        float scale = config.max_grad_norm > 0.0f && norm > config.max_grad_norm ?
+            config.max_grad_norm / (norm + 1e-6f) : 1.0f;
+        for (size_t k = 0; k < params.size(); ++k) {
+            Tensor<FLOAT32>& p = *params[k];
+            float* g = p.grad->data();
+            for (int i = 0; i < p.size(); ++i) g[i] *= scale;
+            for (int i = 0; i < p.size(); ++i) m[k][i] = config.beta1 * m[k][i] + (1 - config.beta1) * g[i];
+            for (int i = 0; i < p.size(); ++i) v[k][i] = config.beta2 * v[k][i] + (1 - config.beta2) * g[i] * g[i];
+            float decay = p.shape.size() >= 2 ? config.weight_decay : 0.0f;
+            for (int i = 0; i < p.size(); ++i) p.data()[i] -= config.learning_rate * decay * p.data()[i];
+            float bias1 = 1 - std::pow(config.beta1, static_cast<float>(t));
+            float bias2 = 1 - std::pow(config.beta2, static_cast<float>(t));
+            for (int i = 0; i < p.size(); ++i) {
+                float m_hat = m[k][i] / bias1, v_hat = v[k][i] / bias2;
+                p.data()[i] -= config.learning_rate * m_hat / (std::sqrt(v_hat) + config.epsilon);
+            }
+            for (int i = 0; i < p.size(); ++i) g[i] = 0.0f;
+        }
+        return norm;
+    }
+};
+
+static std::vector<Tensor<FLOAT32>> optimizer_params(std::mt19937& rng) {
+    std::normal_distribution<float> dis(0.0f, 1.0f);
+    // a gain vector, an odd-sized matrix and one spanning several chunks
+    std::vector<Tensor<FLOAT32>> params = {Tensor<FLOAT32>({37}), Tensor<FLOAT32>({13, 7}),
+        Tensor<FLOAT32>({3, Optimizer<FLOAT32>::chunk_size + 5})};
+    for (auto& p : params) {
+        for (int i = 0; i < p.size(); ++i) p.data()[i] = dis(rng);
+        p.grad = std::make_shared<Tensor<FLOAT32>>(p.shape);
+    }
+    return params;
+}
+
+static void fill_grads(std::vector<Tensor<FLOAT32>>& params, std::mt19937& rng, float scale) {
+    std::normal_distribution<float> dis(0.0f, scale);
+    for (auto& p : params) {
+        for (int i = 0; i < p.size(); ++i) p.grad->data()[i] = dis(rng) + 0.1f * p.data()[i];
+    }
+}
+
+void test_optimizer() {
+    OptimizerConfig config;
+    config.learning_rate = 1e-2f;
+    config.weight_decay = 0.1f;
+    config.max_grad_norm = 5.0f;
+
+    // fused AdamW against the reference, with clipping active on some steps
+    std::mt19937 rng(44), rng_ref(44);
+    std::vector<Tensor<FLOAT32>> fused = optimizer_params(rng), reference = optimizer_params(rng_ref);
+    Optimizer<FLOAT32> opt(config);
+    for (auto& p : fused) opt.add_parameter(p);
+    ReferenceAdamW ref{config};
+    std::vector<Tensor<FLOAT32>*> ref_ptrs;
+    for (auto& p : reference) ref_ptrs.push_back(&p);
+    for (int step = 0; step < 10; ++step) {
+        float scale = step % 2 == 0 ? 0.001f : 0.1f;
+        fill_grads(fused, rng, scale);
+        fill_grads(reference, rng_ref, scale);
+        float norm = opt.step();
+        float ref_norm = ref.step(ref_ptrs);
+        assert(std::fabs(norm - ref_norm) < 1e-4f * ref_norm);
+    }
+    float max_diff = 0.0f;
+    for (size_t k = 0; k < fused.size(); ++k) {
+        for (int i = 0; i < fused[k].size(); ++i) {
+            max_diff = std::max(max_diff, std::fabs(fused[k].data()[i] - reference[k].data()[i]));
+            assert(fused[k].grad->data()[i] == 0.0f);
+        }
+    }
+    assert(max_diff < 1e-5f);
+    assert(opt.state_bytes() == 2 * opt.num_elements() * sizeof(float));
+
+    // SGD with momentum and decay, by hand
+    {
+        OptimizerConfig sgd;
+        sgd.kind = OPTIMIZER_SGD;
+        sgd.learning_rate = 0.1f;
+        sgd.momentum = 0.9f;
+        sgd.weight_decay = 0.01f;
+        Tensor<FLOAT32> w({2, 9});
+        for (int i = 0; i < w.size(); ++i) w.data()[i] = 1.0f;
+        Optimizer<FLOAT32> opt_sgd(sgd);
+        opt_sgd.add_parameter(w);
+        float expected = 1.0f, buf = 0.0f;
+        for (int step = 0; step < 3; ++step) {
+            for (int i = 0; i < w.size(); ++i) w.grad->data()[i] = 0.5f;
+            opt_sgd.step();
+            buf = 0.9f * buf + 0.5f;
+            expected = expected * (1.0f - 0.1f * 0.01f) - 0.1f * buf;
+        }
+        for (int i = 0; i < w.size(); ++i) assert(std::fabs(w.data()[i] - expected) < 1e-6f);
+    }
+
+    // 16-bit states track the fp32 run at half the state memory; fp16 stores
+    // sqrt(v), so even tiny gradients keep a usable second moment
+    for (StatePrecision precision : {STATE_FLOAT16, STATE_BFLOAT16}) {
+        std::mt19937 r32(45), r16(45);
+        std::vector<Tensor<FLOAT32>> p32 = optimizer_params(r32), p16 = optimizer_params(r16);
+        OptimizerConfig narrow = config;
+        narrow.state_precision = precision;
+        Optimizer<FLOAT32> o32(config), o16(narrow);
+        for (auto& p : p32) o32.add_parameter(p);
+        for (auto& p : p16) o16.add_parameter(p);
+        for (int step = 0; step < 20; ++step) {
+            float scale = step % 2 == 0 ? 1e-4f : 0.1f;
+            fill_grads(p32, r32, scale);
+            fill_grads(p16, r16, scale);
+            o32.step();
+            o16.step();
+        }
+        float diff = 0.0f;
+        for (size_t k = 0; k < p32.size(); ++k) {
+            for (int i = 0; i < p32[k].size(); ++i) diff = std::max(diff, std::fabs(p32[k].data()[i] - p16[k].data()[i]));
+        }
+        assert(o16.state_bytes() * 2 == o32.state_bytes());
+        assert(diff < 2e-2f);
+        std::cout << (precision == STATE_FLOAT16 ? "fp16" : "bf16") << " states: max drift from fp32 " << diff
+                  << " after 20 steps (lr " << config.learning_rate << ")" << std::endl;
+    }
+
+    // fp16 parameters are updated through fp32 and converge on a quadratic
+    {
+        Tensor<FLOAT16> w({64});
+        Optimizer<FLOAT16> opt16(config);
+        opt16.add_parameter(w);
+        for (int step = 0; step < 300; ++step) {
+            for (int i = 0; i < w.size(); ++i) {
+                w.grad->data()[i] = float_to_half(2.0f * (half_to_float(w.data()[i]) - 1.0f));
+            }
+            opt16.step();
+        }
+        for (int i = 0; i < w.size(); ++i) assert(std::fabs(half_to_float(w.data()[i]) - 1.0f) < 0.1f);
+    }
+    std::cout << "fused AdamW max difference from the per-tensor reference: " << max_diff << std::endl;
+}
+
+void benchmark_optimizer() {
+    std::mt19937 rng(46);
+    std::normal_distribution<float> dis(0.0f, 1.0f);
+    // roughly a 16M-parameter model: a few large matrices and many small gains
+    std::vector<Tensor<FLOAT32>> params;
+    for (int l = 0; l < 8; ++l) {
+        params.emplace_back(std::vector<int>{512, 3072});
+        params.emplace_back(std::vector<int>{512});
+        params.emplace_back(std::vector<int>{512});
+    }
+    for (auto& p : params) {
+        p.grad = std::make_shared<Tensor<FLOAT32>>(p.shape);
+        for (int i = 0; i < p.size(); ++i) p.grad->data()[i] = dis(rng);
+    }
+    std::vector<Tensor<FLOAT32>*> ptrs;
+    for (auto& p : params) ptrs.push_back(&p);
+
+    OptimizerConfig config;
+    config.weight_decay = 0.1f;
+    config.max_grad_norm = 1.0f;
+    const int iters = 5;
+    ReferenceAdamW ref{config};
+    ref.step(ptrs);
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int it = 0; it < iters; ++it) ref.step(ptrs);
+    auto mid = std::chrono::high_resolution_clock::now();
+
+    for (StatePrecision precision : {STATE_FLOAT32, STATE_FLOAT16, STATE_BFLOAT16}) {
+        config.state_precision = precision;
+        Optimizer<FLOAT32> opt(config);
+        for (auto& p : params) opt.add_parameter(p);
+        opt.step();
+        auto s = std::chrono::high_resolution_clock::now();
+        for (int it = 0; it < iters; ++it) opt.step();
+        auto e = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> fused_s = e - s;
+        const char* names[] = {"fp32", "fp16", "bf16"};
+        std::cout << "fused, " << names[precision] << " states: "
+                  << fused_s.count() / iters * 1e3 << " ms/step, state " << opt.state_bytes() / 1e6 << " MB"
+                  << std::endl;
+    }
+    std::chrono::duration<double> ref_s = mid - start;
+    std::cout << "per-tensor reference: " << ref_s.count() / iters * 1e3 << " ms/step for "
+              << 8 * (512 * 3072 + 1024) / 1e6 << "M parameters" << std::endl;
+}
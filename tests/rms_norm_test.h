@@ -52,3 +52,90 @@ void test_rmsnorm_forward() {
     // Stop the dataloader after the test
     dataloader.stop_loading();
 }
+
+void test_rmsnorm_rows_and_backward() {
+    const int rows = 3, dim = 8;
+    std::vector<int> shape = {rows, dim};
+    Tensor<FLOAT32> input = Tensor<FLOAT32>::rand(shape);
+    for (int i = 0; i < input.size(); ++i) {
+        input.data()[i] = input.data()[i] * 4.0f - 2.0f + (i / dim);
+    }
+
+    RMSNorm<FLOAT32> norm(dim, 1e-5f);
+    for (int j = 0; j < dim; ++j) {
+        norm.weight().data()[j] = 0.5f + 0.1f * j;
+    }
+    Tensor<FLOAT32> out = norm.forward(input);
+
+    // every row is normalized on its own
+    for (int r = 0; r < rows; ++r) {
+        float ms = 0.0f;
+        for (int j = 0; j < dim; ++j) {
+            ms += input.data()[r * dim + j] * input.data()[r * dim + j];
+        }
+        float inv_rms = 1.0f / std::sqrt(ms / dim + 1e-5f);
+        for (int j = 0; j < dim; ++j) {
+            float expected = input.data()[r * dim + j] * inv_rms * (0.5f + 0.1f * j);
+            assert(std::abs(out.data()[r * dim + j] - expected) < 1e-5f);
+        }
+    }
+
+    // backward of loss = sum(out * w) against central differences
+    Tensor<FLOAT32> upstream = Tensor<FLOAT32>::rand(shape);
+    Tensor<FLOAT32> grad_input = norm.backward(upstream);
+    auto loss = [&](RMSNorm<FLOAT32>& n, const Tensor<FLOAT32>& x) {
+        RMSNorm<FLOAT32> probe(dim, 1e-5f);
+        std::memcpy(probe.weight().data(), n.weight().data(), dim * sizeof(float));
+        Tensor<FLOAT32> y = probe.forward(x);
+        double total = 0.0;
+        for (int i = 0; i < y.size(); ++i) {
+            total += y.data()[i] * upstream.data()[i];
+        }
+        return total;
+    };
+    const float h = 1e-2f;
+    for (int i = 0; i < input.size(); ++i) {
+        Tensor<FLOAT32> plus(shape), minus(shape);
+        std::memcpy(plus.data(), input.data(), input.size() * sizeof(float));
+        std::memcpy(minus.data(), input.data(), input.size() * sizeof(float));
+        plus.data()[i] += h;
+        minus.data()[i] -= h;
+        double numeric = (loss(norm, plus) - loss(norm, minus)) / (2 * h);
+        assert(std::abs(numeric - grad_input.data()[i]) < 2e-3);
+    }
+    for (int j = 0; j < dim; ++j) {
+        float saved = norm.weight().data()[j];
+        norm.weight().data()[j] = saved + h;
+        double up = loss(norm, input);
+        norm.weight().data()[j] = saved - h;
+        double down = loss(norm, input);
+        norm.weight().data()[j] = saved;
+        assert(std::abs((up - down) / (2 * h) - norm.weight().grad->data()[j]) < 2e-3);
+    }
+
+    // fused residual add matches add followed by norm
+    Tensor<FLOAT32> residual = Tensor<FLOAT32>::rand(shape);
+    Tensor<FLOAT32> summed = residual + input;
+    Tensor<FLOAT32> reference = norm.forward(summed);
+    Tensor<FLOAT32> fused = norm.forward_residual(residual, input);
+    for (int i = 0; i < fused.size(); ++i) {
+        assert(std::abs(fused.data()[i] - reference.data()[i]) < 1e-6f);
+        assert(residual.data()[i] == summed.data()[i]);
+    }
+
+    // fp16 storage accumulates in fp32 and stays close to the fp32 result
+    Tensor<FLOAT16> half_input(shape);
+    for (int i = 0; i < input.size(); ++i) {
+        half_input.data()[i] = float_to_half(input.data()[i]);
+    }
+    RMSNorm<FLOAT16> half_norm(dim, 1e-5f);
+    for (int j = 0; j < dim; ++j) {
+        half_norm.weight().data()[j] = float_to_half(0.5f + 0.1f * j);
+    }
+    Tensor<FLOAT16> half_out = half_norm.forward(half_input);
+    for (int i = 0; i < out.size(); ++i) {
+        assert(std::abs(half_to_float(half_out.data()[i]) - out.data()[i]) < 1e-2f);
+    }
+
+    std::cout << "RMSNorm row-wise forward/backward tests passed!" << std::endl;
+}
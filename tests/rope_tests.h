@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+#include "rope.h"
+
+void test_rope() {
+    std::mt19937 rng(37);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    const int batch = 2, seq = 9, heads = 3, dim = 20;
+    Tensor<FLOAT32> x({batch, seq, heads, dim});
+    for (int i = 0; i < x.size(); ++i) {
+        x.data()[i] = dist(rng);
+    }
+    std::vector<float> original(x.data(), x.data() + x.size());
+
+    // scalar reference with explicit angles
+    auto expected_at = [&](int token, int h, int c, int pos) {
+        const float* v = original.data() + (static_cast<int64_t>(token) * heads + h) * dim;
+        int i = c / 2;
+        double angle = pos * std::pow(10000.0, -2.0 * i / dim);
+        double x0 = v[2 * i], x1 = v[2 * i + 1];
+        return static_cast<float>(c % 2 == 0 ? x0 * std::cos(angle) - x1 * std::sin(angle)
+                                             : x0 * std::sin(angle) + x1 * std::cos(angle));
+    };
+
+    RoPE<FLOAT32> rope(dim, 4096);
+    rope.forward(x);
+    for (int token = 0; token < batch * seq; ++token) {
+        for (int h = 0; h < heads; ++h) {
+            for (int c = 0; c < dim; ++c) {
+                float got = x.data()[(static_cast<int64_t>(token) * heads + h) * dim + c];
+                assert(std::abs(got - expected_at(token, h, c, token % seq)) < 1e-5f);
+            }
+        }
+    }
+    rope.backward(x);
+    for (int i = 0; i < x.size(); ++i) {
+        assert(std::abs(x.data()[i] - original[i]) < 1e-5f);
+    }
+
+    // arbitrary position ids (packed batch / decode)
+    std::vector<int> positions(batch * seq);
+    for (int t = 0; t < batch * seq; ++t) {
+        positions[t] = (t * 397) % 4000;
+    }
+    rope.forward(x, positions);
+    for (int token = 0; token < batch * seq; ++token) {
+        for (int c = 0; c < dim; ++c) {
+            float got = x.data()[(static_cast<int64_t>(token) * heads + 1) * dim + c];
+            assert(std::abs(got - expected_at(token, 1, c, positions[token])) < 1e-4f);
+        }
+    }
+
+    // a position past the table is rejected before any row is rotated
+    std::vector<float> before(x.data(), x.data() + x.size());
+    positions[batch * seq - 1] = 4096;
+    bool caught = false;
+    try {
+        rope.forward(x, positions);
+    } catch (const std::out_of_range&) {
+        caught = true;
+    }
+    assert(caught);
+    assert(std::equal(before.begin(), before.end(), x.data()));
+
+    // q.k after RoPE depends only on the relative offset
+    std::vector<float> q(dim), k(dim), q2(dim), k2(dim);
+    for (int c = 0; c < dim; ++c) {
+        q[c] = q2[c] = dist(rng);
+        k[c] = k2[c] = dist(rng);
+    }
+    rope.apply_float_row(q.data(), 1, 100);
+    rope.apply_float_row(k.data(), 1, 93);
+    rope.apply_float_row(q2.data(), 1, 1007);
+    rope.apply_float_row(k2.data(), 1, 1000);
+    assert(std::abs(simd_dot(q.data(), k.data(), dim) - simd_dot(q2.data(), k2.data(), dim)) < 1e-3f);
+
+    // fp16 activations, fp32 rotation
+    Tensor<FLOAT16> xh({batch, seq, heads, dim});
+    row_from_float<FLOAT16>(original.data(), xh.data(), xh.size());
+    RoPE<FLOAT16> half_rope(dim, 64);
+    half_rope.forward(xh);
+    for (int token = 0; token < batch * seq; ++token) {
+        for (int c = 0; c < dim; ++c) {
+            float got = half_to_float(xh.data()[static_cast<int64_t>(token) * heads * dim + c]);
+            assert(std::abs(got - expected_at(token, 0, c, token % seq)) < 1e-2f);
+        }
+    }
+
+    // tables are shared per (head_dim, base)
+    assert(rope_table(dim, 128).get() == rope_table(dim, 64).get());
+    std::cout << "RoPE tests passed!" << std::endl;
+}
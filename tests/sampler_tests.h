@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <vector>
+#include "sampler.h"
+
+// The distribution a config should sample from, by full sort: temperature,
+// then top-k, then the smallest prefix holding top_p of the remaining mass.
+static std::vector<double> reference_distribution(const std::vector<float>& logits, const SamplingConfig& c) {
+    const int vocab = static_cast<int>(logits.size());
+    std::vector<int> order(vocab);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return logits[a] > logits[b]; });
+    int keep = c.top_k > 0 ? std::min(vocab, c.top_k) : vocab;
+    std::vector<double> w(vocab, 0.0);
+    double total = 0.0;
+    for (int i = 0; i < keep; ++i) total += (w[order[i]] = std::exp((logits[order[i]] - logits[order[0]]) / c.temperature));
+    double acc = 0.0;
+    int nucleus = 0;
+    while (nucleus < keep && acc < c.top_p * total) acc += w[order[nucleus++]];
+    std::vector<double> p(vocab, 0.0);
+    for (int i = 0; i < nucleus; ++i) p[order[i]] = w[order[i]] / acc;
+    return p;
+}
+
+static double sampled_distance(Sampler& sampler, const std::vector<float>& logits, const std::vector<double>& expected,
+    int draws) {
+    const int vocab = static_cast<int>(logits.size());
+    std::vector<double> freq(vocab, 0.0);
+    std::vector<float> row(vocab);
+    uint32_t token = 0;
+    for (int d = 0; d < draws; ++d) {
+        sampler.start_sequence(0, 1000 + d);
+        row = logits;
+        sampler.sample_rows(row.data(), {0}, &token);
+        assert(expected[token] > 0.0);
+        freq[token] += 1.0 / draws;
+    }
+    double dist = 0.0;
+    for (int v = 0; v < vocab; ++v) dist = std::max(dist, std::fabs(freq[v] - expected[v]));
+    return dist;
+}
+
+void test_sampler() {
+    std::mt19937 rng(52);
+    std::normal_distribution<float> dis(0.0f, 2.0f);
+
+    // the vectorized exp against std::exp, inside the clamped range
+    std::vector<float> xs(1000), es;
+    for (int i = 0; i < 1000; ++i) xs[i] = -100.0f + 0.18f * i;
+    es = xs;
+    float sum = simd_exp_sum(es.data(), 0.0f, 1.0f, static_cast<int64_t>(es.size()));
+    double ref_sum = 0.0;
+    for (int i = 0; i < 1000; ++i) {
+        float ref = std::exp(xs[i]);
+        ref_sum += ref;
+        if (std::fabs(xs[i]) < 87.0f) assert(std::fabs(es[i] - ref) <= 1e-6f * ref);
+    }
+    assert(std::fabs(sum - ref_sum) < 1e-5 * ref_sum);
+
+    // greedy picks the argmax, and a repetition penalty on it moves the choice
+    const int vocab = 50;
+    std::vector<float> logits(vocab);
+    for (auto& l : logits) l = dis(rng);
+    uint32_t best = static_cast<uint32_t>(std::max_element(logits.begin(), logits.end()) - logits.begin());
+    SamplingConfig greedy;
+    greedy.temperature = 0.0f;
+    Sampler g(vocab, greedy);
+    g.start_sequence(7, 1);
+    std::vector<float> row = logits;
+    uint32_t token = 0;
+    g.sample_rows(row.data(), {7}, &token);
+    assert(token == best);
+    greedy.repetition_penalty = 1e6f;
+    g.set_config(greedy);
+    row = logits;
+    g.sample_rows(row.data(), {7}, &token);
+    assert(token != best);
+
+    // sampled frequencies follow the full-sort reference for each path
+    const int draws = 100000;
+    std::vector<SamplingConfig> configs(3);
+    configs[0].temperature = 1.3f;
+    configs[1].temperature = 0.7f;
+    configs[1].top_k = 10;
+    configs[1].top_p = 0.8f;
+    configs[2].temperature = 0.9f;
+    configs[2].top_p = 0.6f;
+    for (const SamplingConfig& c : configs) {
+        Sampler sampler(vocab, c);
+        double dist = sampled_distance(sampler, logits, reference_distribution(logits, c), draws);
+        assert(dist < 0.01);
+        std::cout << "T " << c.temperature << ", top_k " << c.top_k << ", top_p " << c.top_p
+                  << ": max |frequency - probability| " << dist << " over " << draws << " draws" << std::endl;
+    }
+
+    // a sequence's tokens depend on its seed, not on its row in the batch
+    const int big_vocab = 5000;
+    std::vector<float> a(big_vocab), b(big_vocab);
+    for (auto& l : a) l = dis(rng);
+    for (auto& l : b) l = dis(rng);
+    SamplingConfig nucleus;
+    nucleus.top_p = 0.9f;
+    nucleus.frequency_penalty = 0.5f;
+    Sampler s1(big_vocab, nucleus), s2(big_vocab, nucleus);
+    for (Sampler* s : {&s1, &s2}) {
+        s->start_sequence(0, 11);
+        s->start_sequence(1, 22);
+    }
+    for (int step = 0; step < 20; ++step) {
+        std::vector<float> ab(a), ba(b);
+        ab.insert(ab.end(), b.begin(), b.end());
+        ba.insert(ba.end(), a.begin(), a.end());
+        uint32_t t1[2], t2[2];
+        s1.sample_rows(ab.data(), {0, 1}, t1);
+        s2.sample_rows(ba.data(), {1, 0}, t2);
+        assert(t1[0] == t2[1] && t1[1] == t2[0]);
+    }
+
+    // fp16 logits go through the same path
+    Tensor<FLOAT16> half({2, big_vocab});
+    for (int i = 0; i < big_vocab; ++i) {
+        half.data()[i] = float_to_half(a[i]);
+        half.data()[big_vocab + i] = float_to_half(b[i]);
+    }
+    uint32_t t16[2];
+    s1.sample(half, {0, 1}, t16);
+    assert(t16[0] < static_cast<uint32_t>(big_vocab) && t16[1] < static_cast<uint32_t>(big_vocab));
+
+    // ids past the vocabulary and a sequence twice in one batch are rejected
+    uint32_t outside[2] = {3, 1u << 28};
+    bool threw = false;
+    try {
+        s1.observe(0, outside, 2);
+    } catch (const std::out_of_range&) {
+        threw = true;
+    }
+    assert(threw);
+    threw = false;
+    std::vector<float> twice(a);
+    twice.insert(twice.end(), a.begin(), a.end());
+    try {
+        s1.sample_rows(twice.data(), {0, 0}, t16);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+}
+
+// Textbook sampler: std::exp softmax and a full sort per row.
+static uint32_t full_sort_sample(const float* logits, int vocab, const SamplingConfig& c, std::mt19937_64& rng) {
+    std::vector<std::pair<float, uint32_t>> probs(vocab);
+    float max = *std::max_element(logits, logits + vocab), total = 0.0f;
+    for (int i = 0; i < vocab; ++i) total += (probs[i] = {std::exp((logits[i] - max) / c.temperature), i}).first;
+    std::sort(probs.begin(), probs.end(), [](auto& x, auto& y) { return x.first > y.first; });
+    int keep = c.top_k > 0 ? c.top_k : vocab;
+    if (c.top_k > 0) total = 0.0f;
+    for (int i = 0; c.top_k > 0 && i < keep; ++i) total += probs[i].first;
+    float acc = 0.0f;
+    int nucleus = 0;
+    while (nucleus < keep && acc < c.top_p * total) acc += probs[nucleus++].first;
+    float target = std::generate_canonical<float, 24>(rng) * acc, run = 0.0f;
+    for (int i = 0; i < nucleus; ++i) {
+        if ((run += probs[i].first) > target) return probs[i].second;
+    }
+    return probs[nucleus - 1].second;
+}
+
+void benchmark_sampler() {
+    std::mt19937 rng(53);
+    std::normal_distribution<float> dis(0.0f, 3.0f);
+    const int batch = 8, iters = 20;
+    std::vector<SamplingConfig> configs(2);
+    configs[0].temperature = 0.8f;
+    configs[0].top_p = 0.9f;
+    configs[0].repetition_penalty = 1.1f;
+    configs[1].temperature = 0.8f;
+    configs[1].top_k = 40;
+    configs[1].top_p = 0.95f;
+
+    for (int vocab : {5000, 32000, 128000}) {
+        std::vector<float> logits(static_cast<size_t>(batch) * vocab), scratch(logits.size());
+        for (auto& l : logits) l = dis(rng);
+        std::vector<int> seqs(batch);
+        std::iota(seqs.begin(), seqs.end(), 0);
+        std::vector<uint32_t> tokens(batch);
+        for (const SamplingConfig& c : configs) {
+            std::mt19937_64 ref_rng(1);
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int it = 0; it < iters; ++it) {
+                for (int b = 0; b < batch; ++b) tokens[b] = full_sort_sample(logits.data() + b * vocab, vocab, c, ref_rng);
+            }
+            auto mid = std::chrono::high_resolution_clock::now();
+            Sampler sampler(vocab, c);
+            for (int b = 0; b < batch; ++b) sampler.start_sequence(b, b);
+            for (int it = 0; it < iters; ++it) {
+                scratch = logits;
+                sampler.sample_rows(scratch.data(), seqs, tokens.data());
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double> ref_s = mid - start, fast_s = end - mid;
+            std::cout << "vocab " << vocab << ", batch " << batch << ", top_k " << c.top_k << ", top_p " << c.top_p
+                      << ": full sort " << ref_s.count() / iters * 1000 << " ms/step, sampler "
+                      << fast_s.count() / iters * 1000 << " ms/step" << std::endl;
+        }
+    }
+
+    // against one decode step of a small model with a 32000 vocabulary
+    LlamaConfig config;
+    config.vocab_size = 32000;
+    config.dim = 512;
+    config.num_layers = 4;
+    config.num_heads = 8;
+    config.num_kv_heads = 4;
+    config.hidden_dim = 1376;
+    config.max_batch = batch;
+    config.max_seq = 64;
+    LlamaModel<FLOAT32> model(config);
+    std::vector<int> seqs;
+    for (int b = 0; b < batch; ++b) seqs.push_back(model.start_sequence());
+    std::vector<uint32_t> ids(batch * 16);
+    for (auto& id : ids) id = rng() % config.vocab_size;
+    model.forward(seqs, ids.data(), 16);
+    Sampler sampler(config.vocab_size, configs[0]);
+    for (int b = 0; b < batch; ++b) sampler.start_sequence(seqs[b], b);
+    std::vector<uint32_t> next(batch);
+    double decode_s = 0.0, sample_s = 0.0;
+    for (int step = 0; step < 16; ++step) {
+        auto s0 = std::chrono::high_resolution_clock::now();
+        Tensor<FLOAT32> logits = model.forward(seqs, step == 0 ? ids.data() : next.data(), 1);
+        auto s1 = std::chrono::high_resolution_clock::now();
+        sampler.sample(logits, seqs, next.data());
+        auto s2 = std::chrono::high_resolution_clock::now();
+        decode_s += std::chrono::duration<double>(s1 - s0).count();
+        sample_s += std::chrono::duration<double>(s2 - s1).count();
+    }
+    std::cout << "decode step " << decode_s / 16 * 1000 << " ms, sampling " << sample_s / 16 * 1000 << " ms ("
+              << 100.0 * sample_s / decode_s << "% of decode)" << std::endl;
+}
@@ -0,0 +1,196 @@
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "trainer.h"
+
+// Stands in for Dataloader: hands out a token vector batch_size tokens at a
+// time and an empty tensor once it runs out.
+struct VectorTokenSource {
+    std::vector<uint32_t> tokens;
+    size_t batch_size;
+    size_t pos = 0;
+    int fetches = 0;
+
+    Tensor<UINT32> get_next_batch_uint32() {
+        if (pos >= tokens.size()) {
+            return Tensor<UINT32>();
+        }
+        size_t n = std::min(batch_size, tokens.size() - pos);
+        Tensor<UINT32> batch(std::vector<int>{static_cast<int>(n), 1});
+        std::copy(tokens.begin() + pos, tokens.begin() + pos + n, batch.data());
+        pos += n;
+        ++fetches;
+        return batch;
+    }
+};
+
+static LlamaConfig trainer_test_config() {
+    LlamaConfig tiny;
+    tiny.vocab_size = 64;
+    tiny.dim = 32;
+    tiny.num_layers = 2;
+    tiny.num_heads = 4;
+    tiny.num_kv_heads = 2;
+    tiny.hidden_dim = 48;
+    tiny.max_seq = 16;
+    return tiny;
+}
+
+static void copy_model(LlamaModel<FLOAT32>& from, LlamaModel<FLOAT32>& to) {
+    copy_parameters(from, to);
+    Tensor<FLOAT32> src = from.embeddings().get_embedding_matrix(), dst = to.embeddings().get_embedding_matrix();
+    std::copy(src.data(), src.data() + src.size(), dst.data());
+}
+
+static float max_parameter_diff(LlamaModel<FLOAT32>& a, LlamaModel<FLOAT32>& b) {
+    std::vector<Tensor<FLOAT32>*> pa = a.parameters(), pb = b.parameters();
+    float diff = 0.0f;
+    for (size_t k = 0; k < pa.size(); ++k) {
+        for (int i = 0; i < pa[k]->size(); ++i) diff = std::max(diff, std::fabs(pa[k]->data()[i] - pb[k]->data()[i]));
+    }
+    return diff;
+}
+
+void test_trainer() {
+    LlamaConfig tiny = trainer_test_config();
+    std::vector<uint32_t> tokens(2000);
+    for (size_t i = 0; i < tokens.size(); ++i) tokens[i] = (i * 7 + i / 5) % tiny.vocab_size;
+
+    OptimizerConfig sgd;
+    sgd.kind = OPTIMIZER_SGD;
+    sgd.learning_rate = 0.05f;
+    sgd.momentum = 0.9f;
+
+    // 4 micro-batches of 2 sequences take the same step as one batch of 8
+    LlamaModel<FLOAT32> whole(tiny), accumulated(tiny), unfetched(tiny);
+    copy_model(whole, accumulated);
+    copy_model(whole, unfetched);
+    VectorTokenSource src_whole{tokens, 37}, src_accumulated{tokens, 37}, src_unfetched{tokens, 37};
+    TrainerConfig one_batch{8, 16, 1, false, {}};
+    TrainerConfig micro{2, 16, 4, true, {CHECKPOINT_BLOCK, 1}};
+    TrainerConfig micro_sync = micro;
+    micro_sync.prefetch = false;
+    Trainer<FLOAT32, VectorTokenSource> t_whole(whole, src_whole, sgd, one_batch);
+    Trainer<FLOAT32, VectorTokenSource> t_accumulated(accumulated, src_accumulated, sgd, micro);
+    Trainer<FLOAT32, VectorTokenSource> t_unfetched(unfetched, src_unfetched, sgd, micro_sync);
+    for (int step = 0; step < 3; ++step) {
+        float loss_whole = 0.0f, loss_accumulated = 0.0f, loss_unfetched = 0.0f;
+        assert(t_whole.step(loss_whole) && t_accumulated.step(loss_accumulated) && t_unfetched.step(loss_unfetched));
+        assert(std::fabs(loss_whole - loss_accumulated) < 1e-4f);
+        // prefetching changes when the data is cut, not what is computed
+        assert(loss_accumulated == loss_unfetched);
+    }
+    float diff = max_parameter_diff(whole, accumulated);
+    assert(diff < 1e-4f);
+    assert(max_parameter_diff(accumulated, unfetched) == 0.0f);
+    assert(t_accumulated.tokens_per_step() == t_whole.tokens_per_step());
+    assert(t_accumulated.peak_activation_bytes() < t_whole.peak_activation_bytes());
+    assert(t_whole.memory_plan().slab_bytes() < t_whole.memory_plan().unshared_bytes());
+    for (Tensor<FLOAT32>* p : accumulated.parameters()) {
+        for (int i = 0; i < p->size(); ++i) assert(p->grad->data()[i] == 0.0f);
+    }
+
+    // a source that cannot fill a logical batch ends training without a step
+    LlamaModel<FLOAT32> short_model(tiny);
+    VectorTokenSource short_src{std::vector<uint32_t>(tokens.begin(), tokens.begin() + 3 * 32 + 1), 10};
+    Trainer<FLOAT32, VectorTokenSource> t_short(short_model, short_src, sgd, TrainerConfig{2, 16, 2, true, {}});
+    float loss = 0.0f;
+    assert(t_short.step(loss));
+    assert(!t_short.step(loss));
+    assert(t_short.steps() == 1);
+    for (Tensor<FLOAT32>* p : short_model.parameters()) {
+        for (int i = 0; i < p->size(); ++i) assert(p->grad->data()[i] == 0.0f);
+    }
+
+    // the embedding rows take the optimizer's own step and share its clip:
+    // plain SGD clipped to a tiny norm moves all parameters by exactly lr * max_norm
+    LlamaModel<FLOAT32> clipped(tiny);
+    VectorTokenSource clip_src{tokens, 64};
+    OptimizerConfig clip_sgd;
+    clip_sgd.kind = OPTIMIZER_SGD;
+    clip_sgd.learning_rate = 1.0f;
+    clip_sgd.momentum = 0.0f;
+    clip_sgd.max_grad_norm = 1e-3f;
+    Trainer<FLOAT32, VectorTokenSource> t_clip(clipped, clip_src, clip_sgd, TrainerConfig{2, 16, 1, true, {}});
+    Tensor<FLOAT32> table = clipped.embeddings().get_embedding_matrix();
+    auto snapshot = [&]() {
+        std::vector<float> values(table.data(), table.data() + table.size());
+        for (Tensor<FLOAT32>* p : clipped.parameters()) values.insert(values.end(), p->data(), p->data() + p->size());
+        return values;
+    };
+    std::vector<float> before = snapshot();
+    assert(t_clip.step(loss));
+    std::vector<float> after = snapshot();
+    double moved = 0.0, moved_table = 0.0;
+    for (size_t i = 0; i < before.size(); ++i) {
+        double d = static_cast<double>(after[i]) - before[i];
+        moved += d * d;
+        if (i < static_cast<size_t>(table.size())) moved_table += d * d;
+    }
+    assert(moved_table > 0.0);
+    assert(std::fabs(std::sqrt(moved) - 1e-3) < 1e-5);
+    // and read the learning rate at step time
+    t_clip.optimizer().config().learning_rate = 0.0f;
+    before = snapshot();
+    assert(t_clip.step(loss));
+    assert(snapshot() == before);
+
+    // fp16 steps go through the loss scaler
+    LlamaModel<FLOAT16> model16(tiny);
+    VectorTokenSource src16{tokens, 64};
+    OptimizerConfig adam;
+    adam.learning_rate = 1e-3f;
+    Trainer<FLOAT16, VectorTokenSource> t16(model16, src16, adam, TrainerConfig{2, 16, 2, true, {}});
+    assert(t16.step(loss) && std::isfinite(loss));
+
+    std::cout << "accumulated vs whole-batch step: max parameter diff " << diff << ", peak activations "
+              << t_accumulated.peak_activation_bytes() << " vs " << t_whole.peak_activation_bytes() << " bytes"
+              << std::endl;
+}
+
+// Byte-level wikitext-2 through the trainer: one logical batch of 16 x 64
+// tokens, taken whole or in micro-batches, with and without prefetch.
+void benchmark_trainer() {
+    std::vector<uint32_t> corpus = read_bytes_corpus();
+    if (corpus.empty()) {
+        std::cout << "data/wikitext-2-validation.txt not found, skipping" << std::endl;
+        return;
+    }
+    for (auto& t : corpus) t &= 0xff;
+    LlamaConfig config;
+    config.vocab_size = 256;
+    config.dim = 128;
+    config.num_layers = 2;
+    config.num_heads = 4;
+    config.num_kv_heads = 2;
+    config.hidden_dim = 344;
+    config.max_seq = 64;
+    LlamaModel<FLOAT32> reference(config);
+    OptimizerConfig adam;
+    adam.learning_rate = 3e-3f;
+    adam.weight_decay = 0.01f;
+    adam.max_grad_norm = 1.0f;
+
+    const int steps = 20;
+    for (TrainerConfig tc : {TrainerConfig{16, 64, 1, false, {}}, TrainerConfig{4, 64, 4, false, {}},
+             TrainerConfig{4, 64, 4, true, {}}, TrainerConfig{1, 64, 16, true, {CHECKPOINT_BLOCK, 1}}}) {
+        LlamaModel<FLOAT32> model(config);
+        copy_model(reference, model);
+        VectorTokenSource source{corpus, 512};
+        Trainer<FLOAT32, VectorTokenSource> trainer(model, source, adam, tc);
+        float loss = 0.0f, first = 0.0f;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int step = 0; step < steps && trainer.step(loss); ++step) {
+            if (step == 0) first = loss;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsed = end - start;
+        std::cout << "micro-batch " << tc.micro_batch << " x " << tc.accumulation_steps
+                  << (tc.prefetch ? ", prefetch" : "") << (tc.checkpoint.mode == CHECKPOINT_BLOCK ? ", checkpointed" : "")
+                  << ": " << trainer.steps() * trainer.tokens_per_step() / elapsed.count() << " tokens/s, loss "
+                  << first << " -> " << loss << ", peak activations "
+                  << trainer.peak_activation_bytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+    }
+}